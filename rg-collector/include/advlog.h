@@ -0,0 +1,342 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// Advertisement Log
+// Fixed-capacity store of packed advertisement records, allocated once at boot.
+// Repeated sightings of the same address and manufacturer data are merged
+// into one record with hit count and RSSI statistics; a new record is only
+// started when the manufacturer data changes. JSON is only produced at sync time.
+
+// Define the maximum number of distinct records held between syncs.
+#ifndef ADV_LOG_CAPACITY
+#define ADV_LOG_CAPACITY 256
+#endif
+// Define the index size, must be a power of two and at least 2x the capacity.
+#ifndef ADV_LOG_INDEX_SIZE
+#define ADV_LOG_INDEX_SIZE 512
+#endif
+// Define what happens to a new record when the log is full.
+// 0 = drop the new record, 1 = overwrite the oldest record
+#ifndef ADV_LOG_OVERWRITE
+#define ADV_LOG_OVERWRITE 0
+#endif
+
+// A legacy advertisement is at most 31 bytes, so neither field can be larger
+#define ADV_NAME_MAX 31
+#define ADV_MAN_MAX 31
+
+// Define the RSSI samples kept per record (after the first) and their time unit.
+// When the series is full every other sample is dropped and the spacing doubles,
+// so it always covers the whole time the device was in view.
+#define ADV_SERIES_MAX 16
+#define ADV_SERIES_TICK_MS 100
+
+#define ADV_FLAG_CONNECTABLE 0x01
+// Name or manufacturer data was longer than the record can hold
+#define ADV_FLAG_TRUNCATED 0x02
+
+static_assert((ADV_LOG_INDEX_SIZE & (ADV_LOG_INDEX_SIZE - 1)) == 0, "ADV_LOG_INDEX_SIZE must be a power of two");
+static_assert(ADV_LOG_INDEX_SIZE >= 2 * ADV_LOG_CAPACITY, "ADV_LOG_INDEX_SIZE must be at least 2x ADV_LOG_CAPACITY");
+static_assert(ADV_LOG_CAPACITY < 0xFFFF, "ADV_LOG_CAPACITY must fit the uint16_t index");
+
+// Structure to store a single sighting of an advertisement, raw bytes only.
+// Filled in by the scan callback.
+struct AdvSighting
+{
+  // Address as stored by NimBLEAddress::getVal() (little endian)
+  uint8_t addr[6];
+  uint8_t addrType;
+  int8_t rssi;
+  uint8_t flags;
+  uint8_t nameLen;
+  uint8_t manLen;
+  uint8_t name[ADV_NAME_MAX];
+  uint8_t man[ADV_MAN_MAX];
+  // millis() of the sighting
+  uint32_t seen;
+};
+
+// Structure to store an aggregated advertisement. The sighting fields hold
+// the latest sighting, the rest are maintained by AdvLog::put().
+struct AdvRecord : AdvSighting
+{
+  // Sightings merged into this record, saturates at 0xFFFF
+  uint16_t hits;
+  int8_t rssiMin;
+  int8_t rssiMax;
+  int32_t rssiSum;
+  // millis() of the first sighting
+  uint32_t firstSeen;
+
+  // RSSI time series: the first sample is (firstSeen, rssiFirst), each later
+  // sample is stored as ticks and RSSI change since the previous one
+  int8_t rssiFirst;
+  uint8_t seriesLen;
+  // Minimum ticks between samples, doubles each time the series is thinned
+  uint8_t seriesStep;
+  uint32_t seriesLast;
+  int8_t seriesRssiLast;
+  uint8_t seriesDt[ADV_SERIES_MAX];
+  int8_t seriesDrssi[ADV_SERIES_MAX];
+};
+
+// Mean RSSI over all merged sightings
+int8_t advRssiMean(const AdvRecord &rec)
+{
+  return rec.hits ? (int8_t)(rec.rssiSum / (int32_t)rec.hits) : rec.rssi;
+}
+
+// Append the sighting's RSSI to the record's series if enough time has passed
+void advSeriesAdd(AdvRecord &rec, int8_t rssi, uint32_t now)
+{
+  uint32_t ticks = (now - rec.seriesLast) / ADV_SERIES_TICK_MS;
+  if (ticks < rec.seriesStep)
+  {
+    return;
+  }
+  if (rec.seriesLen == ADV_SERIES_MAX)
+  {
+    // Thin out: merge each pair of samples into the later one
+    for (uint8_t i = 0; i < ADV_SERIES_MAX / 2; i++)
+    {
+      uint32_t dt = rec.seriesDt[2 * i] + rec.seriesDt[2 * i + 1];
+      rec.seriesDt[i] = dt > 0xFF ? 0xFF : dt;
+      rec.seriesDrssi[i] = rec.seriesDrssi[2 * i] + rec.seriesDrssi[2 * i + 1];
+    }
+    rec.seriesLen = ADV_SERIES_MAX / 2;
+    if (rec.seriesStep < 0x80)
+      rec.seriesStep *= 2;
+    if (ticks < rec.seriesStep)
+    {
+      return;
+    }
+  }
+  // RSSI is within [-128, 20] in practice so the change always fits an int8_t
+  rec.seriesDt[rec.seriesLen] = ticks > 0xFF ? 0xFF : ticks;
+  rec.seriesDrssi[rec.seriesLen] = rssi - rec.seriesRssiLast;
+  rec.seriesLen++;
+  rec.seriesLast = now;
+  rec.seriesRssiLast = rssi;
+}
+
+// Walk the AD structures of a raw advertisement payload and copy out the
+// name and manufacturer data. Replaces getName()/getManufacturerData(),
+// which return a freshly allocated std::string on every call.
+void advParsePayload(AdvSighting &rec, const uint8_t *payload, size_t length)
+{
+  bool haveCompleteName = false;
+  bool haveMan = false;
+  rec.nameLen = 0;
+  rec.manLen = 0;
+
+  size_t i = 0;
+  while (i < length)
+  {
+    uint8_t fieldLen = payload[i];
+    // Zero length field marks the end of significant data
+    if (fieldLen == 0 || i + 1 + fieldLen > length)
+    {
+      break;
+    }
+    uint8_t type = payload[i + 1];
+    const uint8_t *data = payload + i + 2;
+    uint8_t dataLen = fieldLen - 1;
+
+    // 0x09 = Complete Local Name, 0x08 = Shortened Local Name
+    if ((type == 0x09 || (type == 0x08 && rec.nameLen == 0)) && !haveCompleteName)
+    {
+      haveCompleteName = type == 0x09;
+      rec.nameLen = dataLen > ADV_NAME_MAX ? ADV_NAME_MAX : dataLen;
+      if (dataLen > ADV_NAME_MAX)
+        rec.flags |= ADV_FLAG_TRUNCATED;
+      memcpy(rec.name, data, rec.nameLen);
+    }
+    // 0xFF = Manufacturer Specific Data, first one wins like getManufacturerData()
+    else if (type == 0xFF && !haveMan)
+    {
+      haveMan = true;
+      rec.manLen = dataLen > ADV_MAN_MAX ? ADV_MAN_MAX : dataLen;
+      if (dataLen > ADV_MAN_MAX)
+        rec.flags |= ADV_FLAG_TRUNCATED;
+      memcpy(rec.man, data, rec.manLen);
+    }
+    i += 1 + fieldLen;
+  }
+}
+
+class AdvLog
+{
+public:
+  AdvLog()
+  {
+    clear();
+  }
+
+  // Merge a sighting into the record for its address and manufacturer data,
+  // or start a new record. Never allocates.
+  // Returns false if the sighting was dropped because the log is full.
+  bool put(const AdvSighting &sighting)
+  {
+    uint32_t pos = hash(sighting) & indexMask;
+    while (index[pos] != 0)
+    {
+      uint16_t slot = index[pos] - 1;
+      if (sameKey(records[slot], sighting))
+      {
+        merge(records[slot], sighting);
+        return true;
+      }
+      pos = (pos + 1) & indexMask;
+    }
+
+    if (count == ADV_LOG_CAPACITY)
+    {
+      dropped++;
+#if ADV_LOG_OVERWRITE
+      // Evict the oldest record, then insert again since the probe
+      // sequence may have been shifted by the removal
+      unindex(head);
+      head = (head + 1) % ADV_LOG_CAPACITY;
+      count--;
+      return put(sighting);
+#else
+      return false;
+#endif
+    }
+
+    uint16_t slot = (head + count) % ADV_LOG_CAPACITY;
+    start(records[slot], sighting);
+    index[pos] = slot + 1;
+    count++;
+    return true;
+  }
+
+  // Number of records currently held
+  uint16_t size() const
+  {
+    return count;
+  }
+
+  // No room for another record, a sighting of a new key would be dropped
+  bool full() const
+  {
+    return count == ADV_LOG_CAPACITY;
+  }
+
+  // Record i in insertion order, 0 is the oldest
+  const AdvRecord &at(uint16_t i) const
+  {
+    return records[(head + i) % ADV_LOG_CAPACITY];
+  }
+
+  // Records lost to a full log since the last clear()
+  uint32_t droppedCount() const
+  {
+    return dropped;
+  }
+
+  void clear()
+  {
+    memset(index, 0, sizeof(index));
+    head = 0;
+    count = 0;
+    dropped = 0;
+  }
+
+private:
+  static const uint32_t indexMask = ADV_LOG_INDEX_SIZE - 1;
+
+  AdvRecord records[ADV_LOG_CAPACITY];
+  // Open addressing (linear probing) index of slot + 1, 0 = empty
+  uint16_t index[ADV_LOG_INDEX_SIZE];
+  uint16_t head;
+  uint16_t count;
+  uint32_t dropped;
+
+  static uint32_t hash(const AdvSighting &rec)
+  {
+    // FNV-1a over the address and manufacturer data
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 6; i++)
+    {
+      h = (h ^ rec.addr[i]) * 16777619u;
+    }
+    h = (h ^ rec.manLen) * 16777619u;
+    for (uint8_t i = 0; i < rec.manLen; i++)
+    {
+      h = (h ^ rec.man[i]) * 16777619u;
+    }
+    return h;
+  }
+
+  static bool sameKey(const AdvSighting &a, const AdvSighting &b)
+  {
+    return memcmp(a.addr, b.addr, 6) == 0 && a.manLen == b.manLen && memcmp(a.man, b.man, a.manLen) == 0;
+  }
+
+  static void start(AdvRecord &rec, const AdvSighting &sighting)
+  {
+    static_cast<AdvSighting &>(rec) = sighting;
+    rec.hits = 1;
+    rec.rssiMin = sighting.rssi;
+    rec.rssiMax = sighting.rssi;
+    rec.rssiSum = sighting.rssi;
+    rec.firstSeen = sighting.seen;
+    rec.rssiFirst = sighting.rssi;
+    rec.seriesLen = 0;
+    rec.seriesStep = 1;
+    rec.seriesLast = sighting.seen;
+    rec.seriesRssiLast = sighting.rssi;
+  }
+
+  static void merge(AdvRecord &rec, const AdvSighting &sighting)
+  {
+    rec.rssi = sighting.rssi;
+    rec.addrType = sighting.addrType;
+    rec.flags = sighting.flags;
+    // Only some sightings carry the scan response, don't forget a known name
+    if (sighting.nameLen > 0)
+    {
+      rec.nameLen = sighting.nameLen;
+      memcpy(rec.name, sighting.name, sighting.nameLen);
+    }
+    if (rec.hits < 0xFFFF)
+    {
+      rec.hits++;
+      rec.rssiSum += sighting.rssi;
+    }
+    if (sighting.rssi < rec.rssiMin)
+      rec.rssiMin = sighting.rssi;
+    if (sighting.rssi > rec.rssiMax)
+      rec.rssiMax = sighting.rssi;
+    rec.seen = sighting.seen;
+    advSeriesAdd(rec, sighting.rssi, sighting.seen);
+  }
+
+  // Remove the index entry for slot, shifting back any entries that
+  // probed past it so lookups never hit a false empty.
+  void unindex(uint16_t slot)
+  {
+    uint32_t pos = hash(records[slot]) & indexMask;
+    while (index[pos] != slot + 1)
+    {
+      pos = (pos + 1) & indexMask;
+    }
+    index[pos] = 0;
+
+    uint32_t next = (pos + 1) & indexMask;
+    while (index[next] != 0)
+    {
+      uint32_t home = hash(records[index[next] - 1]) & indexMask;
+      // Move the entry back if its home is not cyclically within (pos, next]
+      if (((next - home) & indexMask) >= ((next - pos) & indexMask))
+      {
+        index[pos] = index[next];
+        index[next] = 0;
+        pos = next;
+      }
+      next = (next + 1) & indexMask;
+    }
+  }
+};
@@ -0,0 +1,269 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#include "advlog.h"
+
+// GATT Cache
+// Layouts of walked GATT trees keyed by a fingerprint of the advertisement,
+// so a fleet of identical devices is only discovered once. The fingerprint
+// only picks a layout to try: a later walk checks the device's characteristic
+// handles, UUIDs and properties against it before reading by handle. Values
+// that came back the same on GATT_CACHE_CONFIRM walks are then served from the
+// cache instead of read, and logged as such.
+
+// Define the number of layouts kept, the least recently used one is replaced.
+#ifndef GATT_CACHE_LAYOUTS
+#define GATT_CACHE_LAYOUTS 8
+#endif
+// Define the characteristics a layout can hold, larger trees are not cached.
+#ifndef GATT_CACHE_LAYOUT_CHRS
+#define GATT_CACHE_LAYOUT_CHRS 32
+#endif
+// Define the longest value that can be served from the cache.
+#ifndef GATT_CACHE_VALUE_MAX
+#define GATT_CACHE_VALUE_MAX 20
+#endif
+// Define the walks a value has to read back the same before it is reused.
+#ifndef GATT_CACHE_CONFIRM
+#define GATT_CACHE_CONFIRM 2
+#endif
+// Define the manufacturer data bytes in the fingerprint: the company id and
+// the vendor's type bytes after it.
+#ifndef GATT_CACHE_MAN_PREFIX
+#define GATT_CACHE_MAN_PREFIX 4
+#endif
+
+// Value changed between walks or is too long to keep, always read
+#define GATT_CACHE_VOLATILE 0x01
+// Read was refused by the peer, not tried again
+#define GATT_CACHE_READ_FAILED 0x02
+
+// Structure to store one characteristic of a layout.
+struct GattCacheChr
+{
+  uint8_t svcLen;
+  uint8_t chrLen;
+  uint8_t svc[16];
+  uint8_t chr[16];
+  uint8_t prop;
+  uint8_t flags;
+  // Walks that read back val, saturates at 0xFF
+  uint8_t confirmed;
+  uint8_t valLen;
+  // ATT handle of the value
+  uint16_t handle;
+  uint8_t val[GATT_CACHE_VALUE_MAX];
+};
+
+// Structure to store the layout of one device model.
+struct GattLayout
+{
+  uint32_t fingerprint;
+  // GattCache clock of the last lookup or store
+  uint32_t lastUsed;
+  uint8_t count;
+  // More characteristics than fit chrs, the layout can't be stored
+  bool overflow;
+  GattCacheChr chrs[GATT_CACHE_LAYOUT_CHRS];
+};
+
+static_assert(GATT_CACHE_LAYOUT_CHRS <= 0xFF, "GATT_CACHE_LAYOUT_CHRS must fit the uint8_t count");
+static_assert(GATT_CACHE_VALUE_MAX <= 0xFF, "GATT_CACHE_VALUE_MAX must fit the uint8_t length");
+
+// Fingerprint of a device model: address type, manufacturer data length and
+// prefix, and name
+uint32_t gattFingerprint(const AdvSighting &rec)
+{
+  // FNV-1a, lengths are mixed in so fields can't run into each other
+  uint32_t h = 2166136261u;
+  h = (h ^ rec.addrType) * 16777619u;
+  h = (h ^ rec.manLen) * 16777619u;
+  uint8_t manLen = rec.manLen > GATT_CACHE_MAN_PREFIX ? GATT_CACHE_MAN_PREFIX : rec.manLen;
+  for (uint8_t i = 0; i < manLen; i++)
+  {
+    h = (h ^ rec.man[i]) * 16777619u;
+  }
+  h = (h ^ rec.nameLen) * 16777619u;
+  for (uint8_t i = 0; i < rec.nameLen; i++)
+  {
+    h = (h ^ rec.name[i]) * 16777619u;
+  }
+  return h;
+}
+
+// Start an empty layout for a full walk
+void gattLayoutBegin(GattLayout &layout, uint32_t fingerprint)
+{
+  layout.fingerprint = fingerprint;
+  layout.count = 0;
+  layout.overflow = false;
+}
+
+// Add a discovered characteristic, returns it or nullptr if the layout is full
+GattCacheChr *gattLayoutAdd(GattLayout &layout, const uint8_t *svc, uint8_t svcLen,
+                            const uint8_t *chr, uint8_t chrLen, uint8_t prop, uint16_t handle)
+{
+  if (layout.count == GATT_CACHE_LAYOUT_CHRS)
+  {
+    layout.overflow = true;
+    return nullptr;
+  }
+  GattCacheChr &c = layout.chrs[layout.count++];
+  c.svcLen = svcLen > 16 ? 16 : svcLen;
+  memcpy(c.svc, svc, c.svcLen);
+  c.chrLen = chrLen > 16 ? 16 : chrLen;
+  memcpy(c.chr, chr, c.chrLen);
+  c.prop = prop;
+  c.flags = 0;
+  c.confirmed = 0;
+  c.valLen = 0;
+  c.handle = handle;
+  return &c;
+}
+
+// True if the layout has a characteristic at this value handle with the same
+// UUID and properties, as discovered on a device
+bool gattLayoutHas(const GattLayout &layout, uint16_t handle, const uint8_t *chr, uint8_t chrLen, uint8_t prop)
+{
+  for (uint8_t i = 0; i < layout.count; i++)
+  {
+    const GattCacheChr &c = layout.chrs[i];
+    if (c.handle == handle)
+      return c.chrLen == chrLen && memcmp(c.chr, chr, chrLen) == 0 && c.prop == prop;
+  }
+  return false;
+}
+
+// Learn from a value read on a walk
+void gattCacheLearn(GattCacheChr &c, const uint8_t *val, size_t valLen)
+{
+  if (c.flags & GATT_CACHE_VOLATILE)
+  {
+    return;
+  }
+  if (valLen > GATT_CACHE_VALUE_MAX)
+  {
+    c.flags |= GATT_CACHE_VOLATILE;
+  }
+  else if (c.confirmed == 0)
+  {
+    memcpy(c.val, val, valLen);
+    c.valLen = valLen;
+    c.confirmed = 1;
+  }
+  else if (c.valLen == valLen && memcmp(c.val, val, valLen) == 0)
+  {
+    if (c.confirmed < 0xFF)
+      c.confirmed++;
+  }
+  else
+  {
+    c.flags |= GATT_CACHE_VOLATILE;
+  }
+}
+
+// True if the walk can take the cached value instead of reading it
+bool gattCacheReusable(const GattCacheChr &c)
+{
+  return !(c.flags & GATT_CACHE_VOLATILE) && c.confirmed >= GATT_CACHE_CONFIRM;
+}
+
+class GattCache
+{
+public:
+  GattCache()
+  {
+    held = 0;
+    clock = 0;
+    resetCounts();
+  }
+
+  // Copy the layout for fingerprint into out. Counts a hit or a miss.
+  bool lookup(uint32_t fingerprint, GattLayout &out)
+  {
+    GattLayout *layout = find(fingerprint);
+    if (!layout)
+    {
+      missCount++;
+      return false;
+    }
+    hitCount++;
+    layout->lastUsed = ++clock;
+    memcpy(&out, layout, sizeof(GattLayout));
+    return true;
+  }
+
+  // Store a layout learned or updated by a walk, replacing the least
+  // recently used layout when the cache is full
+  void store(const GattLayout &layout)
+  {
+    if (layout.overflow)
+    {
+      return;
+    }
+    GattLayout *slot = find(layout.fingerprint);
+    if (!slot && held < GATT_CACHE_LAYOUTS)
+    {
+      slot = &layouts[held++];
+    }
+    if (!slot)
+    {
+      slot = &layouts[0];
+      for (uint8_t i = 1; i < held; i++)
+      {
+        // Wraparound safe, same as the rate limit expiry
+        if ((int32_t)(layouts[i].lastUsed - slot->lastUsed) < 0)
+          slot = &layouts[i];
+      }
+    }
+    memcpy(slot, &layout, sizeof(GattLayout));
+    slot->lastUsed = ++clock;
+  }
+
+  // Drop a layout that turned out not to match the device
+  void forget(uint32_t fingerprint)
+  {
+    GattLayout *layout = find(fingerprint);
+    if (layout)
+    {
+      held--;
+      if (layout != &layouts[held])
+        memcpy(layout, &layouts[held], sizeof(GattLayout));
+    }
+  }
+
+  // Lookups since the last resetCounts()
+  uint32_t hits() const
+  {
+    return hitCount;
+  }
+
+  uint32_t misses() const
+  {
+    return missCount;
+  }
+
+  void resetCounts()
+  {
+    hitCount = 0;
+    missCount = 0;
+  }
+
+private:
+  GattLayout layouts[GATT_CACHE_LAYOUTS];
+  uint8_t held;
+  uint32_t clock;
+  uint32_t hitCount;
+  uint32_t missCount;
+
+  GattLayout *find(uint32_t fingerprint)
+  {
+    for (uint8_t i = 0; i < held; i++)
+    {
+      if (layouts[i].fingerprint == fingerprint)
+        return &layouts[i];
+    }
+    return nullptr;
+  }
+};
@@ -0,0 +1,181 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// GATT Log
+// Binary store for walked GATT trees: UUIDs as their 2/4/16 raw bytes and
+// values in a shared byte arena. Text is only produced when a sync is sent.
+// Several walks can add to the log at once, each record names its tree.
+
+// Define the number of walks held between syncs.
+#ifndef GATT_LOG_MAX_TREES
+#define GATT_LOG_MAX_TREES 8
+#endif
+// Define the number of characteristics held between syncs.
+#ifndef GATT_LOG_CAPACITY
+#define GATT_LOG_CAPACITY 128
+#endif
+// Define the bytes available for characteristic values between syncs.
+#ifndef GATT_LOG_VALUE_BYTES
+#define GATT_LOG_VALUE_BYTES 8192
+#endif
+
+// Where the value of a record came from
+#define GATT_VALUE_READ 0
+// Served from the GATT cache, not read on this walk
+#define GATT_VALUE_CACHED 1
+// Not read: the read failed, or the device refused it on an earlier walk
+#define GATT_VALUE_FAILED 2
+
+// Structure to store one characteristic of a walk.
+struct GattRecord
+{
+  uint8_t tree;
+  uint8_t svcLen;
+  uint8_t chrLen;
+  uint8_t svc[16];
+  uint8_t chr[16];
+  uint8_t prop;
+  // GATT_VALUE_*
+  uint8_t source;
+  // Value bytes live in the arena at valOffset
+  uint16_t valLen;
+  uint16_t valOffset;
+};
+
+// Structure to store one walk.
+struct GattTree
+{
+  // Little endian peer address, same as AdvRecord
+  uint8_t addr[6];
+  uint16_t count;
+};
+
+static_assert(GATT_LOG_MAX_TREES <= 0xFF, "GATT_LOG_MAX_TREES must fit the uint8_t tree id");
+static_assert(GATT_LOG_VALUE_BYTES <= 0xFFFF, "GATT_LOG_VALUE_BYTES must fit the uint16_t offset");
+
+class GattLog
+{
+public:
+  GattLog()
+  {
+    clear();
+  }
+
+  // Hold a tree slot for a walk that is about to connect. Returns false if
+  // every slot is taken or held.
+  bool reserveTree()
+  {
+    if (treesHeld + treesReserved >= GATT_LOG_MAX_TREES)
+    {
+      return false;
+    }
+    treesReserved++;
+    return true;
+  }
+
+  // Give back a slot held by reserveTree() that no tree was started on
+  void releaseTree()
+  {
+    if (treesReserved > 0)
+      treesReserved--;
+  }
+
+  // Start a new tree for addr, on the slot held by reserveTree() if there is
+  // one. Returns its id or -1 if no tree slot is left.
+  int beginTree(const uint8_t addr[6])
+  {
+    releaseTree();
+    if (treesHeld == GATT_LOG_MAX_TREES)
+    {
+      dropped++;
+      return -1;
+    }
+    GattTree &tree = trees[treesHeld];
+    memcpy(tree.addr, addr, 6);
+    tree.count = 0;
+    return treesHeld++;
+  }
+
+  // Add a characteristic to a tree. Values that don't fit the arena are
+  // stored empty. Returns false if the characteristic was dropped.
+  bool add(int tree, const uint8_t *svc, uint8_t svcLen, const uint8_t *chr, uint8_t chrLen,
+           uint8_t prop, const uint8_t *val, size_t valLen, uint8_t source)
+  {
+    if (tree < 0 || tree >= treesHeld || recordsHeld == GATT_LOG_CAPACITY)
+    {
+      dropped++;
+      return false;
+    }
+    GattRecord &rec = records[recordsHeld++];
+    rec.tree = tree;
+    rec.svcLen = svcLen > 16 ? 16 : svcLen;
+    memcpy(rec.svc, svc, rec.svcLen);
+    rec.chrLen = chrLen > 16 ? 16 : chrLen;
+    memcpy(rec.chr, chr, rec.chrLen);
+    rec.prop = prop;
+    rec.source = source;
+    rec.valOffset = valueUsed;
+    if (valLen > (size_t)(GATT_LOG_VALUE_BYTES - valueUsed))
+    {
+      valLen = 0;
+      dropped++;
+    }
+    rec.valLen = valLen;
+    if (valLen > 0)
+      memcpy(values + valueUsed, val, valLen);
+    valueUsed += valLen;
+    trees[tree].count++;
+    return true;
+  }
+
+  uint8_t treeCount() const
+  {
+    return treesHeld;
+  }
+
+  const GattTree &tree(uint8_t i) const
+  {
+    return trees[i];
+  }
+
+  uint16_t recordCount() const
+  {
+    return recordsHeld;
+  }
+
+  const GattRecord &record(uint16_t i) const
+  {
+    return records[i];
+  }
+
+  const uint8_t *value(const GattRecord &rec) const
+  {
+    return values + rec.valOffset;
+  }
+
+  // Trees, characteristics or values lost to a full log since the last clear()
+  uint32_t droppedCount() const
+  {
+    return dropped;
+  }
+
+  void clear()
+  {
+    treesHeld = 0;
+    treesReserved = 0;
+    recordsHeld = 0;
+    valueUsed = 0;
+    dropped = 0;
+  }
+
+private:
+  GattTree trees[GATT_LOG_MAX_TREES];
+  GattRecord records[GATT_LOG_CAPACITY];
+  uint8_t values[GATT_LOG_VALUE_BYTES];
+  uint8_t treesHeld;
+  uint8_t treesReserved;
+  uint16_t recordsHeld;
+  uint16_t valueUsed;
+  uint32_t dropped;
+};
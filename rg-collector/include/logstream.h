@@ -0,0 +1,398 @@
+#pragma once
+#include <Arduino.h>
+#include <WebServer.h>
+
+#include "advlog.h"
+#include "gattlog.h"
+#include "rgpack.h"
+#include "rgwire.h"
+
+static_assert(ADV_SERIES_TICK_MS == RGW_SERIES_TICK_MS, "series tick must match the wire format");
+static_assert(ADV_SERIES_MAX <= RGW_MAX_SERIES, "series must fit an ADV frame");
+
+// Log Streaming
+// Define the size of the only buffer used while sending a sync response.
+#ifndef LOG_CHUNK_SIZE
+#define LOG_CHUNK_SIZE 1024
+#endif
+
+// Where a sync response goes: the HTTP client, or the logger over ESP-NOW
+// (see rgnow.h) when the firmware is built for that
+class ChunkTarget
+{
+public:
+  virtual ~ChunkTarget() {}
+  // Status 200 with contentType, the length isn't known yet
+  virtual void begin(const char *contentType) = 0;
+  virtual void send(const uint8_t *data, size_t length) = 0;
+  // The response is complete
+  virtual void end() = 0;
+  // A whole response with status code and a short text instead
+  virtual void refuse(int code, const char *message) = 0;
+};
+
+// Sends a response to the client of server, in HTTP chunks
+class ServerTarget : public ChunkTarget
+{
+public:
+  ServerTarget(WebServer &server) : server(server) {}
+
+  // Send headers with an unknown length, WebServer switches to chunked encoding
+  void begin(const char *contentType) override
+  {
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, contentType, "");
+  }
+
+  void send(const uint8_t *data, size_t length) override
+  {
+    server.sendContent((const char *)data, length);
+  }
+
+  // The terminating zero length chunk
+  void end() override
+  {
+    server.sendContent("");
+  }
+
+  void refuse(int code, const char *message) override
+  {
+    server.send(code, "text/plain", message);
+  }
+
+private:
+  WebServer &server;
+};
+
+// Print sink that collects output into a fixed buffer and hands it to its
+// target in chunks, so a response of any size costs LOG_CHUNK_SIZE bytes.
+class ChunkedPrint : public Print
+{
+public:
+  ChunkedPrint(ChunkTarget &target) : target(target), len(0), total(0) {}
+
+  void begin(const char *contentType)
+  {
+    target.begin(contentType);
+  }
+
+  size_t write(uint8_t c) override
+  {
+    buf[len++] = c;
+    if (len == LOG_CHUNK_SIZE)
+    {
+      flush();
+    }
+    return 1;
+  }
+
+  size_t write(const uint8_t *data, size_t size) override
+  {
+    size_t n = size;
+    while (n > 0)
+    {
+      size_t room = LOG_CHUNK_SIZE - len;
+      size_t take = n < room ? n : room;
+      memcpy(buf + len, data, take);
+      len += take;
+      data += take;
+      n -= take;
+      if (len == LOG_CHUNK_SIZE)
+      {
+        flush();
+      }
+    }
+    return size;
+  }
+
+  void flush() override
+  {
+    if (len > 0)
+    {
+      target.send(buf, len);
+      total += len;
+      len = 0;
+    }
+  }
+
+  // Flush what is left and complete the response
+  void end()
+  {
+    flush();
+    target.end();
+  }
+
+  // Room for n bytes (n <= LOG_CHUNK_SIZE) to be encoded straight into the
+  // chunk buffer; hand the end of what was written to commit()
+  char *reserve(size_t n)
+  {
+    if (LOG_CHUNK_SIZE - len < n)
+    {
+      flush();
+    }
+    return (char *)buf + len;
+  }
+
+  void commit(char *end)
+  {
+    len = (uint8_t *)end - buf;
+    if (len == LOG_CHUNK_SIZE)
+    {
+      flush();
+    }
+  }
+
+  // Bytes handed to the target so far
+  size_t sent() const
+  {
+    return total;
+  }
+
+private:
+  ChunkTarget &target;
+  uint8_t buf[LOG_CHUNK_SIZE];
+  size_t len;
+  size_t total;
+};
+
+// Print sink for the record frames of a packed body, the packer's PACKED
+// frames go out as chunks
+class PackPrint : public Print
+{
+public:
+  PackPrint(ChunkedPrint &out, RgpPacker &packer) : out(out), packer(packer) {}
+
+  void begin()
+  {
+    packer.begin(toChunks, &out);
+  }
+
+  size_t write(uint8_t c) override
+  {
+    packer.write(&c, 1);
+    return 1;
+  }
+
+  size_t write(const uint8_t *data, size_t size) override
+  {
+    packer.write(data, size);
+    return size;
+  }
+
+  // A record starts with the next frame
+  void record()
+  {
+    packer.markRecord();
+  }
+
+  // Send what the packer holds, before any plain frame
+  void finish()
+  {
+    packer.finish();
+  }
+
+private:
+  ChunkedPrint &out;
+  RgpPacker &packer;
+
+  static void toChunks(void *ctx, const uint8_t *frame, size_t length)
+  {
+    ((ChunkedPrint *)ctx)->write(frame, length);
+  }
+};
+
+// Write bytes as lowercase hex straight into the chunk buffer
+void printHex(ChunkedPrint &out, const uint8_t *data, size_t length)
+{
+  while (length > 0)
+  {
+    size_t n = length > LOG_CHUNK_SIZE / 2 ? LOG_CHUNK_SIZE / 2 : length;
+    out.commit(rgwHex(out.reserve(2 * n), data, n));
+    data += n;
+    length -= n;
+  }
+}
+
+// Write UUID text straight into the chunk buffer
+void printUuid(ChunkedPrint &out, const uint8_t *uuid, uint8_t len)
+{
+  out.commit(rgwFormatUuid(out.reserve(RGW_UUID_STR_LEN), uuid, len));
+}
+
+// Open the "logs" entry of record seq, without the closing brace
+void printEntryJson(ChunkedPrint &out, const uint8_t addr[6], uint32_t seq)
+{
+  char addrStr[18];
+  rgwFormatAddress(addrStr, addr);
+  out.print(F("{\"addr\":\""));
+  out.print(addrStr);
+  out.print(F("\",\"seq\":"));
+  out.print(seq);
+  out.print(',');
+}
+
+// Write the advertisement fields of one "logs" entry, without the closing brace
+// so the caller can append a "tree"
+void printAdvJson(ChunkedPrint &out, const AdvRecord &rec, uint32_t seq)
+{
+  printEntryJson(out, rec.addr, seq);
+  out.print(F("\"name\":\""));
+  printHex(out, rec.name, rec.nameLen);
+  out.print(F("\",\"rssi\":"));
+  out.print(rec.rssi);
+  out.print(F(",\"man\":\""));
+  printHex(out, rec.man, rec.manLen);
+  out.print(F("\",\"connectable\":"));
+  out.print((rec.flags & ADV_FLAG_CONNECTABLE) ? F("true") : F("false"));
+  out.print(F(",\"addr_type\":"));
+  out.print(rec.addrType);
+  out.printf(",\"hits\":%u,\"first\":%lu,\"last\":%lu,\"rssi_min\":%d,\"rssi_max\":%d,\"rssi_mean\":%d",
+             rec.hits, (unsigned long)rec.firstSeen, (unsigned long)rec.seen,
+             rec.rssiMin, rec.rssiMax, advRssiMean(rec));
+  // Expand the delta encoded series into offsets from first and absolute values
+  uint32_t t = 0;
+  out.print(F(",\"rssi_t\":[0"));
+  for (uint8_t i = 0; i < rec.seriesLen; i++)
+  {
+    t += rec.seriesDt[i] * ADV_SERIES_TICK_MS;
+    out.print(',');
+    out.print(t);
+  }
+  int v = rec.rssiFirst;
+  out.print(F("],\"rssi_v\":["));
+  out.print(v);
+  for (uint8_t i = 0; i < rec.seriesLen; i++)
+  {
+    v += rec.seriesDrssi[i];
+    out.print(',');
+    out.print(v);
+  }
+  out.print(']');
+}
+
+// Describe a record for rgwWriteAdv
+RgwAdv rgwAdvFromRecord(const AdvRecord &rec)
+{
+  RgwAdv adv;
+  adv.addr = rec.addr;
+  adv.addrType = rec.addrType;
+  adv.rssi = rec.rssi;
+  adv.flags = rec.flags;
+  adv.name = rec.name;
+  adv.nameLen = rec.nameLen;
+  adv.man = rec.man;
+  adv.manLen = rec.manLen;
+  adv.hits = rec.hits;
+  adv.rssiMin = rec.rssiMin;
+  adv.rssiMax = rec.rssiMax;
+  adv.rssiMean = advRssiMean(rec);
+  adv.first = rec.firstSeen;
+  adv.last = rec.seen;
+  adv.rssiFirst = rec.rssiFirst;
+  adv.seriesLen = rec.seriesLen;
+  adv.seriesDt = rec.seriesDt;
+  adv.seriesDrssi = rec.seriesDrssi;
+  adv.series = nullptr;
+  return adv;
+}
+
+// Rebuild a record from an ADV frame, e.g. one read back from the spill log
+void advRecordFromRgw(AdvRecord &rec, const RgwAdv &adv)
+{
+  memcpy(rec.addr, adv.addr, 6);
+  rec.addrType = adv.addrType;
+  rec.rssi = adv.rssi;
+  rec.flags = adv.flags;
+  rec.nameLen = adv.nameLen > ADV_NAME_MAX ? ADV_NAME_MAX : adv.nameLen;
+  memcpy(rec.name, adv.name, rec.nameLen);
+  rec.manLen = adv.manLen > ADV_MAN_MAX ? ADV_MAN_MAX : adv.manLen;
+  memcpy(rec.man, adv.man, rec.manLen);
+  rec.seen = adv.last;
+  rec.hits = adv.hits;
+  rec.rssiMin = adv.rssiMin;
+  rec.rssiMax = adv.rssiMax;
+  // Only the mean survives the wire, advRssiMean() gives it back
+  rec.rssiSum = (int32_t)adv.rssiMean * adv.hits;
+  rec.firstSeen = adv.first;
+  rec.rssiFirst = adv.rssiFirst;
+  rec.seriesLen = adv.seriesLen > ADV_SERIES_MAX ? ADV_SERIES_MAX : adv.seriesLen;
+  for (uint8_t i = 0; i < rec.seriesLen; i++)
+  {
+    rec.seriesDt[i] = adv.series[2 * i];
+    rec.seriesDrssi[i] = (int8_t)adv.series[2 * i + 1];
+  }
+}
+
+// Write the "tree" member of a "logs" entry
+void printTreeJson(ChunkedPrint &out, const GattLog &log, uint8_t tree)
+{
+  out.print(F("\"tree\":["));
+  bool first = true;
+  for (uint16_t i = 0; i < log.recordCount(); i++)
+  {
+    const GattRecord &rec = log.record(i);
+    if (rec.tree != tree)
+      continue;
+    if (!first)
+      out.print(',');
+    first = false;
+    out.print(F("{\"svc\":\""));
+    printUuid(out, rec.svc, rec.svcLen);
+    out.print(F("\",\"chr\":\""));
+    printUuid(out, rec.chr, rec.chrLen);
+    out.print('"');
+    if (rec.source == GATT_VALUE_FAILED)
+    {
+      out.print(F(",\"read_failed\":true"));
+    }
+    else if (rec.prop & RGW_PROP_READ)
+    {
+      out.print(F(",\"val\":\""));
+      printHex(out, log.value(rec), rec.valLen);
+      out.print('"');
+    }
+    if (rec.source == GATT_VALUE_CACHED)
+      out.print(F(",\"cached\":true"));
+    out.print(F(",\"prop\":"));
+    out.print(rec.prop);
+    out.print('}');
+  }
+  out.print(']');
+}
+
+// Write the GATT frames of a tree, frame must hold RGW_MAX_FRAME bytes
+void sendTreeWire(Print &out, uint8_t *frame, const GattLog &log, uint8_t tree)
+{
+  for (uint16_t i = 0; i < log.recordCount(); i++)
+  {
+    const GattRecord &rec = log.record(i);
+    if (rec.tree != tree)
+      continue;
+    uint8_t type = RGW_FRAME_GATT;
+    if (rec.source == GATT_VALUE_CACHED)
+      type = RGW_FRAME_GATT_CACHED;
+    else if (rec.source == GATT_VALUE_FAILED)
+      type = RGW_FRAME_GATT_FAILED;
+    size_t n = rgwWriteGatt(frame, type, log.tree(tree).addr, rec.svc, rec.svcLen, rec.chr, rec.chrLen,
+                            rec.prop, log.value(rec), rec.valLen);
+    out.write(frame, n);
+  }
+}
+
+// For each tree, the index of the latest advertisement record of the same
+// address (-1 if there is none) so the tree can be sent inside that entry
+void matchTrees(int32_t treeAdv[GATT_LOG_MAX_TREES], const AdvLog &advs, const GattLog &gatts)
+{
+  for (uint8_t t = 0; t < gatts.treeCount(); t++)
+  {
+    treeAdv[t] = -1;
+    for (int32_t i = advs.size() - 1; i >= 0; i--)
+    {
+      if (memcmp(advs.at(i).addr, gatts.tree(t).addr, 6) == 0)
+      {
+        treeAdv[t] = i;
+        break;
+      }
+    }
+  }
+}
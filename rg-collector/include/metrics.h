@@ -0,0 +1,96 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+// Metrics
+// Counters and fixed bucket histograms for the hot paths. An update is a few
+// relaxed atomic adds, safe from the scan callback and any task and never
+// blocking. Read by /metrics and summarized in every sync.
+
+// Define the histogram buckets, the last one takes everything >= 2^(n-2).
+#ifndef METRIC_BUCKETS
+#define METRIC_BUCKETS 24
+#endif
+
+static_assert(METRIC_BUCKETS >= 2 && METRIC_BUCKETS <= 33, "METRIC_BUCKETS must be within 2..33");
+
+class Counter
+{
+public:
+  Counter() : value(0) {}
+
+  void add(uint32_t n = 1)
+  {
+    value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  uint32_t get() const
+  {
+    return value.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint32_t> value;
+};
+
+// Values in power of two buckets: bucket 0 holds 0, bucket i holds
+// [2^(i-1), 2^i). Counts and the sum wrap like any counter.
+class Histogram
+{
+public:
+  Histogram() : n(0), total(0), peak(0)
+  {
+    for (int i = 0; i < METRIC_BUCKETS; i++)
+      buckets[i].store(0, std::memory_order_relaxed);
+  }
+
+  void record(uint32_t v)
+  {
+    buckets[bucketOf(v)].fetch_add(1, std::memory_order_relaxed);
+    n.fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(v, std::memory_order_relaxed);
+    uint32_t m = peak.load(std::memory_order_relaxed);
+    while (v > m && !peak.compare_exchange_weak(m, v, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  uint32_t count() const
+  {
+    return n.load(std::memory_order_relaxed);
+  }
+
+  uint32_t sum() const
+  {
+    return total.load(std::memory_order_relaxed);
+  }
+
+  uint32_t bucket(uint8_t i) const
+  {
+    return buckets[i].load(std::memory_order_relaxed);
+  }
+
+  // Largest value recorded since the last call
+  uint32_t takePeak()
+  {
+    return peak.exchange(0, std::memory_order_relaxed);
+  }
+
+  // Exclusive upper bound of bucket i, 0 for the open ended last one
+  static uint32_t limit(uint8_t i)
+  {
+    return i == METRIC_BUCKETS - 1 ? 0 : (uint32_t)1 << i;
+  }
+
+  static uint8_t bucketOf(uint32_t v)
+  {
+    uint8_t i = v ? 32 - __builtin_clz(v) : 0;
+    return i < METRIC_BUCKETS - 1 ? i : METRIC_BUCKETS - 1;
+  }
+
+private:
+  std::atomic<uint32_t> buckets[METRIC_BUCKETS];
+  std::atomic<uint32_t> n;
+  std::atomic<uint32_t> total;
+  std::atomic<uint32_t> peak;
+};
@@ -2,101 +2,174 @@
 #include <NimBLEDevice.h>
 #include <CRC32.h>
 
+#include "advlog.h"
+#include "ownership.h"
+
 // Rate Limiting
-// Define the maximum number of allowed MAC addresses.
-#define MAX_RATE_LIMIT_ITEMS 100
+// Define the number of rate limit slots, must be a power of two.
+// Lookups cost the same at any size, so this can go into the thousands.
+#ifndef MAX_RATE_LIMIT_ITEMS
+#define MAX_RATE_LIMIT_ITEMS 1024
+#endif
 // Define the expiration time in seconds.
 #define EXPIRATION_TIME 300
+// Define how many slots a lookup may probe before giving up on finding a free one.
+#define RATE_LIMIT_MAX_PROBE 16
+// Define how many slots each rateLimitSweep() call looks at for expired entries.
+#define RATE_LIMIT_SWEEP 8
+// Expiration of a slot whose entry expired, 0 is a slot never used. Lookups
+// probe past a freed slot, a later insert may reuse it.
+#define RATE_LIMIT_FREED 1
+
+static_assert((MAX_RATE_LIMIT_ITEMS & (MAX_RATE_LIMIT_ITEMS - 1)) == 0, "MAX_RATE_LIMIT_ITEMS must be a power of two");
+static_assert(RATE_LIMIT_MAX_PROBE <= MAX_RATE_LIMIT_ITEMS, "RATE_LIMIT_MAX_PROBE must not exceed MAX_RATE_LIMIT_ITEMS");
 
 // Structure to store id and its expiration time.
 struct RateLimit
 {
   // CRC32 of either mac (public address) or manufacturer data (random address)
   uint32_t id;
-  // Time in the future when the rate limit expires
+  // Time in the future when the rate limit expires, 0 = slot never used,
+  // RATE_LIMIT_FREED = entry expired
   unsigned long expiration;
 };
 
-// Array to store the id and their expiration times.
+// Open addressing (linear probing) table of ids and their expiration times.
+// Entries are freed as soon as a lookup or the sweep finds them expired: left
+// in place, millis() would come round past their expiration again after ~24.8
+// days and limit the id once more.
 RateLimit rateLimitList[MAX_RATE_LIMIT_ITEMS];
+// Next slot rateLimitSweep() looks at
+uint32_t rateLimitSweepPos = 0;
+
+// Wraparound-safe check of an expiration against millis(), valid for
+// expirations up to ~24 days out
+bool isExpired(unsigned long expiration, unsigned long now)
+{
+  return (int32_t)(expiration - now) <= 0;
+}
+
+// Whether a slot holds an entry, expired or not
+bool isRateLimitLive(const RateLimit &entry)
+{
+  return entry.expiration != 0 && entry.expiration != RATE_LIMIT_FREED;
+}
+
+// Free the entry of a slot if it expired, returns whether it did
+bool freeIfExpired(RateLimit &entry, unsigned long now)
+{
+  if (!isRateLimitLive(entry) || !isExpired(entry.expiration, now))
+    return false;
+  entry.expiration = RATE_LIMIT_FREED;
+  return true;
+}
+
+// Free the expired entries of the next RATE_LIMIT_SWEEP slots. Called at
+// least every few seconds, it frees every entry long before millis() comes
+// round to it again, whether or not the id is looked up.
+void rateLimitSweep(unsigned long now)
+{
+  for (int i = 0; i < RATE_LIMIT_SWEEP; i++)
+  {
+    freeIfExpired(rateLimitList[rateLimitSweepPos], now);
+    rateLimitSweepPos = (rateLimitSweepPos + 1) & (MAX_RATE_LIMIT_ITEMS - 1);
+  }
+}
+
+uint32_t rateLimitSlot(uint32_t id)
+{
+  // The id is already a CRC32, mix it so sequential ids don't cluster
+  id ^= id >> 16;
+  id *= 0x45d9f3b;
+  id ^= id >> 16;
+  return id & (MAX_RATE_LIMIT_ITEMS - 1);
+}
 
-// Function to check if a id is already in the list.
-bool isIdInList(uint32_t id)
+// Check if an id is still rate limited, without adding it to the table
+bool isRateLimited(uint32_t id)
 {
-  for (int i = 0; i < MAX_RATE_LIMIT_ITEMS; i++)
+  unsigned long now = millis();
+  uint32_t pos = rateLimitSlot(id);
+  for (int probe = 0; probe < RATE_LIMIT_MAX_PROBE; probe++)
   {
-    if (rateLimitList[i].id == id)
+    RateLimit &entry = rateLimitList[pos];
+    if (entry.expiration == 0)
+    {
+      return false;
+    }
+    if (!freeIfExpired(entry, now) && isRateLimitLive(entry) && entry.id == id)
     {
       return true;
     }
+    pos = (pos + 1) & (MAX_RATE_LIMIT_ITEMS - 1);
   }
   return false;
 }
 
-// Function to add a new id to the list.
-void addIdToList(uint32_t id)
+// Function to check if a connection is allowed based on its rate limit id.
+// Allowed ids are (re)added to the table with a fresh expiration.
+bool isConnectionAllowed(uint32_t id)
 {
-  bool foundEmpty = false;
-  // FIX: must be unsigned long to hold ULONG_MAX without overflow/UB
-  unsigned long oldestEntry = ULONG_MAX;
-  int writeIndex = 0;
+  unsigned long now = millis();
+  unsigned long expiration = now + (EXPIRATION_TIME * 1000UL);
+  // 0 and RATE_LIMIT_FREED mark slots without an entry
+  if (expiration == 0 || expiration == RATE_LIMIT_FREED)
+    expiration = RATE_LIMIT_FREED + 1;
 
-  for (int i = 0; i < MAX_RATE_LIMIT_ITEMS; i++)
+  uint32_t pos = rateLimitSlot(id);
+  // Slot to write if the id isn't found: the first unused, freed or expired
+  // slot, otherwise the one closest to expiring
+  int writeIndex = -1;
+  int soonestIndex = pos;
+  for (int probe = 0; probe < RATE_LIMIT_MAX_PROBE; probe++)
   {
-    // Fill expired slots
-    if (rateLimitList[i].expiration == 0)
+    RateLimit &entry = rateLimitList[pos];
+    if (entry.expiration == 0)
     {
-      rateLimitList[i].id = id;
-      rateLimitList[i].expiration = millis() + (EXPIRATION_TIME * 1000);
-      foundEmpty = true;
+      // Never used, nothing past here can match
+      if (writeIndex < 0)
+        writeIndex = pos;
       break;
     }
-    // Keep track of oldest entry as writeIndex
-    else if (rateLimitList[i].expiration < oldestEntry)
+    bool freed = freeIfExpired(entry, now) || !isRateLimitLive(entry);
+    if (freed)
+    {
+      // The id may still be further along, keep looking
+      if (writeIndex < 0)
+        writeIndex = pos;
+    }
+    else if (entry.id == id)
     {
-      oldestEntry = rateLimitList[i].expiration;
-      writeIndex = i;
+      return false;
     }
+    else if ((int32_t)(entry.expiration - rateLimitList[soonestIndex].expiration) < 0)
+    {
+      soonestIndex = pos;
+    }
+    pos = (pos + 1) & (MAX_RATE_LIMIT_ITEMS - 1);
   }
 
-  // If empty slot wasn't found, replace the oldest
-  if (!foundEmpty)
+  // If no free slot was found in the probe window, replace the entry closest to expiring
+  if (writeIndex < 0)
   {
-    rateLimitList[writeIndex].id = id;
-    rateLimitList[writeIndex].expiration = millis() + (EXPIRATION_TIME * 1000);
+    writeIndex = soonestIndex;
   }
+  rateLimitList[writeIndex].id = id;
+  rateLimitList[writeIndex].expiration = expiration;
+  return true;
 }
 
-// Function to remove expired MAC addresses from the list.
-void removeExpiredIds()
+// Check if we are the owning scanner of the remote address among the
+// collectors the logger knows, by rendezvous hashing over their softAP MACs
+bool getOwnership(uint32_t id, const uint8_t self[6], const uint8_t scanners[][6], int count)
 {
-  unsigned long currentMillis = millis();
-  for (int i = 0; i < MAX_RATE_LIMIT_ITEMS; i++)
-  {
-    if (rateLimitList[i].expiration != 0 && rateLimitList[i].expiration < currentMillis)
-    {
-      Serial.print("Expired: ");
-      Serial.println(rateLimitList[i].id);
-      rateLimitList[i].id = 0;
-      ;
-      rateLimitList[i].expiration = 0;
-    }
-  }
-}
-
-// Function to check if a connection is allowed based on MAC address.
-bool isConnectionAllowed(uint32_t id)
-{
-  removeExpiredIds();
-  if (!isIdInList(id))
-  {
-    addIdToList(id);
-    return true;
-  }
-  return false;
+  int owner = ownerOf(id, scanners, count);
+  return owner >= 0 && memcmp(scanners[owner], self, 6) == 0;
 }
 
-// Check if we are the owning scanner of the remote address
+// Check if we are the owning scanner of the remote address, for loggers that
+// only send our index and the scanner count. Moves almost every device when
+// the count changes.
 bool getOwnership(uint32_t id, int scannerIndex, int scannerCount)
 {
   if (id % scannerCount == scannerIndex)
@@ -106,28 +179,28 @@ bool getOwnership(uint32_t id, int scannerIndex, int scannerCount)
   return false;
 }
 
-uint32_t getRateLimitId(const NimBLEAdvertisedDevice *advertisedDevice)
+uint32_t getRateLimitId(const AdvSighting &rec)
 {
   //We'll use a CRC32 checksum as the key for identifying a device
   uint32_t checksum;
   // Public mac addr type "should" not change, suitable for rate limit key
-  if (advertisedDevice->getAddressType() == BLE_ADDR_PUBLIC)
+  if (rec.addrType == BLE_ADDR_PUBLIC)
   {
-    checksum = CRC32::calculate(advertisedDevice->getAddress().getVal(), 6);
+    checksum = CRC32::calculate(rec.addr, 6);
   }
   // Random mac addr type can/do change, unsuitable for rate limit key
   // Use the manufacturer data instead. While man data may *also* change,
   // 
-  else if (advertisedDevice->getAddressType() == BLE_ADDR_RANDOM)
+  else if (rec.addrType == BLE_ADDR_RANDOM)
   {
-    checksum = CRC32::calculate(advertisedDevice->getManufacturerData().data(), advertisedDevice->getManufacturerData().length());
+    checksum = CRC32::calculate(rec.man, rec.manLen);
   }
   else
   {
     // The rarer mac addr types just use their mac as the rate limit key
     // As best as I can discern, there is no "best" choice here,
     // but mac is the simplest of them 
-    checksum = CRC32::calculate(advertisedDevice->getAddress().getVal(), 6);
+    checksum = CRC32::calculate(rec.addr, 6);
   }
   return checksum;
 }
\ No newline at end of file
@@ -0,0 +1,271 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+#include <atomic>
+
+// Scan Tuning
+// Every SCAN_TUNE_MS the scan is retuned from what the last period brought
+// in. The duty cycle climbs while more air buys more distinct devices per
+// second and gives air back once it doesn't, then holds the level it settled
+// on for SCAN_TUNE_HOLD periods before it tries a neighbouring one. Where advertisements are dense
+// the scan goes passive and 1M only so SCAN_REQs and coded PHY windows don't
+// crowd the channel. Around the logger's syncs the duty is held down so its
+// WiFi pulls get airtime.
+
+// Define how often the scan is retuned.
+#ifndef SCAN_TUNE_MS
+#define SCAN_TUNE_MS 10000
+#endif
+// Define the advertisement rate (per second) at which the scan goes passive
+// and 1M only, and the rate it has to fall to before it goes back.
+#ifndef SCAN_DENSE_RATE
+#define SCAN_DENSE_RATE 150
+#endif
+#ifndef SCAN_SPARSE_RATE
+#define SCAN_SPARSE_RATE 100
+#endif
+// Define how much better (in percent) a duty level has to do than the last
+// one to keep climbing, and worse to turn back.
+#define SCAN_TUNE_GAIN_PCT 10
+// Define the periods a settled level is held, each change restarts the scan.
+#ifndef SCAN_TUNE_HOLD
+#define SCAN_TUNE_HOLD 6
+#endif
+// Define the duty level held around syncs, the fixed 45/15 scan used before.
+#define SCAN_SYNC_LEVEL 1
+// Define how long before an expected sync and after the latest pull the
+// duty stays held.
+#define SCAN_SYNC_GUARD_MS 5000
+// Define the gap after which a pull starts a new logger visit.
+#define SCAN_VISIT_GAP_MS 5000
+// Define the bits of the distinct device counter, a power of two.
+#define SCAN_DISTINCT_BITS 2048
+
+static_assert(SCAN_SPARSE_RATE < SCAN_DENSE_RATE, "SCAN_SPARSE_RATE must be below SCAN_DENSE_RATE");
+static_assert(SCAN_TUNE_HOLD <= 0xFF, "SCAN_TUNE_HOLD must fit the uint8_t count");
+static_assert((SCAN_DISTINCT_BITS & (SCAN_DISTINCT_BITS - 1)) == 0, "SCAN_DISTINCT_BITS must be a power of two");
+
+// Structure to store one duty level, NimBLEScan::setInterval()/setWindow() in ms.
+struct ScanLevel
+{
+  uint16_t interval;
+  uint16_t window;
+};
+
+// Duty levels, least air first. The top one still leaves a quarter of the
+// air to WiFi, the softAP has to answer the logger.
+const ScanLevel scanLevels[] = {{60, 10}, {45, 15}, {50, 25}, {60, 40}, {80, 60}};
+#define SCAN_LEVELS ((int)(sizeof(scanLevels) / sizeof(scanLevels[0])))
+
+static_assert(SCAN_SYNC_LEVEL < SCAN_LEVELS, "SCAN_SYNC_LEVEL must be one of scanLevels");
+
+// Structure to store what the scan runs with.
+struct ScanSettings
+{
+  uint8_t level;
+  // Active scanning, SCAN_REQs fetch the scan response (names)
+  bool active;
+  // Coded PHY as well as 1M
+  bool allPhys;
+
+  bool operator==(const ScanSettings &other) const
+  {
+    return level == other.level && active == other.active && allPhys == other.allPhys;
+  }
+
+  bool operator!=(const ScanSettings &other) const
+  {
+    return !(*this == other);
+  }
+};
+
+// Distinct ids seen since the last take(), by linear counting over a bitmap.
+// Within a few percent up to about SCAN_DISTINCT_BITS ids, saturates above.
+// add() is a relaxed atomic or, safe from the scan callback.
+class DistinctCounter
+{
+public:
+  DistinctCounter()
+  {
+    for (int i = 0; i < WORDS; i++)
+      words[i].store(0, std::memory_order_relaxed);
+  }
+
+  void add(uint32_t id)
+  {
+    // The id is a CRC32 already, mix it so similar ids spread out
+    id ^= id >> 16;
+    id *= 0x45d9f3b;
+    id ^= id >> 16;
+    uint32_t bit = id & (SCAN_DISTINCT_BITS - 1);
+    words[bit / 32].fetch_or((uint32_t)1 << (bit % 32), std::memory_order_relaxed);
+  }
+
+  // Estimate and start over
+  uint32_t take()
+  {
+    uint32_t zeros = 0;
+    for (int i = 0; i < WORDS; i++)
+      zeros += 32 - __builtin_popcount(words[i].exchange(0, std::memory_order_relaxed));
+    if (zeros == 0)
+      zeros = 1;
+    return (uint32_t)(-(double)SCAN_DISTINCT_BITS * log((double)zeros / SCAN_DISTINCT_BITS) + 0.5);
+  }
+
+private:
+  static const int WORDS = SCAN_DISTINCT_BITS / 32;
+  std::atomic<uint32_t> words[WORDS];
+};
+
+class ScanTuner
+{
+public:
+  ScanTuner() : settings{SCAN_SYNC_LEVEL, true, true}, level(SCAN_SYNC_LEVEL), dir(1), lastScore(-1), probing(false),
+                holdLeft(0), held(false), dense(false), visits(0), lastVisit(0), lastPull(0), visitGap(0)
+  {
+  }
+
+  // What the scan starts with, the fixed settings used before tuning
+  ScanSettings initial() const
+  {
+    return settings;
+  }
+
+  // Settings for the next period from the one that just ended: elapsed ms
+  // long, seen advertisements of distinct devices, and the millis() of the
+  // latest sync pull
+  ScanSettings update(uint32_t now, uint32_t elapsed, uint32_t seen, uint32_t distinct, uint32_t pullAt)
+  {
+    bool pulled = trackVisits(pullAt);
+    if (elapsed == 0)
+      return settings;
+
+    uint32_t rate = (uint64_t)seen * 1000 / elapsed;
+    bool wasDense = dense;
+    if (rate >= SCAN_DENSE_RATE)
+      dense = true;
+    else if (rate <= SCAN_SPARSE_RATE)
+      dense = false;
+
+    // Only a period that ran at the level being tuned, in the same mode and
+    // without WiFi traffic, says anything about that level
+    if (held || pulled || dense != wasDense)
+    {
+      lastScore = -1;
+    }
+    else
+    {
+      // Distinct devices per 1000 s, so sparse periods don't round to 0
+      int64_t score = (int64_t)distinct * 1000000 / elapsed;
+      int step = 0;
+      if (holdLeft > 0)
+      {
+        // Settled, probe a neighbour once the hold is over
+        holdLeft--;
+        if (holdLeft == 0)
+          step = dir;
+      }
+      else if (lastScore < 0)
+      {
+        // Nothing to compare with yet, this period is the baseline
+      }
+      else if (!probing)
+      {
+        step = dir;
+      }
+      else if (score * 100 > lastScore * (100 + SCAN_TUNE_GAIN_PCT))
+      {
+        // Better, keep going the same way
+        step = dir;
+      }
+      else if (score * 100 < lastScore * (100 - SCAN_TUNE_GAIN_PCT))
+      {
+        // Worse, go back to the level before and stay there
+        dir = -dir;
+        step = dir;
+        holdLeft = SCAN_TUNE_HOLD;
+      }
+      else
+      {
+        // Within the band. If more air didn't buy more devices give it
+        // back, either way stay there.
+        if (dir > 0)
+        {
+          dir = -1;
+          step = dir;
+        }
+        holdLeft = SCAN_TUNE_HOLD;
+      }
+      lastScore = score;
+      // Turn around at either end, so a flat score at the bottom still
+      // probes the level above now and then
+      if (step != 0 && (level + step < 0 || level + step >= SCAN_LEVELS))
+      {
+        dir = -dir;
+        step = dir;
+      }
+      level += step;
+      probing = step != 0;
+    }
+
+    held = syncNear(now);
+    settings.level = held && level > SCAN_SYNC_LEVEL ? SCAN_SYNC_LEVEL : level;
+    settings.active = !dense;
+    settings.allPhys = !dense;
+    return settings;
+  }
+
+  // Expected ms between logger visits, 0 until two were seen
+  uint32_t visitInterval() const
+  {
+    return visits >= 2 ? visitGap : 0;
+  }
+
+private:
+  ScanSettings settings;
+  // Level being tuned, settings.level may be held below it
+  int level;
+  int dir;
+  int64_t lastScore;
+  // The last period ran at a level just stepped to
+  bool probing;
+  // Periods the level is held before the next probe
+  uint8_t holdLeft;
+  bool held;
+  bool dense;
+  uint32_t visits;
+  uint32_t lastVisit;
+  uint32_t lastPull;
+  uint32_t visitGap;
+
+  // True if the logger pulled since the last call
+  bool trackVisits(uint32_t pullAt)
+  {
+    if (pullAt == lastPull)
+      return false;
+    if (visits == 0 || pullAt - lastPull > SCAN_VISIT_GAP_MS)
+    {
+      if (visits > 0)
+      {
+        uint32_t gap = pullAt - lastVisit;
+        // Average over the last few visits, the logger's sweeps vary
+        visitGap = visits == 1 ? gap : (visitGap * 3 + gap) / 4;
+      }
+      visits++;
+      lastVisit = pullAt;
+    }
+    lastPull = pullAt;
+    return true;
+  }
+
+  // True if the logger is pulling now or is expected before the next retune
+  bool syncNear(uint32_t now)
+  {
+    if (visits > 0 && now - lastPull < SCAN_SYNC_GUARD_MS)
+      return true;
+    if (visits < 2)
+      return false;
+    int32_t untilVisit = (int32_t)(lastVisit + visitGap - now);
+    return untilVisit < SCAN_TUNE_MS + SCAN_SYNC_GUARD_MS && untilVisit > -SCAN_SYNC_GUARD_MS;
+  }
+};
@@ -0,0 +1,267 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#include "advlog.h"
+
+// Connection Scheduler
+// Connectable devices in view wait here for a walker, which always gets the
+// best scoring one. Scores come from the device's last RSSI and from what past
+// walks of the same model (gattFingerprint()) went like.
+
+// Define the number of devices that can wait for a walker.
+#ifndef SCHED_CANDIDATES
+#define SCHED_CANDIDATES 16
+#endif
+// Define the number of models whose walk history is kept.
+#ifndef SCHED_MODELS
+#define SCHED_MODELS 64
+#endif
+// Define how long a device counts as in view after its last advertisement.
+#ifndef SCHED_IN_VIEW_MS
+#define SCHED_IN_VIEW_MS 2000
+#endif
+// Define the score a model loses per failed walk since its last successful one.
+#ifndef SCHED_FAIL_PENALTY
+#define SCHED_FAIL_PENALTY 30
+#endif
+// Define the failed walks in a row that are counted against a model.
+#ifndef SCHED_FAIL_MAX
+#define SCHED_FAIL_MAX 4
+#endif
+
+static_assert(SCHED_CANDIDATES <= 0xFF, "SCHED_CANDIDATES must fit the uint8_t count");
+static_assert(SCHED_MODELS <= 0xFF, "SCHED_MODELS must fit the uint8_t count");
+static_assert(SCHED_FAIL_MAX <= 0xFF, "SCHED_FAIL_MAX must fit the uint8_t count");
+
+// Structure to store a device waiting for a walker.
+struct SchedCandidate
+{
+  // Little endian address, same as AdvSighting
+  uint8_t addr[6];
+  uint8_t addrType;
+  int8_t rssi;
+  // millis() of the latest advertisement
+  uint32_t seen;
+  uint32_t rateLimitId;
+  uint32_t fingerprint;
+};
+
+// Structure to store the walk history of a device model.
+struct SchedModel
+{
+  uint32_t fingerprint;
+  uint16_t attempts;
+  uint16_t successes;
+  // Failed walks since the last successful one, up to SCHED_FAIL_MAX
+  uint8_t failures;
+  // millis() of the last successful walk, only valid if successes > 0
+  uint32_t lastWalk;
+  // ConnectScheduler clock of the last use, the oldest model is replaced
+  uint32_t lastUsed;
+};
+
+class ConnectScheduler
+{
+public:
+  ConnectScheduler()
+  {
+    clear();
+  }
+
+  // Offer a connectable device, refreshing it if it already waits.
+  // Returns false if every slot holds a better device.
+  bool offer(const AdvSighting &rec, uint32_t rateLimitId, uint32_t fingerprint)
+  {
+    SchedCandidate candidate;
+    memcpy(candidate.addr, rec.addr, 6);
+    candidate.addrType = rec.addrType;
+    candidate.rssi = rec.rssi;
+    candidate.seen = rec.seen;
+    candidate.rateLimitId = rateLimitId;
+    candidate.fingerprint = fingerprint;
+
+    int slot = -1;
+    int worst = -1;
+    int32_t worstScore = 0;
+    for (uint8_t i = 0; i < held; i++)
+    {
+      if (candidates[i].rateLimitId == rateLimitId)
+      {
+        candidates[i] = candidate;
+        return true;
+      }
+      if (!inView(candidates[i], rec.seen))
+      {
+        slot = i;
+        continue;
+      }
+      int32_t s = score(candidates[i], rec.seen);
+      if (worst < 0 || s < worstScore)
+      {
+        worst = i;
+        worstScore = s;
+      }
+    }
+    if (slot < 0 && held < SCHED_CANDIDATES)
+    {
+      slot = held++;
+    }
+    if (slot < 0)
+    {
+      if (score(candidate, rec.seen) <= worstScore)
+        return false;
+      slot = worst;
+    }
+    candidates[slot] = candidate;
+    return true;
+  }
+
+  // Take the best scoring device still in view and count the attempt.
+  // Returns false if none is waiting.
+  bool take(SchedCandidate &out, uint32_t now)
+  {
+    int best = -1;
+    int32_t bestScore = 0;
+    for (uint8_t i = 0; i < held;)
+    {
+      if (!inView(candidates[i], now))
+      {
+        remove(i);
+        continue;
+      }
+      int32_t s = score(candidates[i], now);
+      if (best < 0 || s > bestScore)
+      {
+        best = i;
+        bestScore = s;
+      }
+      i++;
+    }
+    if (best < 0)
+    {
+      return false;
+    }
+    out = candidates[best];
+    remove(best);
+    SchedModel &m = model(out.fingerprint);
+    if (m.attempts < 0xFFFF)
+      m.attempts++;
+    return true;
+  }
+
+  // Record how the walk of a taken device went
+  void result(uint32_t fingerprint, bool success, uint32_t now)
+  {
+    SchedModel &m = model(fingerprint);
+    if (!success)
+    {
+      if (m.failures < SCHED_FAIL_MAX)
+        m.failures++;
+      return;
+    }
+    if (m.successes < 0xFFFF && m.successes < m.attempts)
+      m.successes++;
+    m.failures = 0;
+    m.lastWalk = now;
+  }
+
+  // Higher is better, each term is a small range so they can be read off:
+  //   RSSI      0..60  -100 dBm -> 0, -40 dBm and stronger -> 60, predicts the link holding up
+  //   novelty   0..40  40 / (1 + successful walks of the model)
+  //   staleness 0..30  seconds since the model was last walked / 10, 30 if never
+  //   success   0..30  30 * (successes + 1) / (attempts + 2) of the model
+  //   failures  -120..0  -SCHED_FAIL_PENALTY per failed walk in a row
+  // A model that keeps failing, e.g. devices refusing every connection, drops
+  // below a fresh model at any RSSI after SCHED_FAIL_MAX failures and is only
+  // walked when nothing better waits. One successful walk clears it.
+  int32_t score(const SchedCandidate &candidate, uint32_t now) const
+  {
+    int32_t rssi = candidate.rssi < -100 ? 0 : candidate.rssi > -40 ? 60 : candidate.rssi + 100;
+    const SchedModel *m = find(candidate.fingerprint);
+    if (!m)
+    {
+      return rssi + 40 + 30 + 15;
+    }
+    int32_t novelty = 40 / (1 + m->successes);
+    int32_t staleness = 30;
+    if (m->successes > 0)
+    {
+      uint32_t seconds = (now - m->lastWalk) / 1000;
+      staleness = seconds / 10 > 30 ? 30 : seconds / 10;
+    }
+    int32_t success = 30 * (m->successes + 1) / (m->attempts + 2);
+    int32_t failures = SCHED_FAIL_PENALTY * m->failures;
+    return rssi + novelty + staleness + success - failures;
+  }
+
+  // Number of devices waiting, including ones that went out of view
+  uint8_t size() const
+  {
+    return held;
+  }
+
+  void clear()
+  {
+    held = 0;
+    modelsHeld = 0;
+    clock = 0;
+  }
+
+private:
+  SchedCandidate candidates[SCHED_CANDIDATES];
+  SchedModel models[SCHED_MODELS];
+  uint8_t held;
+  uint8_t modelsHeld;
+  uint32_t clock;
+
+  static bool inView(const SchedCandidate &candidate, uint32_t now)
+  {
+    return (int32_t)(now - candidate.seen) < SCHED_IN_VIEW_MS;
+  }
+
+  void remove(uint8_t i)
+  {
+    held--;
+    candidates[i] = candidates[held];
+  }
+
+  const SchedModel *find(uint32_t fingerprint) const
+  {
+    for (uint8_t i = 0; i < modelsHeld; i++)
+    {
+      if (models[i].fingerprint == fingerprint)
+        return &models[i];
+    }
+    return nullptr;
+  }
+
+  // History of a model, replacing the least recently used one for a new model
+  SchedModel &model(uint32_t fingerprint)
+  {
+    SchedModel *m = const_cast<SchedModel *>(find(fingerprint));
+    if (!m)
+    {
+      if (modelsHeld < SCHED_MODELS)
+      {
+        m = &models[modelsHeld++];
+      }
+      else
+      {
+        m = &models[0];
+        for (uint8_t i = 1; i < modelsHeld; i++)
+        {
+          if ((int32_t)(models[i].lastUsed - m->lastUsed) < 0)
+            m = &models[i];
+        }
+      }
+      m->fingerprint = fingerprint;
+      m->attempts = 0;
+      m->successes = 0;
+      m->failures = 0;
+      m->lastWalk = 0;
+    }
+    m->lastUsed = ++clock;
+    return *m;
+  }
+};
@@ -0,0 +1,43 @@
+#pragma once
+#include <esp_partition.h>
+
+#include "spilllog.h"
+
+// Spill Partition
+// SpillDevice on the "spill" data partition from partitions.csv.
+
+class PartitionSpillDevice : public SpillDevice
+{
+public:
+  PartitionSpillDevice() : part(nullptr) {}
+
+  // Find the partition, returns false if the flashed table has none
+  bool begin()
+  {
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "spill");
+    return part != nullptr;
+  }
+
+  uint32_t size() override
+  {
+    return part ? part->size : 0;
+  }
+
+  bool read(uint32_t offset, void *data, size_t length) override
+  {
+    return part && esp_partition_read(part, offset, data, length) == ESP_OK;
+  }
+
+  bool write(uint32_t offset, const void *data, size_t length) override
+  {
+    return part && esp_partition_write(part, offset, data, length) == ESP_OK;
+  }
+
+  bool erase(uint32_t offset) override
+  {
+    return part && esp_partition_erase_range(part, offset, SPILL_SEGMENT_SIZE) == ESP_OK;
+  }
+
+private:
+  const esp_partition_t *part;
+};
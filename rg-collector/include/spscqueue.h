@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Lock-free single producer / single consumer queue of fixed-size items.
+// push() must only ever be called from one task and pop() from one other
+// task; neither blocks or allocates. N must be a power of two.
+template <typename T, size_t N>
+class SpscQueue
+{
+  static_assert((N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+public:
+  SpscQueue() : head(0), tail(0), dropped(0) {}
+
+  // Producer side. Returns false (and counts a drop) if the queue is full.
+  bool push(const T &item)
+  {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N)
+    {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    items[t & (N - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false if the queue is empty.
+  bool pop(T &item)
+  {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    item = items[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Items lost to a full queue since the last call, safe from any task
+  uint32_t takeDropped()
+  {
+    return dropped.exchange(0, std::memory_order_relaxed);
+  }
+
+private:
+  T items[N];
+  // Free running counters, only the low bits index into items
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  std::atomic<uint32_t> dropped;
+};
@@ -0,0 +1,170 @@
+// Advertisement log check
+// Runs the advertisement log (advlog.h) at a small capacity against a plain
+// model of what it should hold: sightings merged by address and
+// manufacturer data, a full log dropping new records or overwriting the
+// oldest, and the index still finding every record left after evictions.
+// The full log behaves one way per build, so build and run it both ways.
+//
+// Build and run on a host:
+//   g++ -O2 -I ../include -o advlog_check advlog_check.cpp && ./advlog_check
+//   g++ -O2 -D ADV_LOG_OVERWRITE=1 -I ../include -o advlog_check advlog_check.cpp && ./advlog_check
+
+#include <stdio.h>
+#include <deque>
+
+// Small enough that the log fills and the index probes past collisions
+#define ADV_LOG_CAPACITY 8
+#define ADV_LOG_INDEX_SIZE 16
+
+#include "advlog.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%-52s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    failures++;
+}
+
+// xorshift32, fixed seed so runs are repeatable
+static uint32_t rngState = 2463534242u;
+static uint32_t rng()
+{
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+// Device d, its manufacturer data changed v times
+static AdvSighting sighting(uint32_t d, uint8_t v, int8_t rssi, uint32_t seen)
+{
+  AdvSighting s = {};
+  s.addr[0] = d;
+  s.addr[1] = d >> 8;
+  s.addr[5] = 0xC0;
+  s.addrType = 1;
+  s.rssi = rssi;
+  s.manLen = 3;
+  s.man[0] = 0x4C;
+  s.man[1] = 0x00;
+  s.man[2] = v;
+  s.seen = seen;
+  return s;
+}
+
+static bool sameKey(const AdvSighting &a, const AdvSighting &b)
+{
+  return memcmp(a.addr, b.addr, 6) == 0 && a.manLen == b.manLen && memcmp(a.man, b.man, a.manLen) == 0;
+}
+
+// The log holds exactly the model's records, oldest first
+static bool matches(const AdvLog &advs, const std::deque<AdvSighting> &model)
+{
+  if (advs.size() != model.size())
+    return false;
+  for (uint16_t i = 0; i < advs.size(); i++)
+  {
+    if (!sameKey(advs.at(i), model[i]))
+      return false;
+  }
+  return true;
+}
+
+static AdvLog advs;
+
+int main()
+{
+  printf("full log %s\n\n", ADV_LOG_OVERWRITE ? "overwrites the oldest record" : "drops new records");
+
+  // Merging
+  check(advs.put(sighting(1, 0, -60, 1000)) && advs.size() == 1, "first sighting starts a record");
+  advs.put(sighting(1, 0, -70, 1100));
+  advs.put(sighting(1, 0, -50, 1300));
+  const AdvRecord &r = advs.at(0);
+  check(advs.size() == 1 && r.hits == 3, "same address and data merge");
+  check(r.rssiMin == -70 && r.rssiMax == -50 && advRssiMean(r) == -60 && r.rssi == -50, "merge keeps RSSI min, max, mean, latest");
+  check(r.firstSeen == 1000 && r.seen == 1300, "merge keeps first and last seen");
+  check(r.seriesLen == 2 && r.rssiFirst == -60 && r.seriesDrssi[0] == -10 && r.seriesDrssi[1] == 20,
+        "merge adds to the RSSI series");
+  advs.put(sighting(1, 1, -60, 1400));
+  check(advs.size() == 2 && advs.at(1).hits == 1, "changed manufacturer data starts a record");
+  advs.put(sighting(2, 0, -60, 1500));
+  check(advs.size() == 3, "another address starts a record");
+  AdvSighting named = sighting(2, 0, -60, 1600);
+  named.nameLen = 3;
+  memcpy(named.name, "tag", 3);
+  advs.put(named);
+  advs.put(sighting(2, 0, -60, 1700));
+  check(advs.at(2).nameLen == 3 && memcmp(advs.at(2).name, "tag", 3) == 0, "a sighting without a name keeps the known one");
+
+  // Filling up
+  advs.clear();
+  std::deque<AdvSighting> model;
+  for (uint32_t d = 0; d < ADV_LOG_CAPACITY; d++)
+  {
+    advs.put(sighting(d, 0, -60, d));
+    model.push_back(sighting(d, 0, -60, d));
+  }
+  check(advs.full() && matches(advs, model), "fills to capacity");
+  bool taken = advs.put(sighting(100, 0, -60, 100));
+  advs.put(sighting(3, 0, -61, 101));
+#if ADV_LOG_OVERWRITE
+  model.pop_front();
+  model.push_back(sighting(100, 0, -60, 100));
+  check(taken && advs.droppedCount() == 1 && matches(advs, model), "a new record overwrites the oldest");
+  check(advs.at(2).hits == 2, "records left are still merged into");
+#else
+  check(!taken && advs.droppedCount() == 1 && matches(advs, model), "a new record is dropped");
+  check(advs.at(3).hits == 2, "records held are still merged into");
+#endif
+
+  // Churn through many devices at random, checking after every sighting
+  // that the log holds what the model does and finds it again
+  advs.clear();
+  model.clear();
+  bool inOrder = true;
+  bool found = true;
+  uint32_t drops = 0;
+  for (uint32_t i = 0; i < 200000; i++)
+  {
+    AdvSighting s = sighting(rng() % 40, rng() % 2, -60, i);
+    bool held = false;
+    for (const AdvSighting &m : model)
+      held = held || sameKey(m, s);
+    bool room = model.size() < ADV_LOG_CAPACITY;
+    bool taken = advs.put(s);
+    if (!held && room)
+    {
+      model.push_back(s);
+    }
+    else if (!held)
+    {
+      drops++;
+#if ADV_LOG_OVERWRITE
+      model.pop_front();
+      model.push_back(s);
+#endif
+    }
+    inOrder = inOrder && taken == (held || room || ADV_LOG_OVERWRITE) && matches(advs, model);
+    // A held record is merged into, not started again
+    if (!model.empty())
+    {
+      const AdvSighting &again = model[rng() % model.size()];
+      uint16_t size = advs.size();
+      found = found && advs.put(again) && advs.size() == size;
+    }
+    // Empty now and then, like a sync
+    if (i % 5000 == 4999)
+    {
+      advs.clear();
+      model.clear();
+    }
+  }
+  check(inOrder, "churn keeps the records the model does");
+  check(found, "every record held is found after evictions");
+  check(drops > 0, "churn filled the log");
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,331 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+// Arduino Facade
+// Just enough of the ESP32 Arduino core and FreeRTOS for src/main.cpp to
+// build on a host. Time is virtual: the replay sets simClockUs and nothing
+// runs concurrently, so locks, notifications and task creation are no-ops.
+
+// Virtual clock in microseconds, advanced by the replay (and by delay())
+inline uint64_t simClockUs = 0;
+// Heap use as counted by the replay's operator new while simCountHeap is
+// set, feeds ESP.getFreeHeap()
+inline bool simCountHeap = false;
+inline size_t simHeapUsed = 0;
+inline size_t simHeapPeak = 0;
+inline uint64_t simHeapAllocs = 0;
+// Internal RAM the XIAO ESP32-S3 leaves to the application after boot
+#define SIM_HEAP_SIZE (320 * 1024)
+// Serial output goes to stderr only when set
+inline bool simSerialEcho = false;
+inline uint32_t simRandomState = 1;
+
+// 32 bits like on the ESP32, so they wrap the same way
+inline uint32_t millis()
+{
+  return (uint32_t)(simClockUs / 1000);
+}
+
+// Virtual too, durations measured with it (on_result_us) read 0 on a host
+inline uint32_t micros()
+{
+  return (uint32_t)simClockUs;
+}
+
+inline void delay(uint32_t ms)
+{
+  simClockUs += (uint64_t)ms * 1000;
+}
+
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 0x03
+#define LED_BUILTIN 21
+
+inline void pinMode(uint8_t pin, uint8_t mode) {}
+inline void digitalWrite(uint8_t pin, uint8_t val) {}
+
+// xorshift32, seeded by the replay so each collector gets its own epoch
+inline uint32_t esp_random()
+{
+  simRandomState ^= simRandomState << 13;
+  simRandomState ^= simRandomState >> 17;
+  simRandomState ^= simRandomState << 5;
+  return simRandomState;
+}
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *)(s))
+#define PSTR(s) (s)
+#define log_e(...) \
+  do             \
+  {              \
+  } while (0)
+
+class String
+{
+public:
+  String() {}
+  String(const char *s) : s(s ? s : "") {}
+  String(const std::string &s) : s(s) {}
+
+  const char *c_str() const
+  {
+    return s.c_str();
+  }
+
+  size_t length() const
+  {
+    return s.size();
+  }
+
+  bool operator==(const char *other) const
+  {
+    return s == other;
+  }
+
+private:
+  std::string s;
+};
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+
+  virtual size_t write(const uint8_t *data, size_t size)
+  {
+    for (size_t i = 0; i < size; i++)
+      write(data[i]);
+    return size;
+  }
+
+  virtual void flush() {}
+
+  size_t write(const char *s)
+  {
+    return write((const uint8_t *)s, strlen(s));
+  }
+
+  size_t print(const char *s)
+  {
+    return write(s);
+  }
+
+  size_t print(const __FlashStringHelper *s)
+  {
+    return write((const char *)s);
+  }
+
+  size_t print(const String &s)
+  {
+    return write(s.c_str());
+  }
+
+  size_t print(char c)
+  {
+    return write((uint8_t)c);
+  }
+
+  size_t print(unsigned char v)
+  {
+    return print((unsigned long)v);
+  }
+
+  size_t print(int v)
+  {
+    return print((long)v);
+  }
+
+  size_t print(unsigned int v)
+  {
+    return print((unsigned long)v);
+  }
+
+  size_t print(long v)
+  {
+    return printf("%ld", v);
+  }
+
+  size_t print(unsigned long v)
+  {
+    return printf("%lu", v);
+  }
+
+  size_t print(double v)
+  {
+    return printf("%.2f", v);
+  }
+
+  template <typename T>
+  size_t println(const T &v)
+  {
+    return print(v) + print('\n');
+  }
+
+  size_t println()
+  {
+    return print('\n');
+  }
+
+  size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)))
+  {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (n < 0)
+      return 0;
+    return write((const uint8_t *)buf, (size_t)n < sizeof(buf) ? n : sizeof(buf) - 1);
+  }
+
+  template <typename... Args>
+  size_t printf_P(const char *fmt, Args... args)
+  {
+    return printf(fmt, args...);
+  }
+};
+
+class HardwareSerial : public Print
+{
+public:
+  void begin(unsigned long baud) {}
+
+  size_t write(uint8_t c) override
+  {
+    if (simSerialEcho)
+      fputc(c, stderr);
+    return 1;
+  }
+};
+
+inline HardwareSerial Serial;
+
+class IPAddress
+{
+public:
+  operator String() const
+  {
+    return String("192.168.4.1");
+  }
+};
+
+class EspClass
+{
+public:
+  uint32_t getFreeHeap()
+  {
+    return SIM_HEAP_SIZE - simHeapUsed;
+  }
+
+  uint32_t getMinFreeHeap()
+  {
+    return SIM_HEAP_SIZE - simHeapPeak;
+  }
+
+  void restart()
+  {
+    exit(0);
+  }
+};
+
+inline EspClass ESP;
+
+// FreeRTOS
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+typedef void *TaskHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+enum eNotifyAction
+{
+  eNoAction,
+  eSetBits,
+  eIncrement
+};
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  static int handle;
+  return &handle;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+  return xSemaphoreCreateMutex();
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout)
+{
+  return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+  return pdTRUE;
+}
+
+inline TickType_t xTaskGetTickCount()
+{
+  return millis();
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+  return nullptr;
+}
+
+inline void vTaskDelay(TickType_t ticks)
+{
+  delay(ticks);
+}
+
+inline BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+  return pdPASS;
+}
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  return pdPASS;
+}
+
+inline BaseType_t xTaskNotifyWait(uint32_t clearOnEntry, uint32_t clearOnExit, uint32_t *value, TickType_t timeout)
+{
+  return pdFALSE;
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t timeout)
+{
+  return 0;
+}
+
+// Tasks never start, the replay calls what they would run itself
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *param,
+                                          int priority, TaskHandle_t *handle, int core)
+{
+  if (handle)
+    *handle = nullptr;
+  return pdPASS;
+}
@@ -0,0 +1,609 @@
+#pragma once
+#include <Arduino.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// ArduinoJson Facade
+// The part of the ArduinoJson 7 API the collector reads requests with, plus
+// object iteration for the replay to read JSON sync responses back. Parses
+// into a plain tree, no memory pool or zero-copy tricks, but every node and
+// string is allocated through the document's Allocator like the real thing.
+
+namespace ArduinoJson
+{
+class Allocator
+{
+public:
+  virtual void *allocate(size_t size) = 0;
+  virtual void deallocate(void *ptr) = 0;
+  virtual void *reallocate(void *ptr, size_t new_size) = 0;
+
+protected:
+  ~Allocator() = default;
+};
+}
+
+// What documents use when given no allocator, the heap
+class SimJsonHeap : public ArduinoJson::Allocator
+{
+public:
+  void *allocate(size_t size) override
+  {
+    return ::operator new(size);
+  }
+
+  void deallocate(void *ptr) override
+  {
+    ::operator delete(ptr);
+  }
+
+  // The facade's containers never grow a block in place
+  void *reallocate(void *ptr, size_t new_size) override
+  {
+    return nullptr;
+  }
+};
+
+inline SimJsonHeap simJsonHeap;
+// Allocator new nodes and strings pick up, the document's while it parses
+inline ArduinoJson::Allocator *simJsonAllocator = &simJsonHeap;
+
+// Sets simJsonAllocator for a scope
+class SimJsonUse
+{
+public:
+  SimJsonUse(ArduinoJson::Allocator *allocator) : previous(simJsonAllocator)
+  {
+    simJsonAllocator = allocator;
+  }
+
+  ~SimJsonUse()
+  {
+    simJsonAllocator = previous;
+  }
+
+private:
+  ArduinoJson::Allocator *previous;
+};
+
+// Standard allocator over an ArduinoJson::Allocator, taken from
+// simJsonAllocator when constructed and carried along when moved
+template <typename T>
+struct SimJsonStl
+{
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  SimJsonStl() : allocator(simJsonAllocator) {}
+
+  template <typename U>
+  SimJsonStl(const SimJsonStl<U> &other) : allocator(other.allocator)
+  {
+  }
+
+  T *allocate(size_t n)
+  {
+    void *p = allocator->allocate(n * sizeof(T));
+    if (!p)
+      throw std::bad_alloc();
+    return (T *)p;
+  }
+
+  void deallocate(T *p, size_t)
+  {
+    allocator->deallocate(p);
+  }
+
+  template <typename U>
+  bool operator==(const SimJsonStl<U> &other) const
+  {
+    return allocator == other.allocator;
+  }
+
+  template <typename U>
+  bool operator!=(const SimJsonStl<U> &other) const
+  {
+    return allocator != other.allocator;
+  }
+
+  ArduinoJson::Allocator *allocator;
+};
+
+typedef std::basic_string<char, std::char_traits<char>, SimJsonStl<char>> SimJsonText;
+
+struct JsonNode
+{
+  enum Type
+  {
+    Null,
+    Bool,
+    Integer,
+    Float,
+    Text,
+    Array,
+    Object
+  };
+
+  Type type = Null;
+  bool b = false;
+  int64_t i = 0;
+  double f = 0;
+  SimJsonText text;
+  // Array items or object members, keys is parallel to items for objects
+  std::vector<JsonNode, SimJsonStl<JsonNode>> items;
+  std::vector<SimJsonText, SimJsonStl<SimJsonText>> keys;
+};
+
+class JsonVariant
+{
+public:
+  JsonVariant(const JsonNode *node = nullptr) : node(node) {}
+
+  JsonVariant operator[](const char *key) const
+  {
+    if (!node || node->type != JsonNode::Object)
+      return JsonVariant();
+    for (size_t k = 0; k < node->keys.size(); k++)
+    {
+      if (node->keys[k] == key)
+        return JsonVariant(&node->items[k]);
+    }
+    return JsonVariant();
+  }
+
+  bool isNull() const
+  {
+    return !node || node->type == JsonNode::Null;
+  }
+
+  template <typename T>
+  bool is() const
+  {
+    if (!node)
+      return false;
+    if constexpr (std::is_same<T, bool>::value)
+      return node->type == JsonNode::Bool;
+    else if constexpr (std::is_same<T, const char *>::value)
+      return node->type == JsonNode::Text;
+    else if constexpr (std::is_floating_point<T>::value)
+      return node->type == JsonNode::Integer || node->type == JsonNode::Float;
+    else if constexpr (std::is_integral<T>::value)
+      return node->type == JsonNode::Integer && node->i >= (int64_t)std::numeric_limits<T>::min() &&
+             (node->i < 0 || (uint64_t)node->i <= (uint64_t)std::numeric_limits<T>::max());
+    else
+      return false;
+  }
+
+  template <typename T>
+  T as() const
+  {
+    if constexpr (std::is_same<T, const char *>::value)
+      return is<const char *>() ? node->text.c_str() : nullptr;
+    else if constexpr (std::is_same<T, bool>::value)
+      return node && (node->type == JsonNode::Bool ? node->b : node->type == JsonNode::Integer && node->i != 0);
+    else if constexpr (std::is_floating_point<T>::value)
+      return !node ? 0 : node->type == JsonNode::Float ? (T)node->f : node->type == JsonNode::Integer ? (T)node->i : 0;
+    else
+      return is<T>() ? (T)node->i : 0;
+  }
+
+  template <typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value ||
+                                                           std::is_same<T, const char *>::value>::type>
+  operator T() const
+  {
+    return as<T>();
+  }
+
+  // The value if it has the type of the default, otherwise the default
+  template <typename T>
+  T operator|(T fallback) const
+  {
+    return is<T>() ? as<T>() : fallback;
+  }
+
+  const char *operator|(const char *fallback) const
+  {
+    return is<const char *>() ? as<const char *>() : fallback;
+  }
+
+  template <typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+  bool operator==(T value) const
+  {
+    return is<T>() && as<T>() == value;
+  }
+
+  const JsonNode *node;
+};
+
+class JsonArray
+{
+public:
+  class iterator
+  {
+  public:
+    iterator(const JsonNode *node) : node(node) {}
+
+    JsonVariant operator*() const
+    {
+      return JsonVariant(node);
+    }
+
+    iterator &operator++()
+    {
+      node++;
+      return *this;
+    }
+
+    bool operator!=(const iterator &other) const
+    {
+      return node != other.node;
+    }
+
+  private:
+    const JsonNode *node;
+  };
+
+  JsonArray(const JsonVariant &v) : node(v.node && v.node->type == JsonNode::Array ? v.node : nullptr) {}
+
+  size_t size() const
+  {
+    return node ? node->items.size() : 0;
+  }
+
+  iterator begin() const
+  {
+    return iterator(node ? node->items.data() : nullptr);
+  }
+
+  iterator end() const
+  {
+    return iterator(node ? node->items.data() + node->items.size() : nullptr);
+  }
+
+private:
+  const JsonNode *node;
+};
+
+class JsonString
+{
+public:
+  JsonString(const SimJsonText *s) : s(s) {}
+
+  const char *c_str() const
+  {
+    return s->c_str();
+  }
+
+private:
+  const SimJsonText *s;
+};
+
+class JsonPair
+{
+public:
+  JsonPair(const JsonNode *object, size_t k) : object(object), k(k) {}
+
+  JsonString key() const
+  {
+    return JsonString(&object->keys[k]);
+  }
+
+  JsonVariant value() const
+  {
+    return JsonVariant(&object->items[k]);
+  }
+
+private:
+  const JsonNode *object;
+  size_t k;
+};
+
+// Members in document order, duplicate keys included
+class JsonObject
+{
+public:
+  class iterator
+  {
+  public:
+    iterator(const JsonNode *object, size_t k) : object(object), k(k) {}
+
+    JsonPair operator*() const
+    {
+      return JsonPair(object, k);
+    }
+
+    iterator &operator++()
+    {
+      k++;
+      return *this;
+    }
+
+    bool operator!=(const iterator &other) const
+    {
+      return k != other.k;
+    }
+
+  private:
+    const JsonNode *object;
+    size_t k;
+  };
+
+  JsonObject(const JsonVariant &v) : node(v.node && v.node->type == JsonNode::Object ? v.node : nullptr) {}
+
+  size_t size() const
+  {
+    return node ? node->items.size() : 0;
+  }
+
+  iterator begin() const
+  {
+    return iterator(node, 0);
+  }
+
+  iterator end() const
+  {
+    return iterator(node, size());
+  }
+
+private:
+  const JsonNode *node;
+};
+
+class JsonDocument
+{
+public:
+  JsonDocument(ArduinoJson::Allocator *allocator = &simJsonHeap) : allocator(allocator)
+  {
+    clear();
+  }
+
+  JsonVariant operator[](const char *key) const
+  {
+    return JsonVariant(&root)[key];
+  }
+
+  // Give everything back to the allocator
+  void clear()
+  {
+    SimJsonUse use(allocator);
+    root = JsonNode();
+  }
+
+  ArduinoJson::Allocator *allocator;
+  JsonNode root;
+};
+
+class DeserializationError
+{
+public:
+  enum Code
+  {
+    Ok,
+    EmptyInput,
+    IncompleteInput,
+    InvalidInput
+  };
+
+  DeserializationError(Code code) : code(code) {}
+
+  friend bool operator==(Code a, const DeserializationError &b)
+  {
+    return a == b.code;
+  }
+
+  friend bool operator==(const DeserializationError &a, Code b)
+  {
+    return a.code == b;
+  }
+
+  const char *c_str() const
+  {
+    static const char *names[] = {"Ok", "EmptyInput", "IncompleteInput", "InvalidInput"};
+    return names[code];
+  }
+
+private:
+  Code code;
+};
+
+class SimJsonParser
+{
+public:
+  SimJsonParser(const char *p, const char *end) : p(p), end(end) {}
+
+  DeserializationError::Code parse(JsonNode &root)
+  {
+    skipSpace();
+    if (p == end)
+      return DeserializationError::EmptyInput;
+    if (!value(root, 0))
+      return p == end ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput;
+    return DeserializationError::Ok;
+  }
+
+private:
+  const char *p;
+  const char *end;
+
+  void skipSpace()
+  {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+      p++;
+  }
+
+  bool literal(const char *word)
+  {
+    size_t n = strlen(word);
+    if ((size_t)(end - p) < n || memcmp(p, word, n) != 0)
+      return false;
+    p += n;
+    return true;
+  }
+
+  bool string(SimJsonText &out)
+  {
+    if (p == end || *p != '"')
+      return false;
+    p++;
+    while (p < end && *p != '"')
+    {
+      if (*p == '\\')
+      {
+        if (++p == end)
+          return false;
+        switch (*p)
+        {
+        case 'n':
+          out += '\n';
+          break;
+        case 't':
+          out += '\t';
+          break;
+        case 'r':
+          out += '\r';
+          break;
+        case 'u':
+          // Only ASCII escapes are expected here
+          if (end - p < 5)
+            return false;
+          char hex[5];
+          memcpy(hex, p + 1, 4);
+          hex[4] = 0;
+          out += (char)strtol(hex, nullptr, 16);
+          p += 4;
+          break;
+        default:
+          out += *p;
+        }
+        p++;
+        continue;
+      }
+      out += *p++;
+    }
+    if (p == end)
+      return false;
+    p++;
+    return true;
+  }
+
+  bool number(JsonNode &node)
+  {
+    const char *start = p;
+    bool integer = true;
+    while (p < end && (isdigit((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E'))
+    {
+      if (*p == '.' || *p == 'e' || *p == 'E')
+        integer = false;
+      p++;
+    }
+    if (p == start)
+      return false;
+    // The input needn't be terminated, and this isn't worth an allocation
+    char text[40];
+    size_t n = p - start < (ptrdiff_t)sizeof(text) ? p - start : sizeof(text) - 1;
+    memcpy(text, start, n);
+    text[n] = 0;
+    if (integer)
+    {
+      node.type = JsonNode::Integer;
+      node.i = strtoll(text, nullptr, 10);
+    }
+    else
+    {
+      node.type = JsonNode::Float;
+      node.f = strtod(text, nullptr);
+    }
+    return true;
+  }
+
+  bool value(JsonNode &node, int depth)
+  {
+    if (depth > 16)
+      return false;
+    skipSpace();
+    if (p == end)
+      return false;
+    if (*p == '{' || *p == '[')
+    {
+      bool object = *p == '{';
+      node.type = object ? JsonNode::Object : JsonNode::Array;
+      p++;
+      skipSpace();
+      if (p < end && *p == (object ? '}' : ']'))
+      {
+        p++;
+        return true;
+      }
+      for (;;)
+      {
+        if (object)
+        {
+          skipSpace();
+          node.keys.emplace_back();
+          if (!string(node.keys.back()))
+            return false;
+          skipSpace();
+          if (p == end || *p++ != ':')
+            return false;
+        }
+        node.items.emplace_back();
+        if (!value(node.items.back(), depth + 1))
+          return false;
+        skipSpace();
+        if (p == end)
+          return false;
+        if (*p == ',')
+        {
+          p++;
+          continue;
+        }
+        if (*p++ != (object ? '}' : ']'))
+          return false;
+        return true;
+      }
+    }
+    if (*p == '"')
+    {
+      node.type = JsonNode::Text;
+      return string(node.text);
+    }
+    if (literal("true") || literal("false"))
+    {
+      node.type = JsonNode::Bool;
+      node.b = p[-1] == 'e' && p[-2] == 'u';
+      return true;
+    }
+    if (literal("null"))
+    {
+      node.type = JsonNode::Null;
+      return true;
+    }
+    return number(node);
+  }
+};
+
+inline DeserializationError deserializeJson(JsonDocument &doc, const char *json, size_t length)
+{
+  doc.clear();
+  SimJsonUse use(doc.allocator);
+  SimJsonParser parser(json, json + length);
+  return parser.parse(doc.root);
+}
+
+inline DeserializationError deserializeJson(JsonDocument &doc, const String &json)
+{
+  return deserializeJson(doc, json.c_str(), json.length());
+}
+
+inline DeserializationError deserializeJson(JsonDocument &doc, const std::string &json)
+{
+  return deserializeJson(doc, json.data(), json.size());
+}
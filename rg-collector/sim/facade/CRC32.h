@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Same CRC-32 (reflected, polynomial 0xEDB88320) as bakercp/CRC32
+class CRC32
+{
+public:
+  template <typename T>
+  static uint32_t calculate(const T *data, size_t count)
+  {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t n = count * sizeof(T);
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < n; i++)
+    {
+      crc ^= p[i];
+      for (int b = 0; b < 8; b++)
+        crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+  }
+};
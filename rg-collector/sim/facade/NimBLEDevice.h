@@ -0,0 +1,374 @@
+#pragma once
+#include <Arduino.h>
+#include <string>
+#include <vector>
+
+// NimBLE Facade
+// Advertisements are NimBLEAdvertisedDevice objects the replay fills in and
+// hands to the scan callbacks. There is no radio: connections never come
+// up, so walkers would only ever see connect failures.
+
+#ifndef NIMBLE_MAX_CONNECTIONS
+#define NIMBLE_MAX_CONNECTIONS 3
+#endif
+
+#define BLE_ADDR_PUBLIC 0x00
+#define BLE_ADDR_RANDOM 0x01
+
+#define BLE_HS_ENOMEM 6
+#define BLE_HS_EDONE 14
+#define BLE_HS_ENOTCONN 7
+#define BLE_HS_ERR_ATT_BASE 0x100
+#define BLE_HS_ATT_ERR(x) ((x) ? BLE_HS_ERR_ATT_BASE + (x) : 0)
+#define BLE_ATT_ERR_ATTR_NOT_LONG 0x0b
+
+#define BLE_GATT_CHR_PROP_BROADCAST 0x01
+#define BLE_GATT_CHR_PROP_READ 0x02
+#define BLE_GATT_CHR_PROP_WRITE_NO_RSP 0x04
+#define BLE_GATT_CHR_PROP_WRITE 0x08
+#define BLE_GATT_CHR_PROP_NOTIFY 0x10
+#define BLE_GATT_CHR_PROP_INDICATE 0x20
+
+struct os_mbuf
+{
+  uint16_t len;
+  const uint8_t *data;
+};
+
+#define OS_MBUF_PKTLEN(om) ((om)->len)
+
+inline int os_mbuf_copydata(const os_mbuf *om, int off, int len, void *dst)
+{
+  memcpy(dst, om->data + off, len);
+  return 0;
+}
+
+struct ble_gatt_error
+{
+  uint16_t status;
+  uint16_t att_handle;
+};
+
+struct ble_gatt_attr
+{
+  uint16_t handle;
+  uint16_t offset;
+  os_mbuf *om;
+};
+
+typedef int ble_gatt_attr_fn(uint16_t connHandle, const ble_gatt_error *error, ble_gatt_attr *attr, void *arg);
+
+inline int ble_gattc_read_long(uint16_t connHandle, uint16_t attrHandle, uint16_t offset, ble_gatt_attr_fn *cb, void *arg)
+{
+  return BLE_HS_ENOTCONN;
+}
+
+// UUID as the host stack hands it over, type is the bit size
+struct ble_uuid_any_t
+{
+  uint8_t type;
+  uint8_t value[16];
+};
+
+struct ble_gatt_chr
+{
+  uint16_t def_handle;
+  uint16_t val_handle;
+  uint8_t properties;
+  ble_uuid_any_t uuid;
+};
+
+typedef int ble_gatt_chr_fn(uint16_t connHandle, const ble_gatt_error *error, const ble_gatt_chr *chr, void *arg);
+
+inline int ble_gattc_disc_all_chrs(uint16_t connHandle, uint16_t startHandle, uint16_t endHandle, ble_gatt_chr_fn *cb,
+                                   void *arg)
+{
+  return BLE_HS_ENOTCONN;
+}
+
+class NimBLEAddress
+{
+public:
+  NimBLEAddress() : type(BLE_ADDR_PUBLIC)
+  {
+    memset(val, 0, sizeof(val));
+  }
+
+  NimBLEAddress(const uint8_t addr[6], uint8_t type) : type(type)
+  {
+    memcpy(val, addr, sizeof(val));
+  }
+
+  const uint8_t *getVal() const
+  {
+    return val;
+  }
+
+  uint8_t getType() const
+  {
+    return type;
+  }
+
+  std::string toString() const
+  {
+    char text[18];
+    snprintf(text, sizeof(text), "%02x:%02x:%02x:%02x:%02x:%02x", val[5], val[4], val[3], val[2], val[1], val[0]);
+    return text;
+  }
+
+private:
+  uint8_t val[6];
+  uint8_t type;
+};
+
+class NimBLEUUID
+{
+public:
+  NimBLEUUID() : bits(16)
+  {
+    memset(val, 0, sizeof(val));
+  }
+
+  NimBLEUUID(uint16_t uuid) : bits(16)
+  {
+    memset(val, 0, sizeof(val));
+    val[0] = uuid & 0xFF;
+    val[1] = uuid >> 8;
+  }
+
+  NimBLEUUID(const ble_uuid_any_t &uuid) : bits(uuid.type)
+  {
+    memcpy(val, uuid.value, sizeof(val));
+  }
+
+  uint8_t bitSize() const
+  {
+    return bits;
+  }
+
+  const uint8_t *getValue() const
+  {
+    return val;
+  }
+
+  bool operator==(const NimBLEUUID &other) const
+  {
+    return bits == other.bits && memcmp(val, other.val, bits / 8) == 0;
+  }
+
+private:
+  uint8_t val[16];
+  uint8_t bits;
+};
+
+// Filled in by the replay from a trace line
+class NimBLEAdvertisedDevice
+{
+public:
+  NimBLEAddress address;
+  int8_t rssi = 0;
+  bool connectable = false;
+  std::vector<uint8_t> payload;
+
+  const NimBLEAddress &getAddress() const
+  {
+    return address;
+  }
+
+  uint8_t getAddressType() const
+  {
+    return address.getType();
+  }
+
+  int8_t getRSSI() const
+  {
+    return rssi;
+  }
+
+  bool isConnectable() const
+  {
+    return connectable;
+  }
+
+  const std::vector<uint8_t> &getPayload() const
+  {
+    return payload;
+  }
+};
+
+class NimBLEScanCallbacks
+{
+public:
+  virtual ~NimBLEScanCallbacks() {}
+  virtual void onResult(const NimBLEAdvertisedDevice *advertisedDevice) {}
+};
+
+class NimBLEScan
+{
+public:
+  enum Phy
+  {
+    SCAN_1M = 0x01,
+    SCAN_CODED = 0x02,
+    SCAN_ALL = 0x03
+  };
+
+  NimBLEScanCallbacks *callbacks = nullptr;
+
+  void setScanCallbacks(NimBLEScanCallbacks *cb, bool wantDuplicates = false)
+  {
+    callbacks = cb;
+  }
+
+  void setDuplicateFilter(bool enabled) {}
+  void setInterval(uint16_t ms) {}
+  void setWindow(uint16_t ms) {}
+  void setMaxResults(uint8_t max) {}
+  void setActiveScan(bool active) {}
+  void setPhy(Phy phy) {}
+  void clearResults() {}
+
+  bool start(uint32_t duration, bool isContinue, bool restart)
+  {
+    scanning = true;
+    return true;
+  }
+
+  bool stop()
+  {
+    scanning = false;
+    return true;
+  }
+
+  bool isScanning()
+  {
+    return scanning;
+  }
+
+private:
+  bool scanning = false;
+};
+
+class NimBLERemoteCharacteristic
+{
+public:
+  bool canRead() const { return false; }
+  bool canBroadcast() const { return false; }
+  bool canIndicate() const { return false; }
+  bool canNotify() const { return false; }
+  bool canWrite() const { return false; }
+  bool canWriteNoResponse() const { return false; }
+
+  uint16_t getHandle() const
+  {
+    return 0;
+  }
+
+  const NimBLEUUID &getUUID() const
+  {
+    return uuid;
+  }
+
+private:
+  NimBLEUUID uuid;
+};
+
+class NimBLERemoteService
+{
+public:
+  const NimBLEUUID &getUUID() const
+  {
+    return uuid;
+  }
+
+  const std::vector<NimBLERemoteCharacteristic *> &getCharacteristics(bool refresh = false)
+  {
+    return chrs;
+  }
+
+private:
+  NimBLEUUID uuid;
+  std::vector<NimBLERemoteCharacteristic *> chrs;
+};
+
+class NimBLEClient;
+
+class NimBLEClientCallbacks
+{
+public:
+  virtual ~NimBLEClientCallbacks() {}
+  virtual void onConnect(NimBLEClient *pClient) {}
+  virtual void onConnectFail(NimBLEClient *pClient, int reason) {}
+  virtual void onDisconnect(NimBLEClient *pClient, int reason) {}
+};
+
+class NimBLEClient
+{
+public:
+  void setClientCallbacks(NimBLEClientCallbacks *cb, bool deleteCallbacks = true) {}
+  void setConnectionParams(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout) {}
+  void setConnectTimeout(uint32_t seconds) {}
+
+  bool connect(const NimBLEAddress &address, bool deleteAttributes = true, bool asyncConnect = false)
+  {
+    return false;
+  }
+
+  bool cancelConnect()
+  {
+    return false;
+  }
+
+  bool isConnected()
+  {
+    return false;
+  }
+
+  bool disconnect()
+  {
+    return false;
+  }
+
+  uint16_t getConnHandle()
+  {
+    return 0xFFFF;
+  }
+
+  NimBLEAddress getPeerAddress()
+  {
+    return NimBLEAddress();
+  }
+
+  const std::vector<NimBLERemoteService *> &getServices(bool refresh = false)
+  {
+    return services;
+  }
+
+private:
+  std::vector<NimBLERemoteService *> services;
+};
+
+class NimBLEDevice
+{
+public:
+  static bool init(const std::string &name)
+  {
+    return true;
+  }
+
+  static bool setPower(int8_t dbm)
+  {
+    return true;
+  }
+
+  static NimBLEScan *getScan()
+  {
+    static NimBLEScan scan;
+    return &scan;
+  }
+
+  static NimBLEClient *createClient()
+  {
+    return new NimBLEClient();
+  }
+};
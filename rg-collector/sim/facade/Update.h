@@ -0,0 +1,36 @@
+#pragma once
+#include <Arduino.h>
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+
+// OTA never happens on a host, every update fails
+class UpdateClass
+{
+public:
+  bool begin(size_t size)
+  {
+    return false;
+  }
+
+  size_t write(uint8_t *data, size_t len)
+  {
+    return 0;
+  }
+
+  bool end(bool evenIfRemaining)
+  {
+    return false;
+  }
+
+  bool hasError()
+  {
+    return true;
+  }
+
+  void printError(Print &out)
+  {
+    out.println("OTA is not available in the simulator");
+  }
+};
+
+inline UpdateClass Update;
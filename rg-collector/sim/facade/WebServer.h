@@ -0,0 +1,112 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#include <string>
+
+// WebServer Facade
+// Routes are recorded but never served. The replay puts a request body in
+// place with simRequest(), calls the handler itself and reads the response
+// back from simResponse.
+
+#define CONTENT_LENGTH_UNKNOWN ((size_t)-1)
+
+enum HTTPMethod
+{
+  HTTP_ANY,
+  HTTP_GET,
+  HTTP_POST
+};
+
+enum HTTPUploadStatus
+{
+  UPLOAD_FILE_START,
+  UPLOAD_FILE_WRITE,
+  UPLOAD_FILE_END,
+  UPLOAD_FILE_ABORTED
+};
+
+struct HTTPUpload
+{
+  HTTPUploadStatus status;
+  String filename;
+  uint8_t *buf;
+  // 32 bits like on the ESP32, the firmware prints it with %u
+  uint32_t currentSize;
+  uint32_t totalSize;
+};
+
+// What a handler sent back
+struct SimResponse
+{
+  int code = 0;
+  std::string contentType;
+  std::string body;
+  // Chunks handed over by sendContent(), the terminating empty one included
+  uint32_t chunks = 0;
+};
+
+class WebServer
+{
+public:
+  typedef std::function<void(void)> THandlerFunction;
+
+  WebServer(int port) {}
+
+  void begin() {}
+  void handleClient() {}
+
+  void on(const char *uri, HTTPMethod method, THandlerFunction fn) {}
+  void on(const char *uri, HTTPMethod method, THandlerFunction fn, THandlerFunction upload) {}
+
+  String arg(const char *name)
+  {
+    return strcmp(name, "plain") == 0 ? String(simBody) : String();
+  }
+
+  HTTPUpload &upload()
+  {
+    return simUpload;
+  }
+
+  void sendHeader(const char *name, const char *value) {}
+
+  void setContentLength(size_t length) {}
+
+  void send(int code, const char *contentType, const char *content)
+  {
+    bool counting = simCountHeap;
+    simCountHeap = false;
+    simResponse.code = code;
+    simResponse.contentType = contentType;
+    simResponse.body += content;
+    simCountHeap = counting;
+  }
+
+  // What was sent is on the wire, not on the collector's heap
+  void sendContent(const char *content, size_t length)
+  {
+    bool counting = simCountHeap;
+    simCountHeap = false;
+    simResponse.body.append(content, length);
+    simResponse.chunks++;
+    simCountHeap = counting;
+  }
+
+  void sendContent(const char *content)
+  {
+    sendContent(content, strlen(content));
+  }
+
+  // Start a request with this body, the previous response is forgotten
+  void simRequest(const std::string &body)
+  {
+    simBody = body;
+    simResponse = SimResponse();
+  }
+
+  SimResponse simResponse;
+
+private:
+  std::string simBody;
+  HTTPUpload simUpload;
+};
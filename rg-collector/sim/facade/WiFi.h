@@ -0,0 +1,40 @@
+#pragma once
+#include <Arduino.h>
+
+class WiFiClass
+{
+public:
+  // softAP MAC of the simulated collector, set by the replay
+  uint8_t simMac[6] = {0x02, 0, 0, 0, 0, 0};
+
+  bool softAP(const char *ssid, const char *password, int channel, bool hidden, int maxConnections)
+  {
+    return true;
+  }
+
+  IPAddress softAPIP()
+  {
+    return IPAddress();
+  }
+
+  String softAPmacAddress()
+  {
+    char text[18];
+    snprintf(text, sizeof(text), "%02X:%02X:%02X:%02X:%02X:%02X",
+             simMac[0], simMac[1], simMac[2], simMac[3], simMac[4], simMac[5]);
+    return String(text);
+  }
+
+  uint8_t *softAPmacAddress(uint8_t *mac)
+  {
+    memcpy(mac, simMac, 6);
+    return mac;
+  }
+
+  bool setSleep(bool enable)
+  {
+    return true;
+  }
+};
+
+inline WiFiClass WiFi;
@@ -0,0 +1,10 @@
+#pragma once
+#include <Arduino.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+// The counted heap has no fragmentation, all of it is one block
+inline size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+  return ESP.getFreeHeap();
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <Arduino.h>
+
+// A "spill" partition held in RAM, the size partitions.csv gives it. The
+// replay clears simSpillEnabled to run without one.
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+#define ESP_PARTITION_TYPE_DATA 0x01
+#define ESP_PARTITION_SUBTYPE_ANY 0xFF
+
+#define SIM_SPILL_SIZE 0x180000
+
+struct esp_partition_t
+{
+  uint32_t size;
+  // Erased flash reads 0xFF, writes can only clear bits like NOR flash
+  uint8_t *data;
+};
+
+inline bool simSpillEnabled = true;
+
+inline const esp_partition_t *esp_partition_find_first(int type, int subtype, const char *label)
+{
+  // Static like flash, it doesn't count against the heap
+  static uint8_t flash[SIM_SPILL_SIZE];
+  static esp_partition_t part = {0, nullptr};
+  if (!simSpillEnabled || strcmp(label, "spill") != 0)
+    return nullptr;
+  if (!part.data)
+  {
+    memset(flash, 0xFF, sizeof(flash));
+    part.size = SIM_SPILL_SIZE;
+    part.data = flash;
+  }
+  return &part;
+}
+
+inline esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size)
+{
+  if (offset + size > part->size)
+    return ESP_FAIL;
+  memcpy(dst, part->data + offset, size);
+  return ESP_OK;
+}
+
+inline esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size)
+{
+  if (offset + size > part->size)
+    return ESP_FAIL;
+  uint8_t *p = part->data + offset;
+  for (size_t i = 0; i < size; i++)
+    p[i] &= ((const uint8_t *)src)[i];
+  return ESP_OK;
+}
+
+inline esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size)
+{
+  if (offset + size > part->size)
+    return ESP_FAIL;
+  memset(part->data + offset, 0xFF, size);
+  return ESP_OK;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <Arduino.h>
+
+#define WIFI_PS_NONE 0
+
+inline int esp_wifi_set_ps(int type)
+{
+  return 0;
+}
+
+typedef enum
+{
+  WIFI_VND_IE_TYPE_BEACON,
+  WIFI_VND_IE_TYPE_PROBE_REQ,
+  WIFI_VND_IE_TYPE_PROBE_RESP,
+  WIFI_VND_IE_TYPE_ASSOC_REQ,
+  WIFI_VND_IE_TYPE_ASSOC_RESP,
+} wifi_vendor_ie_type_t;
+
+typedef enum
+{
+  WIFI_VND_IE_ID_0,
+  WIFI_VND_IE_ID_1,
+} wifi_vendor_ie_id_t;
+
+// The element the beacons would carry, read back by the replay
+inline uint8_t simBeaconIe[256];
+inline bool simBeaconIeSet = false;
+
+inline int esp_wifi_set_vendor_ie(bool enable, wifi_vendor_ie_type_t type, wifi_vendor_ie_id_t idx, const void *vnd_ie)
+{
+  if (type == WIFI_VND_IE_TYPE_BEACON && idx == WIFI_VND_IE_ID_0)
+  {
+    simBeaconIeSet = enable;
+    if (enable)
+      memcpy(simBeaconIe, vnd_ie, 2 + ((const uint8_t *)vnd_ie)[1]);
+  }
+  return 0;
+}
@@ -0,0 +1,1093 @@
+// Collector Replay
+// Runs the collector firmware (src/main.cpp, compiled as is against the
+// facades in sim/facade) on a host and feeds it an advertisement trace:
+// every sighting goes through ScanCallbacks::onResult and the log task's
+// drain, walkers take candidates through the rate limiter, the loop task
+// retunes the scan, and a logger that keeps a cursor like rg-logger pulls
+// handlePost(). Each collector runs in
+// its own process so the firmware's globals stay its own.
+//
+// Reports host cost per advertisement and per sync, static RAM, heap and
+// log high-water marks, the scan duty the tuner picked (there is no radio,
+// sightings arrive whatever the duty), and checks deduplication: every device goes to
+// exactly one collector, no sighting is counted twice or lost uncounted,
+// and record numbers neither repeat nor skip.
+//
+// Build and run on a host (or make sim-collector from the repo root):
+//   g++ -std=gnu++17 -O2 -I facade -I ../include -I ../../rg-common/include -o replay replay.cpp && ./replay
+//
+// Options:
+//   --collectors N   collectors splitting the devices (3)
+//   --devices N      synthetic devices (300)
+//   --rate R         synthetic advertisements per second, all devices (200)
+//   --seconds S      synthetic trace length (600)
+//   --seed N         synthetic trace and epoch seed (1)
+//   --trace FILE     replay a recorded trace instead, see readTrace()
+//   --write-trace F  save the synthetic trace in the same format
+//   --loss P         chance a collector misses a sighting (0)
+//   --sync-ms MS     logger visits per collector (30000)
+//   --log-ms MS      log task wakeups, 0 = after every sighting (0)
+//   --walk-ms MS     walker takes per worker (1000)
+//   --fail P         chance the logger fails to store a pull (0)
+//   --json           pull JSON instead of the binary format
+//   --no-pack        pull the binary format without PACKED frames
+//   --no-spill       run without the flash spill partition
+//   --verbose        echo the collector's Serial output
+
+#include "../src/main.cpp"
+
+#include <chrono>
+#include <map>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Same as rg-logger's LOG_PULL_BYTES and LOG_MAX_PULLS
+#define SIM_PULL_BYTES 16384
+#define SIM_MAX_PULLS 8
+// Longest advertisement plus scan response payload kept per sighting
+#define SIM_PAYLOAD_MAX 62
+
+// Heap
+
+// Only allocations made while the firmware runs are counted (simCountHeap),
+// the replay's own bookkeeping would drown them out
+// Header in front of every block, as big as malloc's alignment so the
+// payload stays aligned
+struct alignas(16) SimBlock
+{
+  size_t size;
+  bool counted;
+};
+
+// Kept out of line, inlined into callers the mix of new and free trips
+// -Wmismatched-new-delete
+__attribute__((noinline)) void *operator new(size_t size)
+{
+  SimBlock *block = (SimBlock *)malloc(sizeof(SimBlock) + size);
+  if (!block)
+    throw std::bad_alloc();
+  block->size = size;
+  block->counted = simCountHeap;
+  if (simCountHeap)
+  {
+    simHeapAllocs++;
+    simHeapUsed += size;
+    if (simHeapUsed > simHeapPeak)
+      simHeapPeak = simHeapUsed;
+  }
+  return block + 1;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+  if (!p)
+    return;
+  SimBlock *block = (SimBlock *)p - 1;
+  if (block->counted)
+    simHeapUsed -= block->size;
+  free(block);
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete[](void *p) noexcept
+{
+  operator delete(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+  operator delete(p);
+}
+
+void operator delete[](void *p, size_t size) noexcept
+{
+  operator delete(p);
+}
+
+// Trace
+
+struct SimEvent
+{
+  uint64_t us;
+  // Little endian, as NimBLEAddress::getVal()
+  uint8_t addr[6];
+  uint8_t addrType;
+  int8_t rssi;
+  bool connectable;
+  uint8_t payloadLen;
+  uint8_t payload[SIM_PAYLOAD_MAX];
+};
+
+struct SimOptions
+{
+  int collectors = 3;
+  int devices = 300;
+  double rate = 200;
+  int seconds = 600;
+  uint32_t seed = 1;
+  const char *trace = nullptr;
+  const char *writeTrace = nullptr;
+  double loss = 0;
+  uint32_t syncMs = 30000;
+  uint32_t logMs = 0;
+  uint32_t walkMs = 1000;
+  double fail = 0;
+  bool json = false;
+  bool pack = true;
+  bool spill = true;
+  bool verbose = false;
+};
+
+static SimOptions opt;
+static std::vector<SimEvent> trace;
+
+// A synthetic device. Random addresses may rotate, some devices change their
+// manufacturer data now and then (a new record each time) and some talk far
+// more than others.
+struct SimDevice
+{
+  uint8_t addr[6];
+  uint8_t addrType;
+  bool connectable;
+  bool rotates;
+  bool statusByte;
+  uint8_t nameLen;
+  char name[12];
+  uint8_t man[8];
+  int8_t rssi;
+};
+
+static void putAd(SimEvent &ev, uint8_t type, const uint8_t *data, uint8_t len)
+{
+  ev.payload[ev.payloadLen++] = len + 1;
+  ev.payload[ev.payloadLen++] = type;
+  memcpy(ev.payload + ev.payloadLen, data, len);
+  ev.payloadLen += len;
+}
+
+static void generateTrace()
+{
+  std::mt19937 rng(opt.seed);
+  std::uniform_real_distribution<double> unit(0, 1);
+  std::vector<SimDevice> devices(opt.devices);
+  std::vector<double> weights(opt.devices);
+  double total = 0;
+  for (int i = 0; i < opt.devices; i++)
+  {
+    SimDevice &d = devices[i];
+    for (int b = 0; b < 6; b++)
+      d.addr[b] = rng();
+    d.addrType = unit(rng) < 0.4 ? BLE_ADDR_PUBLIC : BLE_ADDR_RANDOM;
+    d.connectable = unit(rng) < 0.3;
+    d.rotates = d.addrType == BLE_ADDR_RANDOM && unit(rng) < 0.5;
+    d.statusByte = unit(rng) < 0.2;
+    d.nameLen = unit(rng) < 0.3 ? snprintf(d.name, sizeof(d.name), "dev-%d", i) : 0;
+    // Company id, then a fixed body
+    d.man[0] = rng() % 8;
+    d.man[1] = 0;
+    for (int b = 2; b < 8; b++)
+      d.man[b] = rng();
+    d.rssi = -40 - (int)(rng() % 55);
+    // Exponential weights: a few devices take most of the airtime
+    weights[i] = -log(1 - unit(rng));
+    total += weights[i];
+  }
+  std::vector<double> cumulative(opt.devices);
+  double sum = 0;
+  for (int i = 0; i < opt.devices; i++)
+  {
+    sum += weights[i] / total;
+    cumulative[i] = sum;
+  }
+
+  std::exponential_distribution<double> gap(opt.rate / 1e6);
+  uint64_t end = (uint64_t)opt.seconds * 1000000;
+  for (double t = gap(rng); t < end; t += gap(rng))
+  {
+    size_t i = std::lower_bound(cumulative.begin(), cumulative.end(), unit(rng)) - cumulative.begin();
+    SimDevice &d = devices[i < devices.size() ? i : devices.size() - 1];
+    SimEvent ev;
+    ev.us = (uint64_t)t;
+    memcpy(ev.addr, d.addr, 6);
+    // Resolvable private addresses change every 15 minutes
+    if (d.rotates)
+      ev.addr[0] ^= (uint8_t)(ev.us / 900000000);
+    ev.addrType = d.addrType;
+    ev.rssi = d.rssi + (int)(rng() % 11) - 5;
+    ev.connectable = d.connectable;
+    ev.payloadLen = 0;
+    uint8_t flags = 0x06;
+    putAd(ev, 0x01, &flags, 1);
+    uint8_t man[8];
+    memcpy(man, d.man, sizeof(man));
+    if (d.statusByte)
+      man[7] ^= (uint8_t)(ev.us / 30000000);
+    putAd(ev, 0xFF, man, sizeof(man));
+    if (d.nameLen)
+      putAd(ev, 0x09, (const uint8_t *)d.name, d.nameLen);
+    trace.push_back(ev);
+  }
+}
+
+// One sighting per line, lines starting with # are skipped:
+//   t_us,aa:bb:cc:dd:ee:ff,addr_type,rssi,connectable,payload_hex
+// The address is written most significant byte first like NimBLE prints it.
+static bool readTrace(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return false;
+  char line[256];
+  int n = 0;
+  while (fgets(line, sizeof(line), f))
+  {
+    n++;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    unsigned long long us;
+    unsigned a[6], type, connectable;
+    int rssi;
+    char hex[2 * SIM_PAYLOAD_MAX + 2] = "";
+    if (sscanf(line, "%llu,%x:%x:%x:%x:%x:%x,%u,%d,%u,%126[0-9a-fA-F]", &us, &a[5], &a[4], &a[3], &a[2], &a[1],
+               &a[0], &type, &rssi, &connectable, hex) < 10)
+    {
+      fprintf(stderr, "%s:%d: not a trace line\n", path, n);
+      fclose(f);
+      return false;
+    }
+    SimEvent ev;
+    ev.us = us;
+    for (int b = 0; b < 6; b++)
+      ev.addr[b] = a[b];
+    ev.addrType = type;
+    ev.rssi = rssi;
+    ev.connectable = connectable != 0;
+    ev.payloadLen = strlen(hex) / 2;
+    for (uint8_t b = 0; b < ev.payloadLen; b++)
+      sscanf(hex + 2 * b, "%2hhx", &ev.payload[b]);
+    trace.push_back(ev);
+  }
+  fclose(f);
+  std::stable_sort(trace.begin(), trace.end(), [](const SimEvent &a, const SimEvent &b)
+                   { return a.us < b.us; });
+  return true;
+}
+
+static bool writeTrace(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+  fprintf(f, "# t_us,addr,addr_type,rssi,connectable,payload_hex\n");
+  for (const SimEvent &ev : trace)
+  {
+    char hex[2 * SIM_PAYLOAD_MAX + 1];
+    *rgwHex(hex, ev.payload, ev.payloadLen) = '\0';
+    fprintf(f, "%llu,%02x:%02x:%02x:%02x:%02x:%02x,%u,%d,%u,%s\n", (unsigned long long)ev.us, ev.addr[5],
+            ev.addr[4], ev.addr[3], ev.addr[2], ev.addr[1], ev.addr[0], ev.addrType, ev.rssi, ev.connectable, hex);
+  }
+  return fclose(f) == 0;
+}
+
+// The sighting onResult makes of an event, and the device's rate limit id
+static uint32_t simSighting(const SimEvent &ev, AdvSighting &rec)
+{
+  memcpy(rec.addr, ev.addr, 6);
+  rec.addrType = ev.addrType;
+  rec.flags = 0;
+  advParsePayload(rec, ev.payload, ev.payloadLen);
+  return getRateLimitId(rec);
+}
+
+// Whether collector c picks up event i, the same answer in every process
+static bool heard(int c, size_t i)
+{
+  if (opt.loss <= 0)
+    return true;
+  uint32_t h = (uint32_t)(i * 2654435761u) ^ (uint32_t)(c * 40503u + 1);
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return h < (uint32_t)((1 - opt.loss) * 4294967295.0);
+}
+
+static void simMac(int c, uint8_t mac[6])
+{
+  const uint8_t base[6] = {0x02, 0x52, 0x47, 0x00, 0x00, 0x00};
+  memcpy(mac, base, 6);
+  mac[5] = c + 1;
+}
+
+// Key of a log record: address and manufacturer data
+static std::string recordKey(const uint8_t addr[6], const uint8_t *man, uint8_t manLen)
+{
+  return std::string((const char *)addr, 6) + std::string((const char *)man, manLen);
+}
+
+// Collector
+
+struct SimRecord
+{
+  uint32_t seq;
+  uint8_t addr[6];
+  uint8_t addrType;
+  uint8_t manLen;
+  uint8_t man[ADV_MAN_MAX];
+  uint16_t hits;
+};
+
+struct SimPull
+{
+  int code;
+  size_t bytes;
+  bool parsed;
+  uint32_t epoch;
+  uint32_t dropped;
+  uint32_t last;
+  bool more;
+  std::vector<SimRecord> records;
+  // SEQ frames, and what the PACKED frames said they hold
+  uint32_t seqs;
+  RgpUnpacker *unpacker;
+  bool packed;
+};
+
+static void onFrame(void *ctx, uint8_t type, const uint8_t *payload, uint16_t length)
+{
+  SimPull &pull = *(SimPull *)ctx;
+  static uint32_t seq;
+  RgwInfo info;
+  RgwAdv adv;
+  switch (type)
+  {
+  case RGW_FRAME_INFO:
+    if (rgwParseInfo(payload, length, info))
+    {
+      pull.epoch = info.epoch;
+      pull.dropped = info.dropped;
+    }
+    break;
+  case RGW_FRAME_SEQ:
+    seq = rgwGetU32(payload);
+    pull.seqs++;
+    break;
+  case RGW_FRAME_PACKED:
+    // The frames inside come back through here
+    pull.packed = true;
+    pull.unpacker->frame(payload, length);
+    break;
+  case RGW_FRAME_ADV:
+    if (rgwParseAdv(payload, length, adv))
+    {
+      SimRecord rec;
+      rec.seq = seq;
+      memcpy(rec.addr, adv.addr, 6);
+      rec.addrType = adv.addrType;
+      rec.manLen = adv.manLen > ADV_MAN_MAX ? ADV_MAN_MAX : adv.manLen;
+      memcpy(rec.man, adv.man, rec.manLen);
+      rec.hits = adv.hits;
+      pull.records.push_back(rec);
+    }
+    break;
+  case RGW_FRAME_END:
+    pull.last = rgwGetU32(payload);
+    pull.more = payload[4] != 0;
+    pull.parsed = true;
+    break;
+  }
+}
+
+static bool parseHex(const char *hex, uint8_t *out, uint8_t max, uint8_t &len)
+{
+  size_t n = strlen(hex) / 2;
+  if (n > max)
+    return false;
+  for (size_t i = 0; i < n; i++)
+    sscanf(hex + 2 * i, "%2hhx", &out[i]);
+  len = n;
+  return true;
+}
+
+static void parseJsonPull(SimPull &pull, const std::string &body)
+{
+  JsonDocument doc;
+  if (!(deserializeJson(doc, body) == DeserializationError::Ok))
+    return;
+  pull.epoch = doc["epoch"];
+  pull.dropped = doc["dropped"];
+  pull.last = doc["last_seq"];
+  pull.more = doc["more"];
+  for (JsonVariant v : JsonArray(doc["logs"]))
+  {
+    // Entries with only a tree carry no advertisement
+    if (v["man"].isNull())
+      continue;
+    SimRecord rec;
+    unsigned a[6];
+    const char *addr = v["addr"] | "";
+    if (sscanf(addr, "%x:%x:%x:%x:%x:%x", &a[5], &a[4], &a[3], &a[2], &a[1], &a[0]) != 6 ||
+        !parseHex(v["man"], rec.man, ADV_MAN_MAX, rec.manLen))
+      return;
+    for (int b = 0; b < 6; b++)
+      rec.addr[b] = a[b];
+    rec.seq = v["seq"];
+    rec.addrType = v["addr_type"];
+    rec.hits = v["hits"];
+    pull.records.push_back(rec);
+  }
+  pull.parsed = true;
+}
+
+typedef std::chrono::steady_clock SimClock;
+
+static uint64_t nsSince(SimClock::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(SimClock::now() - start).count();
+}
+
+// What a collector process reports back, followed by its device ids
+struct SimResult
+{
+  uint32_t heard;
+  uint32_t owned;
+  uint32_t ownedExpected;
+  uint32_t records;
+  uint64_t hits;
+  uint32_t dropped;
+  uint32_t pulls;
+  uint32_t busy;
+  uint32_t failedPulls;
+  uint64_t bytes;
+  // Backlog the beacon showed before each visit, and what the visits pulled
+  uint64_t beaconBytes;
+  uint64_t visitBytes;
+  uint32_t beaconMissing;
+  uint32_t walks;
+  uint32_t rateLimited;
+  // Scan tuning, duty and passive time in ms weighted by window/interval
+  uint32_t retunes;
+  uint64_t dutyMs;
+  uint64_t passiveMs;
+  uint64_t scanMs;
+  // Checks
+  uint32_t seqErrors;
+  uint32_t keyMismatches;
+  uint32_t rateLimitViolations;
+  // High-water marks
+  uint32_t advLogPeak;
+  uint32_t spillPeak;
+  uint32_t heapPeak;
+  // Host cost
+  uint64_t onResultNs;
+  uint32_t onResultMaxNs;
+  uint32_t onResultP99Ns;
+  uint64_t drainNs;
+  // Heap allocations by the callback and the log task
+  uint64_t scanAllocs;
+  uint64_t postNs;
+  uint32_t postMaxNs;
+  uint64_t postAllocs;
+  uint32_t ids;
+};
+
+// Upper bound of the bucket the p-th fraction of a histogram falls in
+static uint32_t percentile(const Histogram &h, double p)
+{
+  uint32_t want = (uint32_t)(h.count() * p);
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < METRIC_BUCKETS; i++)
+  {
+    seen += h.bucket(i);
+    if (seen > want)
+      return Histogram::limit(i) ? Histogram::limit(i) : 0xFFFFFFFF;
+  }
+  return 0;
+}
+
+class SimLogger
+{
+public:
+  SimLogger(int self, SimResult &result) : self(self), result(result), epoch(0), cursor(0), rng(opt.seed * 7919 + self) {}
+
+  // One visit: pull until the collector has nothing more, like getLogJson()
+  void visit()
+  {
+    // The logs are at their fullest just before a sync
+    result.advLogPeak = std::max<uint32_t>(result.advLogPeak, logs[activeLog].adv.size());
+    result.spillPeak = std::max<uint32_t>(result.spillPeak, spill.count());
+    // What the logger would have heard in the beacon on its way here
+    publishBacklog(millis());
+    RgbStatus status;
+    if (simBeaconIeSet && rgbParseElement(simBeaconIe, sizeof(simBeaconIe), status))
+      result.beaconBytes += status.backlog;
+    else
+      result.beaconMissing++;
+    uint64_t before = result.bytes;
+    bool more = true;
+    for (int i = 0; i < SIM_MAX_PULLS && more; i++)
+    {
+      more = false;
+      if (!pull(more))
+        break;
+    }
+    result.visitBytes += result.bytes - before;
+  }
+
+  // Records stored, keyed by record key, with their hits
+  std::map<std::string, uint64_t> hits;
+  std::set<uint32_t> ids;
+  uint32_t delivered = 0;
+
+private:
+  int self;
+  SimResult &result;
+  uint32_t epoch;
+  uint32_t cursor;
+  std::mt19937 rng;
+
+  std::string request()
+  {
+    std::string body = "{\"si\":" + std::to_string(self) + ",\"ss\":" + std::to_string(opt.collectors) + ",\"scanners\":[";
+    for (int c = 0; c < opt.collectors; c++)
+    {
+      uint8_t mac[6];
+      char text[18];
+      simMac(c, mac);
+      rgwFormatMac(text, mac);
+      body += std::string(c ? ",\"" : "\"") + text + "\"";
+    }
+    body += "]";
+    if (!opt.json)
+      body += ",\"wire\":" + std::to_string(RGW_VERSION);
+    if (!opt.json && opt.pack)
+      body += ",\"pack\":" + std::to_string(RGP_VERSION);
+    body += ",\"epoch\":" + std::to_string(epoch) + ",\"after\":" + std::to_string(cursor) +
+            ",\"max\":" + std::to_string(SIM_PULL_BYTES) + "}";
+    return body;
+  }
+
+  bool pull(bool &more)
+  {
+    server.simRequest(request());
+    SimClock::time_point start = SimClock::now();
+    uint64_t allocs = simHeapAllocs;
+    simCountHeap = true;
+    handlePost();
+    simCountHeap = false;
+    uint32_t ns = nsSince(start);
+    result.postAllocs += simHeapAllocs - allocs;
+    result.postNs += ns;
+    if (ns > result.postMaxNs)
+      result.postMaxNs = ns;
+    result.pulls++;
+
+    const SimResponse &response = server.simResponse;
+    if (response.code != 200)
+    {
+      result.busy++;
+      return false;
+    }
+    SimPull p = {};
+    p.bytes = response.body.size();
+    result.bytes += p.bytes;
+    if (opt.json)
+    {
+      parseJsonPull(p, response.body);
+    }
+    else
+    {
+      RgpUnpacker unpacker(onFrame, &p);
+      p.unpacker = &unpacker;
+      RgwDecoder decoder(onFrame, &p);
+      decoder.feed((const uint8_t *)response.body.data(), response.body.size());
+      // Records come packed if they were asked for, a body without any has no PACKED frame
+      p.parsed = p.parsed && decoder.complete() && !unpacker.failed() && (p.packed ? opt.pack : !opt.pack || p.seqs == 0) &&
+                 (!p.packed || unpacker.records() == p.seqs);
+    }
+    if (!p.parsed)
+    {
+      result.seqErrors++;
+      return false;
+    }
+    // The card write failed, nothing is kept and the cursor stays put
+    if (std::uniform_real_distribution<double>(0, 1)(rng) < opt.fail)
+    {
+      result.failedPulls++;
+      return false;
+    }
+
+    // Numbers carry on from the cursor, one per record
+    uint32_t expect = p.epoch == epoch ? cursor + 1 : 1;
+    for (const SimRecord &rec : p.records)
+    {
+      if (rec.seq != expect)
+        result.seqErrors++;
+      expect = rec.seq + 1;
+      hits[recordKey(rec.addr, rec.man, rec.manLen)] += rec.hits;
+      AdvSighting sighting = {};
+      memcpy(sighting.addr, rec.addr, 6);
+      sighting.addrType = rec.addrType;
+      sighting.manLen = rec.manLen;
+      memcpy(sighting.man, rec.man, rec.manLen);
+      ids.insert(getRateLimitId(sighting));
+      result.hits += rec.hits;
+    }
+    if (!p.records.empty() && p.last != p.records.back().seq)
+      result.seqErrors++;
+    result.records += p.records.size();
+    result.dropped += p.dropped;
+    delivered = p.records.size();
+    epoch = p.epoch;
+    cursor = p.last;
+    more = p.more;
+    return true;
+  }
+};
+
+static void writeAll(int fd, const void *data, size_t length)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  while (length > 0)
+  {
+    ssize_t n = write(fd, p, length);
+    if (n <= 0)
+      exit(2);
+    p += n;
+    length -= n;
+  }
+}
+
+static bool readAll(int fd, void *data, size_t length)
+{
+  uint8_t *p = (uint8_t *)data;
+  while (length > 0)
+  {
+    ssize_t n = read(fd, p, length);
+    if (n <= 0)
+      return false;
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+// Runs in the child process of collector c
+static void runCollector(int c, int fd)
+{
+  SimResult result = {};
+  simSerialEcho = opt.verbose;
+  simSpillEnabled = opt.spill;
+  simRandomState = opt.seed * 2654435761u + c + 1;
+  simMac(c, WiFi.simMac);
+  scannerMac = WiFi.softAPmacAddress();
+  WiFi.softAPmacAddress(scannerMacBytes);
+  setupLogs();
+
+  SimLogger logger(c, result);
+  // Scanning starts once the logger registered
+  logger.visit();
+  setupBLE();
+  NimBLEScanCallbacks *callbacks = NimBLEDevice::getScan()->callbacks;
+
+  uint8_t macs[OWNER_MAX_SCANNERS][6];
+  for (int i = 0; i < opt.collectors; i++)
+    simMac(i, macs[i]);
+  // Owned sightings per record key, what the logger should end up with
+  std::map<std::string, uint64_t> expected;
+  // When each rate limit id was last taken for a walk
+  std::map<uint32_t, uint32_t> walkedAt;
+
+  Histogram onResultNs;
+  // Collectors are visited in turn, spread over the sync interval
+  uint64_t nextSync = (uint64_t)opt.syncMs * 1000 * c / opt.collectors;
+  uint64_t nextWalk = (uint64_t)opt.walkMs * 1000;
+  uint64_t nextDrain = (uint64_t)opt.logMs * 1000;
+  uint64_t nextTune = (uint64_t)SCAN_TUNE_MS * 1000;
+  NimBLEAdvertisedDevice dev;
+  uint64_t end = trace.empty() ? 0 : trace.back().us;
+  for (size_t i = 0; i <= trace.size(); i++)
+  {
+    uint64_t now = i < trace.size() ? trace[i].us : end + 1;
+    for (;;)
+    {
+      uint64_t next = std::min(std::min(nextSync, nextTune), std::min(nextWalk, opt.logMs ? nextDrain : UINT64_MAX));
+      if (next > now)
+        break;
+      simClockUs = next;
+      if (next == nextDrain && opt.logMs)
+      {
+        SimClock::time_point start = SimClock::now();
+        uint64_t allocs = simHeapAllocs;
+        simCountHeap = true;
+        drainAdvQueue();
+        simCountHeap = false;
+        result.drainNs += nsSince(start);
+        result.scanAllocs += simHeapAllocs - allocs;
+        nextDrain += (uint64_t)opt.logMs * 1000;
+      }
+      else if (next == nextSync)
+      {
+        logger.visit();
+        nextSync += (uint64_t)opt.syncMs * 1000;
+      }
+      else if (next == nextTune)
+      {
+        // The period that just ended ran with the settings picked last time
+        const ScanLevel &level = scanLevels[scanSettings.level];
+        result.scanMs += SCAN_TUNE_MS;
+        result.dutyMs += (uint64_t)SCAN_TUNE_MS * level.window / level.interval;
+        if (!scanSettings.active)
+          result.passiveMs += SCAN_TUNE_MS;
+        ScanSettings before = scanSettings;
+        tuneScan();
+        if (scanSettings != before)
+          result.retunes++;
+        nextTune += (uint64_t)SCAN_TUNE_MS * 1000;
+      }
+      else
+      {
+        // Walkers take candidates, there is no radio so every walk is
+        // reported as done to keep the scheduler in its usual state
+        for (int w = 0; w < WALK_WORKERS; w++)
+        {
+          SchedCandidate candidate;
+          if (!takeCandidate(candidate))
+            break;
+          result.walks++;
+          uint32_t at = millis();
+          auto last = walkedAt.find(candidate.rateLimitId);
+          if (last != walkedAt.end() && at - last->second < EXPIRATION_TIME * 1000UL)
+            result.rateLimitViolations++;
+          walkedAt[candidate.rateLimitId] = at;
+          scheduler.result(candidate.fingerprint, true, at);
+        }
+        nextWalk += (uint64_t)opt.walkMs * 1000;
+      }
+    }
+    if (i == trace.size())
+      break;
+
+    const SimEvent &ev = trace[i];
+    if (!heard(c, i))
+      continue;
+    result.heard++;
+    AdvSighting rec;
+    uint32_t id = simSighting(ev, rec);
+    if (ownerOf(id, macs, opt.collectors) == c)
+    {
+      result.ownedExpected++;
+      expected[recordKey(rec.addr, rec.man, rec.manLen)]++;
+    }
+
+    dev.address = NimBLEAddress(ev.addr, ev.addrType);
+    dev.rssi = ev.rssi;
+    dev.connectable = ev.connectable;
+    dev.payload.assign(ev.payload, ev.payload + ev.payloadLen);
+    simClockUs = ev.us;
+    SimClock::time_point start = SimClock::now();
+    uint64_t allocs = simHeapAllocs;
+    simCountHeap = true;
+    callbacks->onResult(&dev);
+    simCountHeap = false;
+    uint32_t ns = nsSince(start);
+    onResultNs.record(ns);
+    result.onResultNs += ns;
+    if (ns > result.onResultMaxNs)
+      result.onResultMaxNs = ns;
+    if (!opt.logMs)
+    {
+      start = SimClock::now();
+      simCountHeap = true;
+      drainAdvQueue();
+      simCountHeap = false;
+      result.drainNs += nsSince(start);
+    }
+    result.scanAllocs += simHeapAllocs - allocs;
+  }
+
+  // The logger keeps visiting until everything, flash included, is stored
+  drainAdvQueue();
+  int idle = 0;
+  for (int visits = 0; idle < 2 && visits < 10000; visits++)
+  {
+    simClockUs += (uint64_t)opt.syncMs * 1000;
+    uint32_t before = result.records;
+    logger.visit();
+    idle = result.records == before && logger.delivered == 0 ? idle + 1 : 0;
+  }
+
+  result.owned = metrics.advOwned.get();
+  result.rateLimited = metrics.rateLimited.get();
+  result.onResultP99Ns = percentile(onResultNs, 0.99);
+  result.heapPeak = simHeapPeak;
+  // Nothing dropped means every owned sighting is in exactly one record's hits
+  if (result.dropped == 0)
+  {
+    for (const auto &e : expected)
+    {
+      auto got = logger.hits.find(e.first);
+      if (got == logger.hits.end() || got->second != e.second)
+        result.keyMismatches++;
+    }
+  }
+  for (const auto &got : logger.hits)
+  {
+    auto e = expected.find(got.first);
+    if (e == expected.end() || got.second > e->second)
+      result.keyMismatches++;
+  }
+
+  std::vector<uint32_t> ids(logger.ids.begin(), logger.ids.end());
+  result.ids = ids.size();
+  writeAll(fd, &result, sizeof(result));
+  writeAll(fd, ids.data(), ids.size() * sizeof(uint32_t));
+}
+
+// Report
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%-52s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    failures++;
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: replay [--collectors N] [--devices N] [--rate R] [--seconds S] [--seed N]\n"
+                  "              [--trace FILE] [--write-trace FILE] [--loss P] [--sync-ms MS]\n"
+                  "              [--log-ms MS] [--walk-ms MS] [--fail P] [--json] [--no-pack] [--no-spill] [--verbose]\n");
+  exit(2);
+}
+
+static void parseOptions(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *a = argv[i];
+    const char *v = i + 1 < argc ? argv[i + 1] : nullptr;
+    bool flag = true;
+    if (!strcmp(a, "--json"))
+      opt.json = true;
+    else if (!strcmp(a, "--no-pack"))
+      opt.pack = false;
+    else if (!strcmp(a, "--no-spill"))
+      opt.spill = false;
+    else if (!strcmp(a, "--verbose"))
+      opt.verbose = true;
+    else
+      flag = false;
+    if (flag)
+      continue;
+    if (!v)
+      usage();
+    i++;
+    if (!strcmp(a, "--collectors"))
+      opt.collectors = atoi(v);
+    else if (!strcmp(a, "--devices"))
+      opt.devices = atoi(v);
+    else if (!strcmp(a, "--rate"))
+      opt.rate = atof(v);
+    else if (!strcmp(a, "--seconds"))
+      opt.seconds = atoi(v);
+    else if (!strcmp(a, "--seed"))
+      opt.seed = strtoul(v, nullptr, 0);
+    else if (!strcmp(a, "--trace"))
+      opt.trace = v;
+    else if (!strcmp(a, "--write-trace"))
+      opt.writeTrace = v;
+    else if (!strcmp(a, "--loss"))
+      opt.loss = atof(v);
+    else if (!strcmp(a, "--sync-ms"))
+      opt.syncMs = strtoul(v, nullptr, 0);
+    else if (!strcmp(a, "--log-ms"))
+      opt.logMs = strtoul(v, nullptr, 0);
+    else if (!strcmp(a, "--walk-ms"))
+      opt.walkMs = strtoul(v, nullptr, 0);
+    else if (!strcmp(a, "--fail"))
+      opt.fail = atof(v);
+    else
+      usage();
+  }
+  if (opt.collectors < 1 || opt.collectors > OWNER_MAX_SCANNERS || opt.devices < 1 || opt.rate <= 0 ||
+      opt.syncMs == 0 || opt.walkMs == 0)
+    usage();
+}
+
+int main(int argc, char **argv)
+{
+  parseOptions(argc, argv);
+  if (opt.trace ? !readTrace(opt.trace) : (generateTrace(), false))
+  {
+    fprintf(stderr, "can't read %s\n", opt.trace);
+    return 2;
+  }
+  if (opt.writeTrace && !writeTrace(opt.writeTrace))
+  {
+    fprintf(stderr, "can't write %s\n", opt.writeTrace);
+    return 2;
+  }
+  double seconds = trace.empty() ? 0 : trace.back().us / 1e6;
+  printf("%zu advertisements over %.0f s, %d collectors, %s sync every %lu ms%s\n\n", trace.size(), seconds,
+         opt.collectors, opt.json ? "JSON" : opt.pack ? "packed binary" : "binary", (unsigned long)opt.syncMs, opt.spill ? "" : ", no spill");
+
+  printf("static RAM (host sizes)\n");
+  printf("  log stores         %8zu\n", sizeof(logs));
+  printf("  advertisement queue%8zu\n", sizeof(advQueue));
+  printf("  rate limit table   %8zu\n", sizeof(rateLimitList));
+  printf("  scheduler          %8zu\n", sizeof(scheduler));
+  printf("  GATT cache         %8zu\n", sizeof(gattCache));
+  printf("  walkers            %8zu\n", sizeof(walkers));
+  printf("  spill log          %8zu\n", sizeof(spill) + sizeof(spillRecord));
+  printf("  sync packer        %8zu\n", sizeof(packer));
+  printf("  metrics            %8zu\n\n", sizeof(metrics));
+
+  std::vector<SimResult> results(opt.collectors);
+  std::vector<std::set<uint32_t>> ids(opt.collectors);
+  SimClock::time_point start = SimClock::now();
+  for (int c = 0; c < opt.collectors; c++)
+  {
+    int fds[2];
+    if (pipe(fds) != 0)
+      return 2;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      close(fds[0]);
+      runCollector(c, fds[1]);
+      _exit(0);
+    }
+    close(fds[1]);
+    std::vector<uint32_t> list;
+    bool ok = readAll(fds[0], &results[c], sizeof(SimResult));
+    if (ok)
+    {
+      list.resize(results[c].ids);
+      ok = readAll(fds[0], list.data(), list.size() * sizeof(uint32_t));
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+      fprintf(stderr, "collector %d failed\n", c);
+      return 2;
+    }
+    ids[c].insert(list.begin(), list.end());
+  }
+  double wall = nsSince(start) / 1e9;
+
+  printf("collector  heard  owned records dropped pulls   bytes  walks  ns/adv p99<ns max ns  us/pull log peak spill peak heap peak duty%% retunes\n");
+  SimResult sum = {};
+  for (int c = 0; c < opt.collectors; c++)
+  {
+    const SimResult &r = results[c];
+    printf("%9d %6u %6u %7u %7u %5u %7llu %6u %7llu %6u %6u %8llu %8u %10u %9u %5.1f %7u\n", c, r.heard, r.owned,
+           r.records, r.dropped, r.pulls, (unsigned long long)r.bytes, r.walks,
+           (unsigned long long)(r.heard ? r.onResultNs / r.heard : 0), r.onResultP99Ns, r.onResultMaxNs,
+           (unsigned long long)(r.pulls ? r.postNs / r.pulls / 1000 : 0), r.advLogPeak, r.spillPeak, r.heapPeak,
+           r.scanMs ? 100.0 * r.dutyMs / r.scanMs : 0, r.retunes);
+    sum.heard += r.heard;
+    sum.owned += r.owned;
+    sum.records += r.records;
+    sum.dropped += r.dropped;
+    sum.bytes += r.bytes;
+    sum.beaconBytes += r.beaconBytes;
+    sum.visitBytes += r.visitBytes;
+    sum.beaconMissing += r.beaconMissing;
+    sum.onResultNs += r.onResultNs;
+    sum.drainNs += r.drainNs;
+    sum.scanAllocs += r.scanAllocs;
+    sum.postNs += r.postNs;
+    sum.postAllocs += r.postAllocs;
+    sum.pulls += r.pulls;
+    sum.dutyMs += r.dutyMs;
+    sum.passiveMs += r.passiveMs;
+    sum.scanMs += r.scanMs;
+    sum.retunes += r.retunes;
+  }
+  double pipelineS = (sum.onResultNs + sum.drainNs) / 1e9;
+  printf("\nscan path: %.0f ns per advertisement (callback %.0f, log task %.0f), %.0f advertisements/s on this host\n",
+         sum.heard ? (sum.onResultNs + sum.drainNs) / (double)sum.heard : 0,
+         sum.heard ? sum.onResultNs / (double)sum.heard : 0, sum.heard ? sum.drainNs / (double)sum.heard : 0,
+         pipelineS > 0 ? sum.heard / pipelineS : 0);
+  printf("scan path: %.2f heap allocations per advertisement\n",
+         sum.heard ? sum.scanAllocs / (double)sum.heard : 0);
+  printf("syncs: %u pulls, %.1f bytes per record, %.0f us and %.1f heap allocations per pull\n", sum.pulls,
+         sum.records ? sum.bytes / (double)sum.records : 0, sum.pulls ? sum.postNs / 1e3 / sum.pulls : 0,
+         sum.pulls ? sum.postAllocs / (double)sum.pulls : 0);
+  printf("beacon: backlog shown before a visit was %.0f%% of what the visit pulled\n",
+         sum.visitBytes ? 100.0 * sum.beaconBytes / sum.visitBytes : 0);
+  printf("scan tuning: %u retunes, %.1f%% mean duty, passive %.0f%% of the time\n", sum.retunes,
+         sum.scanMs ? 100.0 * sum.dutyMs / sum.scanMs : 0, sum.scanMs ? 100.0 * sum.passiveMs / sum.scanMs : 0);
+  printf("replay: %.2f s wall, %.0fx real time\n\n", wall, wall > 0 ? seconds * opt.collectors / wall : 0);
+
+  // Devices the owner heard at least once must come from it and nobody else
+  uint8_t macs[OWNER_MAX_SCANNERS][6];
+  for (int c = 0; c < opt.collectors; c++)
+    simMac(c, macs[c]);
+  std::set<uint32_t> expectedIds;
+  for (size_t i = 0; i < trace.size(); i++)
+  {
+    AdvSighting rec;
+    uint32_t id = simSighting(trace[i], rec);
+    if (heard(ownerOf(id, macs, opt.collectors), i))
+      expectedIds.insert(id);
+  }
+  std::map<uint32_t, int> loggedBy;
+  bool disjoint = true;
+  for (int c = 0; c < opt.collectors; c++)
+  {
+    for (uint32_t id : ids[c])
+    {
+      if (loggedBy.count(id))
+        disjoint = false;
+      loggedBy[id] = c;
+    }
+  }
+  bool complete = true;
+  for (uint32_t id : expectedIds)
+  {
+    if (!loggedBy.count(id))
+      complete = false;
+  }
+
+  bool owners = true;
+  bool conserved = true;
+  bool keys = true;
+  bool seqs = true;
+  bool limits = true;
+  for (int c = 0; c < opt.collectors; c++)
+  {
+    const SimResult &r = results[c];
+    owners = owners && r.owned == r.ownedExpected;
+    conserved = conserved && r.hits + r.dropped == r.owned;
+    keys = keys && r.keyMismatches == 0;
+    seqs = seqs && r.seqErrors == 0;
+    limits = limits && r.rateLimitViolations == 0;
+  }
+  check(disjoint, "each device is logged by one collector");
+  check(sum.dropped > 0 || complete, "every device heard by its owner is logged");
+  check(owners, "collectors own what rendezvous hashing gives them");
+  check(conserved, "hits plus dropped equal owned sightings");
+  check(keys, "each sighting is counted in its own record once");
+  check(seqs, "record numbers neither repeat nor skip");
+  check(limits, "no device is walked twice within its rate limit");
+  check(sum.beaconMissing == 0, "every visit finds the backlog in the beacon");
+  check(sum.scanAllocs == 0, "advertisements are logged without heap allocations");
+  if (sum.dropped > 0)
+    printf("\n%u sightings dropped, completeness is not checked\n", sum.dropped);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+// SPSC queue stress test
+// Runs the scan callback's queue (spscqueue.h) between two real threads, a
+// producer pushing numbered items as fast as it can and a consumer popping
+// them, first with the producer waiting out a full queue and then with it
+// dropping like onResult does. Every item is as big as a sighting and
+// carries its number throughout, so a torn copy shows. The consumer has to
+// see the items in the order they went in, each once, and the drops counted
+// have to be exactly the items missing.
+//
+// Build and run on a host (add -fsanitize=thread to check the memory order):
+//   g++ -std=gnu++17 -O2 -pthread -I ../include -o spsc_stress spsc_stress.cpp && ./spsc_stress
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "spscqueue.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%-52s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    failures++;
+}
+
+#define ITEMS 2000000
+// Small enough to run full and wrap all the time
+#define QUEUE_SIZE 16
+// Items pushed before the producer lets the other thread run
+#define BURST 24
+
+// Same size as an AdvSighting, every word holds the item's number
+struct Item
+{
+  uint32_t words[24];
+};
+
+static Item itemOf(uint32_t n)
+{
+  Item item;
+  for (uint32_t &w : item.words)
+    w = n;
+  return item;
+}
+
+static bool whole(const Item &item)
+{
+  for (uint32_t w : item.words)
+  {
+    if (w != item.words[0])
+      return false;
+  }
+  return true;
+}
+
+struct Run
+{
+  // Numbers the producer got in, and the consumer got out, in order
+  std::vector<uint32_t> pushed;
+  std::vector<uint32_t> popped;
+  uint32_t torn;
+  uint32_t dropped;
+};
+
+static Run run(bool wait)
+{
+  static SpscQueue<Item, QUEUE_SIZE> queue;
+  Run r;
+  r.pushed.reserve(ITEMS);
+  r.popped.reserve(ITEMS);
+  r.torn = 0;
+  std::atomic<bool> done(false);
+
+  std::thread consumer([&]() {
+    Item item;
+    for (;;)
+    {
+      // Read done before popping, so nothing pushed before it was set is missed
+      bool last = done.load(std::memory_order_acquire);
+      bool got = false;
+      while (queue.pop(item))
+      {
+        got = true;
+        if (!whole(item))
+          r.torn++;
+        r.popped.push_back(item.words[0]);
+      }
+      if (last && !got)
+        break;
+      // Let the producer run on a single core
+      if (!got)
+        std::this_thread::yield();
+    }
+  });
+
+  for (uint32_t n = 1; n <= ITEMS; n++)
+  {
+    if (wait)
+    {
+      while (!queue.push(itemOf(n)))
+        std::this_thread::yield();
+      r.pushed.push_back(n);
+    }
+    else if (queue.push(itemOf(n)))
+    {
+      r.pushed.push_back(n);
+    }
+    // Advertisements come in bursts, and the consumer gets a turn on a
+    // single core
+    if (n % BURST == 0)
+      std::this_thread::yield();
+  }
+  done.store(true, std::memory_order_release);
+  consumer.join();
+  r.dropped = queue.takeDropped();
+  return r;
+}
+
+int main()
+{
+  Run waiting = run(true);
+  printf("waiting producer: %zu items through, found the queue full %u times\n", waiting.popped.size(),
+         waiting.dropped);
+  Run dropping = run(false);
+  printf("dropping producer: %zu items through, %u dropped\n\n", dropping.popped.size(), dropping.dropped);
+
+  check(waiting.torn == 0 && dropping.torn == 0, "no item is read half written");
+  check(waiting.popped == waiting.pushed && waiting.popped.size() == ITEMS,
+        "a waiting producer gets every item through in order");
+  check(dropping.popped == dropping.pushed, "a dropping producer's items come out in order, once");
+  check(dropping.dropped > 0 && dropping.popped.size() + dropping.dropped == ITEMS,
+        "every item missing is counted as dropped");
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,317 @@
+// Text allocation benchmark
+// Counts the heap allocations and time it takes to turn a full log into the
+// hex and UUID text of a JSON sync, record by record: once the way the
+// collector does it (rgwHex and rgwFormatUuid from rgwire.h, straight into
+// the chunk buffer through logstream.h's printHex and printUuid), and once
+// the way it used to, a std::string per field as NimBLEUtils::dataToHexString
+// and NimBLEUUID::toString() return them, each copied into the document.
+// Every operator new is counted, std::string and the facade's String go
+// through it. The scan callback and log task are counted by the replay.
+//
+// Build and run on a host:
+//   g++ -std=gnu++17 -O2 -I facade -I ../include -I ../../rg-common/include -o textalloc_bench textalloc_bench.cpp && ./textalloc_bench
+
+#include <stdio.h>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+
+#include "logstream.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%-52s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    failures++;
+}
+
+// Heap
+
+static bool counting = false;
+static uint64_t allocs = 0;
+
+void *operator new(size_t size)
+{
+  if (counting)
+    allocs++;
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p, size_t size) noexcept
+{
+  free(p);
+}
+
+// xorshift32, fixed seed so runs are repeatable
+static uint32_t rngState = 2463534242u;
+static uint32_t rng()
+{
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+// Takes the chunks of a response and keeps nothing
+class NullTarget : public ChunkTarget
+{
+public:
+  size_t bytes = 0;
+
+  void begin(const char *contentType) override {}
+  void send(const uint8_t *data, size_t length) override
+  {
+    bytes += length;
+  }
+  void end() override {}
+  void refuse(int code, const char *message) override {}
+};
+
+// The old way
+
+// Like NimBLEUtils::dataToHexString
+static std::string hexString(const uint8_t *data, size_t length)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  out.reserve(2 * length);
+  for (size_t i = 0; i < length; i++)
+  {
+    out += digits[data[i] >> 4];
+    out += digits[data[i] & 0x0F];
+  }
+  return out;
+}
+
+// Like NimBLEUUID::toString()
+static std::string uuidString(const uint8_t *uuid, uint8_t len)
+{
+  char text[40];
+  if (len == 2)
+    snprintf(text, sizeof(text), "0x%04x", uuid[0] | (uuid[1] << 8));
+  else if (len == 4)
+    snprintf(text, sizeof(text), "0x%08lx", (unsigned long)rgwGetU32(uuid));
+  else
+    snprintf(text, sizeof(text), "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x", uuid[15],
+             uuid[14], uuid[13], uuid[12], uuid[11], uuid[10], uuid[9], uuid[8], uuid[7], uuid[6], uuid[5], uuid[4],
+             uuid[3], uuid[2], uuid[1], uuid[0]);
+  return text;
+}
+
+// The document keeps a copy of every string it is given
+struct OldDocument
+{
+  std::vector<std::string> strings;
+  size_t bytes = 0;
+
+  void add(const std::string &s)
+  {
+    strings.push_back(s);
+    bytes += s.size();
+  }
+};
+
+static void oldRecord(OldDocument &doc, const AdvRecord &rec, const GattLog &gatt, int tree)
+{
+  doc.add(hexString(rec.name, rec.nameLen));
+  doc.add(hexString(rec.man, rec.manLen));
+  for (uint16_t i = 0; tree >= 0 && i < gatt.recordCount(); i++)
+  {
+    const GattRecord &g = gatt.record(i);
+    if (g.tree != tree)
+      continue;
+    doc.add(uuidString(g.svc, g.svcLen));
+    doc.add(uuidString(g.chr, g.chrLen));
+    doc.add(hexString(gatt.value(g), g.valLen));
+  }
+}
+
+// A full log of advertisements, some of them walked
+
+static AdvLog advs;
+static GattLog gatt;
+static int treeOf[ADV_LOG_CAPACITY];
+
+static void fillLog()
+{
+  advs.clear();
+  gatt.clear();
+  for (uint32_t d = 0; !advs.full(); d++)
+  {
+    AdvSighting s = {};
+    for (int b = 0; b < 6; b++)
+      s.addr[b] = rng();
+    s.addrType = rng() % 2;
+    s.rssi = -40 - rng() % 50;
+    s.flags = ADV_FLAG_CONNECTABLE;
+    s.nameLen = rng() % 2 ? 8 + rng() % 12 : 0;
+    for (uint8_t i = 0; i < s.nameLen; i++)
+      s.name[i] = 'a' + rng() % 26;
+    s.manLen = 4 + rng() % 24;
+    for (uint8_t i = 0; i < s.manLen; i++)
+      s.man[i] = rng();
+    s.seen = d;
+    advs.put(s);
+  }
+  for (uint16_t k = 0; k < advs.size(); k++)
+  {
+    treeOf[k] = -1;
+    if (k % (ADV_LOG_CAPACITY / GATT_LOG_MAX_TREES) != 0)
+      continue;
+    int tree = gatt.beginTree(advs.at(k).addr);
+    treeOf[k] = tree;
+    for (int c = 0; c < GATT_LOG_CAPACITY / GATT_LOG_MAX_TREES; c++)
+    {
+      uint8_t svc[16];
+      uint8_t chr[16];
+      uint8_t val[24];
+      for (int b = 0; b < 16; b++)
+      {
+        svc[b] = rng();
+        chr[b] = rng();
+      }
+      for (int b = 0; b < 24; b++)
+        val[b] = rng();
+      uint8_t len = c % 3 == 0 ? 16 : 2;
+      gatt.add(tree, svc, len, chr, c % 4 == 0 ? 4 : len, RGW_PROP_READ, val, 4 + c % 20,
+               c % 5 == 0 ? GATT_VALUE_CACHED : GATT_VALUE_READ);
+    }
+  }
+}
+
+static double nsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+#define ROUNDS 200
+
+int main()
+{
+  fillLog();
+  uint32_t records = advs.size();
+  printf("%u records, %u walked with %u characteristics, %d rounds\n\n", records, gatt.treeCount(),
+         gatt.recordCount(), ROUNDS);
+
+  // Text the collector sends now
+  NullTarget target;
+  uint64_t before = allocs;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < ROUNDS; r++)
+  {
+    ChunkedPrint out(target);
+    counting = true;
+    for (uint16_t k = 0; k < records; k++)
+    {
+      printAdvJson(out, advs.at(k), k + 1);
+      if (treeOf[k] >= 0)
+      {
+        out.print(',');
+        printTreeJson(out, gatt, treeOf[k]);
+      }
+      out.print('}');
+    }
+    out.flush();
+    counting = false;
+  }
+  double nowNs = nsSince(start) / ((double)ROUNDS * records);
+  uint64_t nowAllocs = allocs - before;
+
+  // Only the encoders, for the fields the old way made strings of
+  char text[2 * 255];
+  size_t chars = 0;
+  before = allocs;
+  start = std::chrono::steady_clock::now();
+  for (int r = 0; r < ROUNDS; r++)
+  {
+    counting = true;
+    for (uint16_t k = 0; k < records; k++)
+    {
+      const AdvRecord &rec = advs.at(k);
+      chars += rgwHex(text, rec.name, rec.nameLen) - text;
+      chars += rgwHex(text, rec.man, rec.manLen) - text;
+    }
+    for (uint16_t i = 0; i < gatt.recordCount(); i++)
+    {
+      const GattRecord &g = gatt.record(i);
+      chars += rgwFormatUuid(text, g.svc, g.svcLen) - text;
+      chars += rgwFormatUuid(text, g.chr, g.chrLen) - text;
+      chars += rgwHex(text, gatt.value(g), g.valLen) - text;
+    }
+    counting = false;
+  }
+  double encoderNs = nsSince(start) / ((double)ROUNDS * records);
+  uint64_t encoderAllocs = allocs - before;
+
+  // The same fields as they used to be made
+  before = allocs;
+  start = std::chrono::steady_clock::now();
+  size_t oldBytes = 0;
+  for (int r = 0; r < ROUNDS; r++)
+  {
+    counting = true;
+    OldDocument doc;
+    for (uint16_t k = 0; k < records; k++)
+      oldRecord(doc, advs.at(k), gatt, treeOf[k]);
+    counting = false;
+    oldBytes = doc.bytes;
+  }
+  double oldNs = nsSince(start) / ((double)ROUNDS * records);
+  uint64_t oldAllocs = allocs - before;
+
+  double runs = (double)ROUNDS * records;
+  printf("%-36s %14s %12s\n", "hex and UUID fields", "allocs/record", "ns/record");
+  printf("%-36s %14.2f %12.0f\n", "std::string per field (before)", oldAllocs / runs, oldNs);
+  printf("%-36s %14.2f %12.0f\n", "rgwHex and rgwFormatUuid", encoderAllocs / runs, encoderNs);
+  printf("%-36s %14.2f %12.0f\n", "whole JSON entry, printHex/printUuid", nowAllocs / runs, nowNs);
+  printf("\n");
+
+  // Both make the same text
+  bool same = true;
+  for (uint16_t k = 0; k < records; k++)
+  {
+    const AdvRecord &rec = advs.at(k);
+    same = same && std::string(text, rgwHex(text, rec.man, rec.manLen)) == hexString(rec.man, rec.manLen);
+  }
+  for (uint16_t i = 0; i < gatt.recordCount(); i++)
+  {
+    const GattRecord &g = gatt.record(i);
+    same = same && std::string(text, rgwFormatUuid(text, g.svc, g.svcLen)) == uuidString(g.svc, g.svcLen) &&
+           std::string(text, rgwFormatUuid(text, g.chr, g.chrLen)) == uuidString(g.chr, g.chrLen);
+  }
+  check(same, "the encoders write what NimBLE's strings held");
+  check(chars == ROUNDS * oldBytes, "and as much of it");
+  check(encoderAllocs == 0, "rgwHex and rgwFormatUuid allocate nothing");
+  check(nowAllocs == 0 && target.bytes > 0, "a record's JSON text allocates nothing");
+  check(oldAllocs > 0, "the std::string way allocated per record");
+
+  return failures ? 1 : 0;
+}
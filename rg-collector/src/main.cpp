@@ -1,6 +1,7 @@
 #include <SPI.h>
 #include <WiFi.h>
 #include <esp_wifi.h>
+#include <esp_heap_caps.h>
 #include <WebServer.h>
 #include <Update.h>
 #define CONFIG_BT_NIMBLE_EXT_ADV 1
@@ -10,12 +11,40 @@
 #endif
 #include <CRC32.h>
 #include <ArduinoJson.h>
+#include <algorithm>
 
+#include "advlog.h"
+#include "gattcache.h"
+#include "gattlog.h"
+#include "jsonarena.h"
+#include "logstream.h"
+#include "metrics.h"
+#include "ownership.h"
 #include "ratelimit.h"
+#include "rgbeacon.h"
+#include "rgnow.h"
+#include "rgwire.h"
+#include "scantune.h"
+#include "scheduler.h"
+#include "spilllog.h"
+#include "spillpartition.h"
+#include "spscqueue.h"
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+// Requests take a few frames, it is the logger that needs a deep queue
+#define RGN_QUEUE_FRAMES 8
+#include "rgnowlink.h"
+#endif
 
 String scannerMac;
+uint8_t scannerMacBytes[6];
 int scannerIndex = 0;
 int scannerCount = 1;
+// softAP MACs of every collector the logger knows, decides device ownership
+// once a logger has sent them (see ownership.h). Written by the HTTP task,
+// read by the scan callback.
+uint8_t scannerMacs[OWNER_MAX_SCANNERS][6];
+int scannerMacCount = 0;
+portMUX_TYPE scannerMux = portMUX_INITIALIZER_UNLOCKED;
 
 const char *ssid = "BLEAKEST01"; // SSID Name
 const char *password = "";       // SSID Password - Set to NULL to have an open AP
@@ -64,22 +93,171 @@ const char *serverIndex =
     "</script>";
 
 // BLE Scanner vars
-// FIX: volatile ensures the compiler doesn't optimize away cross-context reads
-static volatile bool doConnect = false;
 static uint32_t scanTime = 0; /** 0 = scan forever */
 
-// JSON doc for logging (ArduinoJson v7: no capacity arg, dynamic allocation)
-JsonDocument parentDoc;
-JsonObject logDoc = parentDoc["logs"].to<JsonObject>();
+// Structure to store everything one sync sends.
+struct LogStore
+{
+  // Advertisements are logged as packed binary records into a preallocated
+  // store; JSON is only built when the logger syncs
+  AdvLog adv;
+  // GATT trees in binary form, UUIDs and values are only turned into text at sync time
+  GattLog gatt;
+  // Counters taken when the store is frozen for a sync
+  uint32_t dropped;
+  uint32_t cacheHits;
+  uint32_t cacheMisses;
+  // Also set when frozen: records are the advertisements in log order, each
+  // carrying the trees matched to it, then the trees whose advertisement was
+  // dropped from a full log. Record k is numbered firstSeq + k.
+  uint32_t firstSeq;
+  uint16_t records;
+  int32_t treeAdv[GATT_LOG_MAX_TREES];
+  // Frozen with records the logger hasn't acknowledged, sent again until it does
+  bool pending;
+};
+
+// Double buffered: scanning and walks fill logs[activeLog] while a sync
+// streams the other one, so neither waits on the logger
+LogStore logs[2];
+uint8_t activeLog = 0;
+// Record numbering, see rgwire.h. Only the HTTP task freezes stores.
+uint32_t bootEpoch;
+uint32_t nextSeq = 1;
+
+// Advertisements that outgrow RAM while the logger is away go to flash as
+// ADV frames and are sent after the frozen store's records, numbered on from
+// spillSeq (see spilllog.h)
+PartitionSpillDevice spillDevice;
+SpillLog spill;
+bool spillReady = false;
+uint32_t spillSeq = 1;
+// Guards spill between the log task (appends) and the HTTP task (reads, releases)
+SemaphoreHandle_t spillMutex;
+// The spill log counts a record it had no room for as one drop, this adds
+// the rest of its hits so dropped counts sightings. Guarded by spillMutex.
+uint32_t spillDroppedHits = 0;
+// Only used by the HTTP task, too big for its stack
+uint8_t spillRecord[SPILL_RECORD_MAX];
+
+static_assert(RGW_MAX_FRAME <= SPILL_RECORD_MAX, "an ADV frame must fit a spill record");
+
+// Define the bytes of internal RAM sync requests are parsed in.
+#ifndef JSON_ARENA_SIZE
+#define JSON_ARENA_SIZE 4096
+#endif
+// Sync requests are parsed here instead of on the heap (see jsonarena.h),
+// HTTP task only
+uint8_t jsonArenaBuf[JSON_ARENA_SIZE];
+JsonArena jsonArena;
+// GATT layouts of device models already walked
+GattCache gattCache;
+// Guards activeLog, the active LogStore and gattCache between the log task,
+// the walker tasks and the HTTP task
+SemaphoreHandle_t logMutex;
+
+// Define the number of sightings that can wait for the log task.
+#define ADV_QUEUE_SIZE 64
+// Scan callback (NimBLE host task) -> log task
+SpscQueue<AdvSighting, ADV_QUEUE_SIZE> advQueue;
+TaskHandle_t logTaskHandle = nullptr;
+
+// Hot path telemetry, served on /metrics and summarized in every sync
+struct Metrics
+{
+  Counter advSeen;
+  Counter advOwned;
+  // Devices skipped because their rate limit hadn't expired
+  Counter rateLimited;
+  // Sightings not offered to the scheduler because a walker held it
+  Counter schedBusy;
+  Counter connects;
+  Counter connectFails;
+  Histogram onResultUs;
+  Histogram walkMs;
+  // Characteristics logged per walk
+  Histogram walkChrs;
+  Histogram syncBytes;
+  Histogram syncMs;
+};
+Metrics metrics;
+// Size and duration of the previous sync response, HTTP task only
+uint32_t lastSyncBytes = 0;
+uint32_t lastSyncMs = 0;
+
+// Define how often the backlog in the softAP beacon is brought up to date.
+#ifndef BEACON_UPDATE_MS
+#define BEACON_UPDATE_MS 2000
+#endif
+// Define the bytes a record is taken to cost a sync until one has been measured.
+#define BEACON_RECORD_BYTES 40
+// Bytes a record took in the syncs so far, set by the HTTP task
+static volatile uint32_t syncRecordBytes = BEACON_RECORD_BYTES;
+// Loop task only
+RgbFillRate beaconFill;
+RgbStatus beaconStatus;
+bool beaconPublished = false;
+static uint32_t lastBeaconAt = 0;
+
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+// Define the longest sync request taken over ESP-NOW.
+#ifndef NOW_REQUEST_SIZE
+#define NOW_REQUEST_SIZE 1024
+#endif
+// The request being put together from the logger's frames, HTTP task only
+char nowRequest[NOW_REQUEST_SIZE + 1];
+size_t nowRequestLen = 0;
+bool nowRequestLong = false;
+uint8_t nowLogger[6];
+int32_t nowSession = -1;
+// Session of the request answered last, its frames sent again are passed over
+int32_t nowAnswered = -1;
+#endif
 
 // Bluetooth
 
-static NimBLEScan::Phy scanPhy = NimBLEScan::Phy::SCAN_ALL;
+// Picks the scan duty cycle and mode from what the last period brought in,
+// loop task only
+ScanTuner scanTuner;
+ScanSettings scanSettings = scanTuner.initial();
+// Distinct devices heard since the last retune, added to by the scan callback
+DistinctCounter distinctSeen;
+// millis() of the latest sync pull, set by the HTTP task
+static volatile uint32_t lastPullAt = 0;
+// millis() of the latest retune, loop task only
+static uint32_t lastTuneAt = 0;
+
+// Define the number of devices walked at once, each walker owns one NimBLE client.
+#define WALK_WORKERS 3
+// Define the connection attempt timeout in seconds.
+#define WALK_CONNECT_TIMEOUT 3
+// Define the time a walk may hold a connection, whatever was read by then is kept.
+#define WALK_DEADLINE_MS 4000
+// Define the reads queued back to back and the bytes their values can take.
+#define WALK_BATCH_READS 16
+#define WALK_BATCH_BYTES 2048
 
-// FIX: store address copy, not raw pointer.
-// With setMaxResults(0), the NimBLEAdvertisedDevice* passed to onResult is
-// only valid for the duration of the callback — storing it is a dangling pointer.
-static NimBLEAddress advDeviceAddress;
+static_assert(WALK_WORKERS <= NIMBLE_MAX_CONNECTIONS, "WALK_WORKERS can't exceed NIMBLE_MAX_CONNECTIONS");
+static_assert(WALK_BATCH_BYTES >= RGW_MAX_VALUE, "WALK_BATCH_BYTES must fit the longest value");
+
+// Connectable devices in view, scan callback (NimBLE host task) -> walker tasks.
+// FIX: the scheduler keeps address copies, not raw pointers. With
+// setMaxResults(0), the NimBLEAdvertisedDevice* passed to onResult is only
+// valid for the duration of the callback — storing it is a dangling pointer.
+ConnectScheduler scheduler;
+// Guards scheduler and the rate limit table
+SemaphoreHandle_t schedMutex;
+// Given when a device is offered to the scheduler, wakes a waiting walker
+SemaphoreHandle_t candidateReady;
+// Held while the scan has to stay off for a pending connection (NimBLE allows
+// only one at a time and GAP events misbehave when it overlaps a scan)
+SemaphoreHandle_t radioLock;
+// Walks that hold a tree slot or have a tree open in the active GattLog,
+// guarded by logMutex
+static int activeWalks = 0;
+// Set by the HTTP task when it had to turn a sync away, walkers hold off
+// starting new walks until it got through. Guarded by logMutex.
+static bool syncWanted = false;
 
 class ScanCallbacks : public NimBLEScanCallbacks
 {
@@ -88,160 +266,700 @@ class ScanCallbacks : public NimBLEScanCallbacks
   // callback was silently never called.
   void onResult(const NimBLEAdvertisedDevice *advertisedDevice) override
   {
+    uint32_t start = micros();
+    metrics.advSeen.add();
     // LED ON
     digitalWrite(LED_BUILTIN, HIGH);
+    // Copy the advertisement into a stack record, nothing here allocates
+    AdvSighting rec;
+    memcpy(rec.addr, advertisedDevice->getAddress().getVal(), 6);
+    rec.addrType = advertisedDevice->getAddressType();
+    rec.rssi = advertisedDevice->getRSSI();
+    rec.flags = advertisedDevice->isConnectable() ? ADV_FLAG_CONNECTABLE : 0;
+    const std::vector<uint8_t> &payload = advertisedDevice->getPayload();
+    advParsePayload(rec, payload.data(), payload.size());
+    rec.seen = millis();
     // Convert device advertisement to a rateLimitId
-    uint32_t id = getRateLimitId(advertisedDevice);
+    uint32_t id = getRateLimitId(rec);
+    distinctSeen.add(id);
     // Use rateLimitId and our position in the mesh to determine
     // if the remote device is "ours" to log its advertisement data.
     // This prevents N devices logging the same advertisement data to the
     // server and SD card (duplicates)
-    if (getOwnership(id, scannerIndex, scannerCount))
-    {
-      JsonObject scanObj = logDoc[advertisedDevice->getAddress().toString()].to<JsonObject>();
-      scanObj["name"] = NimBLEUtils::dataToHexString(
-          (uint8_t *)advertisedDevice->getName().data(),
-          advertisedDevice->getName().length());
-      scanObj["rssi"] = advertisedDevice->getRSSI();
-      scanObj["man"] = NimBLEUtils::dataToHexString(
-          (uint8_t *)advertisedDevice->getManufacturerData().data(),
-          advertisedDevice->getManufacturerData().length());
-      scanObj["connectable"] = advertisedDevice->isConnectable();
-      scanObj["addr_type"] = advertisedDevice->getAddressType();
-
-      // Apple {0x4c, 0x00} is EVERYWHERE — skip them and prioritize anything else
-      char apl[2] = {0x4c, 0x00};
-      if (advertisedDevice->getManufacturerData().length() == 0 || memcmp((uint8_t *)advertisedDevice->getManufacturerData().data(), apl, 2) != 0)
+    portENTER_CRITICAL(&scannerMux);
+    bool owned = scannerMacCount > 0 ? getOwnership(id, scannerMacBytes, scannerMacs, scannerMacCount)
+                                     : getOwnership(id, scannerIndex, scannerCount);
+    portEXIT_CRITICAL(&scannerMux);
+    if (owned)
+    {
+      metrics.advOwned.add();
+      // Hand the sighting to the log task, the callback never waits on the log
+      if (advQueue.push(rec))
+      {
+        xTaskNotifyGive(logTaskHandle);
+      }
+
+      // Using the rateLimitId, check if the device is in our rate limit list
+      // and if the rate limit has expired. The scheduler decides which of the
+      // devices in view is walked next, frequent models like Apple's drop
+      // down on their own as their walks pile up. The host task doesn't wait
+      // for a walker holding the scheduler, the device is offered again on
+      // its next advertisement.
+      if (advertisedDevice->isConnectable() && xSemaphoreTake(schedMutex, 0) == pdTRUE)
       {
-        // Using the rateLimitId, check if the device is in our rate limit list
-        // and if the rate limit has expired
-        if (!doConnect && isConnectionAllowed(id) && advertisedDevice->isConnectable())
+        bool limited = isRateLimited(id);
+        bool offered = !limited && scheduler.offer(rec, id, gattFingerprint(rec));
+        xSemaphoreGive(schedMutex);
+        if (limited)
         {
-          // FIX: copy the address out; the advertisedDevice pointer is only
-          // valid for the duration of this callback when setMaxResults(0)
-          advDeviceAddress = advertisedDevice->getAddress();
-          doConnect = true;
+          metrics.rateLimited.add();
         }
+        if (offered)
+        {
+          xSemaphoreGive(candidateReady);
+        }
+      }
+      else if (advertisedDevice->isConnectable())
+      {
+        metrics.schedBusy.add();
       }
     }
     // LED OFF
     digitalWrite(LED_BUILTIN, LOW);
+    metrics.onResultUs.record(micros() - start);
   }
 } scanCallbacks;
 
-// Creates/Re-Uses Client, Connects, Walks GATT tree, reads, and leaves
-bool connectToServer()
+// Client GAP events, read and discovery completions, delivered to the walker
+// task as notification bits
+#define WALK_EVT_CONNECTED 0x01
+#define WALK_EVT_CONNECT_FAILED 0x02
+#define WALK_EVT_DISCONNECTED 0x04
+#define WALK_EVT_READ 0x08
+#define WALK_EVT_DISCOVERED 0x10
+#define WALK_EVT_ALL 0x1F
+
+// Characteristic properties a walk logs and a layout keeps
+#define WALK_CHR_PROPS (BLE_GATT_CHR_PROP_BROADCAST | BLE_GATT_CHR_PROP_READ | BLE_GATT_CHR_PROP_WRITE_NO_RSP | \
+                        BLE_GATT_CHR_PROP_WRITE | BLE_GATT_CHR_PROP_NOTIFY | BLE_GATT_CHR_PROP_INDICATE)
+
+// Structure to store one read of a batch.
+struct BatchRead
 {
+  uint16_t handle;
+  // Value bytes live in batchBuf at offset
+  uint16_t offset;
+  uint16_t len;
+  // 0 or the NimBLE host / ATT error
+  int status;
+};
+
+// Per walker state. The client's GAP events (NimBLE host task) are forwarded
+// to the walker task that owns it.
+class Walker : public NimBLEClientCallbacks
+{
+public:
+  TaskHandle_t task = nullptr;
   NimBLEClient *pClient = nullptr;
+  // Events received but not waited for yet
+  uint32_t events = 0;
+  // Layout of the device being walked, copied out of or into gattCache
+  GattLayout layout;
+  // millis() by which the walk has to be done
+  uint32_t deadline = 0;
+  // Reads run by runBatch(), batchNext is advanced by onBatchRead
+  BatchRead batch[WALK_BATCH_READS];
+  uint8_t batchCount = 0;
+  volatile uint8_t batchNext = 0;
+  volatile bool batchStop = false;
+  uint16_t batchUsed = 0;
+  uint8_t batchBuf[WALK_BATCH_BYTES];
+  // Set by onVerifyChr: characteristics found in the layout, any that
+  // weren't, and how the discovery ended
+  uint16_t verifyFound = 0;
+  bool verifyMismatch = false;
+  int verifyStatus = 0;
 
-  // Try to reuse a client that already has cached services for this device
-  pClient = NimBLEDevice::getClientByPeerAddress(advDeviceAddress);
-  if (pClient)
+  void onConnect(NimBLEClient *pClient) override
+  {
+    xTaskNotify(task, WALK_EVT_CONNECTED, eSetBits);
+  }
+
+  void onConnectFail(NimBLEClient *pClient, int reason) override
+  {
+    xTaskNotify(task, WALK_EVT_CONNECT_FAILED, eSetBits);
+  }
+
+  void onDisconnect(NimBLEClient *pClient, int reason) override
+  {
+    xTaskNotify(task, WALK_EVT_DISCONNECTED, eSetBits);
+  }
+};
+
+Walker walkers[WALK_WORKERS];
+
+void disableBLEScanning()
+{
+  // Stop scanning before connecting — GAP events misbehave when both are active
+  if (NimBLEDevice::getScan()->isScanning())
   {
-    // false = keep cached attributes, saves service discovery time
-    if (!pClient->connect(advDeviceAddress, false))
+    NimBLEDevice::getScan()->stop();
+    while (NimBLEDevice::getScan()->isScanning())
     {
-      return false;
+      delay(1);
     }
   }
-  else
+}
+
+// Wait for any of the wanted events, others stay pending for a later wait.
+// Returns the wanted events seen, 0 on timeout.
+uint32_t waitWalkEvents(Walker &w, uint32_t want, TickType_t timeout)
+{
+  TickType_t start = xTaskGetTickCount();
+  for (;;)
   {
-    // Reuse a disconnected client if available, otherwise create one
-    pClient = NimBLEDevice::getDisconnectedClient();
-    if (!pClient)
+    uint32_t seen = w.events & want;
+    if (seen)
     {
-      if (NimBLEDevice::getCreatedClientCount() >= NIMBLE_MAX_CONNECTIONS)
-      {
-        Serial.println("Max clients reached - no more connections available");
-        return false;
-      }
-      pClient = NimBLEDevice::createClient();
+      w.events &= ~seen;
+      return seen;
     }
+    TickType_t waited = xTaskGetTickCount() - start;
+    if (waited >= timeout)
+    {
+      return 0;
+    }
+    uint32_t bits;
+    if (xTaskNotifyWait(0, WALK_EVT_ALL, &bits, timeout - waited) == pdTRUE)
+    {
+      w.events |= bits;
+    }
+  }
+}
+
+// True once the walk ran out of time or lost its connection
+bool walkOver(Walker &w)
+{
+  return (int32_t)(millis() - w.deadline) >= 0 || !w.pClient->isConnected();
+}
 
-    /** Set initial connection parameters: 15ms interval, 0 latency, 510ms timeout.
-     *  These settings are safe for 3 clients to connect reliably.
-     *  Min interval: 12 * 1.25ms = 15, Max interval: 12 * 1.25ms = 15, 0 latency, 51 * 10ms = 510ms timeout
-     */
-    pClient->setConnectionParams(12, 12, 0, 51);
-    pClient->setConnectTimeout(3);
+int onBatchRead(uint16_t connHandle, const struct ble_gatt_error *error, struct ble_gatt_attr *attr, void *arg);
 
-    if (!pClient->connect(advDeviceAddress))
+// Start the read at w.batchNext. Returns false if the batch is over: every
+// read is done, it was stopped, the buffer is full or time is up.
+bool startBatchRead(Walker &w)
+{
+  while (w.batchNext < w.batchCount && !w.batchStop &&
+         WALK_BATCH_BYTES - w.batchUsed >= RGW_MAX_VALUE &&
+         (int32_t)(millis() - w.deadline) < 0)
+  {
+    BatchRead &read = w.batch[w.batchNext];
+    read.offset = w.batchUsed;
+    read.len = 0;
+    int rc = ble_gattc_read_long(w.pClient->getConnHandle(), read.handle, 0, onBatchRead, &w);
+    if (rc == 0)
+    {
+      return true;
+    }
+    // Out of GATT procedures, the walker retries once one is free
+    if (rc == BLE_HS_ENOMEM)
     {
-      NimBLEDevice::deleteClient(pClient);
       return false;
     }
+    read.status = rc;
+    w.batchNext++;
   }
+  return false;
+}
 
-  if (!pClient->isConnected())
+// Called by the NimBLE host task for each part of a long read. The next read
+// of the batch is started right here, without a round trip through the walker.
+int onBatchRead(uint16_t connHandle, const struct ble_gatt_error *error, struct ble_gatt_attr *attr, void *arg)
+{
+  Walker *w = (Walker *)arg;
+  BatchRead &read = w->batch[w->batchNext];
+  if (error->status == 0 && attr)
   {
-    return false;
+    uint16_t len = OS_MBUF_PKTLEN(attr->om);
+    if (len > RGW_MAX_VALUE - read.len)
+      len = RGW_MAX_VALUE - read.len;
+    os_mbuf_copydata(attr->om, 0, len, w->batchBuf + read.offset + read.len);
+    read.len += len;
+    return 0;
+  }
+  read.status = error->status;
+  // Same as readValue(): a value of exactly MTU - 1 bytes may reject the blob read
+  if (error->status == BLE_HS_EDONE ||
+      (error->status == BLE_HS_ATT_ERR(BLE_ATT_ERR_ATTR_NOT_LONG) && read.len > 0))
+  {
+    read.status = 0;
   }
+  w->batchUsed = read.offset + read.len;
+  w->batchNext++;
+  if (!startBatchRead(*w))
+  {
+    xTaskNotify(w->task, WALK_EVT_READ, eSetBits);
+  }
+  return 0;
+}
 
-  NimBLERemoteService *pSvc = nullptr;
-  NimBLERemoteCharacteristic *pChr = nullptr;
+// Read the handles in w.batch[0..batchCount) back to back, like readValue()
+// but from handles and without waking the walker between reads. ATT allows one
+// request in flight per link, so this is as close as reads on one connection
+// get; the walkers overlap reads across connections. Returns with batchNext at
+// the first read not done, when the buffer filled up or the walk is over.
+void runBatch(Walker &w)
+{
+  w.batchNext = 0;
+  w.batchUsed = 0;
+  w.batchStop = false;
+  while (w.batchNext < w.batchCount && WALK_BATCH_BYTES - w.batchUsed >= RGW_MAX_VALUE && !walkOver(w))
+  {
+    if (!startBatchRead(w))
+    {
+      vTaskDelay(1);
+      continue;
+    }
+    int32_t left = w.deadline - millis();
+    if (!waitWalkEvents(w, WALK_EVT_READ, left > 0 ? pdMS_TO_TICKS(left) : 0))
+    {
+      // Out of time with a read in flight. Dropping the link fails it, the
+      // stack always calls back so the buffer is never written after we return.
+      w.batchStop = true;
+      w.pClient->disconnect();
+      waitWalkEvents(w, WALK_EVT_READ, portMAX_DELAY);
+    }
+  }
+}
+
+bool isAttError(int rc)
+{
+  return rc > BLE_HS_ERR_ATT_BASE && rc < BLE_HS_ERR_ATT_BASE + 0x100;
+}
+
+// Lower is read first: services that identify the device, then vendor
+// services, then the rest of the SIG ones with GATT bookkeeping last
+uint8_t serviceRank(const NimBLEUUID &uuid)
+{
+  if (uuid == NimBLEUUID((uint16_t)0x180A)) // Device Information
+    return 0;
+  if (uuid == NimBLEUUID((uint16_t)0x1800)) // Generic Access
+    return 1;
+  if (uuid.bitSize() == 128)
+    return 2;
+  if (uuid == NimBLEUUID((uint16_t)0x1801)) // Generic Attribute
+    return 4;
+  return 3;
+}
+
+// Log one characteristic with the result of its read, if it was read.
+// Learns the value into the cached layout entry when there is one. A readable
+// characteristic without a value is logged as failed, never as an empty value.
+void logCharacteristic(Walker &w, int tree, const uint8_t *svc, uint8_t svcLen, const uint8_t *chr, uint8_t chrLen,
+                       uint8_t prop, const BatchRead *read, GattCacheChr *cached)
+{
+  const uint8_t *val = nullptr;
+  size_t valLen = 0;
+  uint8_t source = GATT_VALUE_READ;
+  if (read && read->status == 0)
+  {
+    val = w.batchBuf + read->offset;
+    valLen = read->len;
+    if (cached)
+      gattCacheLearn(*cached, val, valLen);
+  }
+  else if (read)
+  {
+    source = GATT_VALUE_FAILED;
+    if (cached && isAttError(read->status))
+      cached->flags |= GATT_CACHE_READ_FAILED;
+  }
+  else if (cached && gattCacheReusable(*cached))
+  {
+    source = GATT_VALUE_CACHED;
+    val = cached->val;
+    valLen = cached->valLen;
+  }
+  else if (prop & BLE_GATT_CHR_PROP_READ)
+  {
+    // Refused on an earlier walk, not tried again
+    source = GATT_VALUE_FAILED;
+  }
 
-  JsonArray devTree = logDoc[pClient->getPeerAddress().toString().c_str()]["tree"].to<JsonArray>();
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  logs[activeLog].gatt.add(tree, svc, svcLen, chr, chrLen, prop, val, valLen, source);
+  xSemaphoreGive(logMutex);
+}
 
-  const std::vector<NimBLERemoteService *> pSvcs = pClient->getServices(true);
+// Discover and walk the services of a connected client into a GattLog tree,
+// most useful first, learning the layout into w.layout on the way. When the
+// deadline passes the tree is left with what was read so far.
+void walkTree(Walker &w, int tree)
+{
+  std::vector<NimBLERemoteService *> pSvcs = w.pClient->getServices(true);
+  std::stable_sort(pSvcs.begin(), pSvcs.end(), [](NimBLERemoteService *a, NimBLERemoteService *b)
+                   { return serviceRank(a->getUUID()) < serviceRank(b->getUUID()); });
 
   // Iterate over services
-  for (auto sit = pSvcs.begin(); sit != pSvcs.end(); ++sit)
+  for (auto sit = pSvcs.begin(); sit != pSvcs.end() && !walkOver(w); ++sit)
   {
-    pSvc = *sit;
-    if (pSvc)
+    NimBLERemoteService *pSvc = *sit;
+    if (!pSvc)
+      continue;
+    const NimBLEUUID &svcUuid = pSvc->getUUID();
+    const std::vector<NimBLERemoteCharacteristic *> pChrs = pSvc->getCharacteristics(true);
+
+    size_t next = 0;
+    while (next < pChrs.size() && !walkOver(w))
     {
-      const std::vector<NimBLERemoteCharacteristic *> pChrs = pSvc->getCharacteristics(true);
+      // Speed matters — assume you're traveling in a car at 70mph
+      // and another car going the opposite direction at 70mph passes you
+      w.batchCount = 0;
+      for (size_t i = next; i < pChrs.size() && w.batchCount < WALK_BATCH_READS; i++)
+      {
+        if (pChrs[i] && pChrs[i]->canRead())
+          w.batch[w.batchCount++].handle = pChrs[i]->getHandle();
+      }
+      runBatch(w);
 
-      for (auto cit = pChrs.begin(); cit != pChrs.end(); ++cit)
+      // Log up to the first read the batch didn't get to
+      uint8_t r = 0;
+      for (; next < pChrs.size(); next++)
       {
-        pChr = *cit;
-        if (pChr)
-        {
-          JsonObject nested = devTree.add<JsonObject>();
-          nested["svc"] = pSvc->getUUID().toString();
-          nested["chr"] = pChr->getUUID().toString();
-
-          uint8_t charProp = 0x00;
-          // Speed matters — assume you're traveling in a car at 70mph
-          // and another car going the opposite direction at 70mph passes you
-          if (pChr->canRead())
-          {
-            charProp = charProp | BLE_GATT_CHR_PROP_READ;
-            NimBLEAttValue rv = pChr->readValue();
-            nested["val"] = NimBLEUtils::dataToHexString((uint8_t *)rv.data(), rv.length());
-          }
-          if (pChr->canBroadcast())
-            charProp = charProp | BLE_GATT_CHR_PROP_BROADCAST;
-          if (pChr->canIndicate())
-            charProp = charProp | BLE_GATT_CHR_PROP_INDICATE;
-          if (pChr->canNotify())
-            charProp = charProp | BLE_GATT_CHR_PROP_NOTIFY;
-          if (pChr->canWrite())
-            charProp = charProp | BLE_GATT_CHR_PROP_WRITE;
-          if (pChr->canWriteNoResponse())
-            charProp = charProp | BLE_GATT_CHR_PROP_WRITE_NO_RSP;
-
-          nested["prop"] = charProp;
-        }
+        NimBLERemoteCharacteristic *pChr = pChrs[next];
+        if (!pChr)
+          continue;
+        if (pChr->canRead() && r == w.batchNext)
+          break;
+        const NimBLEUUID &chrUuid = pChr->getUUID();
+
+        uint8_t charProp = 0x00;
+        if (pChr->canRead())
+          charProp = charProp | BLE_GATT_CHR_PROP_READ;
+        if (pChr->canBroadcast())
+          charProp = charProp | BLE_GATT_CHR_PROP_BROADCAST;
+        if (pChr->canIndicate())
+          charProp = charProp | BLE_GATT_CHR_PROP_INDICATE;
+        if (pChr->canNotify())
+          charProp = charProp | BLE_GATT_CHR_PROP_NOTIFY;
+        if (pChr->canWrite())
+          charProp = charProp | BLE_GATT_CHR_PROP_WRITE;
+        if (pChr->canWriteNoResponse())
+          charProp = charProp | BLE_GATT_CHR_PROP_WRITE_NO_RSP;
+
+        GattCacheChr *cached = gattLayoutAdd(w.layout, svcUuid.getValue(), svcUuid.bitSize() / 8,
+                                             chrUuid.getValue(), chrUuid.bitSize() / 8,
+                                             charProp, pChr->getHandle());
+        logCharacteristic(w, tree, svcUuid.getValue(), svcUuid.bitSize() / 8,
+                          chrUuid.getValue(), chrUuid.bitSize() / 8, charProp,
+                          pChr->canRead() ? &w.batch[r++] : nullptr, cached);
       }
     }
   }
+}
+
+// True if a cached layout entry needs a read on this walk
+bool needsRead(const GattCacheChr &c)
+{
+  return (c.prop & BLE_GATT_CHR_PROP_READ) && !(c.flags & GATT_CACHE_READ_FAILED) && !gattCacheReusable(c);
+}
+
+// Called by the NimBLE host task for each characteristic verifyLayout()
+// discovers, and once more when the discovery is over
+int onVerifyChr(uint16_t connHandle, const struct ble_gatt_error *error, const struct ble_gatt_chr *chr, void *arg)
+{
+  Walker *w = (Walker *)arg;
+  if (error->status == 0 && chr)
+  {
+    NimBLEUUID uuid(chr->uuid);
+    if (gattLayoutHas(w->layout, chr->val_handle, uuid.getValue(), uuid.bitSize() / 8,
+                      chr->properties & WALK_CHR_PROPS))
+      w->verifyFound++;
+    else
+      w->verifyMismatch = true;
+    return 0;
+  }
+  w->verifyStatus = error->status;
+  xTaskNotify(w->task, WALK_EVT_DISCOVERED, eSetBits);
+  return 0;
+}
 
-  // Disconnect cleanly — call once and wait
-  if (pClient->isConnected())
+// Check w.layout against the connected device: every characteristic has to
+// be at the cached handle, with the same UUID and properties, and the device
+// can't have any others. One discovery over all handles, without the service
+// discovery and attribute objects of a full walk.
+bool verifyLayout(Walker &w)
+{
+  w.verifyFound = 0;
+  w.verifyMismatch = false;
+  w.verifyStatus = 0;
+  int rc;
+  while ((rc = ble_gattc_disc_all_chrs(w.pClient->getConnHandle(), 1, 0xFFFF, onVerifyChr, &w)) == BLE_HS_ENOMEM &&
+         !walkOver(w))
   {
-    pClient->disconnect();
-    unsigned long timeout = millis() + 3000;
-    while (pClient->isConnected() && millis() < timeout)
+    // Out of GATT procedures, wait for one to free up
+    vTaskDelay(1);
+  }
+  if (rc != 0)
+  {
+    return false;
+  }
+  int32_t left = w.deadline - millis();
+  if (!waitWalkEvents(w, WALK_EVT_DISCOVERED, left > 0 ? pdMS_TO_TICKS(left) : 0))
+  {
+    // Same as runBatch(), dropping the link ends the discovery
+    w.pClient->disconnect();
+    waitWalkEvents(w, WALK_EVT_DISCOVERED, portMAX_DELAY);
+    return false;
+  }
+  return w.verifyStatus == BLE_HS_EDONE && !w.verifyMismatch && w.verifyFound == w.layout.count;
+}
+
+// Walk a connected client from the cached layout in w.layout once the device
+// is found to match it: values that are known to stay the same are taken from
+// the cache and the rest is read by handle. Returns false, with nothing
+// logged, if the device doesn't match the layout.
+bool walkCached(Walker &w, int tree)
+{
+  if (!verifyLayout(w))
+  {
+    return false;
+  }
+  uint8_t next = 0;
+  while (next < w.layout.count && !walkOver(w))
+  {
+    w.batchCount = 0;
+    for (uint8_t i = next; i < w.layout.count && w.batchCount < WALK_BATCH_READS; i++)
     {
-      delay(10);
+      if (needsRead(w.layout.chrs[i]))
+        w.batch[w.batchCount++].handle = w.layout.chrs[i].handle;
     }
-    NimBLEDevice::deleteClient(pClient);
-  }
+    runBatch(w);
 
+    uint8_t r = 0;
+    for (; next < w.layout.count; next++)
+    {
+      GattCacheChr &c = w.layout.chrs[next];
+      const BatchRead *read = nullptr;
+      if (needsRead(c))
+      {
+        if (r == w.batchNext)
+          break;
+        read = &w.batch[r++];
+      }
+      logCharacteristic(w, tree, c.svc, c.svcLen, c.chr, c.chrLen, c.prop, read, &c);
+    }
+  }
   return true;
 }
 
+// Connects, walks GATT tree, reads, and leaves. Runs on a walker task, the
+// connection itself is driven by the client callbacks.
+bool connectToServer(Walker &w, const SchedCandidate &candidate)
+{
+  uint32_t bits;
+  // Forget events left over from the previous device
+  xTaskNotifyWait(0, WALK_EVT_ALL, &bits, 0);
+  w.events = 0;
+
+  metrics.connects.add();
+  xSemaphoreTake(radioLock, portMAX_DELAY);
+  disableBLEScanning();
+  // true = async, returns once the connection is initiated
+  bool started = w.pClient->connect(NimBLEAddress(candidate.addr, candidate.addrType), true, true);
+  uint32_t result = 0;
+  if (started)
+  {
+    result = waitWalkEvents(w, WALK_EVT_CONNECTED | WALK_EVT_CONNECT_FAILED,
+                            pdMS_TO_TICKS(WALK_CONNECT_TIMEOUT * 1000 + 500));
+    if (!result)
+    {
+      // The stack should have timed out by now, don't leave the attempt pending
+      w.pClient->cancelConnect();
+      waitWalkEvents(w, WALK_EVT_CONNECTED | WALK_EVT_CONNECT_FAILED, pdMS_TO_TICKS(500));
+    }
+  }
+  xSemaphoreGive(radioLock);
+
+  if (!(result & WALK_EVT_CONNECTED) || !w.pClient->isConnected())
+  {
+    metrics.connectFails.add();
+    // Give back the tree slot held for the walk
+    xSemaphoreTake(logMutex, portMAX_DELAY);
+    logs[activeLog].gatt.releaseTree();
+    xSemaphoreGive(logMutex);
+    return false;
+  }
+  uint32_t walkStart = millis();
+  w.deadline = walkStart + WALK_DEADLINE_MS;
+
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  int tree = logs[activeLog].gatt.beginTree(w.pClient->getPeerAddress().getVal());
+  bool cached = tree >= 0 && gattCache.lookup(candidate.fingerprint, w.layout);
+  xSemaphoreGive(logMutex);
+
+  if (tree >= 0)
+  {
+    bool matched = cached && walkCached(w, tree);
+    if (!matched)
+    {
+      // Nothing cached, or the cached layout is another model's: discover
+      gattLayoutBegin(w.layout, candidate.fingerprint);
+      walkTree(w, tree);
+    }
+
+    // Only a walk that finished in time on a live connection has a complete
+    // layout, it replaces one that didn't match. Otherwise a layout that
+    // didn't match is dropped and the next walk discovers again.
+    bool complete = !walkOver(w);
+    metrics.walkMs.record(millis() - walkStart);
+    xSemaphoreTake(logMutex, portMAX_DELAY);
+    if (complete)
+      gattCache.store(w.layout);
+    else if (cached && !matched)
+      gattCache.forget(candidate.fingerprint);
+    // No sync swaps the store while a walk is open
+    metrics.walkChrs.record(logs[activeLog].gatt.tree(tree).count);
+    xSemaphoreGive(logMutex);
+  }
+
+  // Disconnect cleanly — call once and wait for the callback
+  if (w.pClient->isConnected())
+  {
+    w.pClient->disconnect();
+    waitWalkEvents(w, WALK_EVT_DISCONNECTED, pdMS_TO_TICKS(3000));
+  }
+
+  return tree >= 0;
+}
+
+// Take the best device in view from the scheduler and start its rate limit.
+// Walkers call this with logMutex held, schedMutex is only ever taken after it.
+bool takeCandidate(SchedCandidate &candidate)
+{
+  xSemaphoreTake(schedMutex, portMAX_DELAY);
+  // Walkers come by at least every 100 ms, idle or not
+  rateLimitSweep(millis());
+  bool taken = false;
+  while (!taken && scheduler.take(candidate, millis()))
+  {
+    // Another walker may have taken the same device under a new address
+    taken = isConnectionAllowed(candidate.rateLimitId);
+    if (!taken)
+      metrics.rateLimited.add();
+  }
+  xSemaphoreGive(schedMutex);
+  return taken;
+}
+
+// Takes the best scoring device from the scheduler one at a time, WALK_WORKERS
+// of these run side by side so devices that show up together are walked together
+void walkTask(void *param)
+{
+  Walker &w = *(Walker *)param;
+  w.task = xTaskGetCurrentTaskHandle();
+  SchedCandidate candidate;
+  for (;;)
+  {
+    // A device is only taken, and its rate limit spent, with a tree slot held
+    // for its walk. A sync can't take the GattLog while a walk is open, let a
+    // waiting one through first.
+    xSemaphoreTake(logMutex, portMAX_DELAY);
+    bool room = !syncWanted && logs[activeLog].gatt.reserveTree();
+    bool taken = room && takeCandidate(candidate);
+    if (taken)
+      activeWalks++;
+    else if (room)
+      logs[activeLog].gatt.releaseTree();
+    xSemaphoreGive(logMutex);
+    if (!room)
+    {
+      // Every tree is taken until the next sync, nothing to walk into. The
+      // rate limits still have to be swept.
+      xSemaphoreTake(schedMutex, portMAX_DELAY);
+      rateLimitSweep(millis());
+      xSemaphoreGive(schedMutex);
+      vTaskDelay(pdMS_TO_TICKS(20));
+      continue;
+    }
+    if (!taken)
+    {
+      // Candidates can go out of view while we sleep, so look again now and then
+      xSemaphoreTake(candidateReady, pdMS_TO_TICKS(100));
+      continue;
+    }
+
+    // Devices are only queued once scanning runs, so NimBLE is up by now
+    if (!w.pClient)
+    {
+      w.pClient = NimBLEDevice::createClient();
+      w.pClient->setClientCallbacks(&w, false);
+      /** Set initial connection parameters: 15ms interval, 0 latency, 510ms timeout.
+       *  These settings are safe for 3 clients to connect reliably.
+       *  Min interval: 12 * 1.25ms = 15, Max interval: 12 * 1.25ms = 15, 0 latency, 51 * 10ms = 510ms timeout
+       */
+      w.pClient->setConnectionParams(12, 12, 0, 51);
+      w.pClient->setConnectTimeout(WALK_CONNECT_TIMEOUT);
+    }
+
+    bool walked = connectToServer(w, candidate);
+
+    xSemaphoreTake(logMutex, portMAX_DELAY);
+    activeWalks--;
+    xSemaphoreGive(logMutex);
+
+    xSemaphoreTake(schedMutex, portMAX_DELAY);
+    scheduler.result(candidate.fingerprint, walked, millis());
+    xSemaphoreGive(schedMutex);
+
+    Serial.printf("GATT walk %s %s\n", NimBLEAddress(candidate.addr, candidate.addrType).toString().c_str(),
+                  walked ? "done." : "fail.");
+  }
+}
+
+// Interval/window leave radio time for WiFi at every level. Active scans
+// probe devices for 31 more bytes of manufacturer data pre-connection.
+void configureScan(NimBLEScan *pScan, const ScanSettings &settings)
+{
+  pScan->setInterval(scanLevels[settings.level].interval);
+  pScan->setWindow(scanLevels[settings.level].window);
+  pScan->setActiveScan(settings.active);
+  pScan->setPhy(settings.allPhys ? NimBLEScan::Phy::SCAN_ALL : NimBLEScan::Phy::SCAN_1M);
+}
+
+// Retune the scan from the period since the last call, runs on the loop task
+void tuneScan()
+{
+  static uint32_t lastSeen = 0;
+  uint32_t now = millis();
+  uint32_t seen = metrics.advSeen.get();
+  ScanSettings next = scanTuner.update(now, now - lastTuneAt, seen - lastSeen, distinctSeen.take(), lastPullAt);
+  lastTuneAt = now;
+  lastSeen = seen;
+  if (next == scanSettings)
+  {
+    return;
+  }
+  // Settings only take effect on a fresh start. A pending connection has the
+  // scan off already, loop() starts it again with the new settings.
+  xSemaphoreTake(radioLock, portMAX_DELAY);
+  NimBLEScan *pScan = NimBLEDevice::getScan();
+  bool scanning = pScan->isScanning();
+  if (scanning)
+  {
+    pScan->stop();
+  }
+  scanSettings = next;
+  configureScan(pScan, scanSettings);
+  if (scanning)
+  {
+    pScan->start(scanTime, false, false);
+  }
+  xSemaphoreGive(radioLock);
+  Serial.printf("Scan %u/%u ms %s%s\n", scanLevels[next.level].interval, scanLevels[next.level].window,
+                next.active ? "active" : "passive", next.allPhys ? "" : " 1M");
+}
+
 // Configure BLE stack from scratch, set callbacks, and start an infinite scan
 void setupBLE()
 {
@@ -258,42 +976,342 @@ void setupBLE()
 
   pScan->setScanCallbacks(&scanCallbacks);
 
-  // Tuned interval/window for faster scanning while leaving radio time for WiFi
-  pScan->setInterval(45);
-  pScan->setWindow(15);
   // Don't store scan results in memory — callbacks only
   pScan->setMaxResults(0);
 
-  // Active scan probes devices for 31 bytes of manufacturer data pre-connection
-  pScan->setActiveScan(true);
-
-  pScan->setPhy(scanPhy);
+  configureScan(pScan, scanSettings);
 
   pScan->start(scanTime, false, false);
 }
 
-void disableBLEScanning()
+// FIX: volatile ensures compiler doesn't cache the value across tasks
+static volatile bool syncedLogs = false;
+
+// Number the records of a store that was just frozen
+void freezeLogStore(LogStore &store)
 {
-  // Stop scanning before connecting — GAP events misbehave when both are active
-  if (NimBLEDevice::getScan()->isScanning())
+  matchTrees(store.treeAdv, store.adv, store.gatt);
+  store.records = store.adv.size();
+  for (uint8_t t = 0; t < store.gatt.treeCount(); t++)
   {
-    NimBLEDevice::getScan()->stop();
-    while (NimBLEDevice::getScan()->isScanning())
+    if (store.treeAdv[t] < 0)
+      store.records++;
+  }
+  store.firstSeq = nextSeq;
+  nextSeq += store.records;
+  store.pending = store.records > 0;
+  spillSeq = nextSeq;
+}
+
+void rewindSpill(SpillCursor &cursor)
+{
+  xSemaphoreTake(spillMutex, portMAX_DELAY);
+  spill.rewind(cursor);
+  xSemaphoreGive(spillMutex);
+}
+
+// Read the next flash record of a pull, -1 once the spill log runs out
+int readSpill(SpillCursor &cursor)
+{
+  xSemaphoreTake(spillMutex, portMAX_DELAY);
+  int n = spill.read(cursor, spillRecord);
+  xSemaphoreGive(spillMutex);
+  return n;
+}
+
+// Tree sent as record k, for k past the advertisements
+uint8_t orphanTree(const LogStore &store, uint16_t k)
+{
+  uint16_t n = store.adv.size();
+  for (uint8_t t = 0; t < store.gatt.treeCount(); t++)
+  {
+    if (store.treeAdv[t] < 0 && n++ == k)
+      return t;
+  }
+  return 0;
+}
+
+// A pull stops at the first record that starts past maxBytes (0 = no limit),
+// but always carries one so a record bigger than that still gets through
+bool roomForRecord(const ChunkedPrint &out, uint32_t k, uint32_t first, uint32_t maxBytes)
+{
+  return k == first || maxBytes == 0 || out.sent() < maxBytes;
+}
+
+// Metrics as they were at the previous sync summary
+struct MetricsMark
+{
+  uint32_t at;
+  uint32_t advSeen;
+  uint32_t advOwned;
+  uint32_t onResultCount;
+  uint32_t onResultSum;
+  uint32_t rateLimited;
+  uint32_t schedBusy;
+  uint32_t connects;
+  uint32_t connectFails;
+  uint32_t walks;
+  uint32_t walkSum;
+  uint32_t chrSum;
+};
+
+uint32_t meanOf(uint32_t sum, uint32_t count)
+{
+  return count ? sum / count : 0;
+}
+
+// Fill the STATS values (rgwStatNames order) with what changed since the last call
+void takeSyncStats(uint32_t stats[RGW_STATS])
+{
+  static MetricsMark mark = {};
+  MetricsMark now;
+  now.at = millis();
+  now.advSeen = metrics.advSeen.get();
+  now.advOwned = metrics.advOwned.get();
+  now.onResultCount = metrics.onResultUs.count();
+  now.onResultSum = metrics.onResultUs.sum();
+  now.rateLimited = metrics.rateLimited.get();
+  now.schedBusy = metrics.schedBusy.get();
+  now.connects = metrics.connects.get();
+  now.connectFails = metrics.connectFails.get();
+  now.walks = metrics.walkMs.count();
+  now.walkSum = metrics.walkMs.sum();
+  now.chrSum = metrics.walkChrs.sum();
+
+  uint32_t walks = now.walks - mark.walks;
+  stats[0] = now.at - mark.at;
+  stats[1] = now.advSeen - mark.advSeen;
+  stats[2] = now.advOwned - mark.advOwned;
+  stats[3] = meanOf(now.onResultSum - mark.onResultSum, now.onResultCount - mark.onResultCount);
+  stats[4] = metrics.onResultUs.takePeak();
+  stats[5] = now.rateLimited - mark.rateLimited;
+  stats[6] = now.connects - mark.connects;
+  stats[7] = now.connectFails - mark.connectFails;
+  stats[8] = walks;
+  stats[9] = meanOf(now.walkSum - mark.walkSum, walks);
+  stats[10] = metrics.walkMs.takePeak();
+  stats[11] = meanOf(now.chrSum - mark.chrSum, walks);
+  stats[12] = lastSyncBytes;
+  stats[13] = lastSyncMs;
+  stats[14] = ESP.getMinFreeHeap();
+  stats[15] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  stats[16] = now.schedBusy - mark.schedBusy;
+  mark = now;
+}
+
+// The "stats" member of a JSON sync, same as RgwJsonWriter makes of a STATS frame
+void printStatsJson(ChunkedPrint &out)
+{
+  uint32_t stats[RGW_STATS];
+  takeSyncStats(stats);
+  for (uint8_t i = 0; i < RGW_STATS; i++)
+  {
+    out.print(i == 0 ? F(",\"stats\":{\"") : F(",\""));
+    out.print(rgwStatNames[i]);
+    out.print(F("\":"));
+    out.print(stats[i]);
+  }
+  out.print('}');
+}
+
+// Stream records first.. of a frozen store, then up to spilled flash records,
+// as JSON straight from the binary log in fixed size chunks, nothing
+// proportional to the log size is allocated. Returns the index of the first
+// record not sent.
+uint32_t sendLogJson(ChunkedPrint &out, const LogStore &store, uint16_t first, uint32_t spilled, uint32_t maxBytes)
+{
+  // Counters go out with the start of the store only, so resent records
+  // don't count them twice
+  bool head = first == 0;
+  out.begin("application/json");
+  out.print(F("{\"mac\":\""));
+  out.print(scannerMac);
+  out.print(F("\",\"epoch\":"));
+  out.print(bootEpoch);
+  out.print(F(",\"now\":"));
+  out.print(millis());
+  out.print(F(",\"dropped\":"));
+  out.print(head ? store.dropped : 0);
+  out.print(F(",\"cache_hits\":"));
+  out.print(head ? store.cacheHits : 0);
+  out.print(F(",\"cache_misses\":"));
+  out.print(head ? store.cacheMisses : 0);
+  out.print(F(",\"logs\":["));
+  uint32_t total = store.records + spilled;
+  SpillCursor cursor;
+  rewindSpill(cursor);
+  bool sep = false;
+  uint32_t k = first;
+  for (; k < total && roomForRecord(out, k, first, maxBytes); k++)
+  {
+    if (k >= store.records)
     {
-      delay(1);
+      int n = readSpill(cursor);
+      if (n < 0)
+      {
+        total = k;
+        break;
+      }
+      RgwAdv adv;
+      if (n < RGW_FRAME_HEADER_SIZE || spillRecord[0] != RGW_FRAME_ADV ||
+          !rgwParseAdv(spillRecord + RGW_FRAME_HEADER_SIZE, n - RGW_FRAME_HEADER_SIZE, adv))
+        continue;
+      AdvRecord rec;
+      advRecordFromRgw(rec, adv);
+      if (sep)
+        out.print(',');
+      sep = true;
+      printAdvJson(out, rec, store.firstSeq + k);
+      out.print('}');
+      continue;
     }
+    if (sep)
+      out.print(',');
+    sep = true;
+    if (k < store.adv.size())
+    {
+      printAdvJson(out, store.adv.at(k), store.firstSeq + k);
+      for (uint8_t t = 0; t < store.gatt.treeCount(); t++)
+      {
+        if (store.treeAdv[t] == (int32_t)k)
+        {
+          out.print(',');
+          printTreeJson(out, store.gatt, t);
+        }
+      }
+    }
+    else
+    {
+      uint8_t t = orphanTree(store, k);
+      printEntryJson(out, store.gatt.tree(t).addr, store.firstSeq + k);
+      printTreeJson(out, store.gatt, t);
+    }
+    out.print('}');
   }
+  out.print(']');
+  printStatsJson(out);
+  out.print(F(",\"last_seq\":"));
+  out.print(store.firstSeq + k - 1);
+  out.print(F(",\"more\":"));
+  out.print(k < total ? F("true") : F("false"));
+  out.print('}');
+  return k;
 }
 
-// FIX: volatile ensures compiler doesn't cache the value across server.handleClient() calls
-static volatile bool syncedLogs = false;
+// Compresses the records of a binary sync for loggers that ask, HTTP task only
+RgpPacker packer;
 
-void handlePost()
+// Stream records first.. of a frozen store, then up to spilled flash records,
+// in the compact rgw binary format, see rgwire.h. With pack the records go
+// out in PACKED frames, see rgpack.h. Returns the index of the first record
+// not sent.
+uint32_t sendLogWire(ChunkedPrint &out, const LogStore &store, uint16_t first, uint32_t spilled, uint32_t maxBytes,
+                     bool pack)
 {
-  disableBLEScanning();
-  String json = server.arg("plain");
+  uint8_t frame[RGW_MAX_FRAME];
+  size_t n;
+  bool head = first == 0;
+  PackPrint packed(out, packer);
+  Print &records = pack ? (Print &)packed : (Print &)out;
+  out.begin("application/octet-stream");
+  n = rgwWriteHeader(frame);
+  out.write(frame, n);
+  RgwInfo info = {scannerMacBytes, head ? store.dropped : 0, millis(),
+                  head ? store.cacheHits : 0, head ? store.cacheMisses : 0, bootEpoch};
+  n = rgwWriteInfo(frame, info);
+  out.write(frame, n);
+  if (pack)
+  {
+    packed.begin();
+  }
+  uint32_t total = store.records + spilled;
+  SpillCursor cursor;
+  rewindSpill(cursor);
+  uint32_t k = first;
+  for (; k < total && roomForRecord(out, k, first, maxBytes); k++)
+  {
+    if (k >= store.records)
+    {
+      // Spilled records are stored as ADV frames, they go out as they are
+      int len = readSpill(cursor);
+      if (len < 0)
+      {
+        total = k;
+        break;
+      }
+      n = rgwWriteSeq(frame, store.firstSeq + k);
+      packed.record();
+      records.write(frame, n);
+      records.write(spillRecord, len);
+      continue;
+    }
+    n = rgwWriteSeq(frame, store.firstSeq + k);
+    packed.record();
+    records.write(frame, n);
+    if (k < store.adv.size())
+    {
+      n = rgwWriteAdv(frame, rgwAdvFromRecord(store.adv.at(k)));
+      records.write(frame, n);
+      for (uint8_t t = 0; t < store.gatt.treeCount(); t++)
+      {
+        if (store.treeAdv[t] == (int32_t)k)
+          sendTreeWire(records, frame, store.gatt, t);
+      }
+    }
+    else
+    {
+      sendTreeWire(records, frame, store.gatt, orphanTree(store, k));
+    }
+  }
+  if (pack)
+  {
+    packed.finish();
+  }
+  uint32_t stats[RGW_STATS];
+  takeSyncStats(stats);
+  n = rgwWriteStats(frame, stats, RGW_STATS);
+  out.write(frame, n);
+  n = rgwWriteEnd(frame, store.firstSeq + k - 1, k < total);
+  out.write(frame, n);
+  return k;
+}
+
+// Numbering is left alone, records spilled after the store's keep theirs
+// until the next freeze
+void resetLogDoc(LogStore &store)
+{
+  store.adv.clear();
+  store.gatt.clear();
+  store.dropped = 0;
+  store.cacheHits = 0;
+  store.cacheMisses = 0;
+  store.pending = false;
+}
+
+// Move every record of a full log to flash rather than drop new ones. Runs
+// on the log task with logMutex held, walkers wait out the flash writes.
+void spillAdvLog(AdvLog &adv)
+{
+  static uint8_t frame[RGW_MAX_FRAME];
+  xSemaphoreTake(spillMutex, portMAX_DELAY);
+  for (uint16_t i = 0; i < adv.size(); i++)
+  {
+    size_t n = rgwWriteAdv(frame, rgwAdvFromRecord(adv.at(i)));
+    if (!spill.append(frame, n))
+      spillDroppedHits += adv.at(i).hits - 1;
+  }
+  xSemaphoreGive(spillMutex);
+  adv.clear();
+}
+
+// Answer a sync request, json being the logger's body, runs on the HTTP task
+// whichever transport the request came over
+void serveSync(const String &json, ChunkTarget &reply)
+{
+  uint32_t syncStart = millis();
+  lastPullAt = syncStart;
   Serial.println(json);
-  JsonDocument scannerInfo;
+  JsonDocument scannerInfo(&jsonArena);
   if (DeserializationError::Ok == deserializeJson(scannerInfo, json))
   {
     // Count and index may change as scanners come online/offline
@@ -303,24 +1321,418 @@ void handlePost()
     {
       scannerCount = sc;
     }
+    // Stable identities of all collectors, newer loggers send these
+    JsonArray scanners = scannerInfo["scanners"];
+    if (scanners.size() > 0)
+    {
+      uint8_t macs[OWNER_MAX_SCANNERS][6];
+      int count = 0;
+      for (JsonVariant mac : scanners)
+      {
+        if (count < OWNER_MAX_SCANNERS && ownerParseMac(mac | "", macs[count]))
+          count++;
+      }
+      portENTER_CRITICAL(&scannerMux);
+      memcpy(scannerMacs, macs, sizeof(macs));
+      scannerMacCount = count;
+      portEXIT_CRITICAL(&scannerMux);
+    }
 
-    String resp;
-    serializeJson(parentDoc, resp);
-    server.send(200, "application/json", resp);
+    // Loggers that keep a cursor send the last record they stored; one from
+    // before a reboot (other epoch) acknowledges nothing. Older loggers send
+    // no cursor, what they are sent is dropped right away as it always was.
+    bool acking = scannerInfo["after"].is<uint32_t>();
+    uint32_t after = 0;
+    if (acking && scannerInfo["epoch"] == bootEpoch)
+    {
+      after = scannerInfo["after"];
+    }
+    uint32_t maxBytes = scannerInfo["max"] | (uint32_t)0;
+
+    // Only the HTTP task touches the frozen store and spillSeq. Flash
+    // records are numbered after the store's, one being acknowledged means
+    // all of the store was too.
+    LogStore *frozen = &logs[activeLog ^ 1];
+    if (after >= spillSeq)
+    {
+      xSemaphoreTake(spillMutex, portMAX_DELAY);
+      spillSeq += spill.release(after - spillSeq + 1);
+      xSemaphoreGive(spillMutex);
+    }
+    if (frozen->pending && after >= frozen->firstSeq + frozen->records - 1)
+    {
+      resetLogDoc(*frozen);
+    }
+    // Flash only goes to loggers that acknowledge it, it would be gone on
+    // the first failed transfer otherwise
+    uint32_t spilled = 0;
+    if (acking && spillReady)
+    {
+      xSemaphoreTake(spillMutex, portMAX_DELAY);
+      spilled = spill.count();
+      xSemaphoreGive(spillMutex);
+    }
+    if (!frozen->pending)
+    {
+      xSemaphoreTake(logMutex, portMAX_DELAY);
+      // Walks add to the GattLog as they go, taking it now would cut their
+      // trees short. No new walk starts until the logger is back on its next sweep.
+      if (activeWalks > 0)
+      {
+        syncWanted = true;
+        xSemaphoreGive(logMutex);
+        if (spilled == 0)
+        {
+          reply.refuse(503, "Busy");
+          return;
+        }
+        // Flash can go now, the empty frozen store just numbers it
+      }
+      else
+      {
+        // Freeze the active store and switch logging over to the empty one.
+        // Scanning carries on, the radio is never taken away for HTTP.
+        frozen = &logs[activeLog];
+        activeLog ^= 1;
+        // Advertisements, and trees, characteristics or values a full GattLog lost
+        frozen->dropped = frozen->adv.droppedCount() + frozen->gatt.droppedCount() + advQueue.takeDropped();
+        frozen->cacheHits = gattCache.hits();
+        frozen->cacheMisses = gattCache.misses();
+        gattCache.resetCounts();
+        syncWanted = false;
+        xSemaphoreGive(logMutex);
+        xSemaphoreTake(spillMutex, portMAX_DELAY);
+        frozen->dropped += spill.takeDropped() + spillDroppedHits;
+        spillDroppedHits = 0;
+        xSemaphoreGive(spillMutex);
+      }
+      freezeLogStore(*frozen);
+    }
+    // Resume after the cursor, from the start if it is behind this store
+    uint16_t first = 0;
+    if (after >= frozen->firstSeq)
+    {
+      first = std::min<uint32_t>(after - frozen->firstSeq + 1, frozen->records);
+    }
+
+    // Loggers that understand the binary format ask for it, others get JSON.
+    // Packing is on top of the binary format.
+    ChunkedPrint out(reply);
+    int wire = scannerInfo["wire"] | 0;
+    bool pack = (scannerInfo["pack"] | 0) == RGP_VERSION;
+    uint32_t sent;
+    if (wire == RGW_VERSION)
+    {
+      sent = sendLogWire(out, *frozen, first, spilled, maxBytes, pack);
+    }
+    else
+    {
+      sent = sendLogJson(out, *frozen, first, spilled, maxBytes);
+    }
+    out.end();
+    lastSyncBytes = out.sent();
+    lastSyncMs = millis() - syncStart;
+    metrics.syncBytes.record(lastSyncBytes);
+    metrics.syncMs.record(lastSyncMs);
+    // Flash records took numbers past the store's
+    nextSeq = std::max(nextSeq, frozen->firstSeq + sent);
+    if (sent > 0)
+    {
+      syncRecordBytes = (3 * syncRecordBytes + lastSyncBytes / sent) / 4;
+    }
+    // Kept until the next request acknowledges it, the transfer or the
+    // logger's card write may still fail
+    if (!acking || !frozen->pending)
+    {
+      resetLogDoc(*frozen);
+    }
     syncedLogs = true;
   }
   else
   {
-    server.send(400, "text/plain", "Error");
+    reply.refuse(400, "Error");
   }
 }
 
-void resetLogDoc()
+// Runs on the HTTP task
+void handlePost()
 {
-  parentDoc.clear();
-  parentDoc.shrinkToFit();
-  parentDoc["mac"] = scannerMac;
-  logDoc = parentDoc["logs"].to<JsonObject>();
+  ServerTarget reply(server);
+  serveSync(server.arg("plain"), reply);
+}
+
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+// Sends a response to the logger over ESP-NOW, in frames (see rgnow.h)
+class NowTarget : public ChunkTarget
+{
+public:
+  NowTarget(const uint8_t mac[6], uint16_t session) : framer(toLogger, this), session(session)
+  {
+    memcpy(this->mac, mac, 6);
+  }
+
+  void begin(const char *contentType) override
+  {
+    framer.begin(RGN_RESPONSE, session);
+  }
+
+  // Once a frame is lost the rest goes nowhere, the logger drops the
+  // response and its cursor stays where it was
+  void send(const uint8_t *data, size_t length) override
+  {
+    framer.write(data, length);
+  }
+
+  void end() override
+  {
+    if (!framer.end())
+    {
+      Serial.println("ESP-NOW response lost");
+    }
+  }
+
+  void refuse(int code, const char *message) override
+  {
+    uint8_t status[2];
+    rgwPutU16(status, code);
+    framer.begin(RGN_REFUSED, session);
+    framer.write(status, sizeof(status));
+    framer.write((const uint8_t *)message, strlen(message));
+    framer.end();
+  }
+
+private:
+  RgnFramer framer;
+  uint16_t session;
+  uint8_t mac[6];
+
+  static bool toLogger(void *ctx, const uint8_t *frame, size_t length)
+  {
+    return rgnSend(((NowTarget *)ctx)->mac, frame, length);
+  }
+};
+
+static void onRequestBytes(void *ctx, uint8_t type, const uint8_t *data, size_t length)
+{
+  if (nowRequestLen + length > NOW_REQUEST_SIZE)
+  {
+    nowRequestLong = true;
+    return;
+  }
+  memcpy(nowRequest + nowRequestLen, data, length);
+  nowRequestLen += length;
+}
+
+// Sync requests over ESP-NOW, runs on the HTTP task like handlePost() so the
+// frozen store keeps its one owner
+void serveNow()
+{
+  static RgnReassembler request(onRequestBytes, nullptr);
+  RgnPacket packet;
+  while (rgnReceive(packet, 0))
+  {
+    RgnFrame frame;
+    if (!rgnParseFrame(packet.data, packet.length, frame) || frame.type != RGN_REQUEST)
+    {
+      continue;
+    }
+    // A new request starts with its first frame, the logger gives each its
+    // own session
+    if (frame.index == 0 && frame.session != nowSession && frame.session != nowAnswered)
+    {
+      request.begin(RGN_REQUEST, frame.session);
+      nowSession = frame.session;
+      memcpy(nowLogger, packet.mac, 6);
+      nowRequestLen = 0;
+      nowRequestLong = false;
+    }
+    if (memcmp(packet.mac, nowLogger, 6) != 0 || !request.feed(packet.data, packet.length))
+    {
+      continue;
+    }
+    if (request.failed())
+    {
+      // The logger asks again under a new session
+      nowSession = -1;
+    }
+    else if (request.complete())
+    {
+      nowAnswered = nowSession;
+      nowSession = -1;
+      NowTarget reply(nowLogger, frame.session);
+      if (nowRequestLong)
+      {
+        reply.refuse(400, "Error");
+        continue;
+      }
+      nowRequest[nowRequestLen] = 0;
+      serveSync(String(nowRequest), reply);
+    }
+  }
+}
+#endif
+
+void printCounter(ChunkedPrint &out, const char *name, uint32_t value)
+{
+  out.printf("# TYPE rg_%s counter\nrg_%s %lu\n", name, name, (unsigned long)value);
+}
+
+void printGauge(ChunkedPrint &out, const char *name, uint32_t value)
+{
+  out.printf("# TYPE rg_%s gauge\nrg_%s %lu\n", name, name, (unsigned long)value);
+}
+
+// Cumulative buckets, values are integers so bucket i is le 2^i - 1
+void printHistogram(ChunkedPrint &out, const char *name, const Histogram &h)
+{
+  out.printf("# TYPE rg_%s histogram\n", name);
+  uint32_t cumulative = 0;
+  for (uint8_t i = 0; i < METRIC_BUCKETS - 1; i++)
+  {
+    cumulative += h.bucket(i);
+    out.printf("rg_%s_bucket{le=\"%lu\"} %lu\n", name, (unsigned long)(Histogram::limit(i) - 1),
+               (unsigned long)cumulative);
+  }
+  cumulative += h.bucket(METRIC_BUCKETS - 1);
+  out.printf("rg_%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)cumulative);
+  out.printf("rg_%s_sum %lu\nrg_%s_count %lu\n", name, (unsigned long)h.sum(), name, (unsigned long)h.count());
+}
+
+// Prometheus text format, runs on the HTTP task
+void handleMetrics()
+{
+  ServerTarget reply(server);
+  ChunkedPrint out(reply);
+  out.begin("text/plain; version=0.0.4");
+  printGauge(out, "uptime_ms", millis());
+  printCounter(out, "adv_seen_total", metrics.advSeen.get());
+  printCounter(out, "adv_owned_total", metrics.advOwned.get());
+  printCounter(out, "rate_limited_total", metrics.rateLimited.get());
+  printCounter(out, "connects_total", metrics.connects.get());
+  printCounter(out, "connect_fails_total", metrics.connectFails.get());
+  printHistogram(out, "on_result_us", metrics.onResultUs);
+  printHistogram(out, "walk_ms", metrics.walkMs);
+  printHistogram(out, "walk_chrs", metrics.walkChrs);
+  printHistogram(out, "sync_bytes", metrics.syncBytes);
+  printHistogram(out, "sync_ms", metrics.syncMs);
+  printGauge(out, "heap_free_bytes", ESP.getFreeHeap());
+  printGauge(out, "heap_min_bytes", ESP.getMinFreeHeap());
+  printGauge(out, "heap_largest_bytes", heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  printGauge(out, "spill_records", spill.count());
+  printGauge(out, "scan_interval_ms", scanLevels[scanSettings.level].interval);
+  printGauge(out, "scan_window_ms", scanLevels[scanSettings.level].window);
+  printGauge(out, "scan_active", scanSettings.active);
+  printGauge(out, "json_arena_peak_bytes", jsonArena.peak());
+  printCounter(out, "json_heap_allocs_total", jsonArena.heapAllocations());
+  out.end();
+}
+
+// Put what the logger would find here into the softAP's beacons and probe
+// responses (see rgbeacon.h), the logger picks whom to pull from by it.
+// Runs on the loop task.
+void publishBacklog(uint32_t now)
+{
+  RgbStatus status = {};
+  uint32_t records = 0;
+  uint8_t fill = 0;
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  // A frozen store still pending was sent, the next pull acknowledges it
+  const LogStore &active = logs[activeLog];
+  records += active.adv.size() + active.gatt.treeCount();
+  // A full advertisement log spills to flash, without it new devices are dropped
+  if (!spillReady)
+    fill = active.adv.size() * 255 / ADV_LOG_CAPACITY;
+  fill = std::max<uint32_t>(fill, active.gatt.recordCount() * 255 / GATT_LOG_CAPACITY);
+  if (active.adv.droppedCount() > 0 || active.gatt.droppedCount() > 0)
+    status.flags |= RGB_FLAG_DROPPING;
+  xSemaphoreGive(logMutex);
+  if (spillReady)
+  {
+    xSemaphoreTake(spillMutex, portMAX_DELAY);
+    records += spill.count();
+    fill = std::max<uint32_t>(fill, spill.usedSegments() * 255 / spill.segmentCount());
+    if (spill.droppedCount() > 0 || spillDroppedHits > 0)
+      status.flags |= RGB_FLAG_DROPPING;
+    xSemaphoreGive(spillMutex);
+  }
+  status.fill = fill;
+  status.backlog = records * syncRecordBytes;
+  status.fullIn = beaconFill.update(fill, now);
+  lastBeaconAt = now;
+  if (beaconPublished && status.flags == beaconStatus.flags && status.fill == beaconStatus.fill &&
+      status.backlog == beaconStatus.backlog && status.fullIn == beaconStatus.fullIn)
+    return;
+  beaconStatus = status;
+  beaconPublished = true;
+  static uint8_t element[RGB_ELEMENT_SIZE];
+  rgbWriteElement(element, status);
+  // An element has to be taken off before another goes in its place
+  esp_wifi_set_vendor_ie(false, WIFI_VND_IE_TYPE_BEACON, WIFI_VND_IE_ID_0, nullptr);
+  esp_wifi_set_vendor_ie(true, WIFI_VND_IE_TYPE_BEACON, WIFI_VND_IE_ID_0, element);
+  esp_wifi_set_vendor_ie(false, WIFI_VND_IE_TYPE_PROBE_RESP, WIFI_VND_IE_ID_0, nullptr);
+  esp_wifi_set_vendor_ie(true, WIFI_VND_IE_TYPE_PROBE_RESP, WIFI_VND_IE_ID_0, element);
+}
+
+// Move everything the scan callback queued into the active log
+void drainAdvQueue()
+{
+  AdvSighting sighting;
+  while (advQueue.pop(sighting))
+  {
+    xSemaphoreTake(logMutex, portMAX_DELAY);
+    AdvLog &adv = logs[activeLog].adv;
+    // Out of records while the logger is away, move them to flash
+    if (spillReady && adv.full())
+    {
+      spillAdvLog(adv);
+    }
+    adv.put(sighting);
+    xSemaphoreGive(logMutex);
+  }
+}
+
+// Drains the scan callback's queue into the log, pinned to the core that
+// doesn't run the NimBLE host
+void logTask(void *param)
+{
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    drainAdvQueue();
+  }
+}
+
+// Serves the logger and OTA routes independently of scanning and walks, and
+// the logger's ESP-NOW requests when built for them
+void httpTask(void *param)
+{
+  for (;;)
+  {
+    server.handleClient();
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+    serveNow();
+#endif
+    // Yield instead of busy-spinning, handleClient() returns at once when idle
+    vTaskDelay(pdMS_TO_TICKS(2));
+  }
+}
+
+// Locks, record numbering, the spill log and both stores, before any task
+// that uses them starts
+void setupLogs()
+{
+  logMutex = xSemaphoreCreateMutex();
+  radioLock = xSemaphoreCreateMutex();
+  schedMutex = xSemaphoreCreateMutex();
+  candidateReady = xSemaphoreCreateBinary();
+  spillMutex = xSemaphoreCreateMutex();
+  jsonArena.begin(jsonArenaBuf, sizeof(jsonArenaBuf));
+  bootEpoch = esp_random();
+  // Records left in flash by the last boot go out with the first syncs
+  spillReady = spillDevice.begin() && spill.mount(spillDevice);
+  Serial.printf("Spill log: %s, %lu records\n", spillReady ? "ready" : "unavailable", (unsigned long)spill.count());
+  resetLogDoc(logs[0]);
+  resetLogDoc(logs[1]);
 }
 
 void setup()
@@ -344,9 +1756,17 @@ void setup()
   IPAddress myIP = WiFi.softAPIP();
   Serial.print("AP IP address: ");
   Serial.println(myIP);
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+  // Loggers built for ESP-NOW sync without joining the softAP, see rgnow.h
+  if (!rgnBegin(WIFI_IF_AP))
+  {
+    log_e("ESP-NOW init failed.");
+  }
+#endif
 
   // FIX: populate scannerMac from the actual softAP MAC address
   scannerMac = WiFi.softAPmacAddress();
+  WiFi.softAPmacAddress(scannerMacBytes);
   Serial.print("Scanner MAC: ");
   Serial.println(scannerMac);
 
@@ -379,14 +1799,24 @@ void setup()
       }
     } });
   server.on("/logger", HTTP_POST, handlePost);
+  server.on("/metrics", HTTP_GET, handleMetrics);
   server.begin();
 
-  resetLogDoc();
+  setupLogs();
+
+  // NimBLE's host task runs on PRO_CPU (core 0); logging and HTTP go on the
+  // other core next to loop()
+  xTaskCreatePinnedToCore(logTask, "log", 4096, nullptr, 2, &logTaskHandle, 1);
+  xTaskCreatePinnedToCore(httpTask, "http", 8192, nullptr, 1, nullptr, 1);
+  for (int i = 0; i < WALK_WORKERS; i++)
+  {
+    xTaskCreatePinnedToCore(walkTask, "walk", 6144, &walkers[i], 1, nullptr, 1);
+  }
 
   // Wait for first registration from the logger before starting to scan
   while (!syncedLogs)
   {
-    server.handleClient();
+    delay(10);
   }
   syncedLogs = false;
 
@@ -395,52 +1825,32 @@ void setup()
 
 void loop()
 {
-  while (true)
+  if (syncedLogs)
   {
-    if (doConnect)
-    {
-      digitalWrite(LED_BUILTIN, HIGH);
-      disableBLEScanning();
-      Serial.print("Attempting BTLE connection...");
-      doConnect = false;
-      if (connectToServer())
-      {
-        Serial.println("done.");
-        // Wait for the logger to collect the GATT tree before clearing the doc.
-        // Clearing while the logger is mid-read would clobber the tree entries.
-        while (!syncedLogs)
-        {
-          server.handleClient();
-        }
-        // FIX: reset immediately here so the scan restarts with a clean doc,
-        // not deferred to the next loop() iteration (which would accumulate duplicates)
-        syncedLogs = false;
-        resetLogDoc();
-      }
-      else
-      {
-        Serial.println("fail.");
-      }
-
-      advDeviceAddress = NimBLEAddress{};
-      digitalWrite(LED_BUILTIN, LOW);
-      break;
-    }
+    syncedLogs = false;
+    Serial.printf_P(PSTR("free heap memory: %d\n"), ESP.getFreeHeap());
+  }
 
-    server.handleClient();
+  if (millis() - lastTuneAt >= SCAN_TUNE_MS)
+  {
+    tuneScan();
+  }
 
-    if (syncedLogs)
-    {
-      syncedLogs = false;
-      resetLogDoc();
-      break;
-    }
+  if (millis() - lastBeaconAt >= BEACON_UPDATE_MS)
+  {
+    publishBacklog(millis());
   }
 
-  Serial.printf_P(PSTR("free heap memory: %d\n"), ESP.getFreeHeap());
-  if (!NimBLEDevice::getScan()->isScanning())
+  // Connection attempts stop the scan, pick it back up as soon as none is
+  // pending. Walks in progress don't need it off.
+  if (xSemaphoreTake(radioLock, 0) == pdTRUE)
   {
-    NimBLEDevice::getScan()->clearResults();
-    NimBLEDevice::getScan()->start(scanTime, false, false);
+    if (!NimBLEDevice::getScan()->isScanning())
+    {
+      NimBLEDevice::getScan()->clearResults();
+      NimBLEDevice::getScan()->start(scanTime, false, false);
+    }
+    xSemaphoreGive(radioLock);
   }
+  delay(10);
 }
@@ -0,0 +1,155 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ArduinoJson.h>
+
+// JSON Arena
+// ArduinoJson allocator that carves documents out of one buffer handed over
+// at boot instead of the heap, so parsing or building a request leaves no
+// holes behind. Blocks are bumped off the top; freeing the top one gives it
+// back and once every block is freed (the document is cleared or goes out of
+// scope) the whole buffer is free again. Freeing a block below the top only
+// counts it, its bytes come back with the rest.
+// A request that outgrows the buffer goes on to the heap and is counted, so
+// undersized arenas show up instead of failing. Not thread safe, keep each
+// arena to one task.
+
+// Define the alignment of every block, enough for the doubles in a document.
+#define JSON_ARENA_ALIGN 8
+
+class JsonArena : public ArduinoJson::Allocator
+{
+public:
+  JsonArena() : base(nullptr), capacity(0), top(0), last(NONE), live(0), arenaCount(0), heapCount(0), peakBytes(0) {}
+
+  // Take over bytes of buf, which has to stay around for good
+  void begin(void *buf, size_t bytes)
+  {
+    // Align the start, the blocks are aligned from there on
+    uintptr_t start = ((uintptr_t)buf + JSON_ARENA_ALIGN - 1) & ~(uintptr_t)(JSON_ARENA_ALIGN - 1);
+    base = buf ? (uint8_t *)start : nullptr;
+    capacity = buf && bytes > start - (uintptr_t)buf ? bytes - (start - (uintptr_t)buf) : 0;
+    top = 0;
+    last = NONE;
+    live = 0;
+  }
+
+  void *allocate(size_t size) override
+  {
+    size_t need = HEADER + roundUp(size);
+    if (need > capacity - top)
+    {
+      heapCount++;
+      return malloc(size);
+    }
+    uint8_t *block = base + top;
+    *(size_t *)block = size;
+    last = top;
+    top += need;
+    live++;
+    arenaCount++;
+    if (top > peakBytes)
+      peakBytes = top;
+    return block + HEADER;
+  }
+
+  void deallocate(void *ptr) override
+  {
+    if (!ptr)
+      return;
+    if (!owns(ptr))
+    {
+      free(ptr);
+      return;
+    }
+    live--;
+    if (live == 0)
+    {
+      top = 0;
+      last = NONE;
+    }
+    else if (isLast(ptr))
+    {
+      top = last;
+      last = NONE;
+    }
+  }
+
+  void *reallocate(void *ptr, size_t size) override
+  {
+    if (!ptr)
+      return allocate(size);
+    if (!owns(ptr))
+      return realloc(ptr, size);
+    // The top block grows or shrinks where it is, ArduinoJson's string
+    // builder and shrinkToFit() always work on the latest block
+    if (isLast(ptr) && roundUp(size) <= capacity - last - HEADER)
+    {
+      *(size_t *)(base + last) = size;
+      top = last + HEADER + roundUp(size);
+      if (top > peakBytes)
+        peakBytes = top;
+      return ptr;
+    }
+    size_t old = *(size_t *)((uint8_t *)ptr - HEADER);
+    void *moved = allocate(size);
+    if (!moved)
+      return nullptr;
+    memcpy(moved, ptr, old < size ? old : size);
+    deallocate(ptr);
+    return moved;
+  }
+
+  // Blocks served from the buffer and from the heap since boot
+  uint32_t arenaAllocations() const
+  {
+    return arenaCount;
+  }
+
+  uint32_t heapAllocations() const
+  {
+    return heapCount;
+  }
+
+  // Most of the buffer ever in use, and its size
+  size_t peak() const
+  {
+    return peakBytes;
+  }
+
+  size_t size() const
+  {
+    return capacity;
+  }
+
+private:
+  // Each block is preceded by its requested size, padded to the alignment
+  static const size_t HEADER = (sizeof(size_t) + JSON_ARENA_ALIGN - 1) & ~(size_t)(JSON_ARENA_ALIGN - 1);
+  static const size_t NONE = SIZE_MAX;
+
+  uint8_t *base;
+  size_t capacity;
+  size_t top;
+  // Offset of the top block, NONE once it was given back
+  size_t last;
+  uint32_t live;
+  uint32_t arenaCount;
+  uint32_t heapCount;
+  size_t peakBytes;
+
+  static size_t roundUp(size_t size)
+  {
+    return (size + JSON_ARENA_ALIGN - 1) & ~(size_t)(JSON_ARENA_ALIGN - 1);
+  }
+
+  bool owns(const void *ptr) const
+  {
+    return (const uint8_t *)ptr >= base && (const uint8_t *)ptr < base + capacity;
+  }
+
+  bool isLast(const void *ptr) const
+  {
+    return last != NONE && (const uint8_t *)ptr == base + last + HEADER;
+  }
+};
@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// Device ownership
+// Every device is logged and walked by one collector only. The owner is picked
+// by rendezvous hashing: each collector's softAP MAC is weighed against the
+// device id and the heaviest wins. When a collector joins or leaves, only the
+// devices it wins or held move, about 1/N of them; everything else keeps its
+// owner along with its rate limit. Plain C++ so the collector and host side
+// simulations agree.
+
+// Define the most collectors the logger sends in one list.
+#ifndef OWNER_MAX_SCANNERS
+#define OWNER_MAX_SCANNERS 15
+#endif
+
+// Weight of a collector for a device id
+uint32_t ownerWeight(uint32_t id, const uint8_t mac[6])
+{
+  // FNV-1a over the MAC, then the id is mixed in with the murmur3 finalizer
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < 6; i++)
+  {
+    h = (h ^ mac[i]) * 16777619u;
+  }
+  h ^= id;
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+// Index of the collector that owns id, -1 if there are none
+int ownerOf(uint32_t id, const uint8_t macs[][6], int count)
+{
+  int best = -1;
+  uint32_t bestWeight = 0;
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t w = ownerWeight(id, macs[i]);
+    // Ties go to the lower MAC so every collector agrees regardless of order
+    if (best < 0 || w > bestWeight || (w == bestWeight && memcmp(macs[i], macs[best], 6) < 0))
+    {
+      best = i;
+      bestWeight = w;
+    }
+  }
+  return best;
+}
+
+// Parse "AA:BB:CC:DD:EE:FF" (either case), returns false if it isn't a MAC
+bool ownerParseMac(const char *text, uint8_t mac[6])
+{
+  for (int i = 0; i < 6; i++)
+  {
+    uint8_t b = 0;
+    for (int j = 0; j < 2; j++)
+    {
+      char c = *text++;
+      b <<= 4;
+      if (c >= '0' && c <= '9')
+        b |= c - '0';
+      else if (c >= 'a' && c <= 'f')
+        b |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+        b |= c - 'A' + 10;
+      else
+        return false;
+    }
+    mac[i] = b;
+    if (*text++ != (i < 5 ? ':' : '\0'))
+      return false;
+  }
+  return true;
+}
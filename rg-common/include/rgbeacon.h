@@ -0,0 +1,115 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "rgwire.h"
+
+// RG Beacon
+// What a collector holds for the logger, carried in a vendor specific element
+// of its softAP beacons and probe responses so the logger learns it from the
+// scan it makes anyway, without connecting. The element is
+//   id 0xDD length oui(3) type payload
+// with the payload
+//   version(u8) flags(u8) fill(u8) reserved(u8) backlog(u32 LE) fullIn(u16 LE)
+// backlog is about how many bytes a logger would pull to empty the collector,
+// fill how close (of 255) the store that drops records first is to full, and
+// fullIn the seconds until it is at the rate it filled lately, RGB_NEVER if
+// it isn't filling. RGB_FLAG_DROPPING is set once records were dropped since
+// the last sync.
+
+// Define the OUI the element goes under, a locally administered one.
+#define RGB_OUI_0 0x02
+#define RGB_OUI_1 0x52
+#define RGB_OUI_2 0x47
+#define RGB_OUI_TYPE 0x01
+#define RGB_VERSION 1
+#define RGB_ELEMENT_ID 0xDD
+#define RGB_PAYLOAD_SIZE 10
+// Whole element, id and length included
+#define RGB_ELEMENT_SIZE (2 + 4 + RGB_PAYLOAD_SIZE)
+#define RGB_FLAG_DROPPING 0x01
+#define RGB_NEVER 0xFFFF
+
+// Structure to hold what a beacon says about its collector's backlog
+struct RgbStatus
+{
+  uint8_t flags;
+  uint8_t fill;
+  uint32_t backlog;
+  uint16_t fullIn;
+};
+
+// The element for status, RGB_ELEMENT_SIZE bytes
+size_t rgbWriteElement(uint8_t *out, const RgbStatus &status)
+{
+  out[0] = RGB_ELEMENT_ID;
+  out[1] = RGB_ELEMENT_SIZE - 2;
+  out[2] = RGB_OUI_0;
+  out[3] = RGB_OUI_1;
+  out[4] = RGB_OUI_2;
+  out[5] = RGB_OUI_TYPE;
+  uint8_t *p = out + 6;
+  p[0] = RGB_VERSION;
+  p[1] = status.flags;
+  p[2] = status.fill;
+  p[3] = 0;
+  rgwPutU32(p + 4, status.backlog);
+  rgwPutU16(p + 8, status.fullIn);
+  return RGB_ELEMENT_SIZE;
+}
+
+// Read a vendor element starting at its id, false if it isn't ours or is
+// from a version this doesn't know. Later versions only add to the end.
+bool rgbParseElement(const uint8_t *data, size_t length, RgbStatus &status)
+{
+  if (length < RGB_ELEMENT_SIZE || data[0] != RGB_ELEMENT_ID || data[1] < RGB_ELEMENT_SIZE - 2 ||
+      (size_t)data[1] + 2 > length)
+    return false;
+  if (data[2] != RGB_OUI_0 || data[3] != RGB_OUI_1 || data[4] != RGB_OUI_2 || data[5] != RGB_OUI_TYPE)
+    return false;
+  const uint8_t *p = data + 6;
+  if (p[0] < RGB_VERSION)
+    return false;
+  status.flags = p[1];
+  status.fill = p[2];
+  status.backlog = rgwGetU32(p + 4);
+  status.fullIn = rgwGetU16(p + 8);
+  return true;
+}
+
+// Turns a store's fill, sampled now and then, into the seconds until it is
+// full. Only growth is followed, a sync emptying the store leaves the rate as
+// it was.
+class RgbFillRate
+{
+public:
+  RgbFillRate() : lastFill(0), lastAt(0), started(false), perHour(0) {}
+
+  // fill of 255 at now (ms), returns the seconds until 255
+  uint16_t update(uint8_t fill, uint32_t now)
+  {
+    if (started && fill >= lastFill && now != lastAt)
+    {
+      // Fill per hour so slow growth doesn't round to nothing
+      uint32_t rate = (uint32_t)(fill - lastFill) * 3600000u / (now - lastAt);
+      // Weigh the new sample a quarter
+      perHour = (3 * perHour + rate) / 4;
+    }
+    started = true;
+    lastFill = fill;
+    lastAt = now;
+    if (fill == 255)
+      return 0;
+    if (perHour == 0)
+      return RGB_NEVER;
+    uint32_t seconds = (uint32_t)(255 - fill) * 3600u / perHour;
+    return seconds < RGB_NEVER ? seconds : RGB_NEVER - 1;
+  }
+
+private:
+  uint8_t lastFill;
+  uint32_t lastAt;
+  bool started;
+  uint32_t perHour;
+};
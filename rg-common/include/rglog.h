@@ -0,0 +1,317 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "rgwire.h"
+#include "spilllog.h"
+
+// RG Log
+// Frame format of the log segments rg-logger writes to the SD card, and a
+// reader for them shared by the host tools. Every record is one frame
+//   magic "RGLF" length(u32 LE) crc(u32 LE) kind(u8) reserved(u8)
+//   collector(6) epoch(u32 LE) seq(u32 LE) time(u32 LE) payload[length]
+// crc is spillCrc32 of the payload followed by the 20 header bytes after crc,
+// the header is only known once the payload is written. kind says what the
+// payload is: a JSON line without its newline, or an rgw body as the
+// collector sent it (packed, see rgpack.h). collector is the collector's MAC,
+// epoch and seq the cursor the body ends at (0 for JSON from older
+// collectors) and time the logger's clock in seconds.
+//
+// Zeros may sit between frames and are passed over. A frame that doesn't
+// check out is skipped by looking for the next magic after its start, so a
+// flipped bit or a torn write costs that frame and no more.
+//
+// A segment the logger moved on from ends in an index footer
+//   collectors[n][6] entries[count] trailer
+// with one entry per frame
+//   offset(u32 LE) time(u32 LE) seq(u32 LE) collector(u8) kind(u8) reserved(u16)
+// where collector indexes collectors, and the trailer in the last 16 bytes
+//   magic "RGLI" count(u16 LE) n(u8) reserved(u8) size(u32 LE) crc(u32 LE)
+// size is the footer's bytes, trailer included, and crc covers those before
+// it. A segment cut short by a reset has no footer and is read front to back.
+
+#define RGL_FRAME_HEADER 32
+#define RGL_KIND_JSON 1
+#define RGL_KIND_RGW 2
+// Define the most frames indexed per segment, the logger moves on to the next
+// segment once there are this many.
+#ifndef RGL_INDEX_ENTRIES
+#define RGL_INDEX_ENTRIES 512
+#endif
+// Define the most collectors indexed per segment, as for RGL_INDEX_ENTRIES.
+#ifndef RGL_INDEX_COLLECTORS
+#define RGL_INDEX_COLLECTORS 16
+#endif
+#define RGL_INDEX_ENTRY 16
+#define RGL_INDEX_TRAILER 16
+// Largest footer
+#define RGL_INDEX_MAX (6 * RGL_INDEX_COLLECTORS + RGL_INDEX_ENTRY * RGL_INDEX_ENTRIES + RGL_INDEX_TRAILER)
+// "RGLF" and "RGLI" read as little endian u32
+#define RGL_FRAME_MAGIC 0x464C4752u
+#define RGL_INDEX_MAGIC 0x494C4752u
+
+static_assert(RGL_INDEX_ENTRIES <= 0xFFFF, "RGL_INDEX_ENTRIES must fit the u16 count");
+static_assert(RGL_INDEX_COLLECTORS <= 0xFF, "RGL_INDEX_COLLECTORS must fit the u8 count");
+
+// Structure to hold what a frame header says about its payload
+struct RglFrame
+{
+  uint8_t kind;
+  uint8_t collector[6];
+  uint32_t epoch;
+  uint32_t seq;
+  uint32_t time;
+  // Set by rglParseFrame()
+  const uint8_t *payload;
+  uint32_t length;
+};
+
+// Header of a frame for length bytes of payload, payloadCrc is spillCrc32
+// of them
+size_t rglWriteHeader(uint8_t *out, const RglFrame &frame, uint32_t length, uint32_t payloadCrc)
+{
+  rgwPutU32(out, RGL_FRAME_MAGIC);
+  rgwPutU32(out + 4, length);
+  out[12] = frame.kind;
+  out[13] = 0;
+  memcpy(out + 14, frame.collector, 6);
+  rgwPutU32(out + 20, frame.epoch);
+  rgwPutU32(out + 24, frame.seq);
+  rgwPutU32(out + 28, frame.time);
+  rgwPutU32(out + 8, spillCrc32(out + 12, RGL_FRAME_HEADER - 12, payloadCrc));
+  return RGL_FRAME_HEADER;
+}
+
+// Size of the frame at data if it is whole and checks out, 0 otherwise
+size_t rglParseFrame(const uint8_t *data, size_t length, RglFrame &frame)
+{
+  if (length < RGL_FRAME_HEADER || rgwGetU32(data) != RGL_FRAME_MAGIC)
+    return 0;
+  uint32_t payloadLen = rgwGetU32(data + 4);
+  if (payloadLen > length - RGL_FRAME_HEADER)
+    return 0;
+  uint32_t crc = spillCrc32(data + RGL_FRAME_HEADER, payloadLen);
+  if (spillCrc32(data + 12, RGL_FRAME_HEADER - 12, crc) != rgwGetU32(data + 8))
+    return 0;
+  frame.kind = data[12];
+  memcpy(frame.collector, data + 14, 6);
+  frame.epoch = rgwGetU32(data + 20);
+  frame.seq = rgwGetU32(data + 24);
+  frame.time = rgwGetU32(data + 28);
+  frame.payload = data + RGL_FRAME_HEADER;
+  frame.length = payloadLen;
+  return RGL_FRAME_HEADER + payloadLen;
+}
+
+struct RglIndexEntry
+{
+  uint32_t offset;
+  uint32_t time;
+  uint32_t seq;
+  uint8_t collector;
+  uint8_t kind;
+};
+
+// A segment's index footer, built by the writer as frames go in and read
+// back from the end of a segment
+class RglIndex
+{
+public:
+  RglIndex()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    count = 0;
+    collectorCount = 0;
+  }
+
+  // No room for another frame from a collector not seen yet
+  bool full() const
+  {
+    return count == RGL_INDEX_ENTRIES || collectorCount == RGL_INDEX_COLLECTORS;
+  }
+
+  // The frame at offset of the segment, false if there is no room for it
+  bool add(uint32_t offset, const RglFrame &frame)
+  {
+    int c = find(frame.collector);
+    if (count == RGL_INDEX_ENTRIES || (c < 0 && collectorCount == RGL_INDEX_COLLECTORS))
+      return false;
+    if (c < 0)
+    {
+      c = collectorCount++;
+      memcpy(collectors[c], frame.collector, 6);
+    }
+    RglIndexEntry &entry = entries[count++];
+    entry.offset = offset;
+    entry.time = frame.time;
+    entry.seq = frame.seq;
+    entry.collector = c;
+    entry.kind = frame.kind;
+    return true;
+  }
+
+  // Bytes of the footer
+  size_t size() const
+  {
+    return 6 * collectorCount + RGL_INDEX_ENTRY * count + RGL_INDEX_TRAILER;
+  }
+
+  size_t write(uint8_t *out) const
+  {
+    uint8_t *p = out;
+    for (uint8_t c = 0; c < collectorCount; c++, p += 6)
+      memcpy(p, collectors[c], 6);
+    for (uint16_t i = 0; i < count; i++, p += RGL_INDEX_ENTRY)
+    {
+      rgwPutU32(p, entries[i].offset);
+      rgwPutU32(p + 4, entries[i].time);
+      rgwPutU32(p + 8, entries[i].seq);
+      p[12] = entries[i].collector;
+      p[13] = entries[i].kind;
+      rgwPutU16(p + 14, 0);
+    }
+    rgwPutU32(p, RGL_INDEX_MAGIC);
+    rgwPutU16(p + 4, count);
+    p[6] = collectorCount;
+    p[7] = 0;
+    rgwPutU32(p + 8, size());
+    rgwPutU32(p + 12, spillCrc32(out, p + 12 - out));
+    return size();
+  }
+
+  // Read the footer a segment of length bytes ends in, false if there is
+  // none or it doesn't check out
+  bool parse(const uint8_t *segment, size_t length)
+  {
+    reset();
+    if (length < RGL_INDEX_TRAILER)
+      return false;
+    const uint8_t *trailer = segment + length - RGL_INDEX_TRAILER;
+    uint16_t n = rgwGetU16(trailer + 4);
+    uint8_t c = trailer[6];
+    uint32_t bytes = rgwGetU32(trailer + 8);
+    if (rgwGetU32(trailer) != RGL_INDEX_MAGIC || n > RGL_INDEX_ENTRIES || c > RGL_INDEX_COLLECTORS ||
+        bytes != 6u * c + RGL_INDEX_ENTRY * n + RGL_INDEX_TRAILER || bytes > length)
+      return false;
+    const uint8_t *p = segment + length - bytes;
+    if (spillCrc32(p, bytes - 4) != rgwGetU32(trailer + 12))
+      return false;
+    for (uint8_t i = 0; i < c; i++, p += 6)
+      memcpy(collectors[i], p, 6);
+    for (uint16_t i = 0; i < n; i++, p += RGL_INDEX_ENTRY)
+    {
+      entries[i].offset = rgwGetU32(p);
+      entries[i].time = rgwGetU32(p + 4);
+      entries[i].seq = rgwGetU32(p + 8);
+      entries[i].collector = p[12];
+      entries[i].kind = p[13];
+      if (entries[i].collector >= c)
+        return false;
+    }
+    count = n;
+    collectorCount = c;
+    return true;
+  }
+
+  // Index of a collector's MAC in collectors, -1 if it isn't there
+  int find(const uint8_t collector[6]) const
+  {
+    for (uint8_t c = 0; c < collectorCount; c++)
+    {
+      if (memcmp(collectors[c], collector, 6) == 0)
+        return c;
+    }
+    return -1;
+  }
+
+  uint16_t count;
+  uint8_t collectorCount;
+  uint8_t collectors[RGL_INDEX_COLLECTORS][6];
+  RglIndexEntry entries[RGL_INDEX_ENTRIES];
+};
+
+// Walks the frames of a segment held in memory, front to back or from an
+// index entry's offset. Bytes passed over that aren't zeros, and frames that
+// start with the magic but don't check out, are counted.
+class RglReader
+{
+public:
+  // A segment with an index footer is only read up to it
+  RglReader(const uint8_t *segment, size_t length, const RglIndex *index = nullptr)
+      : data(segment), end(length), at(0), frameOffset(0), skipped(0), corrupt(0)
+  {
+    if (index)
+      end = length - index->size();
+  }
+
+  void seek(uint32_t offset)
+  {
+    at = offset < end ? offset : end;
+  }
+
+  // The next frame that checks out, false at the end of the segment
+  bool next(RglFrame &frame)
+  {
+    while (at < end)
+    {
+      if (data[at] == 0)
+      {
+        at++;
+        continue;
+      }
+      frameOffset = at;
+      size_t size = rglParseFrame(data + at, end - at, frame);
+      if (size > 0)
+      {
+        at += size;
+        return true;
+      }
+      if (end - at >= 4 && rgwGetU32(data + at) == RGL_FRAME_MAGIC)
+        corrupt++;
+      // On to the next magic
+      size_t from = at++;
+      while (at < end && !(data[at] == 'R' && end - at >= 4 && rgwGetU32(data + at) == RGL_FRAME_MAGIC))
+        at++;
+      skipped += countNonZero(from, at);
+    }
+    return false;
+  }
+
+  // Segment offset of the frame next() returned last
+  uint32_t offset() const
+  {
+    return frameOffset;
+  }
+
+  // Bytes passed over that weren't zeros, and damaged frames among them
+  size_t skippedBytes() const
+  {
+    return skipped;
+  }
+
+  uint32_t corruptFrames() const
+  {
+    return corrupt;
+  }
+
+private:
+  const uint8_t *data;
+  size_t end;
+  size_t at;
+  uint32_t frameOffset;
+  size_t skipped;
+  uint32_t corrupt;
+
+  size_t countNonZero(size_t from, size_t to) const
+  {
+    size_t n = 0;
+    for (size_t i = from; i < to; i++)
+      n += data[i] != 0;
+    return n;
+  }
+};
@@ -0,0 +1,295 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "rgwire.h"
+#include "spilllog.h"
+
+// RG Now
+// Carries a sync over ESP-NOW instead of HTTP, so the logger talks to each
+// collector by the MAC its sweep found without joining its softAP. The
+// request is the JSON body the logger would POST to /logger and the response
+// the body the collector would send back, both byte for byte, so the records
+// and the cursor work as over HTTP. Plain C++, the framing runs the same on a
+// host.
+//
+// A message goes out as frames of at most RGN_MAX_FRAME bytes, ESP-NOW's
+// limit:
+//   'R' 'N' type(u8) flags(u8) session(u16 LE) index(u16 LE) payload
+// index counts up from 0 within the message. The last frame has
+// RGN_FLAG_LAST and ends with a trailer
+//   length(u32 LE) crc(u32 LE)
+// of the whole message, crc being spillCrc32 of it. Frames go out one at a
+// time, each only after the one before was acknowledged, so they arrive in
+// order; one sent again because its acknowledgement was lost arrives twice.
+// The logger picks a new session for each request and the collector answers
+// under the same one. A refused request (HTTP's 503 or 400) is answered with
+// an RGN_REFUSED message of the status code (u16 LE) and its text.
+
+// Define the transports a sync can go over, both firmwares have to be built
+// with the same RG_TRANSPORT.
+#define RG_TRANSPORT_HTTP 0
+#define RG_TRANSPORT_ESPNOW 1
+#ifndef RG_TRANSPORT
+#define RG_TRANSPORT RG_TRANSPORT_HTTP
+#endif
+
+// Define the most bytes of one frame, ESP_NOW_MAX_DATA_LEN.
+#define RGN_MAX_FRAME 250
+#define RGN_HEADER_SIZE 8
+#define RGN_TRAILER_SIZE 8
+#define RGN_MAX_PAYLOAD (RGN_MAX_FRAME - RGN_HEADER_SIZE)
+#define RGN_REQUEST 1
+#define RGN_RESPONSE 2
+#define RGN_REFUSED 3
+#define RGN_FLAG_LAST 0x01
+
+static_assert(RG_TRANSPORT == RG_TRANSPORT_HTTP || RG_TRANSPORT == RG_TRANSPORT_ESPNOW,
+              "RG_TRANSPORT must be RG_TRANSPORT_HTTP or RG_TRANSPORT_ESPNOW");
+
+// Structure to hold the header of one frame
+struct RgnFrame
+{
+  uint8_t type;
+  uint8_t flags;
+  uint16_t session;
+  uint16_t index;
+  const uint8_t *payload;
+  size_t length;
+};
+
+// Read the header of a frame, false if it isn't one
+bool rgnParseFrame(const uint8_t *data, size_t length, RgnFrame &frame)
+{
+  if (length < RGN_HEADER_SIZE || length > RGN_MAX_FRAME || data[0] != 'R' || data[1] != 'N')
+    return false;
+  frame.type = data[2];
+  frame.flags = data[3];
+  frame.session = rgwGetU16(data + 4);
+  frame.index = rgwGetU16(data + 6);
+  frame.payload = data + RGN_HEADER_SIZE;
+  frame.length = length - RGN_HEADER_SIZE;
+  // The last frame holds at least the trailer
+  return !(frame.flags & RGN_FLAG_LAST) || frame.length >= RGN_TRAILER_SIZE;
+}
+
+// Splits a message written in pieces of any size into frames and hands each
+// to emit as it fills. Takes one frame of RAM however long the message is.
+class RgnFramer
+{
+public:
+  // Sends one frame, returns false if it couldn't be delivered
+  typedef bool (*Emit)(void *ctx, const uint8_t *frame, size_t length);
+
+  RgnFramer(Emit emit, void *ctx) : emit(emit), ctx(ctx)
+  {
+    begin(0, 0);
+  }
+
+  // Before each message
+  void begin(uint8_t type, uint16_t session)
+  {
+    this->type = type;
+    this->session = session;
+    index = 0;
+    len = RGN_HEADER_SIZE;
+    total = 0;
+    crc = 0;
+    broken = false;
+  }
+
+  // Takes nothing once a frame couldn't be delivered
+  bool write(const uint8_t *data, size_t length)
+  {
+    if (broken)
+      return false;
+    total += length;
+    crc = spillCrc32(data, length, crc);
+    while (length > 0)
+    {
+      // A full frame is held back until more comes, the last one is only
+      // known at end()
+      if (len == RGN_MAX_FRAME && !send(0))
+        return false;
+      size_t room = RGN_MAX_FRAME - len;
+      size_t take = length < room ? length : room;
+      memcpy(frame + len, data, take);
+      len += take;
+      data += take;
+      length -= take;
+    }
+    return true;
+  }
+
+  // Send what is left with the trailer, returns true if the whole message
+  // was delivered
+  bool end()
+  {
+    if (broken)
+      return false;
+    if (RGN_MAX_FRAME - len < RGN_TRAILER_SIZE && !send(0))
+      return false;
+    rgwPutU32(frame + len, total);
+    rgwPutU32(frame + len + 4, crc);
+    len += RGN_TRAILER_SIZE;
+    return send(RGN_FLAG_LAST);
+  }
+
+  bool failed() const
+  {
+    return broken;
+  }
+
+  // Frames sent so far
+  uint16_t frames() const
+  {
+    return index;
+  }
+
+private:
+  Emit emit;
+  void *ctx;
+  uint8_t type;
+  uint16_t session;
+  uint16_t index;
+  uint8_t frame[RGN_MAX_FRAME];
+  size_t len;
+  uint32_t total;
+  uint32_t crc;
+  bool broken;
+
+  bool send(uint8_t flags)
+  {
+    frame[0] = 'R';
+    frame[1] = 'N';
+    frame[2] = type;
+    frame[3] = flags;
+    rgwPutU16(frame + 4, session);
+    rgwPutU16(frame + 6, index);
+    if (!emit(ctx, frame, len))
+    {
+      broken = true;
+      return false;
+    }
+    index++;
+    len = RGN_HEADER_SIZE;
+    return true;
+  }
+};
+
+// Puts a message back together from its frames and hands its bytes to
+// deliver as they arrive, so the receiver can stream it on like an HTTP
+// body. Frames of other sessions and repeats of one already taken are
+// ignored; a frame missing from the order fails the message, as do a length
+// or CRC in the trailer that don't match what was delivered. Bytes delivered
+// before that aren't taken back, the receiver drops them when the message
+// fails.
+class RgnReassembler
+{
+public:
+  // type is the message's, RGN_REFUSED instead of RGN_RESPONSE if it was
+  typedef void (*Deliver)(void *ctx, uint8_t type, const uint8_t *data, size_t length);
+
+  RgnReassembler(Deliver deliver, void *ctx) : deliver(deliver), ctx(ctx)
+  {
+    begin(0, 0);
+  }
+
+  // Before each message, of type (RGN_RESPONSE takes RGN_REFUSED too) and
+  // under session
+  void begin(uint8_t type, uint16_t session)
+  {
+    expected = type;
+    this->session = session;
+    got = 0;
+    next = 0;
+    total = 0;
+    crc = 0;
+    done = false;
+    broken = false;
+  }
+
+  // One frame as received, returns false if it wasn't part of the message
+  bool feed(const uint8_t *data, size_t length)
+  {
+    RgnFrame f;
+    if (done || broken || !rgnParseFrame(data, length, f) || f.session != session || !accepts(f.type))
+      return false;
+    if (f.index < next)
+      return false;
+    if (f.index > next || (next > 0 && f.type != got))
+    {
+      broken = true;
+      return true;
+    }
+    got = f.type;
+    next++;
+    bool last = f.flags & RGN_FLAG_LAST;
+    size_t n = last ? f.length - RGN_TRAILER_SIZE : f.length;
+    if (n > 0)
+    {
+      total += n;
+      crc = spillCrc32(f.payload, n, crc);
+      deliver(ctx, got, f.payload, n);
+    }
+    if (last)
+    {
+      done = true;
+      broken = rgwGetU32(f.payload + n) != total || rgwGetU32(f.payload + n + 4) != crc;
+    }
+    return true;
+  }
+
+  // The whole message arrived intact
+  bool complete() const
+  {
+    return done && !broken;
+  }
+
+  bool failed() const
+  {
+    return broken;
+  }
+
+  // Nothing more will be taken
+  bool finished() const
+  {
+    return done || broken;
+  }
+
+  // Whether any frame was taken yet
+  bool started() const
+  {
+    return next > 0;
+  }
+
+  // Type of the message, 0 until its first frame
+  uint8_t type() const
+  {
+    return got;
+  }
+
+  // Bytes delivered so far
+  uint32_t length() const
+  {
+    return total;
+  }
+
+private:
+  Deliver deliver;
+  void *ctx;
+  uint8_t expected;
+  uint8_t got;
+  uint16_t session;
+  uint16_t next;
+  uint32_t total;
+  uint32_t crc;
+  bool done;
+  bool broken;
+
+  bool accepts(uint8_t type) const
+  {
+    return type == expected || (expected == RGN_RESPONSE && type == RGN_REFUSED);
+  }
+};
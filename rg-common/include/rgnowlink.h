@@ -0,0 +1,133 @@
+#pragma once
+#include <Arduino.h>
+#include <esp_idf_version.h>
+#include <esp_now.h>
+#include <esp_wifi.h>
+
+#include "rgnow.h"
+
+// RG Now Link
+// Moves the frames of rgnow.h over ESP-NOW for either firmware. Frames come
+// in on the WiFi task and wait in a queue for the task that reads them, so
+// the callback never blocks. A frame goes out only once the one before it
+// was acknowledged or given up on, a frame ESP-NOW reports lost is sent
+// again up to RGN_SEND_TRIES times.
+
+// Define how many received frames wait for the reader. The collector sends
+// the next frame as soon as the logger's radio acknowledges one, the queue
+// covers the logger's card writes meanwhile.
+#ifndef RGN_QUEUE_FRAMES
+#define RGN_QUEUE_FRAMES 64
+#endif
+// Define how often a frame is sent before it is given up on.
+#ifndef RGN_SEND_TRIES
+#define RGN_SEND_TRIES 4
+#endif
+// Define how long to wait for ESP-NOW to report a frame sent.
+#ifndef RGN_SEND_WAIT_MS
+#define RGN_SEND_WAIT_MS 50
+#endif
+
+// Structure to hold a received frame and who it came from
+struct RgnPacket
+{
+  uint8_t mac[6];
+  uint8_t length;
+  uint8_t data[RGN_MAX_FRAME];
+};
+
+QueueHandle_t rgnQueue = nullptr;
+SemaphoreHandle_t rgnSent = nullptr;
+volatile bool rgnSendOk = false;
+wifi_interface_t rgnInterface;
+// Frames lost to a full queue
+volatile uint32_t rgnDropped = 0;
+
+static void rgnQueueFrame(const uint8_t *mac, const uint8_t *data, int length)
+{
+  if (length <= 0 || length > RGN_MAX_FRAME)
+    return;
+  RgnPacket packet;
+  memcpy(packet.mac, mac, 6);
+  packet.length = length;
+  memcpy(packet.data, data, length);
+  // Lost frames fail the message at the reader, it is asked for again
+  if (xQueueSend(rgnQueue, &packet, 0) != pdTRUE)
+    rgnDropped++;
+}
+
+// The send and receive callbacks changed arguments with ESP-IDF 5 and 5.5
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 5, 0)
+static void rgnOnSend(const esp_now_send_info_t *info, esp_now_send_status_t status)
+#else
+static void rgnOnSend(const uint8_t *mac, esp_now_send_status_t status)
+#endif
+{
+  rgnSendOk = status == ESP_NOW_SEND_SUCCESS;
+  xSemaphoreGive(rgnSent);
+}
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+static void rgnOnReceive(const esp_now_recv_info_t *info, const uint8_t *data, int length)
+{
+  rgnQueueFrame(info->src_addr, data, length);
+}
+#else
+static void rgnOnReceive(const uint8_t *mac, const uint8_t *data, int length)
+{
+  rgnQueueFrame(mac, data, length);
+}
+#endif
+
+// Once WiFi is up, peers are reached through interface (WIFI_IF_AP on a
+// collector, WIFI_IF_STA on the logger)
+bool rgnBegin(wifi_interface_t interface)
+{
+  rgnInterface = interface;
+  rgnQueue = xQueueCreate(RGN_QUEUE_FRAMES, sizeof(RgnPacket));
+  rgnSent = xSemaphoreCreateBinary();
+  if (!rgnQueue || !rgnSent || esp_now_init() != ESP_OK)
+    return false;
+  return esp_now_register_send_cb(rgnOnSend) == ESP_OK && esp_now_register_recv_cb(rgnOnReceive) == ESP_OK;
+}
+
+// Send one frame to mac on the current channel, false if it wasn't
+// acknowledged
+bool rgnSend(const uint8_t mac[6], const uint8_t *frame, size_t length)
+{
+  if (!esp_now_is_peer_exist(mac))
+  {
+    esp_now_peer_info_t peer = {};
+    memcpy(peer.peer_addr, mac, 6);
+    peer.channel = 0;
+    peer.ifidx = rgnInterface;
+    peer.encrypt = false;
+    if (esp_now_add_peer(&peer) != ESP_OK)
+      return false;
+  }
+  for (int tries = 0; tries < RGN_SEND_TRIES; tries++)
+  {
+    // A report for a frame given up on may still come
+    xSemaphoreTake(rgnSent, 0);
+    if (esp_now_send(mac, frame, length) != ESP_OK)
+    {
+      vTaskDelay(pdMS_TO_TICKS(2));
+      continue;
+    }
+    if (xSemaphoreTake(rgnSent, pdMS_TO_TICKS(RGN_SEND_WAIT_MS)) == pdTRUE && rgnSendOk)
+      return true;
+  }
+  return false;
+}
+
+// The next received frame, waiting up to timeoutMs for one
+bool rgnReceive(RgnPacket &packet, uint32_t timeoutMs)
+{
+  return xQueueReceive(rgnQueue, &packet, pdMS_TO_TICKS(timeoutMs)) == pdTRUE;
+}
+
+// Forget frames left over from earlier messages
+void rgnDrain()
+{
+  xQueueReset(rgnQueue);
+}
@@ -0,0 +1,415 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "rgwire.h"
+
+// rattagatta packed frames (rgp)
+// Streaming compression of an rgw body's records, shared by rg-collector
+// (packer), rg-logger (passes them through) and host tools (unpacker). Plain
+// C++ with no Arduino dependencies so it also builds on a host.
+//
+// A packed body is an rgw stream whose SEQ, ADV and GATT(_CACHED, _FAILED)
+// frames are carried inside PACKED frames; INFO, STATS and END stay plain so
+// a reader gets the cursor without unpacking anything.
+//
+// PACKED  records(u16 LE) tokens
+//
+// "records" counts the SEQ frames the packer was handed for this PACKED frame,
+// the sum over a body is its record count. Tokens are LZSS in groups: a flag
+// byte, then up to 8 items, bit i (LSB first) set for a match. A literal is
+// one byte, a match is a u16 LE holding (distance - 1) in the low
+// RGP_WINDOW_BITS and (length - RGP_MIN_MATCH) above. Distances reach back
+// into the previous PACKED frames of the same body: the unpacked bytes of a
+// body form one stream of frames with one window.
+//
+// Both ends start every body with the window's tail holding rgpDictionary
+// (and zeros before it), so even the first record can refer to common BLE
+// UUIDs, company ids and frame layouts.
+//
+// The logger asks for this with "pack":RGP_VERSION next to "wire" in its POST
+// body; a collector that doesn't know the key sends the records plain.
+
+#define RGP_VERSION 1
+
+// Define the window the packer looks back over, unpackers need as much RAM.
+#define RGP_WINDOW_BITS 11
+#define RGP_WINDOW (1 << RGP_WINDOW_BITS)
+#define RGP_MIN_MATCH 3
+#define RGP_MAX_MATCH (RGP_MIN_MATCH + (1 << (16 - RGP_WINDOW_BITS)) - 1)
+// Define the bytes of frames buffered before they are compressed.
+#ifndef RGP_BLOCK
+#define RGP_BLOCK 512
+#endif
+// Define the match finder's hash table size and how many earlier positions
+// with the same hash it tries.
+#define RGP_HASH_BITS 10
+#define RGP_CHAIN 8
+
+static_assert(RGP_WINDOW_BITS >= 8 && RGP_WINDOW_BITS <= 13, "RGP_WINDOW_BITS must leave room for the length");
+static_assert(RGP_WINDOW + RGP_BLOCK <= 32767, "positions must fit int16_t");
+
+// Window preset, byte strings as they show up inside rgw frames. Changing it
+// changes the format, bump RGP_VERSION.
+const uint8_t rgpDictionary[] = {
+    // Apple continuity, nearby and ANCS/AMS service UUIDs
+    0x66, 0x43, 0xae, 0x10, 0x79, 0x48, 0xf8, 0xa5, 0x91, 0x45, 0xb4, 0xbb, 0x78, 0x1e, 0x61, 0xd0,
+    0xae, 0x04, 0x5d, 0xdc, 0x43, 0xd3, 0x90, 0x93, 0x42, 0x45, 0x67, 0x49, 0xe0, 0x80, 0xa4, 0x9f,
+    0xd0, 0x00, 0x2d, 0x12, 0x1e, 0x4b, 0x0f, 0xa4, 0x99, 0x4e, 0xce, 0xb5, 0x31, 0xf4, 0x05, 0x79,
+    0xdc, 0xf8, 0x55, 0xad, 0x02, 0xc5, 0xf4, 0x8e, 0x3a, 0x43, 0x36, 0x0f, 0x2b, 0x50, 0xd3, 0x89,
+    // Bluetooth base UUID with a 16-bit UUID slot
+    0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    // Device information values
+    'A', 'p', 'p', 'l', 'e', ' ', 'I', 'n', 'c', '.', 'i', 'P', 'h', 'o', 'n', 'e',
+    'S', 'a', 'm', 's', 'u', 'n', 'g', ' ', 'E', 'l', 'e', 'c', 't', 'r', 'o', 'n', 'i', 'c', 's',
+    // Manufacturer data: Microsoft CDP, Samsung, Google, Tile
+    0x06, 0x00, 0x01, 0x09, 0x20, 0x02, 0x75, 0x00, 0x42, 0x04, 0x01, 0x01, 0xe0, 0x00, 0x00, 0x00,
+    0xed, 0xfe, 0x2c, 0xfe, 0x6f, 0xfd,
+    // Manufacturer data: Apple iBeacon, AirPods, AirPlay, handoff, nearby
+    // action, nearby info, Find My
+    0x4c, 0x00, 0x02, 0x15, 0x4c, 0x00, 0x07, 0x19, 0x01, 0x4c, 0x00, 0x09, 0x06, 0x03,
+    0x4c, 0x00, 0x0c, 0x0e, 0x00, 0x4c, 0x00, 0x0f, 0x05, 0xc0, 0x4c, 0x00, 0x10, 0x05, 0x01,
+    0x4c, 0x00, 0x10, 0x06, 0x4c, 0x00, 0x10, 0x07, 0x4c, 0x00, 0x12, 0x19, 0x00,
+    // GATT frames: battery, device information, generic attribute and access
+    0x03, 0x10, 0x00, 0x02, 0x0f, 0x18, 0x02, 0x19, 0x2a, 0x12, 0x01, 0x00,
+    0x03, 0x10, 0x00, 0x02, 0x0a, 0x18, 0x02, 0x50, 0x2a, 0x02, 0x07, 0x00,
+    0x02, 0x0a, 0x18, 0x02, 0x23, 0x2a, 0x02, 0x08, 0x00, 0x02, 0x0a, 0x18, 0x02, 0x24, 0x2a, 0x02,
+    0x02, 0x0a, 0x18, 0x02, 0x25, 0x2a, 0x02, 0x02, 0x0a, 0x18, 0x02, 0x26, 0x2a, 0x02,
+    0x02, 0x0a, 0x18, 0x02, 0x27, 0x2a, 0x02, 0x02, 0x0a, 0x18, 0x02, 0x28, 0x2a, 0x02,
+    0x02, 0x0a, 0x18, 0x02, 0x29, 0x2a, 0x02,
+    0x03, 0x0f, 0x00, 0x02, 0x01, 0x18, 0x02, 0x05, 0x2a, 0x20, 0x00, 0x00,
+    0x02, 0x01, 0x18, 0x02, 0x29, 0x2b, 0x0a, 0x01, 0x00, 0x02, 0x01, 0x18, 0x02, 0x2a, 0x2b, 0x02,
+    0x02, 0x00, 0x18, 0x02, 0x01, 0x2a, 0x02, 0x02, 0x00, 0x02, 0x00, 0x18, 0x02, 0x00, 0x2a, 0x02,
+    // ADV and SEQ frames: random address, no name, one hit and no series
+    0x02, 0x00, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x04, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02};
+
+static_assert(sizeof(rgpDictionary) <= RGP_WINDOW, "rgpDictionary must fit the window");
+
+// Compresses the record frames of one body into PACKED frames. Frames go in
+// with write() as they are encoded, each finished PACKED frame goes to the
+// sink. Uses a fixed buffer of window plus block and a hash chain over it,
+// nothing is allocated.
+class RgpPacker
+{
+public:
+  typedef void (*Sink)(void *ctx, const uint8_t *frame, size_t length);
+
+  RgpPacker() : sink(nullptr), ctx(nullptr)
+  {
+    reset();
+  }
+
+  // Start a body, output goes to sink
+  void begin(Sink sink, void *ctx)
+  {
+    this->sink = sink;
+    this->ctx = ctx;
+    reset();
+  }
+
+  // A record starts in what is written next
+  void markRecord()
+  {
+    records++;
+  }
+
+  void write(const uint8_t *data, size_t length)
+  {
+    while (length > 0)
+    {
+      size_t take = RGP_WINDOW + RGP_BLOCK - end;
+      if (take > length)
+        take = length;
+      memcpy(buf + end, data, take);
+      end += take;
+      data += take;
+      length -= take;
+      if (end == RGP_WINDOW + RGP_BLOCK)
+      {
+        compress();
+        slide();
+      }
+    }
+  }
+
+  // Compress what is buffered and send the last PACKED frame. Call before
+  // the plain frames that follow the records.
+  void finish()
+  {
+    compress();
+    slide();
+    if (outLen > RGW_FRAME_HEADER_SIZE + 2 || records > 0)
+      emit();
+  }
+
+  // Bytes handed to the packer and bytes of PACKED frames it sent
+  uint32_t bytesIn() const
+  {
+    return totalIn;
+  }
+
+  uint32_t bytesOut() const
+  {
+    return totalOut;
+  }
+
+private:
+  Sink sink;
+  void *ctx;
+  // History (up to RGP_WINDOW bytes) followed by input not compressed yet
+  uint8_t buf[RGP_WINDOW + RGP_BLOCK];
+  // Latest position with each hash and the one before it with the same hash
+  int16_t head[1 << RGP_HASH_BITS];
+  int16_t prev[RGP_WINDOW + RGP_BLOCK];
+  size_t start;
+  size_t end;
+  // Positions below this are in the hash chains
+  size_t hashed;
+  uint8_t out[RGW_MAX_FRAME];
+  size_t outLen;
+  size_t flagAt;
+  uint8_t flagBit;
+  uint16_t records;
+  uint32_t totalIn;
+  uint32_t totalOut;
+
+  void reset()
+  {
+    memset(buf, 0, RGP_WINDOW);
+    memcpy(buf + RGP_WINDOW - sizeof(rgpDictionary), rgpDictionary, sizeof(rgpDictionary));
+    for (size_t i = 0; i < (1 << RGP_HASH_BITS); i++)
+      head[i] = -1;
+    start = RGP_WINDOW;
+    end = RGP_WINDOW;
+    hashed = RGP_WINDOW - sizeof(rgpDictionary);
+    insertUpTo(RGP_WINDOW);
+    records = 0;
+    totalIn = 0;
+    totalOut = 0;
+    startFrame();
+  }
+
+  static uint32_t hash(const uint8_t *p)
+  {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - RGP_HASH_BITS);
+  }
+
+  // Chain every position below pos that has RGP_MIN_MATCH bytes after it
+  void insertUpTo(size_t pos)
+  {
+    for (; hashed < pos && hashed + RGP_MIN_MATCH <= end; hashed++)
+    {
+      uint32_t h = hash(buf + hashed);
+      prev[hashed] = head[h];
+      head[h] = hashed;
+    }
+  }
+
+  void compress()
+  {
+    totalIn += end - start;
+    size_t i = start;
+    while (i < end)
+    {
+      insertUpTo(i);
+      size_t bestLen = 0;
+      size_t bestDist = 0;
+      size_t limit = end - i < RGP_MAX_MATCH ? end - i : RGP_MAX_MATCH;
+      if (limit >= RGP_MIN_MATCH)
+      {
+        int32_t cand = head[hash(buf + i)];
+        for (int depth = 0; cand >= 0 && depth < RGP_CHAIN && i - cand <= RGP_WINDOW; depth++)
+        {
+          size_t len = 0;
+          while (len < limit && buf[cand + len] == buf[i + len])
+            len++;
+          if (len > bestLen)
+          {
+            bestLen = len;
+            bestDist = i - cand;
+            if (len == limit)
+              break;
+          }
+          cand = prev[cand];
+        }
+      }
+      if (bestLen >= RGP_MIN_MATCH)
+      {
+        putItem(true, (uint16_t)((bestDist - 1) | ((bestLen - RGP_MIN_MATCH) << RGP_WINDOW_BITS)));
+        i += bestLen;
+      }
+      else
+      {
+        putItem(false, buf[i]);
+        i++;
+      }
+    }
+    start = end;
+  }
+
+  // Keep the last RGP_WINDOW bytes as history, positions move down with them
+  void slide()
+  {
+    insertUpTo(end);
+    if (end <= RGP_WINDOW)
+      return;
+    size_t shift = end - RGP_WINDOW;
+    memmove(buf, buf + shift, RGP_WINDOW);
+    for (size_t i = 0; i < (1 << RGP_HASH_BITS); i++)
+      head[i] = head[i] >= (int32_t)shift ? head[i] - shift : -1;
+    for (size_t i = 0; i + shift < hashed; i++)
+      prev[i] = prev[i + shift] >= (int32_t)shift ? prev[i + shift] - shift : -1;
+    start -= shift;
+    end -= shift;
+    hashed -= shift;
+  }
+
+  void putItem(bool match, uint16_t value)
+  {
+    // A new group may need its flag byte as well as the item
+    if (outLen + 3 > RGW_FRAME_HEADER_SIZE + RGW_MAX_PAYLOAD)
+    {
+      emit();
+    }
+    if (flagBit == 8)
+    {
+      flagAt = outLen++;
+      out[flagAt] = 0;
+      flagBit = 0;
+    }
+    if (match)
+    {
+      out[flagAt] |= 1 << flagBit;
+      rgwPutU16(out + outLen, value);
+      outLen += 2;
+    }
+    else
+    {
+      out[outLen++] = (uint8_t)value;
+    }
+    flagBit++;
+  }
+
+  void emit()
+  {
+    rgwPutU16(out + RGW_FRAME_HEADER_SIZE, records);
+    records = 0;
+    size_t n = rgwFinishFrame(out, RGW_FRAME_PACKED, outLen - RGW_FRAME_HEADER_SIZE);
+    totalOut += n;
+    if (sink)
+      sink(ctx, out, n);
+    startFrame();
+  }
+
+  void startFrame()
+  {
+    outLen = RGW_FRAME_HEADER_SIZE + 2;
+    flagBit = 8;
+  }
+};
+
+// Unpacks the PACKED frames of one body and hands the frames inside to the
+// callback, like RgwDecoder does for plain ones. Holds the window and one
+// frame buffer.
+class RgpUnpacker
+{
+public:
+  RgpUnpacker(RgwDecoder::FrameCallback callback, void *ctx) : frames(callback, ctx)
+  {
+    reset();
+  }
+
+  // Start a body
+  void reset()
+  {
+    memset(window, 0, RGP_WINDOW - sizeof(rgpDictionary));
+    memcpy(window + RGP_WINDOW - sizeof(rgpDictionary), rgpDictionary, sizeof(rgpDictionary));
+    pos = 0;
+    pending = 0;
+    recordCount = 0;
+    bad = false;
+    frames.resetFrames();
+  }
+
+  // Feed the payload of one PACKED frame, returns false once the body is malformed
+  bool frame(const uint8_t *payload, size_t length)
+  {
+    if (bad)
+      return false;
+    if (length < 2)
+      return fail();
+    recordCount += rgwGetU16(payload);
+    size_t i = 2;
+    while (i < length)
+    {
+      uint8_t flags = payload[i++];
+      for (int bit = 0; bit < 8 && i < length; bit++)
+      {
+        if (flags & (1 << bit))
+        {
+          if (i + 2 > length)
+            return fail();
+          uint16_t v = rgwGetU16(payload + i);
+          i += 2;
+          size_t dist = (v & (RGP_WINDOW - 1)) + 1;
+          size_t len = (v >> RGP_WINDOW_BITS) + RGP_MIN_MATCH;
+          for (size_t k = 0; k < len; k++)
+            put(window[(pos - dist) & (RGP_WINDOW - 1)]);
+        }
+        else
+        {
+          put(payload[i++]);
+        }
+      }
+    }
+    flush();
+    if (frames.failed())
+      return fail();
+    return true;
+  }
+
+  // Records the PACKED frames so far said they hold
+  uint32_t records() const
+  {
+    return recordCount;
+  }
+
+  bool failed() const
+  {
+    return bad;
+  }
+
+private:
+  RgwDecoder frames;
+  uint8_t window[RGP_WINDOW];
+  size_t pos;
+  // Unpacked bytes not yet handed to the frame decoder
+  uint8_t chunk[64];
+  size_t pending;
+  uint32_t recordCount;
+  bool bad;
+
+  void put(uint8_t c)
+  {
+    window[pos & (RGP_WINDOW - 1)] = c;
+    pos++;
+    chunk[pending++] = c;
+    if (pending == sizeof(chunk))
+      flush();
+  }
+
+  void flush()
+  {
+    frames.feed(chunk, pending);
+    pending = 0;
+  }
+
+  bool fail()
+  {
+    bad = true;
+    return false;
+  }
+};
@@ -0,0 +1,847 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+// rattagatta wire format (rgw)
+// Compact binary sync payload shared by rg-collector (encoder) and rg-logger
+// (decoder). Plain C++ with no Arduino dependencies so it also builds on a host.
+//
+// Stream: "RGW" + version byte, then frames up to and including an END frame
+// Frame:  type (u8), payload length (u16 LE), payload
+//
+// INFO  mac[6] dropped(u32 LE) now(u32 LE) cacheHits(u32 LE) cacheMisses(u32 LE) epoch(u32 LE)
+// SEQ   seq(u32 LE), starts a record: the ADV and/or GATT frames up to the next SEQ
+// ADV   addr[6] addrType rssi(i8) flags nameLen name[nameLen] manLen man[manLen]
+//       hits(u16 LE) rssiMin(i8) rssiMax(i8) rssiMean(i8) first(u32 LE) last(u32 LE)
+//       rssiFirst(i8) seriesLen {dt drssi(i8)}[seriesLen]
+// GATT  addr[6] svcLen svc[svcLen] chrLen chr[chrLen] prop valLen(u16 LE) val[valLen]
+// GATT_CACHED same as GATT, the value was not read on this walk but served
+//       from the collector's GATT cache (gattcache.h)
+// GATT_FAILED same as GATT without a value: the read failed, or was skipped
+//       because the device refused it on an earlier walk
+// STATS count value(u32 LE)[count], collector telemetry in rgwStatNames order
+// END   last(u32 LE) more(u8), marks a complete transfer
+// PACKED SEQ, ADV and the GATT frames compressed, see rgpack.h
+//
+// Times are the collector's millis(), "now" is taken when the sync starts.
+// The cache counts are GATT cache lookups by walks since the previous sync.
+// "dropped" counts what full logs lost since then: advertisements, and GATT
+// trees, characteristics or values.
+//
+// Records are numbered from 1 and the numbers only go up while the collector
+// runs; epoch is drawn at boot so a logger can tell its cursor went stale.
+// "last" is the number of the last record sent (the acknowledged cursor if
+// none was), "more" is set when records after it are still waiting. The
+// logger sends "epoch" and "after":last back once the body is on its card,
+// which is what lets the collector drop the records.
+// The RSSI series starts at (first, rssiFirst); each sample adds dt ticks of
+// RGW_SERIES_TICK_MS and drssi to the previous one.
+//
+// STATS comes right before END. Counts and means cover the time since the
+// previous sync; readers skip values past the names they know, so new ones
+// can be appended without a version bump.
+//
+// Addresses and UUIDs are little endian, as NimBLE stores them. UUIDs are 2, 4
+// or 16 bytes. GATT frames follow the ADV frame of the same address when the
+// collector still holds one, so a reader can attach them as its "tree".
+// Readers that predate GATT_CACHED and GATT_FAILED skip those frames, they
+// never take a cached or missing value for one read from the device.
+//
+// The logger asks for this format with "wire":RGW_VERSION in its POST body; a
+// collector that doesn't know the key keeps answering with JSON. PACKED
+// frames are only sent when it asks for them too.
+
+#define RGW_VERSION 4
+
+#define RGW_FRAME_INFO 0x01
+#define RGW_FRAME_ADV 0x02
+#define RGW_FRAME_GATT 0x03
+#define RGW_FRAME_SEQ 0x04
+#define RGW_FRAME_STATS 0x05
+#define RGW_FRAME_PACKED 0x06
+#define RGW_FRAME_GATT_CACHED 0x07
+#define RGW_FRAME_GATT_FAILED 0x08
+#define RGW_FRAME_END 0x7F
+
+#define RGW_HEADER_SIZE 4
+#define RGW_FRAME_HEADER_SIZE 3
+// Longest attribute value allowed by the spec
+#define RGW_MAX_VALUE 512
+// Longest RSSI series in an ADV frame
+#define RGW_MAX_SERIES 64
+#define RGW_SERIES_TICK_MS 100
+// Largest payload of each frame type and of any frame
+#define RGW_MAX_GATT_PAYLOAD (6 + 1 + 16 + 1 + 16 + 1 + 2 + RGW_MAX_VALUE)
+#define RGW_MAX_ADV_PAYLOAD (11 + 2 * 255 + 15 + 2 * RGW_MAX_SERIES)
+#define RGW_MAX_PAYLOAD (RGW_MAX_ADV_PAYLOAD > RGW_MAX_GATT_PAYLOAD ? RGW_MAX_ADV_PAYLOAD : RGW_MAX_GATT_PAYLOAD)
+// Buffer size that fits any single frame
+#define RGW_MAX_FRAME (RGW_FRAME_HEADER_SIZE + RGW_MAX_PAYLOAD)
+
+// Names of the STATS values as they appear in the JSON "stats" object
+#define RGW_STATS 17
+const char *const rgwStatNames[RGW_STATS] = {
+    "interval_ms", "adv_seen", "adv_owned", "on_result_us_mean", "on_result_us_max",
+    "rate_limited", "connects", "connect_fails", "walks", "walk_ms_mean", "walk_ms_max",
+    "walk_chrs_mean", "last_sync_bytes", "last_sync_ms", "heap_min", "heap_largest", "sched_busy"};
+
+// GATT characteristic property bit for reads, same value as BLE_GATT_CHR_PROP_READ
+#define RGW_PROP_READ 0x02
+
+struct RgwInfo
+{
+  const uint8_t *mac;
+  uint32_t dropped;
+  uint32_t now;
+  uint32_t cacheHits;
+  uint32_t cacheMisses;
+  uint32_t epoch;
+};
+
+struct RgwAdv
+{
+  const uint8_t *addr;
+  uint8_t addrType;
+  int8_t rssi;
+  uint8_t flags;
+  const uint8_t *name;
+  uint8_t nameLen;
+  const uint8_t *man;
+  uint8_t manLen;
+  uint16_t hits;
+  int8_t rssiMin;
+  int8_t rssiMax;
+  int8_t rssiMean;
+  uint32_t first;
+  uint32_t last;
+  int8_t rssiFirst;
+  uint8_t seriesLen;
+  // Encoding reads the two arrays, parsing points series at the packed pairs
+  const uint8_t *seriesDt;
+  const int8_t *seriesDrssi;
+  const uint8_t *series;
+};
+
+struct RgwGatt
+{
+  const uint8_t *addr;
+  const uint8_t *svc;
+  uint8_t svcLen;
+  const uint8_t *chr;
+  uint8_t chrLen;
+  uint8_t prop;
+  const uint8_t *val;
+  uint16_t valLen;
+};
+
+// Encoding
+
+void rgwPutU16(uint8_t *p, uint16_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+}
+
+void rgwPutU32(uint8_t *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    p[i] = (v >> (8 * i)) & 0xFF;
+  }
+}
+
+uint16_t rgwGetU16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+uint32_t rgwGetU32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+size_t rgwWriteHeader(uint8_t *out)
+{
+  out[0] = 'R';
+  out[1] = 'G';
+  out[2] = 'W';
+  out[3] = RGW_VERSION;
+  return RGW_HEADER_SIZE;
+}
+
+size_t rgwFinishFrame(uint8_t *out, uint8_t type, size_t payloadLen)
+{
+  out[0] = type;
+  out[1] = payloadLen & 0xFF;
+  out[2] = (payloadLen >> 8) & 0xFF;
+  return RGW_FRAME_HEADER_SIZE + payloadLen;
+}
+
+size_t rgwWriteInfo(uint8_t *out, const RgwInfo &info)
+{
+  uint8_t *p = out + RGW_FRAME_HEADER_SIZE;
+  memcpy(p, info.mac, 6);
+  p += 6;
+  rgwPutU32(p, info.dropped);
+  p += 4;
+  rgwPutU32(p, info.now);
+  p += 4;
+  rgwPutU32(p, info.cacheHits);
+  p += 4;
+  rgwPutU32(p, info.cacheMisses);
+  p += 4;
+  rgwPutU32(p, info.epoch);
+  p += 4;
+  return rgwFinishFrame(out, RGW_FRAME_INFO, p - out - RGW_FRAME_HEADER_SIZE);
+}
+
+// Series longer than RGW_MAX_SERIES are cut short
+size_t rgwWriteAdv(uint8_t *out, const RgwAdv &adv)
+{
+  uint8_t seriesLen = adv.seriesLen > RGW_MAX_SERIES ? RGW_MAX_SERIES : adv.seriesLen;
+  uint8_t *p = out + RGW_FRAME_HEADER_SIZE;
+  memcpy(p, adv.addr, 6);
+  p += 6;
+  *p++ = adv.addrType;
+  *p++ = (uint8_t)adv.rssi;
+  *p++ = adv.flags;
+  *p++ = adv.nameLen;
+  memcpy(p, adv.name, adv.nameLen);
+  p += adv.nameLen;
+  *p++ = adv.manLen;
+  memcpy(p, adv.man, adv.manLen);
+  p += adv.manLen;
+  rgwPutU16(p, adv.hits);
+  p += 2;
+  *p++ = (uint8_t)adv.rssiMin;
+  *p++ = (uint8_t)adv.rssiMax;
+  *p++ = (uint8_t)adv.rssiMean;
+  rgwPutU32(p, adv.first);
+  p += 4;
+  rgwPutU32(p, adv.last);
+  p += 4;
+  *p++ = (uint8_t)adv.rssiFirst;
+  *p++ = seriesLen;
+  for (uint8_t i = 0; i < seriesLen; i++)
+  {
+    *p++ = adv.seriesDt[i];
+    *p++ = (uint8_t)adv.seriesDrssi[i];
+  }
+  return rgwFinishFrame(out, RGW_FRAME_ADV, p - out - RGW_FRAME_HEADER_SIZE);
+}
+
+// UUID lengths other than 2, 4 or 16 and values over RGW_MAX_VALUE are clamped.
+// type is RGW_FRAME_GATT, GATT_CACHED or GATT_FAILED.
+size_t rgwWriteGatt(uint8_t *out, uint8_t type, const uint8_t addr[6], const uint8_t *svc, uint8_t svcLen,
+                    const uint8_t *chr, uint8_t chrLen, uint8_t prop, const uint8_t *val, size_t valLen)
+{
+  if (svcLen > 16)
+    svcLen = 16;
+  if (chrLen > 16)
+    chrLen = 16;
+  if (valLen > RGW_MAX_VALUE)
+    valLen = RGW_MAX_VALUE;
+
+  uint8_t *p = out + RGW_FRAME_HEADER_SIZE;
+  memcpy(p, addr, 6);
+  p += 6;
+  *p++ = svcLen;
+  memcpy(p, svc, svcLen);
+  p += svcLen;
+  *p++ = chrLen;
+  memcpy(p, chr, chrLen);
+  p += chrLen;
+  *p++ = prop;
+  rgwPutU16(p, valLen);
+  p += 2;
+  memcpy(p, val, valLen);
+  p += valLen;
+  return rgwFinishFrame(out, type, p - out - RGW_FRAME_HEADER_SIZE);
+}
+
+size_t rgwWriteSeq(uint8_t *out, uint32_t seq)
+{
+  rgwPutU32(out + RGW_FRAME_HEADER_SIZE, seq);
+  return rgwFinishFrame(out, RGW_FRAME_SEQ, 4);
+}
+
+size_t rgwWriteStats(uint8_t *out, const uint32_t *values, uint8_t count)
+{
+  uint8_t *p = out + RGW_FRAME_HEADER_SIZE;
+  *p++ = count;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    rgwPutU32(p, values[i]);
+    p += 4;
+  }
+  return rgwFinishFrame(out, RGW_FRAME_STATS, p - out - RGW_FRAME_HEADER_SIZE);
+}
+
+size_t rgwWriteEnd(uint8_t *out, uint32_t last, bool more)
+{
+  rgwPutU32(out + RGW_FRAME_HEADER_SIZE, last);
+  out[RGW_FRAME_HEADER_SIZE + 4] = more ? 1 : 0;
+  return rgwFinishFrame(out, RGW_FRAME_END, 5);
+}
+
+// Frame parsing, all lengths are checked against the payload size
+
+bool rgwParseInfo(const uint8_t *p, size_t len, RgwInfo &info)
+{
+  if (len != 26)
+    return false;
+  info.mac = p;
+  info.dropped = rgwGetU32(p + 6);
+  info.now = rgwGetU32(p + 10);
+  info.cacheHits = rgwGetU32(p + 14);
+  info.cacheMisses = rgwGetU32(p + 18);
+  info.epoch = rgwGetU32(p + 22);
+  return true;
+}
+
+// values points at count packed u32 LE values, read them with rgwGetU32
+bool rgwParseStats(const uint8_t *p, size_t len, const uint8_t *&values, uint8_t &count)
+{
+  if (len < 1 || len != 1 + 4 * (size_t)p[0])
+    return false;
+  count = p[0];
+  values = p + 1;
+  return true;
+}
+
+bool rgwParseAdv(const uint8_t *p, size_t len, RgwAdv &adv)
+{
+  if (len < 11)
+    return false;
+  adv.addr = p;
+  adv.addrType = p[6];
+  adv.rssi = (int8_t)p[7];
+  adv.flags = p[8];
+  adv.nameLen = p[9];
+  adv.name = p + 10;
+  size_t i = 10 + adv.nameLen;
+  if (i + 1 > len)
+    return false;
+  adv.manLen = p[i];
+  adv.man = p + i + 1;
+  i += 1 + adv.manLen;
+  if (i + 15 > len)
+    return false;
+  adv.hits = rgwGetU16(p + i);
+  adv.rssiMin = (int8_t)p[i + 2];
+  adv.rssiMax = (int8_t)p[i + 3];
+  adv.rssiMean = (int8_t)p[i + 4];
+  adv.first = rgwGetU32(p + i + 5);
+  adv.last = rgwGetU32(p + i + 9);
+  adv.rssiFirst = (int8_t)p[i + 13];
+  adv.seriesLen = p[i + 14];
+  i += 15;
+  adv.seriesDt = nullptr;
+  adv.seriesDrssi = nullptr;
+  adv.series = p + i;
+  return i + 2 * adv.seriesLen == len;
+}
+
+bool rgwParseGatt(const uint8_t *p, size_t len, RgwGatt &gatt)
+{
+  if (len < 6 + 1)
+    return false;
+  gatt.addr = p;
+  size_t i = 6;
+  gatt.svcLen = p[i++];
+  gatt.svc = p + i;
+  i += gatt.svcLen;
+  if (i + 1 > len)
+    return false;
+  gatt.chrLen = p[i++];
+  gatt.chr = p + i;
+  i += gatt.chrLen;
+  if (i + 3 > len)
+    return false;
+  gatt.prop = p[i++];
+  gatt.valLen = rgwGetU16(p + i);
+  i += 2;
+  gatt.val = p + i;
+  return i + gatt.valLen == len;
+}
+
+// Text helpers, output matches what the collector's JSON has always contained.
+// Table driven and written straight into the caller's buffer, no allocation.
+
+// Two lowercase hex digits for every byte value
+const char rgwHexPairs[513] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+// Lowercase hex like NimBLEUtils::dataToHexString, writes 2 * length chars
+// without a terminator and returns the end of the output
+char *rgwHex(char *out, const uint8_t *data, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    memcpy(out, rgwHexPairs + 2 * data[i], 2);
+    out += 2;
+  }
+  return out;
+}
+
+// Same as rgwHex for bytes stored in reverse (little endian) order
+char *rgwHexReversed(char *out, const uint8_t *data, size_t length)
+{
+  for (size_t i = length; i > 0; i--)
+  {
+    memcpy(out, rgwHexPairs + 2 * data[i - 1], 2);
+    out += 2;
+  }
+  return out;
+}
+
+// "aa:bb:cc:dd:ee:ff" from a little endian address like NimBLEAddress::toString
+void rgwFormatAddress(char out[18], const uint8_t addr[6])
+{
+  for (int i = 0; i < 6; i++)
+  {
+    memcpy(out + 3 * i, rgwHexPairs + 2 * addr[5 - i], 2);
+    out[3 * i + 2] = ':';
+  }
+  out[17] = '\0';
+}
+
+// "AA:BB:CC:DD:EE:FF" from a big endian MAC like WiFi.softAPmacAddress()
+void rgwFormatMac(char out[18], const uint8_t mac[6])
+{
+  static const char digits[] = "0123456789ABCDEF";
+  for (int i = 0; i < 6; i++)
+  {
+    out[3 * i] = digits[mac[i] >> 4];
+    out[3 * i + 1] = digits[mac[i] & 0x0F];
+    out[3 * i + 2] = ':';
+  }
+  out[17] = '\0';
+}
+
+// Longest UUID text, a dashed 128-bit UUID
+#define RGW_UUID_STR_LEN 36
+
+// UUID text like NimBLEUUID::toString(): "0x180a", "0x0000180a" or the
+// dashed 128-bit form. Writes at most RGW_UUID_STR_LEN chars without a
+// terminator and returns the end of the output.
+char *rgwFormatUuid(char *out, const uint8_t *uuid, uint8_t len)
+{
+  if (len == 2 || len == 4)
+  {
+    *out++ = '0';
+    *out++ = 'x';
+    return rgwHexReversed(out, uuid, len);
+  }
+  if (len == 16)
+  {
+    // Groups of 4-2-2-2-6 bytes, most significant first
+    out = rgwHexReversed(out, uuid + 12, 4);
+    *out++ = '-';
+    out = rgwHexReversed(out, uuid + 10, 2);
+    *out++ = '-';
+    out = rgwHexReversed(out, uuid + 8, 2);
+    *out++ = '-';
+    out = rgwHexReversed(out, uuid + 6, 2);
+    *out++ = '-';
+    return rgwHexReversed(out, uuid, 6);
+  }
+  return out;
+}
+
+// Streaming decoder. Bytes can be fed in arbitrary pieces (e.g. straight from
+// an HTTP body) and each complete frame is handed to the callback. Uses one
+// RGW_MAX_FRAME sized buffer regardless of the stream length.
+class RgwDecoder
+{
+public:
+  typedef void (*FrameCallback)(void *ctx, uint8_t type, const uint8_t *payload, uint16_t length);
+
+  RgwDecoder(FrameCallback callback, void *ctx) : callback(callback), ctx(ctx)
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    have = 0;
+    need = RGW_HEADER_SIZE;
+    inHeader = true;
+    inFrameHeader = false;
+    done = false;
+    bad = false;
+  }
+
+  // Expect frames without the stream header, e.g. the inside of PACKED frames
+  void resetFrames()
+  {
+    reset();
+    inHeader = false;
+    startFrame();
+  }
+
+  // Returns false once the stream is malformed, further input is ignored
+  bool feed(const uint8_t *data, size_t length)
+  {
+    while (length > 0 && !bad)
+    {
+      if (done)
+      {
+        // Nothing may follow the END frame
+        bad = true;
+        break;
+      }
+      size_t take = need - have;
+      if (take > length)
+        take = length;
+      memcpy(buf + have, data, take);
+      have += take;
+      data += take;
+      length -= take;
+      if (have == need)
+      {
+        step();
+      }
+    }
+    return !bad;
+  }
+
+  // END frame has been seen
+  bool complete() const
+  {
+    return done && !bad;
+  }
+
+  bool failed() const
+  {
+    return bad;
+  }
+
+private:
+  FrameCallback callback;
+  void *ctx;
+  uint8_t buf[RGW_MAX_FRAME];
+  size_t have;
+  size_t need;
+  bool inHeader;
+  bool inFrameHeader;
+  bool done;
+  bool bad;
+
+  void step()
+  {
+    if (inHeader)
+    {
+      if (buf[0] != 'R' || buf[1] != 'G' || buf[2] != 'W' || buf[3] != RGW_VERSION)
+      {
+        bad = true;
+        return;
+      }
+      inHeader = false;
+      startFrame();
+      return;
+    }
+    if (inFrameHeader)
+    {
+      size_t payloadLen = buf[1] | (buf[2] << 8);
+      if (payloadLen > RGW_MAX_PAYLOAD)
+      {
+        bad = true;
+        return;
+      }
+      inFrameHeader = false;
+      need = RGW_FRAME_HEADER_SIZE + payloadLen;
+      if (have < need)
+        return;
+    }
+    // Whole frame buffered
+    uint8_t type = buf[0];
+    callback(ctx, type, buf + RGW_FRAME_HEADER_SIZE, need - RGW_FRAME_HEADER_SIZE);
+    if (type == RGW_FRAME_END)
+    {
+      done = true;
+    }
+    startFrame();
+  }
+
+  void startFrame()
+  {
+    have = 0;
+    need = RGW_FRAME_HEADER_SIZE;
+    inFrameHeader = true;
+  }
+};
+
+// Renders decoded frames as the collector's JSON log line:
+// {"mac":..,"epoch":..,"dropped":..,"logs":[{"addr":..,"seq":..,..,"tree":[..]},..],"stats":{..},"last_seq":..,"more":..}
+// Text is handed to the sink in small pieces, nothing is buffered here.
+class RgwJsonWriter
+{
+public:
+  typedef void (*Sink)(void *ctx, const char *text, size_t length);
+
+  RgwJsonWriter(Sink sink, void *ctx) : sink(sink), ctx(ctx)
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    started = false;
+    entryOpen = false;
+    inTree = false;
+    seqPending = false;
+    statCount = 0;
+    entries = 0;
+    epochSeen = 0;
+    lastSeen = 0;
+    moreSeen = false;
+  }
+
+  // Feed one frame, returns false for a frame that doesn't parse
+  bool frame(uint8_t type, const uint8_t *payload, uint16_t length)
+  {
+    if (type == RGW_FRAME_INFO)
+    {
+      RgwInfo info;
+      if (started || !rgwParseInfo(payload, length, info))
+        return false;
+      char mac[18];
+      rgwFormatMac(mac, info.mac);
+      printFmt("{\"mac\":\"%s\",\"epoch\":%lu,\"now\":%lu,\"dropped\":%lu,",
+               mac, (unsigned long)info.epoch, (unsigned long)info.now, (unsigned long)info.dropped);
+      printFmt("\"cache_hits\":%lu,\"cache_misses\":%lu,\"logs\":[",
+               (unsigned long)info.cacheHits, (unsigned long)info.cacheMisses);
+      epochSeen = info.epoch;
+      started = true;
+      return true;
+    }
+    if (!started)
+      return false;
+
+    if (type == RGW_FRAME_SEQ)
+    {
+      if (length != 4)
+        return false;
+      // The next ADV or GATT frame opens the record's entry, even for the
+      // address of the entry before it
+      closeEntry();
+      seq = rgwGetU32(payload);
+      seqPending = true;
+      return true;
+    }
+
+    if (type == RGW_FRAME_ADV)
+    {
+      RgwAdv adv;
+      if (!rgwParseAdv(payload, length, adv))
+        return false;
+      openEntry(adv.addr);
+      print("\"name\":\"");
+      printHex(adv.name, adv.nameLen);
+      printFmt("\",\"rssi\":%d,\"man\":\"", adv.rssi);
+      printHex(adv.man, adv.manLen);
+      printFmt("\",\"connectable\":%s,\"addr_type\":%u",
+             (adv.flags & 0x01) ? "true" : "false", adv.addrType);
+      printFmt(",\"hits\":%u,\"first\":%lu,\"last\":%lu,\"rssi_min\":%d,\"rssi_max\":%d,\"rssi_mean\":%d",
+               adv.hits, (unsigned long)adv.first, (unsigned long)adv.last, adv.rssiMin, adv.rssiMax, adv.rssiMean);
+      // Expand the delta encoded series into offsets from first and absolute values
+      uint32_t t = 0;
+      print(",\"rssi_t\":[0");
+      for (uint8_t i = 0; i < adv.seriesLen; i++)
+      {
+        t += adv.series[2 * i] * RGW_SERIES_TICK_MS;
+        printFmt(",%lu", (unsigned long)t);
+      }
+      int v = adv.rssiFirst;
+      printFmt("],\"rssi_v\":[%d", v);
+      for (uint8_t i = 0; i < adv.seriesLen; i++)
+      {
+        v += (int8_t)adv.series[2 * i + 1];
+        printFmt(",%d", v);
+      }
+      print("]");
+      return true;
+    }
+    if (type == RGW_FRAME_GATT || type == RGW_FRAME_GATT_CACHED || type == RGW_FRAME_GATT_FAILED)
+    {
+      RgwGatt gatt;
+      if (!rgwParseGatt(payload, length, gatt))
+        return false;
+      if (!entryOpen || memcmp(openAddr, gatt.addr, 6) != 0)
+      {
+        // Tree without an advertisement in this sync
+        openEntry(gatt.addr);
+        print("\"tree\":[");
+        inTree = true;
+      }
+      else if (!inTree)
+      {
+        print(",\"tree\":[");
+        inTree = true;
+      }
+      else
+      {
+        print(",");
+      }
+      char uuid[RGW_UUID_STR_LEN];
+      print("{\"svc\":\"");
+      sink(ctx, uuid, rgwFormatUuid(uuid, gatt.svc, gatt.svcLen) - uuid);
+      print("\",\"chr\":\"");
+      sink(ctx, uuid, rgwFormatUuid(uuid, gatt.chr, gatt.chrLen) - uuid);
+      print("\"");
+      if (type == RGW_FRAME_GATT_FAILED)
+      {
+        print(",\"read_failed\":true");
+      }
+      else if (gatt.prop & RGW_PROP_READ)
+      {
+        print(",\"val\":\"");
+        printHex(gatt.val, gatt.valLen);
+        print("\"");
+      }
+      if (type == RGW_FRAME_GATT_CACHED)
+        print(",\"cached\":true");
+      printFmt(",\"prop\":%u}", gatt.prop);
+      return true;
+    }
+    if (type == RGW_FRAME_STATS)
+    {
+      const uint8_t *values;
+      uint8_t count;
+      if (!rgwParseStats(payload, length, values, count))
+        return false;
+      // Printed after "logs", which is still open
+      statCount = count < RGW_STATS ? count : RGW_STATS;
+      for (uint8_t i = 0; i < statCount; i++)
+        stats[i] = rgwGetU32(values + 4 * i);
+      return true;
+    }
+    if (type == RGW_FRAME_END)
+    {
+      if (length != 5)
+        return false;
+      lastSeen = rgwGetU32(payload);
+      moreSeen = payload[4] != 0;
+      closeEntry();
+      print("]");
+      if (statCount > 0)
+      {
+        for (uint8_t i = 0; i < statCount; i++)
+          printFmt("%s\"%s\":%lu", i == 0 ? ",\"stats\":{" : ",", rgwStatNames[i], (unsigned long)stats[i]);
+        print("}");
+      }
+      printFmt(",\"last_seq\":%lu,\"more\":%s}", (unsigned long)lastSeen, moreSeen ? "true" : "false");
+      return true;
+    }
+    // Unknown frame types from newer collectors are skipped
+    return true;
+  }
+
+  // Number of "logs" entries written, the old logDoc["logs"].size()
+  size_t events() const
+  {
+    return entries;
+  }
+
+  // Boot epoch from INFO, the last record number and more flag from END
+  uint32_t epoch() const
+  {
+    return epochSeen;
+  }
+
+  uint32_t lastSeq() const
+  {
+    return lastSeen;
+  }
+
+  bool more() const
+  {
+    return moreSeen;
+  }
+
+private:
+  Sink sink;
+  void *ctx;
+  bool started;
+  bool entryOpen;
+  bool inTree;
+  uint8_t openAddr[6];
+  bool seqPending;
+  uint32_t seq;
+  uint8_t statCount;
+  uint32_t stats[RGW_STATS];
+  size_t entries;
+  uint32_t epochSeen;
+  uint32_t lastSeen;
+  bool moreSeen;
+
+  void print(const char *text)
+  {
+    sink(ctx, text, strlen(text));
+  }
+
+  void printFmt(const char *fmt, ...) __attribute__((format(printf, 2, 3)))
+  {
+    char tmp[96];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, args);
+    va_end(args);
+    if (n > 0)
+      sink(ctx, tmp, (size_t)n < sizeof(tmp) ? n : sizeof(tmp) - 1);
+  }
+
+  void printHex(const uint8_t *data, size_t length)
+  {
+    char tmp[64];
+    while (length > 0)
+    {
+      size_t n = length > 32 ? 32 : length;
+      rgwHex(tmp, data, n);
+      sink(ctx, tmp, n * 2);
+      data += n;
+      length -= n;
+    }
+  }
+
+  void closeEntry()
+  {
+    if (inTree)
+      print("]");
+    if (entryOpen)
+      print("}");
+    entryOpen = false;
+    inTree = false;
+  }
+
+  void openEntry(const uint8_t addr[6])
+  {
+    bool first = entries == 0;
+    closeEntry();
+    char str[18];
+    rgwFormatAddress(str, addr);
+    if (!first)
+      print(",");
+    print("{\"addr\":\"");
+    print(str);
+    print("\",");
+    if (seqPending)
+    {
+      printFmt("\"seq\":%lu,", (unsigned long)seq);
+      seqPending = false;
+    }
+    memcpy(openAddr, addr, 6);
+    entryOpen = true;
+    entries++;
+  }
+};
@@ -0,0 +1,401 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Spill Log
+// Append-only record log on flash for what no longer fits the collector's RAM
+// while the logger is away. Plain C++ over a SpillDevice, so the same code runs
+// against the flash partition on the collector and a file on a host.
+//
+// The device is cut into segments. Each starts with a header
+//   magic "RGSP" seq(u32 LE) erases(u32 LE) crc(u32 LE) of the 12 bytes before
+// followed by records, each starting 4 byte aligned:
+//   len(u16 LE) state 0xFF crc(u32 LE) of len and data, data[len]
+// Erased flash reads 0xFF, so a len of 0xFFFF ends the segment. state is 0xFF
+// while the record is live and cleared to 0x00 in place once it is released;
+// flash can clear bits without an erase.
+//
+// Segments are filled in seq order and read back oldest first. A segment with
+// no live records is free. It keeps its header, and so its erase count, until
+// it is reused, and a new segment always goes to the free one erased the
+// fewest times so wear spreads over the whole device. A record failing its CRC
+// (e.g. cut short by a reset) ends its segment, and appends after mount()
+// always open a fresh segment so nothing is written over a torn record.
+
+// Define the segment size, a multiple of the 4096 byte flash sector.
+#ifndef SPILL_SEGMENT_SIZE
+#define SPILL_SEGMENT_SIZE 4096
+#endif
+// Define the most segments used, a larger device is only used up to this.
+#ifndef SPILL_MAX_SEGMENTS
+#define SPILL_MAX_SEGMENTS 384
+#endif
+
+#define SPILL_SEGMENT_HEADER 16
+#define SPILL_RECORD_HEADER 8
+// Largest record, one has to fit an empty segment
+#define SPILL_RECORD_MAX (SPILL_SEGMENT_SIZE - SPILL_SEGMENT_HEADER - SPILL_RECORD_HEADER)
+// "RGSP" read as a little endian u32
+#define SPILL_MAGIC 0x50534752u
+#define SPILL_LIVE 0xFF
+#define SPILL_RELEASED 0x00
+
+static_assert(SPILL_SEGMENT_SIZE % 4096 == 0, "SPILL_SEGMENT_SIZE must be a multiple of the flash sector");
+static_assert(SPILL_SEGMENT_SIZE <= 0x8000, "SPILL_SEGMENT_SIZE must fit the uint16_t offsets");
+static_assert(SPILL_MAX_SEGMENTS <= 0x7FFF, "SPILL_MAX_SEGMENTS must fit the int16_t segment index");
+
+// Storage under a SpillLog, offsets are bytes from the start of the device.
+class SpillDevice
+{
+public:
+  virtual ~SpillDevice() {}
+  virtual uint32_t size() = 0;
+  virtual bool read(uint32_t offset, void *data, size_t length) = 0;
+  // Like NOR flash, a write can only clear bits
+  virtual bool write(uint32_t offset, const void *data, size_t length) = 0;
+  // Set the SPILL_SEGMENT_SIZE bytes at offset back to 0xFF
+  virtual bool erase(uint32_t offset) = 0;
+};
+
+// CRC-32 (IEEE, same as the CRC32 library), a nibble at a time
+uint32_t spillCrc32(const uint8_t *data, size_t length, uint32_t crc = 0)
+{
+  static const uint32_t table[16] = {
+      0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+      0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+  }
+  return ~crc;
+}
+
+// Structure to store what mount() and later appends know about a segment.
+struct SpillSegment
+{
+  // 0 = no valid header, blank or never finished
+  uint32_t seq;
+  uint32_t erases;
+  uint16_t live;
+  // End of the written records
+  uint16_t end;
+};
+
+// Position of a reader, rewind() puts it on the oldest live record
+struct SpillCursor
+{
+  int16_t segment;
+  uint16_t offset;
+};
+
+class SpillLog
+{
+public:
+  SpillLog() : dev(nullptr), segments(0), head(-1), maxSeq(0), liveCount(0), dropped(0) {}
+
+  // Scan the device and rebuild the segment table. Returns false if there
+  // is no usable space, appends are then dropped.
+  bool mount(SpillDevice &device)
+  {
+    dev = &device;
+    uint32_t n = device.size() / SPILL_SEGMENT_SIZE;
+    segments = n > SPILL_MAX_SEGMENTS ? SPILL_MAX_SEGMENTS : n;
+    head = -1;
+    maxSeq = 0;
+    liveCount = 0;
+    for (uint16_t s = 0; s < segments; s++)
+    {
+      scan(s);
+      liveCount += table[s].live;
+    }
+    if (segments == 0)
+    {
+      dev = nullptr;
+    }
+    return dev != nullptr;
+  }
+
+  // Append a record, returns false (and counts a drop) if it doesn't fit
+  bool append(const uint8_t *data, uint16_t length)
+  {
+    uint32_t need = recordSize(length);
+    if (!dev || length > SPILL_RECORD_MAX)
+    {
+      dropped++;
+      return false;
+    }
+    if (head < 0 || table[head].end + need > SPILL_SEGMENT_SIZE)
+    {
+      if (!open())
+      {
+        dropped++;
+        return false;
+      }
+    }
+    SpillSegment &seg = table[head];
+    uint8_t hdr[SPILL_RECORD_HEADER];
+    hdr[0] = length & 0xFF;
+    hdr[1] = length >> 8;
+    hdr[2] = SPILL_LIVE;
+    hdr[3] = 0xFF;
+    putU32(hdr + 4, spillCrc32(data, length, spillCrc32(hdr, 2)));
+    uint32_t at = base(head) + seg.end;
+    if (!dev->write(at, hdr, sizeof(hdr)) || !dev->write(at + sizeof(hdr), data, length))
+    {
+      // Whatever made it to flash fails its CRC on the next mount
+      head = -1;
+      dropped++;
+      return false;
+    }
+    seg.end += need;
+    seg.live++;
+    liveCount++;
+    return true;
+  }
+
+  void rewind(SpillCursor &cursor) const
+  {
+    cursor.segment = next(-1);
+    cursor.offset = SPILL_SEGMENT_HEADER;
+  }
+
+  // Read the record at the cursor and move past it. Returns its length, or
+  // -1 once there are no more. data must hold SPILL_RECORD_MAX bytes.
+  int read(SpillCursor &cursor, uint8_t *data)
+  {
+    while (dev && cursor.segment >= 0)
+    {
+      const SpillSegment &seg = table[cursor.segment];
+      while (cursor.offset < seg.end)
+      {
+        uint32_t at = base(cursor.segment) + cursor.offset;
+        uint8_t hdr[SPILL_RECORD_HEADER];
+        if (!dev->read(at, hdr, sizeof(hdr)))
+          return -1;
+        uint16_t length = hdr[0] | (hdr[1] << 8);
+        cursor.offset += recordSize(length);
+        if (hdr[2] != SPILL_LIVE)
+          continue;
+        if (!dev->read(at + sizeof(hdr), data, length))
+          return -1;
+        if (spillCrc32(data, length, spillCrc32(hdr, 2)) != getU32(hdr + 4))
+        {
+          // Went bad since mount. Drop it for good so release() counts the
+          // same records read() hands out.
+          uint8_t state = SPILL_RELEASED;
+          if (dev->write(at + 2, &state, 1))
+          {
+            table[cursor.segment].live--;
+            liveCount--;
+          }
+          dropped++;
+          continue;
+        }
+        return length;
+      }
+      cursor.segment = next(cursor.segment);
+      cursor.offset = SPILL_SEGMENT_HEADER;
+    }
+    return -1;
+  }
+
+  // Release the n oldest live records, returns how many were
+  uint32_t release(uint32_t n)
+  {
+    uint32_t done = 0;
+    for (int16_t s = next(-1); dev && s >= 0 && done < n; s = next(s))
+    {
+      SpillSegment &seg = table[s];
+      for (uint16_t offset = SPILL_SEGMENT_HEADER; offset < seg.end && done < n;)
+      {
+        uint32_t at = base(s) + offset;
+        uint8_t hdr[SPILL_RECORD_HEADER];
+        if (!dev->read(at, hdr, sizeof(hdr)))
+          return done;
+        offset += recordSize(hdr[0] | (hdr[1] << 8));
+        if (hdr[2] != SPILL_LIVE)
+          continue;
+        uint8_t state = SPILL_RELEASED;
+        if (!dev->write(at + 2, &state, 1))
+          return done;
+        seg.live--;
+        liveCount--;
+        done++;
+      }
+    }
+    return done;
+  }
+
+  // Live records
+  uint32_t count() const
+  {
+    return liveCount;
+  }
+
+  // Records dropped since the last takeDropped()
+  uint32_t droppedCount() const
+  {
+    return dropped;
+  }
+
+  // Records dropped since the last call
+  uint32_t takeDropped()
+  {
+    uint32_t n = dropped;
+    dropped = 0;
+    return n;
+  }
+
+  uint16_t segmentCount() const
+  {
+    return segments;
+  }
+
+  // Segments holding live records or taking appends, appends are dropped
+  // once every segment is
+  uint16_t usedSegments() const
+  {
+    uint16_t n = 0;
+    for (uint16_t s = 0; s < segments; s++)
+    {
+      if (table[s].live > 0 || s == head)
+        n++;
+    }
+    return n;
+  }
+
+  uint32_t erases(uint16_t segment) const
+  {
+    return table[segment].erases;
+  }
+
+private:
+  SpillDevice *dev;
+  SpillSegment table[SPILL_MAX_SEGMENTS];
+  uint16_t segments;
+  // Segment taking appends, -1 = open a new one first
+  int16_t head;
+  uint32_t maxSeq;
+  uint32_t liveCount;
+  uint32_t dropped;
+
+  static uint32_t recordSize(uint16_t length)
+  {
+    return (SPILL_RECORD_HEADER + length + 3) & ~3u;
+  }
+
+  static uint32_t base(int16_t segment)
+  {
+    return (uint32_t)segment * SPILL_SEGMENT_SIZE;
+  }
+
+  static void putU32(uint8_t *p, uint32_t v)
+  {
+    for (int i = 0; i < 4; i++)
+      p[i] = (v >> (8 * i)) & 0xFF;
+  }
+
+  static uint32_t getU32(const uint8_t *p)
+  {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  // Segment with live records that comes after segment in seq order, -1 for the oldest
+  int16_t next(int16_t segment) const
+  {
+    uint32_t after = segment < 0 ? 0 : table[segment].seq;
+    int16_t best = -1;
+    for (uint16_t s = 0; s < segments; s++)
+    {
+      if (table[s].live > 0 && table[s].seq > after && (best < 0 || table[s].seq < table[best].seq))
+        best = s;
+    }
+    return best;
+  }
+
+  // Erase the least worn free segment and make it the head
+  bool open()
+  {
+    int16_t pick = -1;
+    for (uint16_t s = 0; s < segments; s++)
+    {
+      if (table[s].live == 0 && s != head && (pick < 0 || table[s].erases < table[pick].erases))
+        pick = s;
+    }
+    head = -1;
+    if (pick < 0)
+      return false;
+    SpillSegment &seg = table[pick];
+    seg.erases++;
+    seg.seq = 0;
+    seg.end = SPILL_SEGMENT_HEADER;
+    if (!dev->erase(base(pick)))
+      return false;
+    uint8_t hdr[SPILL_SEGMENT_HEADER];
+    putU32(hdr, SPILL_MAGIC);
+    putU32(hdr + 4, maxSeq + 1);
+    putU32(hdr + 8, seg.erases);
+    putU32(hdr + 12, spillCrc32(hdr, 12));
+    if (!dev->write(base(pick), hdr, sizeof(hdr)))
+      return false;
+    seg.seq = ++maxSeq;
+    head = pick;
+    return true;
+  }
+
+  // Rebuild a segment's entry from flash, records are checked up to the first bad one
+  void scan(uint16_t s)
+  {
+    SpillSegment &seg = table[s];
+    seg.seq = 0;
+    seg.erases = 0;
+    seg.live = 0;
+    seg.end = SPILL_SEGMENT_HEADER;
+    uint8_t hdr[SPILL_SEGMENT_HEADER];
+    if (!dev->read(base(s), hdr, sizeof(hdr)) || getU32(hdr) != SPILL_MAGIC ||
+        getU32(hdr + 12) != spillCrc32(hdr, 12))
+    {
+      return;
+    }
+    seg.erases = getU32(hdr + 8);
+    uint32_t seq = getU32(hdr + 4);
+    if (seq == 0)
+      return;
+    seg.seq = seq;
+    if (seq > maxSeq)
+      maxSeq = seq;
+
+    uint32_t offset = SPILL_SEGMENT_HEADER;
+    while (offset + SPILL_RECORD_HEADER <= SPILL_SEGMENT_SIZE)
+    {
+      uint32_t at = base(s) + offset;
+      uint8_t rec[SPILL_RECORD_HEADER];
+      if (!dev->read(at, rec, sizeof(rec)))
+        break;
+      uint16_t length = rec[0] | (rec[1] << 8);
+      if (length > SPILL_RECORD_MAX || offset + recordSize(length) > SPILL_SEGMENT_SIZE)
+        break;
+      // CRC the data in small pieces, nothing segment sized on the stack
+      uint32_t crc = spillCrc32(rec, 2);
+      uint8_t chunk[64];
+      bool ok = true;
+      for (uint16_t i = 0; i < length && ok; i += sizeof(chunk))
+      {
+        uint16_t left = length - i;
+        uint16_t n = left < sizeof(chunk) ? left : sizeof(chunk);
+        ok = dev->read(at + sizeof(rec) + i, chunk, n);
+        crc = spillCrc32(chunk, n, crc);
+      }
+      if (!ok || crc != getU32(rec + 4))
+        break;
+      if (rec[2] == SPILL_LIVE)
+        seg.live++;
+      offset += recordSize(length);
+    }
+    seg.end = offset;
+  }
+};
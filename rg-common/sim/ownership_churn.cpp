@@ -0,0 +1,105 @@
+// Ownership churn simulation
+// How many devices change owner when a collector joins or leaves, for the
+// old id % scannerCount split and for rendezvous hashing (ownership.h).
+//
+// Build and run on a host:
+//   g++ -O2 -I ../include -o ownership_churn ownership_churn.cpp && ./ownership_churn
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ownership.h"
+
+#define DEVICES 100000
+#define MAX_COLLECTORS 14
+
+// xorshift32, fixed seed so runs are repeatable
+static uint32_t rngState = 2463534242u;
+static uint32_t rng()
+{
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static uint32_t ids[DEVICES];
+static uint8_t macs[MAX_COLLECTORS + 1][6];
+
+// Owner MAC index of every device, modulo split over the first count
+// collectors in list order like the logger's si/ss
+static void ownModulo(const int *members, int count, int *owner)
+{
+  for (int d = 0; d < DEVICES; d++)
+    owner[d] = members[ids[d] % count];
+}
+
+static void ownRendezvous(const int *members, int count, int *owner)
+{
+  uint8_t set[MAX_COLLECTORS + 1][6];
+  for (int i = 0; i < count; i++)
+    memcpy(set[i], macs[members[i]], 6);
+  for (int d = 0; d < DEVICES; d++)
+    owner[d] = members[ownerOf(ids[d], set, count)];
+}
+
+static double moved(const int *a, const int *b)
+{
+  int n = 0;
+  for (int d = 0; d < DEVICES; d++)
+    n += a[d] != b[d];
+  return 100.0 * n / DEVICES;
+}
+
+static int before[DEVICES];
+static int after[DEVICES];
+
+int main()
+{
+  for (int d = 0; d < DEVICES; d++)
+    ids[d] = rng();
+  for (int c = 0; c <= MAX_COLLECTORS; c++)
+  {
+    // Espressif OUI, random NIC part
+    macs[c][0] = 0x34;
+    macs[c][1] = 0x85;
+    macs[c][2] = 0x18;
+    for (int i = 3; i < 6; i++)
+      macs[c][i] = rng();
+  }
+
+  printf("%d devices, %% of them changing owner\n\n", DEVICES);
+  printf("            join                        leave (n -> n-1)\n");
+  printf("collectors  ideal  modulo  rendezvous   ideal  modulo  rendezvous\n");
+  for (int n = 2; n <= MAX_COLLECTORS; n++)
+  {
+    int members[MAX_COLLECTORS + 1];
+    for (int i = 0; i <= n; i++)
+      members[i] = i;
+
+    // Join: collector n shows up at the end of the logger's list
+    ownModulo(members, n, before);
+    ownModulo(members, n + 1, after);
+    double joinModulo = moved(before, after);
+    ownRendezvous(members, n, before);
+    ownRendezvous(members, n + 1, after);
+    double joinRendezvous = moved(before, after);
+
+    // Leave: a collector from the middle of the list drops out
+    int left[MAX_COLLECTORS];
+    int k = 0;
+    for (int i = 0; i < n; i++)
+      if (i != n / 2)
+        left[k++] = i;
+    ownModulo(members, n, before);
+    ownModulo(left, n - 1, after);
+    double leaveModulo = moved(before, after);
+    ownRendezvous(members, n, before);
+    ownRendezvous(left, n - 1, after);
+    double leaveRendezvous = moved(before, after);
+
+    printf("%3d -> %-3d  %5.1f  %6.1f  %10.1f   %5.1f  %6.1f  %10.1f\n", n, n + 1, 100.0 / (n + 1),
+           joinModulo, joinRendezvous, 100.0 / n, leaveModulo, leaveRendezvous);
+  }
+  return 0;
+}
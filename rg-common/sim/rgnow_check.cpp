@@ -0,0 +1,325 @@
+// RG Now check
+// Runs messages through the ESP-NOW framing (rgnow.h) and back over a
+// simulated radio that loses frames and their acknowledgements: messages of
+// every size around a frame, frames sent twice, missing, damaged, cut short
+// or from another session, a refusal, and a sync body of rgw records that
+// has to come out byte for byte as it went in.
+//
+// Build and run on a host:
+//   g++ -O2 -I ../include -o rgnow_check rgnow_check.cpp && ./rgnow_check
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "rgnow.h"
+
+// Same as rgnowlink.h's RGN_SEND_TRIES
+#define SEND_TRIES 4
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%-52s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    failures++;
+}
+
+static uint32_t randomState = 1;
+
+static uint32_t next()
+{
+  randomState = randomState * 1103515245 + 12345;
+  return randomState >> 8;
+}
+
+static bool chance(double p)
+{
+  return (next() & 0xFFFF) < p * 0x10000;
+}
+
+// The radio between the two ends. A frame is lost with dataLoss, the
+// acknowledgement of one that arrived with ackLoss, and the sender tries
+// SEND_TRIES times like rgnSend(), so a frame can arrive twice. What arrives
+// is kept in order for the receiver.
+struct Link
+{
+  double dataLoss;
+  double ackLoss;
+  std::vector<std::vector<uint8_t>> air;
+  uint32_t sends;
+  uint32_t repeats;
+  bool oversize;
+
+  Link(double dataLoss = 0, double ackLoss = 0)
+      : dataLoss(dataLoss), ackLoss(ackLoss), sends(0), repeats(0), oversize(false)
+  {
+  }
+
+  static bool emit(void *ctx, const uint8_t *frame, size_t length)
+  {
+    Link &link = *(Link *)ctx;
+    if (length > RGN_MAX_FRAME)
+      link.oversize = true;
+    bool arrived = false;
+    for (int tries = 0; tries < SEND_TRIES; tries++)
+    {
+      link.sends++;
+      if (chance(link.dataLoss))
+        continue;
+      if (arrived)
+        link.repeats++;
+      arrived = true;
+      link.air.push_back(std::vector<uint8_t>(frame, frame + length));
+      if (!chance(link.ackLoss))
+        return true;
+    }
+    return false;
+  }
+};
+
+// What the receiver got
+struct Received
+{
+  std::vector<uint8_t> bytes;
+  uint8_t type;
+};
+
+static void collect(void *ctx, uint8_t type, const uint8_t *data, size_t length)
+{
+  Received &r = *(Received *)ctx;
+  r.type = type;
+  r.bytes.insert(r.bytes.end(), data, data + length);
+}
+
+// Frame message in pieces of random size onto link, false if a frame
+// couldn't be delivered
+static bool sendMessage(Link &link, uint8_t type, uint16_t session, const std::vector<uint8_t> &message)
+{
+  RgnFramer framer(Link::emit, &link);
+  framer.begin(type, session);
+  size_t i = 0;
+  while (i < message.size())
+  {
+    size_t n = 1 + next() % 600;
+    if (n > message.size() - i)
+      n = message.size() - i;
+    framer.write(message.data() + i, n);
+    i += n;
+  }
+  return framer.end();
+}
+
+static void receive(RgnReassembler &r, const Link &link)
+{
+  for (const std::vector<uint8_t> &frame : link.air)
+    r.feed(frame.data(), frame.size());
+}
+
+static std::vector<uint8_t> randomBytes(size_t n)
+{
+  std::vector<uint8_t> bytes(n);
+  for (size_t i = 0; i < n; i++)
+    bytes[i] = next();
+  return bytes;
+}
+
+// A sync body as a collector sends it: header, INFO, then records of a SEQ
+// and an ADV frame each, then END
+static std::vector<uint8_t> syncBody(uint32_t records)
+{
+  std::vector<uint8_t> body;
+  uint8_t frame[RGW_MAX_FRAME];
+  body.insert(body.end(), frame, frame + rgwWriteHeader(frame));
+  uint8_t mac[6] = {0x02, 0x52, 0x47, 0, 0, 1};
+  RgwInfo info = {mac, 0, 1000, 0, 0, 0xC0FFEE};
+  body.insert(body.end(), frame, frame + rgwWriteInfo(frame, info));
+  for (uint32_t i = 0; i < records; i++)
+  {
+    uint8_t addr[6] = {0xC0, 0, 0, 0, (uint8_t)(i >> 8), (uint8_t)i};
+    uint8_t name[8] = {'d', 'e', 'v', 'i', 'c', 'e', (uint8_t)('0' + i % 10), 0};
+    uint8_t dt[4] = {1, 2, 3, 4};
+    int8_t drssi[4] = {-1, 2, -3, 4};
+    RgwAdv adv = {};
+    adv.addr = addr;
+    adv.rssi = -60 - (int)(i % 30);
+    adv.name = name;
+    adv.nameLen = 7;
+    adv.hits = 1 + i % 50;
+    adv.rssiMin = adv.rssi - 5;
+    adv.rssiMax = adv.rssi + 5;
+    adv.rssiMean = adv.rssi;
+    adv.first = 1000 + i;
+    adv.last = 2000 + i;
+    adv.rssiFirst = adv.rssi;
+    adv.seriesLen = i % 5;
+    adv.seriesDt = dt;
+    adv.seriesDrssi = drssi;
+    body.insert(body.end(), frame, frame + rgwWriteSeq(frame, 100 + i));
+    body.insert(body.end(), frame, frame + rgwWriteAdv(frame, adv));
+  }
+  body.insert(body.end(), frame, frame + rgwWriteEnd(frame, 100 + records - 1, false));
+  return body;
+}
+
+static void onText(void *ctx, const char *text, size_t length)
+{
+  ((std::string *)ctx)->append(text, length);
+}
+
+static void onFrame(void *ctx, uint8_t type, const uint8_t *payload, uint16_t length)
+{
+  ((RgwJsonWriter *)ctx)->frame(type, payload, length);
+}
+
+// The JSON line the logger makes of a body, empty if it doesn't decode
+static std::string jsonLine(const std::vector<uint8_t> &body, size_t &events)
+{
+  std::string line;
+  RgwJsonWriter writer(onText, &line);
+  RgwDecoder decoder(onFrame, &writer);
+  if (!decoder.feed(body.data(), body.size()) || !decoder.complete())
+    return std::string();
+  events = writer.events();
+  return line;
+}
+
+int main()
+{
+  // Every size up to a few frames, each cut where the frame boundaries fall
+  bool whole = true;
+  bool fewest = true;
+  bool fits = true;
+  for (size_t n = 0; n <= 3 * RGN_MAX_PAYLOAD + 20; n++)
+  {
+    Link link;
+    std::vector<uint8_t> message = randomBytes(n);
+    bool sent = sendMessage(link, RGN_REQUEST, n, message);
+    Received got = {};
+    RgnReassembler r(collect, &got);
+    r.begin(RGN_REQUEST, n);
+    receive(r, link);
+    whole = whole && sent && r.complete() && got.bytes == message;
+    fewest = fewest && link.air.size() == (n + RGN_TRAILER_SIZE + RGN_MAX_PAYLOAD - 1) / RGN_MAX_PAYLOAD;
+    fits = fits && !link.oversize;
+  }
+  check(whole, "messages of every size come back whole");
+  check(fewest, "each takes the fewest frames");
+  check(fits, "no frame outgrows ESP-NOW");
+
+  // Acknowledgements lost, the frames were there
+  Link acks(0, 0.3);
+  std::vector<uint8_t> message = randomBytes(20000);
+  bool sent = sendMessage(acks, RGN_RESPONSE, 1, message);
+  Received got = {};
+  RgnReassembler r(collect, &got);
+  r.begin(RGN_RESPONSE, 1);
+  receive(r, acks);
+  check(sent && acks.repeats > 0 && r.complete() && got.bytes == message, "frames that arrive twice are taken once");
+
+  // Lost frames, sent again until the tries run out. A message either comes
+  // through whole or is known to have failed.
+  uint32_t whole2 = 0;
+  uint32_t lost = 0;
+  uint32_t wrong = 0;
+  for (int i = 0; i < 400; i++)
+  {
+    Link lossy(0.4, 0.2);
+    message = randomBytes(next() % 5000);
+    sendMessage(lossy, RGN_RESPONSE, i, message);
+    got = Received();
+    r.begin(RGN_RESPONSE, i);
+    receive(r, lossy);
+    if (r.complete())
+    {
+      whole2++;
+      wrong += got.bytes != message;
+    }
+    else
+    {
+      lost++;
+    }
+  }
+  printf("\n400 messages at 40%% frame loss: %u whole, %u lost\n", whole2, lost);
+  check(whole2 > 0 && lost > 0 && wrong == 0, "a message is whole or lost, never wrong");
+
+  // Damage the link itself
+  message = randomBytes(2000);
+  Link gap;
+  sendMessage(gap, RGN_RESPONSE, 9, message);
+  gap.air.erase(gap.air.begin() + 3);
+  got = Received();
+  r.begin(RGN_RESPONSE, 9);
+  receive(r, gap);
+  check(r.failed() && !r.complete(), "a frame missing from the order fails it");
+
+  Link damaged;
+  sendMessage(damaged, RGN_RESPONSE, 9, message);
+  damaged.air[2][RGN_HEADER_SIZE + 17] ^= 0x20;
+  got = Received();
+  r.begin(RGN_RESPONSE, 9);
+  receive(r, damaged);
+  check(r.failed() && !r.complete(), "a damaged frame fails it by its CRC");
+
+  Link cut;
+  sendMessage(cut, RGN_RESPONSE, 9, message);
+  cut.air.pop_back();
+  got = Received();
+  r.begin(RGN_RESPONSE, 9);
+  receive(r, cut);
+  check(!r.complete() && !r.finished() && got.bytes.size() < message.size(), "a message cut short never completes");
+
+  // An earlier response still in the air while the next one comes
+  Link stale;
+  sendMessage(stale, RGN_RESPONSE, 10, randomBytes(700));
+  Link current;
+  sendMessage(current, RGN_RESPONSE, 11, message);
+  got = Received();
+  r.begin(RGN_RESPONSE, 11);
+  uint32_t staleTaken = 0;
+  for (size_t i = 0; i < current.air.size(); i++)
+  {
+    if (i < stale.air.size())
+      staleTaken += r.feed(stale.air[i].data(), stale.air[i].size());
+    r.feed(current.air[i].data(), current.air[i].size());
+  }
+  check(staleTaken == 0 && r.complete() && got.bytes == message, "frames of another session are passed over");
+
+  // A collector too busy to answer
+  Link refused;
+  std::vector<uint8_t> busy = {0xF7, 0x01, 'B', 'u', 's', 'y'};
+  sendMessage(refused, RGN_REFUSED, 12, busy);
+  got = Received();
+  r.begin(RGN_RESPONSE, 12);
+  receive(r, refused);
+  check(r.complete() && r.type() == RGN_REFUSED && rgwGetU16(got.bytes.data()) == 503,
+        "a refusal comes in place of a response");
+
+  // A pull's worth of records over a poor link, asked for again until it
+  // comes through like the logger does
+  std::vector<uint8_t> body = syncBody(400);
+  int pulls = 0;
+  bool through = false;
+  Link pull;
+  while (!through && pulls < 20)
+  {
+    pull = Link(0.2, 0.1);
+    sendMessage(pull, RGN_RESPONSE, 100 + pulls, body);
+    got = Received();
+    r.begin(RGN_RESPONSE, 100 + pulls);
+    receive(r, pull);
+    through = r.complete();
+    pulls++;
+  }
+  size_t sentEvents = 0;
+  size_t gotEvents = 0;
+  std::string expected = jsonLine(body, sentEvents);
+  std::string line = through ? jsonLine(got.bytes, gotEvents) : std::string();
+  printf("\n%zu byte body in %zu frames, %u sends, %zu header and trailer bytes\n", body.size(), pull.air.size(),
+         pull.sends, pull.air.size() * RGN_HEADER_SIZE + RGN_TRAILER_SIZE);
+  check(through && got.bytes == body, "a sync body comes through byte for byte");
+  check(!line.empty() && line == expected && gotEvents == 400 && sentEvents == 400, "its records decode as they went out");
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,409 @@
+// RG Wire check
+// Runs every frame type of the rgw format (rgwire.h) through its encoder, its
+// parser, the streaming decoder fed in pieces of any size and the JSON
+// writer, and checks the line that comes out against the one the collector's
+// JSON has always held. Then streams and frames that are cut short, too long,
+// of another version or carry bytes past END, which have to be told apart
+// from whole ones.
+//
+// Build and run on a host:
+//   g++ -O2 -I ../include -o rgwire_check rgwire_check.cpp && ./rgwire_check
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "rgwire.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%-52s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    failures++;
+}
+
+static uint32_t randomState = 1;
+
+static uint32_t next()
+{
+  randomState = randomState * 1103515245 + 12345;
+  return randomState >> 8;
+}
+
+typedef std::vector<uint8_t> Bytes;
+
+// A frame as the decoder hands it over
+struct Frame
+{
+  uint8_t type;
+  Bytes payload;
+
+  bool operator==(const Frame &other) const
+  {
+    return type == other.type && payload == other.payload;
+  }
+};
+
+static Frame frameOf(const uint8_t *frame, size_t length)
+{
+  Frame f;
+  f.type = frame[0];
+  f.payload.assign(frame + RGW_FRAME_HEADER_SIZE, frame + length);
+  return f;
+}
+
+static void onFrame(void *ctx, uint8_t type, const uint8_t *payload, uint16_t length)
+{
+  Frame f;
+  f.type = type;
+  f.payload.assign(payload, payload + length);
+  ((std::vector<Frame> *)ctx)->push_back(f);
+}
+
+static void onText(void *ctx, const char *text, size_t length)
+{
+  ((std::string *)ctx)->append(text, length);
+}
+
+// Feed body in pieces of up to most bytes, returns what feed() last did
+static bool feedPieces(RgwDecoder &decoder, const Bytes &body, size_t most)
+{
+  bool ok = true;
+  size_t i = 0;
+  while (i < body.size())
+  {
+    size_t n = 1 + next() % most;
+    if (n > body.size() - i)
+      n = body.size() - i;
+    ok = decoder.feed(body.data() + i, n);
+    i += n;
+  }
+  return ok;
+}
+
+// The JSON line of a body, empty if it doesn't decode or a frame doesn't parse
+static std::string jsonLine(const Bytes &body, size_t &events)
+{
+  std::vector<Frame> frames;
+  RgwDecoder decoder(onFrame, &frames);
+  if (!feedPieces(decoder, body, 64) || !decoder.complete())
+    return std::string();
+  std::string line;
+  RgwJsonWriter writer(onText, &line);
+  for (const Frame &f : frames)
+  {
+    if (!writer.frame(f.type, f.payload.data(), f.payload.size()))
+      return std::string();
+  }
+  events = writer.events();
+  return line;
+}
+
+static const uint8_t mac[6] = {0x02, 0x52, 0x47, 0x00, 0x00, 0x01};
+static const uint8_t addr[6] = {0x06, 0x05, 0x04, 0x03, 0x02, 0x01};
+static const uint8_t other[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0xC0};
+static const uint8_t name[3] = {'t', 'a', 'g'};
+static const uint8_t man[3] = {0x4C, 0x00, 0x02};
+static const uint8_t seriesDt[2] = {1, 2};
+static const int8_t seriesDrssi[2] = {-10, 20};
+// 0x180a, 0x2a29, 0x00000201 and 0000fee0-0000-1000-8000-00805f9b34fb, little endian
+static const uint8_t svc16[2] = {0x0A, 0x18};
+static const uint8_t chr16[2] = {0x29, 0x2A};
+static const uint8_t chr32[4] = {0x01, 0x02, 0x00, 0x00};
+static const uint8_t svc128[16] = {0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80,
+                                   0x00, 0x10, 0x00, 0x00, 0xE0, 0xFE, 0x00, 0x00};
+static const uint8_t value[2] = {'a', 'b'};
+static const uint32_t stats[2] = {1000, 42};
+
+static RgwAdv advertisement()
+{
+  RgwAdv adv = {};
+  adv.addr = addr;
+  adv.addrType = 1;
+  adv.rssi = -60;
+  adv.flags = 0x01;
+  adv.name = name;
+  adv.nameLen = 3;
+  adv.man = man;
+  adv.manLen = 3;
+  adv.hits = 3;
+  adv.rssiMin = -70;
+  adv.rssiMax = -50;
+  adv.rssiMean = -60;
+  adv.first = 1000;
+  adv.last = 1300;
+  adv.rssiFirst = -60;
+  adv.seriesLen = 2;
+  adv.seriesDt = seriesDt;
+  adv.seriesDrssi = seriesDrssi;
+  return adv;
+}
+
+// A body of every frame type, its frames kept apart for the parsers
+static Bytes sampleBody(std::vector<Frame> &frames)
+{
+  Bytes body;
+  uint8_t frame[RGW_MAX_FRAME];
+  body.insert(body.end(), frame, frame + rgwWriteHeader(frame));
+  size_t n;
+  RgwInfo info = {mac, 3, 1000, 5, 6, 0xC0FFEE};
+#define ADD(write)                                   \
+  n = write;                                         \
+  frames.push_back(frameOf(frame, n));               \
+  body.insert(body.end(), frame, frame + n)
+  ADD(rgwWriteInfo(frame, info));
+  ADD(rgwWriteSeq(frame, 7));
+  ADD(rgwWriteAdv(frame, advertisement()));
+  ADD(rgwWriteGatt(frame, RGW_FRAME_GATT, addr, svc16, 2, chr16, 2, RGW_PROP_READ, value, 2));
+  ADD(rgwWriteGatt(frame, RGW_FRAME_GATT, addr, svc128, 16, chr32, 4, 0x10, value, 0));
+  // A frame type from a newer collector
+  frame[RGW_FRAME_HEADER_SIZE] = 0xAA;
+  ADD(rgwFinishFrame(frame, 0x42, 1));
+  ADD(rgwWriteSeq(frame, 8));
+  ADD(rgwWriteGatt(frame, RGW_FRAME_GATT, other, svc16, 2, chr16, 2, RGW_PROP_READ, value, 1));
+  ADD(rgwWriteGatt(frame, RGW_FRAME_GATT_CACHED, other, svc128, 16, chr16, 2, RGW_PROP_READ, value, 2));
+  ADD(rgwWriteGatt(frame, RGW_FRAME_GATT_FAILED, other, svc128, 16, chr32, 4, RGW_PROP_READ, value, 0));
+  ADD(rgwWriteStats(frame, stats, 2));
+  ADD(rgwWriteEnd(frame, 8, true));
+#undef ADD
+  return body;
+}
+
+static const char expectedLine[] =
+    "{\"mac\":\"02:52:47:00:00:01\",\"epoch\":12648430,\"now\":1000,\"dropped\":3,"
+    "\"cache_hits\":5,\"cache_misses\":6,\"logs\":["
+    "{\"addr\":\"01:02:03:04:05:06\",\"seq\":7,\"name\":\"746167\",\"rssi\":-60,\"man\":\"4c0002\","
+    "\"connectable\":true,\"addr_type\":1,\"hits\":3,\"first\":1000,\"last\":1300,"
+    "\"rssi_min\":-70,\"rssi_max\":-50,\"rssi_mean\":-60,\"rssi_t\":[0,100,300],\"rssi_v\":[-60,-70,-50],"
+    "\"tree\":[{\"svc\":\"0x180a\",\"chr\":\"0x2a29\",\"val\":\"6162\",\"prop\":2},"
+    "{\"svc\":\"0000fee0-0000-1000-8000-00805f9b34fb\",\"chr\":\"0x00000201\",\"prop\":16}]},"
+    "{\"addr\":\"c0:00:00:00:00:02\",\"seq\":8,\"tree\":[{\"svc\":\"0x180a\",\"chr\":\"0x2a29\",\"val\":\"61\",\"prop\":2},"
+    "{\"svc\":\"0000fee0-0000-1000-8000-00805f9b34fb\",\"chr\":\"0x2a29\",\"val\":\"6162\",\"cached\":true,"
+    "\"prop\":2},{\"svc\":\"0000fee0-0000-1000-8000-00805f9b34fb\",\"chr\":\"0x00000201\",\"read_failed\":true,"
+    "\"prop\":2}]}],"
+    "\"stats\":{\"interval_ms\":1000,\"adv_seen\":42},\"last_seq\":8,\"more\":true}";
+
+int main()
+{
+  std::vector<Frame> written;
+  Bytes body = sampleBody(written);
+
+  // Each frame through its parser
+  RgwInfo info;
+  const Frame &infoFrame = written[0];
+  check(rgwParseInfo(infoFrame.payload.data(), infoFrame.payload.size(), info) && memcmp(info.mac, mac, 6) == 0 &&
+            info.dropped == 3 && info.now == 1000 && info.cacheHits == 5 && info.cacheMisses == 6 &&
+            info.epoch == 0xC0FFEE,
+        "INFO parses as written");
+
+  check(written[1].payload.size() == 4 && rgwGetU32(written[1].payload.data()) == 7, "SEQ holds its number");
+
+  RgwAdv adv;
+  RgwAdv sent = advertisement();
+  const Frame &advFrame = written[2];
+  bool advOk = rgwParseAdv(advFrame.payload.data(), advFrame.payload.size(), adv);
+  check(advOk && memcmp(adv.addr, addr, 6) == 0 && adv.addrType == 1 && adv.rssi == -60 && adv.flags == 0x01 &&
+            adv.nameLen == 3 && memcmp(adv.name, name, 3) == 0 && adv.manLen == 3 && memcmp(adv.man, man, 3) == 0,
+        "ADV parses its address, name and data");
+  check(advOk && adv.hits == sent.hits && adv.rssiMin == sent.rssiMin && adv.rssiMax == sent.rssiMax &&
+            adv.rssiMean == sent.rssiMean && adv.first == sent.first && adv.last == sent.last &&
+            adv.rssiFirst == sent.rssiFirst && adv.seriesLen == 2 && adv.series[0] == 1 &&
+            (int8_t)adv.series[1] == -10 && adv.series[2] == 2 && (int8_t)adv.series[3] == 20,
+        "ADV parses its counts and RSSI series");
+
+  RgwGatt gatt;
+  const Frame &shortGatt = written[3];
+  check(rgwParseGatt(shortGatt.payload.data(), shortGatt.payload.size(), gatt) && memcmp(gatt.addr, addr, 6) == 0 &&
+            gatt.svcLen == 2 && memcmp(gatt.svc, svc16, 2) == 0 && gatt.chrLen == 2 &&
+            memcmp(gatt.chr, chr16, 2) == 0 && gatt.prop == RGW_PROP_READ && gatt.valLen == 2 &&
+            memcmp(gatt.val, value, 2) == 0,
+        "GATT parses with 16-bit UUIDs");
+  const Frame &longGatt = written[4];
+  check(rgwParseGatt(longGatt.payload.data(), longGatt.payload.size(), gatt) && gatt.svcLen == 16 &&
+            memcmp(gatt.svc, svc128, 16) == 0 && gatt.chrLen == 4 && memcmp(gatt.chr, chr32, 4) == 0 &&
+            gatt.prop == 0x10 && gatt.valLen == 0,
+        "GATT parses with 128 and 32-bit UUIDs");
+  const Frame &cachedGatt = written[8];
+  check(cachedGatt.type == RGW_FRAME_GATT_CACHED &&
+            rgwParseGatt(cachedGatt.payload.data(), cachedGatt.payload.size(), gatt) && gatt.valLen == 2 &&
+            memcmp(gatt.val, value, 2) == 0,
+        "a cached value is a GATT_CACHED frame");
+  const Frame &failedGatt = written[9];
+  check(failedGatt.type == RGW_FRAME_GATT_FAILED &&
+            rgwParseGatt(failedGatt.payload.data(), failedGatt.payload.size(), gatt) && gatt.valLen == 0,
+        "a read that failed is a GATT_FAILED frame");
+
+  const uint8_t *values;
+  uint8_t count;
+  const Frame &statsFrame = written[10];
+  check(rgwParseStats(statsFrame.payload.data(), statsFrame.payload.size(), values, count) && count == 2 &&
+            rgwGetU32(values) == 1000 && rgwGetU32(values + 4) == 42,
+        "STATS parses its values");
+
+  const Frame &endFrame = written[11];
+  check(endFrame.type == RGW_FRAME_END && endFrame.payload.size() == 5 && rgwGetU32(endFrame.payload.data()) == 8 &&
+            endFrame.payload[4] == 1,
+        "END holds the last record and more");
+
+  // A payload one byte short or one too long doesn't parse
+  bool shortRejected = true;
+  bool longRejected = true;
+  for (const Frame &f : written)
+  {
+    Bytes p = f.payload;
+    p.push_back(0);
+    size_t len = f.payload.size();
+    RgwInfo i;
+    RgwAdv a;
+    RgwGatt g;
+    if (f.type == RGW_FRAME_INFO)
+    {
+      shortRejected = shortRejected && !rgwParseInfo(p.data(), len - 1, i);
+      longRejected = longRejected && !rgwParseInfo(p.data(), len + 1, i);
+    }
+    if (f.type == RGW_FRAME_ADV)
+    {
+      for (size_t cut = 0; cut < len; cut++)
+        shortRejected = shortRejected && !rgwParseAdv(p.data(), cut, a);
+      longRejected = longRejected && !rgwParseAdv(p.data(), len + 1, a);
+    }
+    if (f.type == RGW_FRAME_GATT || f.type == RGW_FRAME_GATT_CACHED || f.type == RGW_FRAME_GATT_FAILED)
+    {
+      for (size_t cut = 0; cut < len; cut++)
+        shortRejected = shortRejected && !rgwParseGatt(p.data(), cut, g);
+      longRejected = longRejected && !rgwParseGatt(p.data(), len + 1, g);
+    }
+    if (f.type == RGW_FRAME_STATS)
+    {
+      shortRejected = shortRejected && !rgwParseStats(p.data(), len - 1, values, count);
+      longRejected = longRejected && !rgwParseStats(p.data(), len + 1, values, count);
+    }
+  }
+  check(shortRejected, "payloads cut short don't parse");
+  check(longRejected, "payloads with a byte too many don't parse");
+
+  // The encoders keep to the limits
+  uint8_t frame[RGW_MAX_FRAME + 64];
+  uint8_t big[600] = {};
+  uint8_t dt[100] = {};
+  int8_t drssi[100] = {};
+  RgwAdv largest = advertisement();
+  largest.name = big;
+  largest.nameLen = 255;
+  largest.man = big;
+  largest.manLen = 255;
+  largest.seriesLen = 100;
+  largest.seriesDt = dt;
+  largest.seriesDrssi = drssi;
+  size_t n = rgwWriteAdv(frame, largest);
+  check(n == RGW_FRAME_HEADER_SIZE + RGW_MAX_ADV_PAYLOAD && n <= RGW_MAX_FRAME &&
+            rgwParseAdv(frame + RGW_FRAME_HEADER_SIZE, n - RGW_FRAME_HEADER_SIZE, adv) &&
+            adv.seriesLen == RGW_MAX_SERIES,
+        "the longest ADV fits, its series cut short");
+  n = rgwWriteGatt(frame, RGW_FRAME_GATT, addr, big, 20, big, 20, RGW_PROP_READ, big, sizeof(big));
+  check(n == RGW_FRAME_HEADER_SIZE + RGW_MAX_GATT_PAYLOAD &&
+            rgwParseGatt(frame + RGW_FRAME_HEADER_SIZE, n - RGW_FRAME_HEADER_SIZE, gatt) && gatt.svcLen == 16 &&
+            gatt.chrLen == 16 && gatt.valLen == RGW_MAX_VALUE,
+        "the longest GATT fits, UUIDs and value clamped");
+
+  // The body through the decoder in pieces of every size
+  bool same = true;
+  for (size_t most = 1; most <= body.size(); most++)
+  {
+    std::vector<Frame> frames;
+    RgwDecoder decoder(onFrame, &frames);
+    same = same && feedPieces(decoder, body, most) && decoder.complete() && frames == written;
+  }
+  check(same, "the decoder hands over every frame as written");
+
+  // And on to the JSON line
+  size_t events = 0;
+  std::string line = jsonLine(body, events);
+  check(line == expectedLine, "the JSON line matches the collector's");
+  check(events == 2, "one entry per record");
+  if (line != expectedLine)
+    printf("%s\n", line.c_str());
+
+  // Two records of one address, its manufacturer data changed in between,
+  // make two entries that both keep it
+  Bytes twice(body.begin(), body.begin() + RGW_HEADER_SIZE);
+  twice.insert(twice.end(), frame, frame + rgwWriteInfo(frame, info));
+  RgwAdv changed = advertisement();
+  for (uint32_t s = 1; s <= 2; s++)
+  {
+    twice.insert(twice.end(), frame, frame + rgwWriteSeq(frame, s));
+    twice.insert(twice.end(), frame, frame + rgwWriteAdv(frame, changed));
+    changed.manLen = 2;
+  }
+  twice.insert(twice.end(), frame, frame + rgwWriteEnd(frame, 2, false));
+  line = jsonLine(twice, events);
+  size_t at = line.find("{\"addr\":\"01:02:03:04:05:06\",\"seq\":1,");
+  check(events == 2 && at != std::string::npos &&
+            line.find("{\"addr\":\"01:02:03:04:05:06\",\"seq\":2,", at) != std::string::npos,
+        "records of one address keep an entry each");
+
+  RgwJsonWriter writer(onText, &line);
+  uint8_t seq[4] = {};
+  check(!writer.frame(RGW_FRAME_SEQ, seq, 4), "a frame before INFO is refused");
+  writer.frame(infoFrame.type, infoFrame.payload.data(), infoFrame.payload.size());
+  check(!writer.frame(infoFrame.type, infoFrame.payload.data(), infoFrame.payload.size()), "a second INFO is refused");
+  check(!writer.frame(RGW_FRAME_ADV, advFrame.payload.data(), advFrame.payload.size() - 1), "a malformed ADV is refused");
+  check(!writer.frame(RGW_FRAME_SEQ, seq, 3), "a malformed SEQ is refused");
+
+  // Streams cut short anywhere never complete, and are not taken for broken
+  bool incomplete = true;
+  for (size_t cut = 0; cut < body.size(); cut++)
+  {
+    std::vector<Frame> frames;
+    RgwDecoder decoder(onFrame, &frames);
+    bool ok = decoder.feed(body.data(), cut);
+    incomplete = incomplete && ok && !decoder.complete() && !decoder.failed();
+  }
+  check(incomplete, "a stream cut short never completes");
+
+  // A frame longer than any the format has
+  Bytes oversized(body.begin(), body.begin() + RGW_HEADER_SIZE);
+  oversized.push_back(RGW_FRAME_GATT);
+  oversized.push_back((RGW_MAX_PAYLOAD + 1) & 0xFF);
+  oversized.push_back((RGW_MAX_PAYLOAD + 1) >> 8);
+  oversized.resize(oversized.size() + RGW_MAX_PAYLOAD + 1);
+  std::vector<Frame> frames;
+  RgwDecoder decoder(onFrame, &frames);
+  check(!decoder.feed(oversized.data(), oversized.size()) && decoder.failed() && frames.empty(),
+        "an oversized frame fails the stream");
+
+  // The largest frame the format has still goes through
+  Bytes largestBody(body.begin(), body.begin() + RGW_HEADER_SIZE);
+  n = rgwWriteAdv(frame, largest);
+  largestBody.insert(largestBody.end(), frame, frame + n);
+  n = rgwWriteEnd(frame, 0, false);
+  largestBody.insert(largestBody.end(), frame, frame + n);
+  frames.clear();
+  decoder.reset();
+  check(feedPieces(decoder, largestBody, 100) && decoder.complete() && frames.size() == 2 &&
+            frames[0].payload.size() == RGW_MAX_ADV_PAYLOAD,
+        "the largest frame decodes");
+
+  Bytes version = body;
+  version[3] = RGW_VERSION + 1;
+  frames.clear();
+  decoder.reset();
+  check(!decoder.feed(version.data(), version.size()) && decoder.failed() && frames.empty(),
+        "another version fails the stream");
+
+  Bytes trailing = body;
+  trailing.push_back(RGW_FRAME_SEQ);
+  frames.clear();
+  decoder.reset();
+  check(!decoder.feed(trailing.data(), trailing.size()) && !decoder.complete(), "bytes after END fail the stream");
+
+  // PACKED contents come without the stream header
+  Bytes bare(body.begin() + RGW_HEADER_SIZE, body.end());
+  frames.clear();
+  decoder.resetFrames();
+  check(feedPieces(decoder, bare, 16) && decoder.complete() && frames == written, "frames decode without the header");
+
+  return failures ? 1 : 0;
+}
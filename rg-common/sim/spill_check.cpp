@@ -0,0 +1,194 @@
+// Spill log check
+// Runs the spill log (spilllog.h) against a file standing in for the flash
+// partition: fill and drain, remount, a write torn by a power cut, and how
+// evenly segments wear over many fill/drain rounds.
+//
+// Build and run on a host:
+//   g++ -O2 -I ../include -o spill_check spill_check.cpp && ./spill_check
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "spilllog.h"
+
+#define SEGMENTS 64
+#define ROUNDS 400
+
+// File backed flash: writes AND into what is there like NOR flash does, and
+// a write budget can cut power part way through a write
+class FileSpillDevice : public SpillDevice
+{
+public:
+  FileSpillDevice(const char *path, uint32_t bytes) : budget(-1), bytes(bytes)
+  {
+    file = fopen(path, "w+b");
+    uint8_t erased[SPILL_SEGMENT_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    for (uint32_t i = 0; i < bytes / SPILL_SEGMENT_SIZE; i++)
+      fwrite(erased, 1, sizeof(erased), file);
+  }
+
+  ~FileSpillDevice()
+  {
+    fclose(file);
+  }
+
+  uint32_t size() override
+  {
+    return bytes;
+  }
+
+  bool read(uint32_t offset, void *data, size_t length) override
+  {
+    return offset + length <= bytes && fseek(file, offset, SEEK_SET) == 0 && fread(data, 1, length, file) == length;
+  }
+
+  bool write(uint32_t offset, const void *data, size_t length) override
+  {
+    uint8_t old[SPILL_SEGMENT_SIZE];
+    if (length > sizeof(old) || !read(offset, old, length))
+      return false;
+    size_t n = length;
+    if (budget >= 0 && (long)n > budget)
+      n = budget;
+    for (size_t i = 0; i < n; i++)
+      old[i] &= ((const uint8_t *)data)[i];
+    fseek(file, offset, SEEK_SET);
+    fwrite(old, 1, n, file);
+    if (budget >= 0)
+      budget -= n;
+    return n == length;
+  }
+
+  bool erase(uint32_t offset) override
+  {
+    if (offset % SPILL_SEGMENT_SIZE != 0 || offset >= bytes || budget == 0)
+      return false;
+    uint8_t erased[SPILL_SEGMENT_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    fseek(file, offset, SEEK_SET);
+    return fwrite(erased, 1, sizeof(erased), file) == sizeof(erased);
+  }
+
+  // Bytes that may still be written before the power goes, -1 = no limit
+  long budget;
+
+private:
+  FILE *file;
+  uint32_t bytes;
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%-52s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    failures++;
+}
+
+// Record i: a few bytes whose length and contents depend on i
+static uint16_t makeRecord(uint32_t i, uint8_t *data)
+{
+  uint16_t length = 1 + (i * 37) % 300;
+  for (uint16_t j = 0; j < length; j++)
+    data[j] = (uint8_t)(i * 7 + j);
+  return length;
+}
+
+// Read every live record and check they are first, first + 1, ...
+static bool readsBack(SpillLog &log, uint32_t first, uint32_t count)
+{
+  SpillCursor cursor;
+  log.rewind(cursor);
+  uint8_t data[SPILL_RECORD_MAX];
+  uint8_t want[SPILL_RECORD_MAX];
+  uint32_t n = 0;
+  int length;
+  while ((length = log.read(cursor, data)) >= 0)
+  {
+    uint16_t wantLength = makeRecord(first + n, want);
+    if (length != wantLength || memcmp(data, want, length) != 0)
+      return false;
+    n++;
+  }
+  return n == count;
+}
+
+static uint32_t fill(SpillLog &log, uint32_t first)
+{
+  uint8_t data[SPILL_RECORD_MAX];
+  uint32_t n = 0;
+  while (log.append(data, makeRecord(first + n, data)))
+    n++;
+  return n;
+}
+
+int main()
+{
+  check(spillCrc32((const uint8_t *)"123456789", 9) == 0xCBF43926, "CRC-32 check value");
+
+  FileSpillDevice dev("spill_check.bin", SEGMENTS * SPILL_SEGMENT_SIZE);
+  static SpillLog log;
+  check(log.mount(dev) && log.count() == 0, "blank device mounts empty");
+
+  uint32_t filled = fill(log, 0);
+  log.takeDropped();
+  check(filled > 0 && log.count() == filled, "fills until full");
+  check(readsBack(log, 0, filled), "reads back in order");
+
+  uint32_t half = filled / 2;
+  check(log.release(half) == half && log.count() == filled - half, "releases the oldest half");
+  check(readsBack(log, half, filled - half), "reads back the rest");
+
+  static SpillLog remounted;
+  check(remounted.mount(dev) && remounted.count() == filled - half, "remount keeps live records");
+  check(readsBack(remounted, half, filled - half), "remount keeps their order");
+
+  // Room freed by the release is reused, and the order carries on
+  uint32_t more = fill(remounted, filled);
+  check(more > 0 && readsBack(remounted, half, filled - half + more), "appends after remount");
+
+  // Power goes halfway through a record's data
+  remounted.release(remounted.count());
+  uint8_t data[SPILL_RECORD_MAX];
+  for (uint32_t i = 0; i < 10; i++)
+    remounted.append(data, makeRecord(i, data));
+  dev.budget = SPILL_RECORD_HEADER + 20;
+  remounted.append(data, makeRecord(10, data));
+  dev.budget = -1;
+  static SpillLog torn;
+  check(torn.mount(dev) && readsBack(torn, 0, 10), "torn record is dropped on mount");
+  check(torn.append(data, makeRecord(10, data)) && readsBack(torn, 0, 11), "appends after a torn record");
+
+  // Fill and drain, a record at a time, like syncs against a slow logger
+  uint32_t next = 11;
+  uint32_t oldest = 0;
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    for (int i = 0; i < 200; i++)
+    {
+      if (torn.append(data, makeRecord(next, data)))
+        next++;
+      else
+        break;
+    }
+    oldest += torn.release(150 + round % 100);
+  }
+  check(readsBack(torn, oldest, next - oldest), "order holds over fill/drain rounds");
+
+  uint32_t least = 0xFFFFFFFF;
+  uint32_t most = 0;
+  for (uint16_t s = 0; s < torn.segmentCount(); s++)
+  {
+    if (torn.erases(s) < least)
+      least = torn.erases(s);
+    if (torn.erases(s) > most)
+      most = torn.erases(s);
+  }
+  printf("\nsegment erases after %d rounds: least %u, most %u\n", ROUNDS, least, most);
+  check(most - least <= 2, "wear stays even");
+
+  remove("spill_check.bin");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+// RG Log tool
+// Checks the .rgl segments rg-logger writes to the SD card (see rglog.h) and
+// turns them into JSON lines for rg-loader.
+//
+//   rglog check rg/*.rgl
+// reads every frame of each segment and its index footer and prints what it
+// found, exiting 1 unless every segment reads clean.
+//
+//   rglog export [--collector MAC] [--since T] [--until T] rg/*.rgl > log.jsonl
+// writes one JSON line per frame, rgw bodies decoded. Only frames from that
+// collector, and written at or after since and before until (seconds since
+// 1970 by the logger's clock), are exported; segments with an index footer
+// are only read at the frames it lists for them. Damaged frames are skipped
+// and counted on stderr.
+//
+// Build and run on a host:
+//   g++ -O2 -I ../include -o rglog rglog.cpp && ./rglog check rg/*.rgl
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "rglog.h"
+#include "rgwbody.h"
+
+struct Filter
+{
+  bool byCollector;
+  uint8_t collector[6];
+  uint32_t since;
+  uint32_t until;
+
+  bool any() const
+  {
+    return byCollector || since > 0 || until < UINT32_MAX;
+  }
+
+  bool matches(const uint8_t mac[6], uint32_t time) const
+  {
+    return (!byCollector || memcmp(mac, collector, 6) == 0) && time >= since && time < until;
+  }
+};
+
+struct Totals
+{
+  uint32_t segments;
+  uint32_t frames;
+  uint32_t records;
+  uint32_t corrupt;
+  size_t skipped;
+  uint32_t undecodable;
+  uint32_t unindexed;
+  uint32_t badIndex;
+};
+
+static void exportFrame(const RglFrame &frame, RgwBody &body, Totals &totals)
+{
+  std::string line;
+  if (frame.kind == RGL_KIND_JSON)
+  {
+    line.assign((const char *)frame.payload, frame.length);
+    // Bodies from older collectors may end in a newline of their own
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r' || line.back() == ' '))
+      line.pop_back();
+  }
+  else if (frame.kind != RGL_KIND_RGW || !body.convert(frame.payload, frame.length, line))
+  {
+    totals.undecodable++;
+    return;
+  }
+  else
+  {
+    totals.records += body.events();
+  }
+  line += '\n';
+  fwrite(line.data(), 1, line.size(), stdout);
+}
+
+// Export the frames of an indexed segment the filter picks out of its index
+static void exportIndexed(const std::vector<uint8_t> &data, const RglIndex &index, const Filter &filter,
+                          RgwBody &body, Totals &totals)
+{
+  RglReader reader(data.data(), data.size(), &index);
+  for (uint16_t e = 0; e < index.count; e++)
+  {
+    const RglIndexEntry &entry = index.entries[e];
+    if (!filter.matches(index.collectors[entry.collector], entry.time))
+      continue;
+    RglFrame frame;
+    reader.seek(entry.offset);
+    if (!reader.next(frame) || reader.offset() != entry.offset)
+    {
+      totals.corrupt++;
+      continue;
+    }
+    totals.frames++;
+    exportFrame(frame, body, totals);
+  }
+}
+
+// Read one segment front to back, checking its frames against its index
+static void readSegment(const char *path, const std::vector<uint8_t> &data, bool exporting, const Filter &filter,
+                        RgwBody &body, Totals &totals)
+{
+  static RglIndex index;
+  bool indexed = index.parse(data.data(), data.size());
+  totals.segments++;
+  if (exporting && indexed && filter.any())
+  {
+    exportIndexed(data, index, filter, body, totals);
+    return;
+  }
+  RglReader reader(data.data(), data.size(), indexed ? &index : nullptr);
+  RglFrame frame;
+  uint32_t n = 0;
+  uint16_t e = 0;
+  bool indexOk = true;
+  while (reader.next(frame))
+  {
+    // Every frame has its entry, those of damaged frames are passed over
+    while (indexed && e < index.count && index.entries[e].offset < reader.offset())
+      e++;
+    if (indexed)
+    {
+      const RglIndexEntry *entry = e < index.count ? &index.entries[e++] : nullptr;
+      if (!entry || entry->offset != reader.offset() || entry->time != frame.time || entry->seq != frame.seq ||
+          memcmp(index.collectors[entry->collector], frame.collector, 6) != 0)
+        indexOk = false;
+    }
+    n++;
+    if (exporting && filter.matches(frame.collector, frame.time))
+      exportFrame(frame, body, totals);
+  }
+  totals.frames += n;
+  totals.corrupt += reader.corruptFrames();
+  totals.skipped += reader.skippedBytes();
+  totals.unindexed += !indexed;
+  totals.badIndex += !indexOk;
+  if (!exporting)
+  {
+    printf("%s: %u frames, %u damaged, %zu bytes skipped, %s\n", path, n, reader.corruptFrames(),
+           reader.skippedBytes(), !indexed ? "no index" : indexOk ? "index ok" : "index doesn't match the frames");
+  }
+}
+
+static bool readAll(FILE *in, std::vector<uint8_t> &data)
+{
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+    data.insert(data.end(), chunk, chunk + n);
+  return !ferror(in);
+}
+
+static int usage()
+{
+  fprintf(stderr, "usage: rglog check SEGMENT...\n"
+                  "       rglog export [--collector MAC] [--since T] [--until T] SEGMENT...\n");
+  return 2;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3 || (strcmp(argv[1], "check") != 0 && strcmp(argv[1], "export") != 0))
+    return usage();
+  bool exporting = strcmp(argv[1], "export") == 0;
+  Filter filter = {false, {}, 0, UINT32_MAX};
+  int f = 2;
+  for (; exporting && f + 1 < argc && strncmp(argv[f], "--", 2) == 0; f += 2)
+  {
+    uint8_t *m = filter.collector;
+    if (strcmp(argv[f], "--collector") == 0 &&
+        sscanf(argv[f + 1], "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) == 6)
+      filter.byCollector = true;
+    else if (strcmp(argv[f], "--since") == 0)
+      filter.since = strtoul(argv[f + 1], nullptr, 10);
+    else if (strcmp(argv[f], "--until") == 0)
+      filter.until = strtoul(argv[f + 1], nullptr, 10);
+    else
+      return usage();
+  }
+  if (f >= argc)
+    return usage();
+
+  RgwBody body;
+  Totals totals = {};
+  std::vector<uint8_t> data;
+  for (; f < argc; f++)
+  {
+    FILE *in = fopen(argv[f], "rb");
+    data.clear();
+    if (!in || !readAll(in, data))
+    {
+      fprintf(stderr, "can't read %s\n", argv[f]);
+      return 2;
+    }
+    fclose(in);
+    readSegment(argv[f], data, exporting, filter, body, totals);
+  }
+  fprintf(exporting ? stderr : stdout,
+          "%u segments, %u frames, %u damaged, %zu bytes skipped, %u without index, %u with a bad index",
+          totals.segments, totals.frames, totals.corrupt, totals.skipped, totals.unindexed, totals.badIndex);
+  if (exporting)
+    fprintf(stderr, ", %u records from rgw bodies, %u not decoded", totals.records, totals.undecodable);
+  fprintf(exporting ? stderr : stdout, "\n");
+  if (exporting)
+    return 0;
+  return totals.corrupt || totals.skipped || totals.badIndex ? 1 : 0;
+}
@@ -0,0 +1,101 @@
+// rgw to JSONL
+// Turns the rgw bodies earlier rg-logger firmware appended to .rgw segments
+// (packed ones, see rgpack.h) into the JSON lines it would have written to
+// the .jsonl ones, one per body, ready for rg-loader. The .rgl segments
+// written now go through rglog instead. The zeros a segment ends with are
+// passed over, a body that doesn't decode is skipped up to the next stream
+// header and counted on stderr.
+//
+// Build and run on a host:
+//   g++ -O2 -I ../include -o rgw2jsonl rgw2jsonl.cpp && ./rgw2jsonl rg/*.rgw >> log.jsonl
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "rgwbody.h"
+
+static size_t nextHeader(const std::vector<uint8_t> &data, size_t from)
+{
+  for (size_t i = from; i + RGW_HEADER_SIZE <= data.size(); i++)
+  {
+    if (data[i] == 'R' && memcmp(&data[i], "RGW", 3) == 0 && data[i + 3] == RGW_VERSION)
+      return i;
+  }
+  return data.size();
+}
+
+struct Totals
+{
+  uint32_t bodies;
+  uint32_t records;
+  uint32_t skipped;
+};
+
+static void convert(const std::vector<uint8_t> &data, RgwBody &body, Totals &totals)
+{
+  std::string line;
+  size_t i = 0;
+  while (i < data.size())
+  {
+    // Segment padding, not a damaged body
+    if (data[i] == 0)
+    {
+      while (i < data.size() && data[i] == 0)
+        i++;
+      continue;
+    }
+    size_t len = RgwBody::length(&data[i], data.size() - i);
+    if (len == 0 || !body.convert(&data[i], len, line))
+    {
+      totals.skipped++;
+      i = nextHeader(data, i + 1);
+      continue;
+    }
+    line += '\n';
+    fwrite(line.data(), 1, line.size(), stdout);
+    totals.bodies++;
+    totals.records += body.events();
+    i += len;
+  }
+}
+
+static bool readAll(FILE *in, std::vector<uint8_t> &data)
+{
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+    data.insert(data.end(), chunk, chunk + n);
+  return !ferror(in);
+}
+
+int main(int argc, char **argv)
+{
+  RgwBody body;
+  Totals totals = {};
+  std::vector<uint8_t> data;
+  if (argc < 2)
+  {
+    if (!readAll(stdin, data))
+    {
+      fprintf(stderr, "can't read stdin\n");
+      return 2;
+    }
+    convert(data, body, totals);
+  }
+  // Bodies never span segments, each file is read on its own
+  for (int f = 1; f < argc; f++)
+  {
+    FILE *in = fopen(argv[f], "rb");
+    data.clear();
+    if (!in || !readAll(in, data))
+    {
+      fprintf(stderr, "can't read %s\n", argv[f]);
+      return 2;
+    }
+    fclose(in);
+    convert(data, body, totals);
+  }
+  fprintf(stderr, "%u bodies, %u records, %u skipped\n", totals.bodies, totals.records, totals.skipped);
+  return 0;
+}
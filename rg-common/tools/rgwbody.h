@@ -0,0 +1,83 @@
+#pragma once
+#include <string>
+
+#include "rgpack.h"
+#include "rgwire.h"
+
+// rgw body to JSON
+// Turns one whole rgw body, packed (see rgpack.h) or not, into the JSON line
+// RgwJsonWriter makes of it, for the host tools.
+class RgwBody
+{
+public:
+  RgwBody() : writer(onText, this), unpacker(onFrame, this), bad(false) {}
+
+  // Length of the body starting at data (through its END frame), 0 if it
+  // runs past the end or isn't one
+  static size_t length(const uint8_t *data, size_t length)
+  {
+    if (length < RGW_HEADER_SIZE || memcmp(data, "RGW", 3) != 0 || data[3] != RGW_VERSION)
+      return 0;
+    size_t i = RGW_HEADER_SIZE;
+    while (i + RGW_FRAME_HEADER_SIZE <= length)
+    {
+      uint8_t type = data[i];
+      size_t payloadLen = rgwGetU16(data + i + 1);
+      if (payloadLen > RGW_MAX_PAYLOAD)
+        return 0;
+      i += RGW_FRAME_HEADER_SIZE + payloadLen;
+      if (i > length)
+        return 0;
+      if (type == RGW_FRAME_END)
+        return i;
+    }
+    return 0;
+  }
+
+  // The JSON line of the body, without a newline. Returns false if it
+  // doesn't decode.
+  bool convert(const uint8_t *data, size_t length, std::string &out)
+  {
+    writer.reset();
+    unpacker.reset();
+    line.clear();
+    bad = false;
+    RgwDecoder decoder(onFrame, this);
+    decoder.feed(data, length);
+    if (bad || !decoder.complete() || unpacker.failed())
+      return false;
+    out = line;
+    return true;
+  }
+
+  // Records of the last body converted
+  size_t events() const
+  {
+    return writer.events();
+  }
+
+private:
+  RgwJsonWriter writer;
+  RgpUnpacker unpacker;
+  std::string line;
+  bool bad;
+
+  static void onText(void *ctx, const char *text, size_t length)
+  {
+    ((RgwBody *)ctx)->line.append(text, length);
+  }
+
+  static void onFrame(void *ctx, uint8_t type, const uint8_t *payload, uint16_t length)
+  {
+    RgwBody &body = *(RgwBody *)ctx;
+    if (type == RGW_FRAME_PACKED)
+    {
+      // The frames inside come back through here
+      if (!body.unpacker.frame(payload, length))
+        body.bad = true;
+      return;
+    }
+    if (!body.writer.frame(type, payload, length))
+      body.bad = true;
+  }
+};
@@ -12,21 +12,24 @@ import (
 )
 
 type LogLine struct {
-	SrcMac string         `json:"mac"`
-	Logs   map[string]Log `json:"logs"`
+	SrcMac string `json:"mac"`
+	Logs   []Log  `json:"logs"`
 }
 
 type Log struct {
+	Addr        string `json:"addr"`
 	Name        string `json:"name"`
 	Rssi        int    `json:"rssi"`
 	Man         string `json:"man"`
 	Connectable bool   `json:"connectable"`
 	AddrType    int    `json:"addr_type"`
 	Tree        []struct {
-		Svc  string `json:"svc"`
-		Chr  string `json:"chr"`
-		Val  string `json:"val"`
-		Prop int    `json:"prop"`
+		Svc        string `json:"svc"`
+		Chr        string `json:"chr"`
+		Val        string `json:"val"`
+		Cached     bool   `json:"cached"`
+		ReadFailed bool   `json:"read_failed"`
+		Prop       int    `json:"prop"`
 	} `json:"tree"`
 }
 
@@ -70,7 +73,8 @@ func ReadLog(path string, logch chan dbtools.RecordRow) {
 		var ll LogLine
 		err := json.Unmarshal(scanner.Bytes(), &ll)
 		if err == nil {
-			for mac, log := range ll.Logs {
+			for _, log := range ll.Logs {
+				mac := log.Addr
 				if isMacString(mac) {
 					var record dbtools.RecordRow
 					record.Gid = gid
@@ -108,9 +112,11 @@ func ReadLog(path string, logch chan dbtools.RecordRow) {
 							record.CharacteristicUUID = branch.Chr
 							//Properties
 							record.Properties = branch.Prop
-							//ReadValue
+							//ReadValue, not one the collector served from its GATT cache
+							//or one it couldn't read
+							record.ReadValue = nil
 							rv, err := hex.DecodeString(branch.Val)
-							if err == nil {
+							if err == nil && !branch.Cached && !branch.ReadFailed {
 								record.ReadValue = rv
 							}
 							//fmt.Println(record)
@@ -12,6 +12,9 @@ struct HealthStatus
   uint32_t channel;
   int eventCount;
   unsigned long lastUpdated;
+  // Collector boot epoch and last record on the card, sent back to acknowledge them
+  uint32_t epoch;
+  uint32_t cursor;
 };
 
 HealthStatus healthStatusList[MAX_HEALTH_ITEMS];
@@ -43,6 +46,8 @@ void addScannerToList(uint8_t mac[6], String ssid, int32_t channel)
   healthStatusList[seenScanners].channel = channel;
   healthStatusList[seenScanners].eventCount = 0;
   healthStatusList[seenScanners].lastUpdated = 0;
+  healthStatusList[seenScanners].epoch = 0;
+  healthStatusList[seenScanners].cursor = 0;
   seenScanners++;
 }
 
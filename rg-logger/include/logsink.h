@@ -0,0 +1,441 @@
+#include <Arduino.h>
+
+#include "rgpack.h"
+#include "rgwire.h"
+#include "segwriter.h"
+
+// Define how many times longer than a pull's LOG_PULL_BYTES its JSON line is
+// expected to be, binary records come out about 5 times longer as JSON. A
+// line that outgrows what is left of its segment is dropped and the pull
+// made again into the next one.
+#ifndef LOG_SINK_TEXT_RATIO
+#define LOG_SINK_TEXT_RATIO 6
+#endif
+// Define the bytes of a binary body held until its first record shows it is
+// packed or not: the header, INFO and STATS frames.
+#define LOG_SINK_PREFIX (RGW_HEADER_SIZE + 2 * RGW_MAX_FRAME)
+// Define the bytes of JSON text those frames make.
+#define LOG_SINK_TEXT_PREFIX 256
+
+// Counts the entries of the "logs" array of a JSON body as it goes past and
+// checks that the body is one whole object. Collectors before the array kept
+// "logs" an object keyed by address, its members count the same. Strings and
+// brackets are all it follows, which is as much as rg-loader needs of a line
+// to read it.
+class JsonLogCounter
+{
+public:
+  JsonLogCounter()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    depth = 0;
+    objects = 0;
+    inString = false;
+    escape = false;
+    expectKey = false;
+    capture = false;
+    keyLen = 0;
+    logsValue = false;
+    inLogs = false;
+    logsUsed = false;
+    commas = 0;
+    done = false;
+    bad = false;
+  }
+
+  void feed(const uint8_t *data, size_t length)
+  {
+    for (size_t i = 0; i < length && !bad; i++)
+    {
+      step((char)data[i]);
+    }
+  }
+
+  // The outermost object closed and nothing but whitespace followed
+  bool complete() const
+  {
+    return done && !bad;
+  }
+
+  size_t entries() const
+  {
+    return logsUsed ? commas + 1 : 0;
+  }
+
+private:
+  // Deeper than any collector nests
+  static const uint8_t MAX_DEPTH = 32;
+
+  uint8_t depth;
+  // Bit n is set when the bracket opened at depth n is an object
+  uint32_t objects;
+  bool inString;
+  bool escape;
+  // The next string at depth 1 is a member name
+  bool expectKey;
+  // Reading a member name of the outermost object
+  bool capture;
+  char key[4];
+  uint8_t keyLen;
+  bool logsValue;
+  bool inLogs;
+  bool logsUsed;
+  size_t commas;
+  bool done;
+  bool bad;
+
+  void step(char c)
+  {
+    if (inString)
+    {
+      if (escape)
+        escape = false;
+      else if (c == '\\')
+        escape = true;
+      else if (c == '"')
+        inString = false;
+      else if (capture)
+      {
+        // Longer names only need to be told apart from "logs"
+        if (keyLen < sizeof(key))
+          key[keyLen] = c;
+        if (keyLen <= sizeof(key))
+          keyLen++;
+      }
+      return;
+    }
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+      return;
+    // Only the object itself, and it has to come first
+    if (done || (depth == 0 && c != '{'))
+    {
+      bad = true;
+      return;
+    }
+    if (inLogs && depth == 2 && c != '}' && c != ']')
+      logsUsed = true;
+    switch (c)
+    {
+    case '"':
+      inString = true;
+      capture = depth == 1 && expectKey;
+      keyLen = 0;
+      break;
+    case '{':
+    case '[':
+      if (depth == MAX_DEPTH)
+      {
+        bad = true;
+        return;
+      }
+      if (c == '{')
+        objects |= 1UL << depth;
+      else
+        objects &= ~(1UL << depth);
+      if (depth == 1 && logsValue)
+        inLogs = true;
+      depth++;
+      expectKey = depth == 1;
+      break;
+    case '}':
+    case ']':
+      if (((objects >> (depth - 1)) & 1) != (c == '}'))
+      {
+        bad = true;
+        return;
+      }
+      depth--;
+      if (depth == 1)
+        inLogs = false;
+      done = depth == 0;
+      break;
+    case ',':
+      if (depth == 1)
+      {
+        expectKey = true;
+        logsValue = false;
+      }
+      if (inLogs && depth == 2)
+        commas++;
+      break;
+    case ':':
+      if (depth == 1)
+      {
+        expectKey = false;
+        capture = false;
+        logsValue = keyLen == 4 && memcmp(key, "logs", 4) == 0;
+      }
+      break;
+    }
+  }
+};
+
+// Receives a collector's /logger response through HTTPClient::writeToStream(),
+// or from its ESP-NOW frames (see rgnow.h), and streams it onto the card as it
+// arrives, so a pull takes the same RAM however big it is. A JSON body from an
+// older collector goes into a JSON line frame unchanged, a binary (rgw) body
+// is decoded into one. A body whose records come in PACKED frames (rgpack.h)
+// goes into an rgw frame as it came, only its plain frames are decoded for
+// the cursor. See rglog.h.
+// Until the first record frame shows which, the start of a binary body is
+// held in fixed buffers, the frames before it are small.
+class LogSink : public Stream
+{
+public:
+  LogSink(SegmentWriter &log) : log(log), decoder(onFrame, this), writer(onText, this)
+  {
+    begin(0);
+  }
+
+  // Before each response, which has at most pullBytes of records
+  void begin(size_t pullBytes)
+  {
+    this->pullBytes = pullBytes;
+    kind = 0;
+    decoder.reset();
+    writer.reset();
+    counter.reset();
+    sniffed = false;
+    binary = false;
+    failed = false;
+    packedRecords = 0;
+    received = 0;
+    rawLen = 0;
+    textLen = 0;
+  }
+
+  size_t write(uint8_t c) override
+  {
+    return write(&c, 1);
+  }
+
+  // Takes nothing once the body can't be used, which ends the transfer
+  size_t write(const uint8_t *data, size_t size) override
+  {
+    if (size == 0 || failed)
+      return 0;
+    received += size;
+    if (!sniffed)
+    {
+      sniffed = true;
+      binary = data[0] == 'R';
+      if (!binary)
+      {
+        use(RGL_KIND_JSON);
+      }
+    }
+    if (!binary)
+    {
+      counter.feed(data, size);
+      put(data, size);
+      return failed ? 0 : size;
+    }
+    bool undecided = kind == 0;
+    if (!decoder.feed(data, size))
+    {
+      failed = true;
+    }
+    if (kind == RGL_KIND_RGW)
+    {
+      if (undecided)
+      {
+        put(raw, rawLen);
+      }
+      put(data, size);
+    }
+    else if (kind == 0)
+    {
+      hold(raw, rawLen, sizeof(raw), data, size);
+    }
+    return failed ? 0 : size;
+  }
+
+  // The transfer broke off part way, finish() drops what was written
+  void fail()
+  {
+    failed = true;
+  }
+
+  // Nothing to read back, HTTPClient only writes into us
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+
+  // Once the transfer is done, from the collector with that MAC, time is the
+  // logger's clock in seconds and now millis(). Returns true if the whole
+  // body made it to the card, otherwise what did is dropped again.
+  bool finish(const uint8_t collector[6], uint32_t time, uint32_t now)
+  {
+    if (kind == 0)
+    {
+      return false;
+    }
+    if (failed || !(binary ? decoder.complete() : counter.complete()))
+    {
+      log.abandon();
+      return false;
+    }
+    RglFrame frame = {};
+    frame.kind = kind;
+    memcpy(frame.collector, collector, 6);
+    frame.epoch = epoch();
+    frame.seq = lastSeq();
+    frame.time = time;
+    return log.end(frame, now);
+  }
+
+  bool isBinary() const
+  {
+    return binary;
+  }
+
+  // The body's records are packed, it went to the card as raw
+  bool isPacked() const
+  {
+    return kind == RGL_KIND_RGW;
+  }
+
+  // Number of "logs" entries in the body
+  size_t events() const
+  {
+    if (isPacked())
+    {
+      return packedRecords;
+    }
+    return binary ? writer.events() : counter.entries();
+  }
+
+  // Bytes of the body taken so far
+  size_t bytes() const
+  {
+    return received;
+  }
+
+  // Record cursor of a binary body, older collectors that send JSON have none
+  uint32_t epoch() const
+  {
+    return binary ? writer.epoch() : 0;
+  }
+
+  uint32_t lastSeq() const
+  {
+    return binary ? writer.lastSeq() : 0;
+  }
+
+  // The collector holds records past lastSeq()
+  bool more() const
+  {
+    return binary && writer.more();
+  }
+
+private:
+  SegmentWriter &log;
+  // RGL_KIND_ of the frame the body goes into, 0 until that is known
+  uint8_t kind;
+  size_t pullBytes;
+  RgwDecoder decoder;
+  RgwJsonWriter writer;
+  JsonLogCounter counter;
+  bool sniffed;
+  bool binary;
+  bool failed;
+  size_t packedRecords;
+  size_t received;
+  // The body and its JSON text while it isn't known to be packed or not
+  uint8_t raw[LOG_SINK_PREFIX];
+  size_t rawLen;
+  char text[LOG_SINK_TEXT_PREFIX];
+  size_t textLen;
+
+  void use(uint8_t frameKind)
+  {
+    kind = frameKind;
+    size_t expected = kind == RGL_KIND_JSON ? pullBytes * LOG_SINK_TEXT_RATIO : pullBytes + LOG_SINK_PREFIX;
+    if (!log.start(expected))
+    {
+      failed = true;
+    }
+  }
+
+  void put(const void *data, size_t length)
+  {
+    if (!failed && length > 0 && !log.write(data, length))
+    {
+      failed = true;
+    }
+  }
+
+  void hold(void *into, size_t &have, size_t room, const void *data, size_t length)
+  {
+    if (failed)
+      return;
+    if (have + length > room)
+    {
+      failed = true;
+      return;
+    }
+    memcpy((uint8_t *)into + have, data, length);
+    have += length;
+  }
+
+  static void onFrame(void *ctx, uint8_t type, const uint8_t *payload, uint16_t length)
+  {
+    LogSink *self = (LogSink *)ctx;
+    if (self->failed)
+    {
+      return;
+    }
+    if (type == RGW_FRAME_PACKED)
+    {
+      // Not unpacked here, the count is all that is needed
+      if (length < 2 || self->kind == RGL_KIND_JSON)
+      {
+        self->failed = true;
+        return;
+      }
+      if (self->kind == 0)
+      {
+        self->use(RGL_KIND_RGW);
+      }
+      self->packedRecords += rgwGetU16(payload);
+      return;
+    }
+    if (type == RGW_FRAME_SEQ || type == RGW_FRAME_ADV || type == RGW_FRAME_GATT || type == RGW_FRAME_GATT_CACHED ||
+        type == RGW_FRAME_GATT_FAILED || type == RGW_FRAME_END)
+    {
+      if (self->kind == RGL_KIND_RGW && type != RGW_FRAME_END)
+      {
+        self->failed = true;
+        return;
+      }
+      // Plain records, or none at all: a JSON line with the text so far
+      if (self->kind == 0)
+      {
+        self->use(RGL_KIND_JSON);
+        self->put(self->text, self->textLen);
+      }
+    }
+    // Plain frames still go through the writer, it keeps the cursor
+    if (!self->writer.frame(type, payload, length))
+    {
+      self->failed = true;
+    }
+  }
+
+  static void onText(void *ctx, const char *text, size_t length)
+  {
+    LogSink *self = (LogSink *)ctx;
+    if (self->kind == RGL_KIND_JSON)
+    {
+      self->put(text, length);
+    }
+    else if (self->kind == 0)
+    {
+      self->hold(self->text, self->textLen, sizeof(self->text), text, length);
+    }
+  }
+};
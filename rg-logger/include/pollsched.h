@@ -0,0 +1,300 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "rgbeacon.h"
+
+// Poll Scheduler
+// Picks which collector the logger visits next from what their beacons say
+// they hold (see rgbeacon.h) and what visits to each have cost so far. Plain
+// C++, the same code runs on the logger and on a host.
+//
+// The first pick is a collector about to drop records, the one with the
+// least time left first. Then come those not visited for POLL_MAX_GAP_MS, so
+// none starves, and those whose beacon carries no backlog (older firmware, or
+// not heard for POLL_HEARD_MS), due every POLL_LEGACY_MS as before. Then
+// whichever gives the most bytes per second of airtime: its backlog, up to
+// what one visit takes, over the time joining it and moving those bytes took
+// lately. A collector with less than POLL_MIN_BYTES waiting isn't visited
+// until the bound, so idle ones cost nothing but that.
+//
+// The logger sweeps for beacons again after visiting for POLL_SWEEP_MS, a
+// store filling fast can't wait out visits to every collector. Until a
+// collector's beacon can have caught up with a visit, what the visit left
+// behind stands in for it. A visit that pulled nothing, say because the
+// collector couldn't be joined, isn't tried again for POLL_RETRY_MS.
+
+// Define how long the logger visits collectors before it sweeps again for
+// fresh beacons.
+#ifndef POLL_SWEEP_MS
+#define POLL_SWEEP_MS 8000
+#endif
+// Define the most collectors scheduled, indexes past it are never picked.
+#ifndef POLL_MAX_TARGETS
+#define POLL_MAX_TARGETS 15
+#endif
+// Define the longest a collector goes without a visit.
+#ifndef POLL_MAX_GAP_MS
+#define POLL_MAX_GAP_MS 60000
+#endif
+// Define how soon a collector has to be about to drop records to go first.
+#ifndef POLL_URGENT_S
+#define POLL_URGENT_S 30
+#endif
+// Define the backlog worth a visit before the bound.
+#ifndef POLL_MIN_BYTES
+#define POLL_MIN_BYTES 2048
+#endif
+// Define how long a beacon's backlog is trusted.
+#ifndef POLL_HEARD_MS
+#define POLL_HEARD_MS 30000
+#endif
+// Define how long after a visit a beacon may still show the backlog from
+// before it, the collector's BEACON_UPDATE_MS and some.
+#ifndef POLL_BEACON_LAG_MS
+#define POLL_BEACON_LAG_MS 3000
+#endif
+// Define the wait after a visit that pulled nothing.
+#ifndef POLL_RETRY_MS
+#define POLL_RETRY_MS 10000
+#endif
+// Define the visit interval for collectors without a backlog in their beacon.
+#ifndef POLL_LEGACY_MS
+#define POLL_LEGACY_MS 5000
+#endif
+// Define what a visit is taken to cost until one has been timed: the ms it
+// takes to join a collector and the bytes per second pulled once joined.
+#define POLL_CONNECT_MS 1500
+#define POLL_BYTES_PER_S 100000
+
+static_assert(POLL_RETRY_MS <= POLL_MAX_GAP_MS, "POLL_RETRY_MS must not exceed POLL_MAX_GAP_MS");
+static_assert(POLL_LEGACY_MS <= POLL_MAX_GAP_MS, "POLL_LEGACY_MS must not exceed POLL_MAX_GAP_MS");
+
+// Structure to store what the scheduler knows about one collector.
+struct PollTarget
+{
+  bool known;
+  // Beacon backlog, heardAt is millis() of the latest
+  bool heard;
+  uint32_t heardAt;
+  // As of statusAt, a visit since the beacon moves it on
+  RgbStatus status;
+  uint32_t statusAt;
+  // A visit has been made, visitedAt is millis() of the latest
+  bool visited;
+  uint32_t visitedAt;
+  // The latest visit pulled nothing
+  bool empty;
+  // Averages over the visits so far
+  uint32_t connectMs;
+  uint32_t bytesPerS;
+};
+
+// Why pick() chose a collector
+enum PollReason
+{
+  POLL_NONE,
+  // About to drop records
+  POLL_URGENT,
+  // Not visited for POLL_MAX_GAP_MS
+  POLL_STARVED,
+  // No backlog in its beacon, visited on the old interval
+  POLL_LEGACY,
+  // Most bytes per second of airtime
+  POLL_BACKLOG
+};
+
+class PollScheduler
+{
+public:
+  // visitBytes is the most one visit pulls
+  PollScheduler(uint32_t visitBytes) : visitBytes(visitBytes)
+  {
+    for (int i = 0; i < POLL_MAX_TARGETS; i++)
+      forget(i);
+  }
+
+  // Collector i was found, it is due at once
+  void add(int i)
+  {
+    if (i < 0 || i >= POLL_MAX_TARGETS || targets[i].known)
+      return;
+    forget(i);
+    targets[i].known = true;
+  }
+
+  // Collector i's beacon said status at now
+  void heard(int i, const RgbStatus &status, uint32_t now)
+  {
+    if (i < 0 || i >= POLL_MAX_TARGETS)
+      return;
+    PollTarget &t = targets[i];
+    // May be from before the visit, what it left behind is closer
+    if (t.visited && t.heard && now - t.visitedAt < POLL_BEACON_LAG_MS)
+      return;
+    t.heard = true;
+    t.heardAt = now;
+    t.status = status;
+    t.statusAt = now;
+  }
+
+  // The next collector to visit at now, -1 if none is due. reason, if
+  // given, says why.
+  int pick(uint32_t now, PollReason *reason = nullptr) const
+  {
+    int best = -1;
+    PollReason bestReason = POLL_NONE;
+    uint32_t bestKey = 0;
+    for (int i = 0; i < POLL_MAX_TARGETS; i++)
+    {
+      uint32_t key;
+      PollReason r = classify(i, now, key);
+      // Lower reasons go first, within one the larger key
+      if (r != POLL_NONE && (best < 0 || r < bestReason || (r == bestReason && key > bestKey)))
+      {
+        best = i;
+        bestReason = r;
+        bestKey = key;
+      }
+    }
+    if (reason)
+      *reason = bestReason;
+    return best;
+  }
+
+  // A visit to collector i ended at now. connectMs is how long joining it
+  // took, transferMs how long pulling bytes took after that, more whether it
+  // still holds records. A visit that failed to join passes 0 bytes.
+  void visited(int i, uint32_t now, uint32_t connectMs, uint32_t bytes, uint32_t transferMs, bool more)
+  {
+    if (i < 0 || i >= POLL_MAX_TARGETS)
+      return;
+    PollTarget &t = targets[i];
+    t.visited = true;
+    t.visitedAt = now;
+    t.empty = bytes == 0;
+    if (bytes > 0)
+    {
+      t.connectMs = average(t.connectMs, connectMs);
+      if (transferMs > 0)
+        t.bytesPerS = average(t.bytesPerS, (uint32_t)((uint64_t)bytes * 1000 / transferMs));
+    }
+    // Until the next beacon, what the visit left behind
+    if (t.heard && bytes > 0)
+    {
+      RgbStatus &s = t.status;
+      s.flags &= ~RGB_FLAG_DROPPING;
+      uint32_t left = more && s.backlog > bytes ? s.backlog - bytes : 0;
+      uint8_t fill = s.backlog ? (uint64_t)s.fill * left / s.backlog : 0;
+      // Filling on at the rate the beacon had, a full store gave none
+      if (s.fullIn != RGB_NEVER && s.fill < 255)
+      {
+        uint64_t seconds = (uint64_t)s.fullIn * (255 - fill) / (255 - s.fill);
+        uint32_t since = (now - t.statusAt) / 1000;
+        seconds = seconds > since ? seconds - since : 0;
+        s.fullIn = seconds < RGB_NEVER ? seconds : RGB_NEVER - 1;
+      }
+      else
+      {
+        s.fullIn = RGB_NEVER;
+      }
+      s.fill = fill;
+      s.backlog = left;
+      t.statusAt = now;
+    }
+  }
+
+  // Collector i's beacon was heard lately and it holds too little for a
+  // visit, nothing is wrong with it for not being visited
+  bool idle(int i, uint32_t now) const
+  {
+    if (i < 0 || i >= POLL_MAX_TARGETS)
+      return false;
+    const PollTarget &t = targets[i];
+    return t.heard && now - t.heardAt < POLL_HEARD_MS && t.status.backlog < POLL_MIN_BYTES &&
+           !(t.status.flags & RGB_FLAG_DROPPING);
+  }
+
+  // Expected ms of airtime a visit to collector i takes for bytes
+  uint32_t airtimeMs(int i, uint32_t bytes) const
+  {
+    const PollTarget &t = targets[i];
+    return t.connectMs + (uint32_t)((uint64_t)bytes * 1000 / t.bytesPerS);
+  }
+
+  const PollTarget &target(int i) const
+  {
+    return targets[i];
+  }
+
+private:
+  uint32_t visitBytes;
+  PollTarget targets[POLL_MAX_TARGETS];
+
+  void forget(int i)
+  {
+    memset(&targets[i], 0, sizeof(targets[i]));
+    targets[i].connectMs = POLL_CONNECT_MS;
+    targets[i].bytesPerS = POLL_BYTES_PER_S;
+  }
+
+  // ms until a collector's store is full as of now, by its status
+  static uint32_t remainingMs(const PollTarget &t, uint32_t now)
+  {
+    if (t.status.fullIn == RGB_NEVER)
+      return UINT32_MAX;
+    uint32_t ms = t.status.fullIn * 1000u;
+    uint32_t since = now - t.statusAt;
+    return ms > since ? ms - since : 0;
+  }
+
+  static uint32_t average(uint32_t mean, uint32_t sample)
+  {
+    return (3 * (uint64_t)mean + sample) / 4;
+  }
+
+  // Whether collector i is due at now and why, key orders those due for
+  // the same reason
+  PollReason classify(int i, uint32_t now, uint32_t &key) const
+  {
+    const PollTarget &t = targets[i];
+    key = 0;
+    if (!t.known)
+      return POLL_NONE;
+    if (!t.visited)
+    {
+      // Found since the last visits, like a starved one
+      key = UINT32_MAX;
+      return POLL_STARVED;
+    }
+    uint32_t since = now - t.visitedAt;
+    if (since >= POLL_MAX_GAP_MS)
+    {
+      key = since;
+      return POLL_STARVED;
+    }
+    if (t.empty && since < POLL_RETRY_MS)
+      return POLL_NONE;
+    if (!t.heard || now - t.heardAt >= POLL_HEARD_MS)
+    {
+      key = since;
+      return since >= POLL_LEGACY_MS ? POLL_LEGACY : POLL_NONE;
+    }
+    const RgbStatus &s = t.status;
+    // A visit still has to get there, what it costs counts against the time left
+    uint32_t fullInMs = remainingMs(t, now);
+    uint32_t reachMs = airtimeMs(i, 0);
+    if ((s.flags & RGB_FLAG_DROPPING) || fullInMs <= POLL_URGENT_S * 1000u + reachMs)
+    {
+      key = UINT32_MAX - (fullInMs > reachMs ? fullInMs - reachMs : 0);
+      return POLL_URGENT;
+    }
+    if (s.backlog < POLL_MIN_BYTES)
+      return POLL_NONE;
+    uint32_t bytes = s.backlog < visitBytes ? s.backlog : visitBytes;
+    // Bytes per second of airtime
+    key = (uint32_t)((uint64_t)bytes * 1000 / airtimeMs(i, bytes));
+    return POLL_BACKLOG;
+  }
+};
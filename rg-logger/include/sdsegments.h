@@ -0,0 +1,73 @@
+#pragma once
+#include <FS.h>
+
+#include "segwriter.h"
+
+// SD Segments
+// SegmentStore in a directory of the card, segment n is dir/0000000n.ext.
+// Counts the time spent in writes and syncs, the card's share of a pull.
+
+class SdSegmentStore : public SegmentStore
+{
+public:
+  SdSegmentStore(fs::FS &fs, const char *dir, const char *ext) : fs(fs), dir(dir), ext(ext), busy(0) {}
+
+  bool exists(uint32_t segment) override
+  {
+    char path[40];
+    return fs.exists(name(path, segment));
+  }
+
+  bool create(uint32_t segment) override
+  {
+    file.close();
+    if (!fs.exists(dir))
+    {
+      fs.mkdir(dir);
+    }
+    char path[40];
+    // Read/write without appending, write() seeks before every write
+    file = fs.open(name(path, segment), "w+");
+    return (bool)file;
+  }
+
+  bool write(uint32_t offset, const void *data, size_t length) override
+  {
+    uint32_t start = micros();
+    bool ok = file && file.seek(offset) && file.write((const uint8_t *)data, length) == length;
+    busy += micros() - start;
+    return ok;
+  }
+
+  // File::flush() fsyncs, FATFS writes the data and directory entry out
+  bool sync() override
+  {
+    if (!file)
+    {
+      return false;
+    }
+    uint32_t start = micros();
+    file.flush();
+    busy += micros() - start;
+    return true;
+  }
+
+  // Microseconds spent writing and syncing since boot
+  uint32_t busyUs() const
+  {
+    return busy;
+  }
+
+private:
+  fs::FS &fs;
+  const char *dir;
+  const char *ext;
+  File file;
+  uint32_t busy;
+
+  const char *name(char *path, uint32_t segment)
+  {
+    snprintf(path, 40, "%s/%08lu%s", dir, (unsigned long)segment, ext);
+    return path;
+  }
+};
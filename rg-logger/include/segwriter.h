@@ -0,0 +1,431 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "rglog.h"
+
+// Segment Writer
+// Appends the logger's records to the SD card through one RAM buffer instead
+// of opening, appending to and closing a file on every sync. Plain C++ over a
+// SegmentStore, so the same code runs against the card on the logger and
+// plain files on a host.
+//
+// Records go into numbered segment files of SEG_SIZE bytes as rglog.h frames,
+// and a segment gets its index footer once the writer moves on to the next.
+// Segments are filled with zeros when they are created so their clusters are
+// allocated once and later writes neither touch the FAT nor grow a cluster
+// chain, and a record is never split over two segments. A record can be
+// streamed in without knowing its length: its frame header is written over
+// once it is done. One that runs out of segment is abandoned, zeroed on the
+// card, and the next goes to a new segment.
+//
+// Writes start on a SEG_BLOCK boundary and are whole blocks: the block the
+// data ends in is written again, zero padded, until it is full. The buffer
+// covers a SEG_BUFFER_SIZE aligned window of the segment, so with a buffer
+// that divides the card's cluster no write straddles two clusters either.
+//
+// Under SEG_SYNC_RECORD a record is on the card once end() returns, so what
+// the logger acknowledges to a collector survives a power cut. Under
+// SEG_SYNC_BUFFER records are only synced by flush(), due SEG_FLUSH_MS after
+// the first one waiting, and a power cut loses what wasn't flushed.
+// A writer never appends to a segment an earlier one left behind, it starts
+// the next one, so nothing is written after a record cut short by a reset.
+
+// Define the block writes are aligned to, the card's sector.
+#define SEG_BLOCK 512
+// Define the write buffer, a multiple of SEG_BLOCK that divides the card's
+// cluster (32 KB on most SDHC cards).
+#ifndef SEG_BUFFER_SIZE
+#define SEG_BUFFER_SIZE 16384
+#endif
+// Define the size of a segment file, a multiple of SEG_BUFFER_SIZE. Creating
+// one writes all of it.
+#ifndef SEG_SIZE
+#define SEG_SIZE (1024 * 1024)
+#endif
+// Define how long records may wait in the buffer under SEG_SYNC_BUFFER.
+#ifndef SEG_FLUSH_MS
+#define SEG_FLUSH_MS 10000
+#endif
+
+// Bytes at the end of a segment kept for the index footer
+#define SEG_INDEX_SPACE ((RGL_INDEX_MAX + SEG_BLOCK - 1) / SEG_BLOCK * SEG_BLOCK)
+
+static_assert(SEG_BUFFER_SIZE % SEG_BLOCK == 0, "SEG_BUFFER_SIZE must be a multiple of SEG_BLOCK");
+static_assert(SEG_SIZE % SEG_BUFFER_SIZE == 0, "SEG_SIZE must be a multiple of SEG_BUFFER_SIZE");
+static_assert(SEG_INDEX_SPACE <= SEG_BUFFER_SIZE, "the index footer must fit SEG_BUFFER_SIZE");
+static_assert(RGL_FRAME_HEADER <= SEG_BLOCK, "a frame header must fit a SEG_BLOCK");
+
+enum SegmentSync
+{
+  // Every record is synced before end() returns
+  SEG_SYNC_RECORD,
+  // Records are synced by flush(), due SEG_FLUSH_MS after the first waits
+  SEG_SYNC_BUFFER
+};
+
+// Define the policy writers use unless begin() is given one.
+#ifndef SEG_SYNC
+#define SEG_SYNC SEG_SYNC_RECORD
+#endif
+
+// Segment files under a SegmentWriter, numbered from 1 without gaps.
+class SegmentStore
+{
+public:
+  virtual ~SegmentStore() {}
+  virtual bool exists(uint32_t segment) = 0;
+  // Create an empty segment, replacing one of the same number, and keep it
+  // open for write() in place of the one before
+  virtual bool create(uint32_t segment) = 0;
+  // offset is bytes from the start of the open segment
+  virtual bool write(uint32_t offset, const void *data, size_t length) = 0;
+  // Make what was written so far survive a power cut
+  virtual bool sync() = 0;
+};
+
+class SegmentWriter
+{
+public:
+  SegmentWriter()
+      : store(nullptr), buf(nullptr), policy(SEG_SYNC), current(0), base(0), fill(0), written(0), recordStart(0),
+        headLen(0), crc(0), inRecord(false), full(false), unsynced(false), waiting(false), waitingSince(0), recordCount(0),
+        byteCount(0), syncCount(0)
+  {
+  }
+
+  // Start the segment after the last one in the store. buffer holds
+  // SEG_BUFFER_SIZE bytes and has to stay around for good. Returns false if
+  // there is no buffer or no segment could be created, records are refused then.
+  bool begin(SegmentStore &segments, uint8_t *buffer, SegmentSync sync = SEG_SYNC)
+  {
+    store = &segments;
+    buf = buffer;
+    policy = sync;
+    current = lastSegment();
+    if (!buf || !open(current + 1))
+    {
+      store = nullptr;
+    }
+    return store != nullptr;
+  }
+
+  // Start a record expected to take about expected bytes, in the next
+  // segment if that doesn't fit what is left of this one, its index is full
+  // or the last record ran out of room
+  bool start(size_t expected)
+  {
+    if (!store)
+      return false;
+    // A frame header never straddles two blocks, end() writes its block again
+    uint32_t room = SEG_BLOCK - position() % SEG_BLOCK;
+    uint32_t pad = room < RGL_FRAME_HEADER ? room : 0;
+    bool rotate = full || index.full() ||
+                  (position() > 0 && position() + pad + RGL_FRAME_HEADER + expected > SEG_SIZE - SEG_INDEX_SPACE);
+    if (rotate && (!close() || !open(current + 1)))
+      return false;
+    static const uint8_t zeros[SEG_BLOCK] = {};
+    if (!rotate && !put(zeros, pad))
+      return false;
+    recordStart = position();
+    headLen = recordStart % SEG_BLOCK;
+    crc = 0;
+    inRecord = true;
+    // Zeros until end(), a frame cut short never looks whole
+    if (!put(zeros, RGL_FRAME_HEADER))
+    {
+      abandon();
+      return false;
+    }
+    return true;
+  }
+
+  // Add to the record. Fails once the segment is full, the record has to be
+  // abandoned then and the next one starts a new segment.
+  bool write(const void *data, size_t length)
+  {
+    if (!inRecord)
+      return false;
+    if (position() + length > SEG_SIZE - SEG_INDEX_SPACE)
+    {
+      full = true;
+      return false;
+    }
+    crc = spillCrc32((const uint8_t *)data, length, crc);
+    return put(data, length);
+  }
+
+  // Drop the record being written. What of it reached the card is zeroed
+  // again and synced, so the segment reads as if it never started.
+  void abandon()
+  {
+    if (!inRecord)
+      return;
+    inRecord = false;
+    uint32_t end = base + roundUp(written);
+    if (recordStart >= base)
+    {
+      // Still in the buffer's window
+      uint32_t dirty = written;
+      fill = recordStart - base;
+      if (dirty > fill)
+      {
+        written = fill;
+        writeOut(roundUp(dirty));
+        flush();
+      }
+      return;
+    }
+    // Earlier windows went out whole, zero those after the record's first
+    uint32_t first = recordStart / SEG_BUFFER_SIZE * SEG_BUFFER_SIZE;
+    memset(buf, 0, SEG_BUFFER_SIZE);
+    for (uint32_t w = first + SEG_BUFFER_SIZE; w < end; w += SEG_BUFFER_SIZE)
+    {
+      unsynced = true;
+      store->write(w, buf, end - w < SEG_BUFFER_SIZE ? end - w : SEG_BUFFER_SIZE);
+    }
+    // and write the first back as it was up to the record
+    base = first;
+    fill = recordStart - base;
+    memcpy(buf + fill - headLen, head, headLen);
+    written = fill - headLen;
+    writeOut(SEG_BUFFER_SIZE);
+    written = fill;
+    flush();
+  }
+
+  // The record is complete and frame says what it is, now is millis().
+  // Returns false if it should be on the card by now and isn't.
+  bool end(const RglFrame &frame, uint32_t now)
+  {
+    if (!inRecord)
+      return false;
+    inRecord = false;
+    uint32_t length = position() - recordStart - RGL_FRAME_HEADER;
+    uint8_t header[RGL_FRAME_HEADER];
+    rglWriteHeader(header, frame, length, crc);
+    if (recordStart >= base)
+    {
+      memcpy(buf + recordStart - base, header, RGL_FRAME_HEADER);
+      if (written > recordStart - base)
+        written = recordStart - base;
+    }
+    else
+    {
+      // Its window went out already, write its block again
+      memcpy(head + headLen, header, RGL_FRAME_HEADER);
+      unsynced = true;
+      if (!store->write(recordStart - headLen, head, SEG_BLOCK))
+        return false;
+    }
+    index.add(recordStart, frame);
+    recordCount++;
+    byteCount += length;
+    if (policy == SEG_SYNC_RECORD)
+      return flush();
+    if (!waiting)
+    {
+      waiting = true;
+      waitingSince = now;
+    }
+    return true;
+  }
+
+  // A whole record at once
+  bool append(const void *data, size_t length, const RglFrame &frame, uint32_t now)
+  {
+    if (!start(length))
+      return false;
+    if (!write(data, length))
+    {
+      abandon();
+      return false;
+    }
+    return end(frame, now);
+  }
+
+  // Under SEG_SYNC_BUFFER, records have waited SEG_FLUSH_MS for flush()
+  bool flushDue(uint32_t now) const
+  {
+    return waiting && now - waitingSince >= SEG_FLUSH_MS;
+  }
+
+  // Write what the buffer holds, zero padded to a block, and sync
+  bool flush()
+  {
+    if (!store)
+      return false;
+    if (fill > written)
+    {
+      if (!writeOut(roundUp(fill)))
+        return false;
+      written = fill;
+    }
+    if (unsynced)
+    {
+      syncCount++;
+      if (!store->sync())
+        return false;
+      unsynced = false;
+    }
+    waiting = false;
+    return true;
+  }
+
+  // Segment being written, records and their payload bytes and syncs since
+  // begin()
+  uint32_t segment() const
+  {
+    return current;
+  }
+
+  uint32_t records() const
+  {
+    return recordCount;
+  }
+
+  uint64_t bytes() const
+  {
+    return byteCount;
+  }
+
+  uint32_t syncs() const
+  {
+    return syncCount;
+  }
+
+private:
+  SegmentStore *store;
+  uint8_t *buf;
+  SegmentSync policy;
+  uint32_t current;
+  // Segment offset of buf[0], a multiple of SEG_BUFFER_SIZE
+  uint32_t base;
+  // Bytes in buf, and how many of them are on the card
+  uint32_t fill;
+  uint32_t written;
+  // Where the record's frame starts, and the block it starts in once its
+  // window went out
+  uint32_t recordStart;
+  uint8_t head[SEG_BLOCK];
+  uint32_t headLen;
+  uint32_t crc;
+  bool inRecord;
+  // A record ran out of segment
+  bool full;
+  bool unsynced;
+  // Records waiting for flush() under SEG_SYNC_BUFFER, since when
+  bool waiting;
+  uint32_t waitingSince;
+  uint32_t recordCount;
+  uint64_t byteCount;
+  uint32_t syncCount;
+  RglIndex index;
+
+  static uint32_t roundUp(uint32_t n)
+  {
+    return (n + SEG_BLOCK - 1) / SEG_BLOCK * SEG_BLOCK;
+  }
+
+  uint32_t position() const
+  {
+    return base + fill;
+  }
+
+  // Highest segment number in the store, 0 if there is none. Doubles until
+  // one is missing, then bisects, a few probes even with thousands on a card.
+  uint32_t lastSegment()
+  {
+    uint32_t missing = 1;
+    while (store->exists(missing))
+      missing *= 2;
+    uint32_t found = missing / 2;
+    while (missing - found > 1)
+    {
+      uint32_t mid = found + (missing - found) / 2;
+      if (store->exists(mid))
+        found = mid;
+      else
+        missing = mid;
+    }
+    return found;
+  }
+
+  // Create and zero fill a segment, the buffer holds nothing by then
+  bool open(uint32_t segment)
+  {
+    if (!store->create(segment))
+      return false;
+    memset(buf, 0, SEG_BUFFER_SIZE);
+    for (uint32_t offset = 0; offset < SEG_SIZE; offset += SEG_BUFFER_SIZE)
+    {
+      if (!store->write(offset, buf, SEG_BUFFER_SIZE))
+        return false;
+    }
+    if (!store->sync())
+      return false;
+    current = segment;
+    full = false;
+    index.reset();
+    base = 0;
+    fill = 0;
+    written = 0;
+    unsynced = false;
+    return true;
+  }
+
+  // Write the segment's index footer, the buffer is free afterwards
+  bool close()
+  {
+    if (!flush())
+      return false;
+    uint32_t space = roundUp(index.size());
+    memset(buf, 0, space);
+    index.write(buf + space - index.size());
+    syncCount++;
+    return store->write(SEG_SIZE - space, buf, space) && store->sync();
+  }
+
+  bool put(const void *data, size_t length)
+  {
+    const uint8_t *p = (const uint8_t *)data;
+    while (length > 0)
+    {
+      if (fill == SEG_BUFFER_SIZE && !nextWindow())
+        return false;
+      size_t take = SEG_BUFFER_SIZE - fill < length ? SEG_BUFFER_SIZE - fill : length;
+      memcpy(buf + fill, p, take);
+      fill += take;
+      p += take;
+      length -= take;
+    }
+    return true;
+  }
+
+  // Write buf from the block holding the first unwritten byte up to end,
+  // padding what lies past fill with zeros
+  bool writeOut(uint32_t end)
+  {
+    uint32_t from = written / SEG_BLOCK * SEG_BLOCK;
+    if (end <= from)
+      return true;
+    if (end > fill)
+      memset(buf + fill, 0, end - fill);
+    unsynced = true;
+    return store->write(base + from, buf + from, end - from);
+  }
+
+  // The buffer is full, write it and move on to the next window
+  bool nextWindow()
+  {
+    if (inRecord && recordStart >= base && recordStart < base + SEG_BUFFER_SIZE)
+      memcpy(head, buf + recordStart - base - headLen, SEG_BLOCK);
+    if (!writeOut(SEG_BUFFER_SIZE))
+      return false;
+    base += SEG_BUFFER_SIZE;
+    fill = 0;
+    written = 0;
+    return true;
+  }
+};
@@ -0,0 +1,327 @@
+// Poll scheduler check
+// Runs a simulated fleet of collectors filling at different rates past a
+// logger that sweeps, hears their beacons (rgbeacon.h) and visits them, once
+// the way loop() used to (every collector whose last visit is older than the
+// health expiration, in index order) and once by the poll scheduler
+// (pollsched.h). Checks the beacon element round trip, that the scheduler
+// drains the busy collectors before they drop records, leaves idle ones alone
+// up to the starvation bound, still visits collectors without a beacon, and
+// prints bytes per second of airtime for both.
+//
+// Build and run on a host:
+//   g++ -O2 -I ../include -I ../../rg-common/include -o pollsched_check pollsched_check.cpp && ./pollsched_check
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "pollsched.h"
+
+// Same as rg-logger's LOG_PULL_BYTES and LOG_MAX_PULLS
+#define SIM_VISIT_BYTES (16384 * 8)
+// What one sweep (WiFi.scanNetworks) takes
+#define SIM_SWEEP_MS 3000
+// Joining a collector and the rate a visit pulls at
+#define SIM_CONNECT_MS 1500
+#define SIM_BYTES_PER_S 90000
+// What the old loop waited for before visiting a collector again (health.h)
+#define SIM_EXPIRATION_MS 5000
+#define SIM_SECONDS 3600
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%-56s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    failures++;
+}
+
+// A collector filling its store at rate bytes per second
+struct SimCollector
+{
+  uint32_t rate;
+  uint32_t capacity;
+  bool beacon;
+  // Fractions of a byte carried over between steps, in thousandths
+  uint32_t carry;
+  uint32_t held;
+  uint64_t made;
+  uint64_t dropped;
+  bool dropping;
+  RgbFillRate fillRate;
+  uint32_t visits;
+  uint32_t lastVisit;
+  uint32_t maxGap;
+};
+
+struct SimResult
+{
+  uint64_t made;
+  uint64_t pulled;
+  uint64_t dropped;
+  uint64_t airtimeMs;
+  uint32_t visits;
+  uint32_t idleVisits;
+  uint32_t legacyVisits;
+  uint32_t maxGap;
+  uint32_t maxLegacyGap;
+};
+
+// The fleet: two busy collectors that fill in well under a round-robin pass,
+// a few steady ones, idle ones, and two running firmware without a beacon
+static std::vector<SimCollector> makeFleet()
+{
+  struct
+  {
+    uint32_t rate;
+    uint32_t capacity;
+    bool beacon;
+  } spec[] = {{9000, 256 * 1024, true}, {6000, 192 * 1024, true}, {400, 256 * 1024, true},
+              {300, 256 * 1024, true},  {200, 256 * 1024, true},  {0, 256 * 1024, true},
+              {0, 256 * 1024, true},    {0, 256 * 1024, true},    {1, 256 * 1024, true},
+              {0, 256 * 1024, true},    {2, 256 * 1024, true},    {150, 256 * 1024, false},
+              {0, 256 * 1024, false},   {0, 256 * 1024, true}};
+  std::vector<SimCollector> fleet;
+  for (auto &s : spec)
+  {
+    SimCollector c = {};
+    c.rate = s.rate;
+    c.capacity = s.capacity;
+    c.beacon = s.beacon;
+    fleet.push_back(c);
+  }
+  return fleet;
+}
+
+static bool isIdle(const SimCollector &c)
+{
+  return c.rate == 0;
+}
+
+class SimFleet
+{
+public:
+  SimFleet(std::vector<SimCollector> fleet) : fleet(fleet), now(0), result() {}
+
+  // Collectors fill until now + ms
+  void advance(uint32_t ms)
+  {
+    for (SimCollector &c : fleet)
+    {
+      uint64_t milli = (uint64_t)c.rate * ms + c.carry;
+      uint32_t bytes = milli / 1000;
+      c.carry = milli % 1000;
+      c.made += bytes;
+      uint32_t room = c.capacity - c.held;
+      if (bytes > room)
+      {
+        c.dropped += bytes - room;
+        c.dropping = true;
+        bytes = room;
+      }
+      c.held += bytes;
+    }
+    now += ms;
+  }
+
+  // What collector i puts in its beacon, the way publishBacklog() does
+  RgbStatus status(int i)
+  {
+    SimCollector &c = fleet[i];
+    RgbStatus s = {};
+    s.fill = (uint64_t)c.held * 255 / c.capacity;
+    s.backlog = c.held;
+    s.fullIn = c.fillRate.update(s.fill, now);
+    s.flags = c.dropping ? RGB_FLAG_DROPPING : 0;
+    return s;
+  }
+
+  // A visit to collector i, returns the bytes pulled and how long it took
+  uint32_t visit(int i, uint32_t &joinMs, uint32_t &transferMs)
+  {
+    SimCollector &c = fleet[i];
+    uint32_t bytes = c.held < SIM_VISIT_BYTES ? c.held : SIM_VISIT_BYTES;
+    joinMs = SIM_CONNECT_MS;
+    transferMs = (uint64_t)bytes * 1000 / SIM_BYTES_PER_S + 50;
+    advance(joinMs + transferMs);
+    c.held -= bytes;
+    c.dropping = false;
+    uint32_t gap = now - c.lastVisit;
+    if (gap > c.maxGap)
+      c.maxGap = gap;
+    c.lastVisit = now;
+    c.visits++;
+    result.visits++;
+    result.pulled += bytes;
+    result.airtimeMs += joinMs + transferMs;
+    if (isIdle(c) && c.beacon)
+      result.idleVisits++;
+    if (!c.beacon)
+      result.legacyVisits++;
+    return bytes;
+  }
+
+  SimResult finish()
+  {
+    for (SimCollector &c : fleet)
+    {
+      uint32_t gap = now - c.lastVisit;
+      if (gap > c.maxGap)
+        c.maxGap = gap;
+      result.made += c.made;
+      result.dropped += c.dropped;
+      if (c.maxGap > result.maxGap)
+        result.maxGap = c.maxGap;
+      if (!c.beacon && c.maxGap > result.maxLegacyGap)
+        result.maxLegacyGap = c.maxGap;
+    }
+    return result;
+  }
+
+  std::vector<SimCollector> fleet;
+  uint32_t now;
+  SimResult result;
+};
+
+// loop() as it was: sweep, then every collector not visited within the
+// health expiration, in index order
+static SimResult runRoundRobin()
+{
+  SimFleet sim(makeFleet());
+  std::vector<uint32_t> lastUpdated(sim.fleet.size(), 0);
+  std::vector<bool> ever(sim.fleet.size(), false);
+  while (sim.now < SIM_SECONDS * 1000u)
+  {
+    sim.advance(SIM_SWEEP_MS);
+    for (size_t i = 0; i < sim.fleet.size(); i++)
+    {
+      if (ever[i] && lastUpdated[i] + SIM_EXPIRATION_MS > sim.now)
+        continue;
+      uint32_t joinMs, transferMs;
+      sim.visit(i, joinMs, transferMs);
+      lastUpdated[i] = sim.now;
+      ever[i] = true;
+    }
+  }
+  return sim.finish();
+}
+
+// loop() with the scheduler: sweep, hear the beacons, then visit what it
+// picks for POLL_SWEEP_MS
+static SimResult runScheduler(uint32_t &starvedPicks)
+{
+  SimFleet sim(makeFleet());
+  static PollScheduler scheduler(SIM_VISIT_BYTES);
+  scheduler = PollScheduler(SIM_VISIT_BYTES);
+  for (size_t i = 0; i < sim.fleet.size(); i++)
+    scheduler.add(i);
+  starvedPicks = 0;
+  while (sim.now < SIM_SECONDS * 1000u)
+  {
+    sim.advance(SIM_SWEEP_MS);
+    for (size_t i = 0; i < sim.fleet.size(); i++)
+    {
+      if (!sim.fleet[i].beacon)
+        continue;
+      // Through the element, as the logger hears it
+      uint8_t element[RGB_ELEMENT_SIZE];
+      RgbStatus heard;
+      rgbWriteElement(element, sim.status(i));
+      if (rgbParseElement(element, sizeof(element), heard))
+        scheduler.heard(i, heard, sim.now);
+    }
+    uint32_t sweptAt = sim.now;
+    for (size_t visits = 0; visits < sim.fleet.size() && sim.now - sweptAt < POLL_SWEEP_MS; visits++)
+    {
+      PollReason reason;
+      int i = scheduler.pick(sim.now, &reason);
+      if (i < 0)
+        break;
+      if (reason == POLL_STARVED)
+        starvedPicks++;
+      uint32_t joinMs, transferMs;
+      uint32_t bytes = sim.visit(i, joinMs, transferMs);
+      scheduler.visited(i, sim.now, joinMs, bytes, transferMs, sim.fleet[i].held > 0);
+    }
+  }
+  return sim.finish();
+}
+
+static void checkElement()
+{
+  RgbStatus out = {RGB_FLAG_DROPPING, 200, 123456, 321};
+  uint8_t element[RGB_ELEMENT_SIZE + 4];
+  size_t n = rgbWriteElement(element, out);
+  RgbStatus in = {};
+  bool ok = n == RGB_ELEMENT_SIZE && rgbParseElement(element, n, in) && in.flags == out.flags &&
+            in.fill == out.fill && in.backlog == out.backlog && in.fullIn == out.fullIn;
+  check(ok, "beacon element reads back");
+
+  // A later version with more bytes at the end still reads
+  element[1] += 4;
+  element[6] = RGB_VERSION + 1;
+  memset(element + n, 0xAA, 4);
+  check(rgbParseElement(element, n + 4, in) && in.backlog == out.backlog, "longer element of a later version reads");
+
+  rgbWriteElement(element, out);
+  element[3] ^= 1;
+  bool otherOui = !rgbParseElement(element, n, in);
+  rgbWriteElement(element, out);
+  bool shortElement = !rgbParseElement(element, n - 1, in);
+  check(otherOui && shortElement, "other vendors' and cut short elements are ignored");
+
+  RgbFillRate rate;
+  bool still = rate.update(10, 0) == RGB_NEVER && rate.update(10, 60000) == RGB_NEVER;
+  check(still, "a store that doesn't fill is never full");
+  RgbFillRate filling;
+  uint16_t fullIn = 0;
+  // 1 of 255 every 10 s, from 100 the rest takes 1550 s
+  for (uint32_t t = 0; t <= 20; t++)
+    fullIn = filling.update(100 + t, t * 10000);
+  bool estimate = fullIn > 1200 && fullIn < 1800;
+  // Emptied by a sync, the rate stays
+  uint16_t afterSync = filling.update(5, 210000);
+  check(estimate && afterSync != RGB_NEVER && afterSync > fullIn, "time to full follows the fill rate");
+  check(filling.update(255, 220000) == 0, "a full store is full now");
+}
+
+int main()
+{
+  checkElement();
+
+  uint32_t starvedPicks;
+  SimResult rr = runRoundRobin();
+  SimResult ps = runScheduler(starvedPicks);
+  std::vector<SimCollector> fleet = makeFleet();
+  uint32_t idle = 0;
+  uint32_t legacy = 0;
+  for (const SimCollector &c : fleet)
+  {
+    idle += isIdle(c) && c.beacon;
+    legacy += !c.beacon;
+  }
+
+  printf("\n%zu collectors over %d s, %d ms sweeps, %d ms to join\n", fleet.size(), SIM_SECONDS, SIM_SWEEP_MS,
+         SIM_CONNECT_MS);
+  printf("                 visits  idle visits  MB pulled  MB dropped  airtime s  bytes/s of airtime  longest gap s\n");
+  printf("round robin     %7u  %11u  %9.2f  %10.2f  %9.0f  %18.0f  %13.0f\n", rr.visits, rr.idleVisits,
+         rr.pulled / 1e6, rr.dropped / 1e6, rr.airtimeMs / 1e3, rr.airtimeMs ? rr.pulled * 1e3 / rr.airtimeMs : 0,
+         rr.maxGap / 1e3);
+  printf("poll scheduler  %7u  %11u  %9.2f  %10.2f  %9.0f  %18.0f  %13.0f\n\n", ps.visits, ps.idleVisits,
+         ps.pulled / 1e6, ps.dropped / 1e6, ps.airtimeMs / 1e3, ps.airtimeMs ? ps.pulled * 1e3 / ps.airtimeMs : 0,
+         ps.maxGap / 1e3);
+
+  check(rr.dropped > 0, "round robin lets the busy collectors overflow");
+  check(ps.dropped == 0, "the scheduler drains them before they do");
+  // The bound, plus a sweep and a pass of visits before it is looked at again
+  uint32_t bound = POLL_MAX_GAP_MS + SIM_SWEEP_MS + fleet.size() * (SIM_CONNECT_MS + 2000);
+  check(ps.maxGap <= bound, "no collector waits much past POLL_MAX_GAP_MS");
+  uint32_t idleBound = idle * (SIM_SECONDS * 1000u / POLL_MAX_GAP_MS + 1);
+  check(ps.idleVisits <= idleBound, "idle collectors are only visited at the bound");
+  check(ps.legacyVisits * idle > 2 * ps.idleVisits * legacy, "collectors without a beacon aren't left idle");
+  check(ps.pulled * rr.airtimeMs > rr.pulled * ps.airtimeMs, "more bytes per second of airtime than round robin");
+  printf("\n%u visits for the starvation bound, %u to collectors without a beacon, which waited at most %.0f s\n",
+         starvedPicks, ps.legacyVisits, ps.maxLegacyGap / 1e3);
+  return failures ? 1 : 0;
+}
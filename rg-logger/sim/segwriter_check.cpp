@@ -0,0 +1,483 @@
+// Segment writer check
+// Runs the segment writer (segwriter.h) against plain files standing in for
+// the card and reads them back with the rglog.h reader: records come back
+// whole and in order, closed segments are indexed, writes stay block aligned,
+// abandoned records, damaged frames, power cuts under both sync policies, a
+// new writer after a reset, and how many records a second it takes against
+// the same files compared to opening, appending to and closing one file per
+// record like the logger used to.
+//
+// Build and run on a host:
+//   g++ -O2 -I ../include -I ../../rg-common/include -o segwriter_check segwriter_check.cpp && ./segwriter_check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "segwriter.h"
+
+#define DIR "segwriter_check.d"
+#define EXT ".rgl"
+#define RECORDS 4000
+#define BENCH_RECORDS 2000
+
+// Segments as files in DIR. Writes wait in RAM until sync() like they would
+// in the card's and the FAT driver's buffers, so a power cut can drop them,
+// or let the first torn bytes of them through.
+class FileSegmentStore : public SegmentStore
+{
+public:
+  FileSegmentStore(const char *ext, bool fsyncs = false)
+      : ext(ext), fsyncs(fsyncs), file(nullptr), probes(0), misaligned(0), writes(0)
+  {
+  }
+
+  ~FileSegmentStore()
+  {
+    if (file)
+      fclose(file);
+  }
+
+  bool exists(uint32_t segment) override
+  {
+    probes++;
+    struct stat st;
+    return stat(path(segment).c_str(), &st) == 0;
+  }
+
+  bool create(uint32_t segment) override
+  {
+    if (file)
+      fclose(file);
+    pending.clear();
+    file = fopen(path(segment).c_str(), "w+b");
+    return file != nullptr;
+  }
+
+  bool write(uint32_t offset, const void *data, size_t length) override
+  {
+    if (!file)
+      return false;
+    // Whole blocks, none reaching over a buffer window
+    if (offset % SEG_BLOCK || length % SEG_BLOCK || offset / SEG_BUFFER_SIZE != (offset + length - 1) / SEG_BUFFER_SIZE)
+      misaligned++;
+    writes++;
+    Write w;
+    w.offset = offset;
+    w.data.assign((const uint8_t *)data, (const uint8_t *)data + length);
+    pending.push_back(w);
+    return true;
+  }
+
+  bool sync() override
+  {
+    if (!file)
+      return false;
+    apply(SIZE_MAX);
+    fflush(file);
+    if (fsyncs)
+      fsync(fileno(file));
+    return true;
+  }
+
+  // The power goes, torn bytes of the unsynced writes make it to the files
+  void cut(size_t torn)
+  {
+    apply(torn);
+    if (file)
+      fclose(file);
+    file = nullptr;
+  }
+
+  std::string path(uint32_t segment) const
+  {
+    char name[64];
+    snprintf(name, sizeof(name), DIR "/%08u%s", segment, ext);
+    return name;
+  }
+
+  const char *ext;
+  bool fsyncs;
+  FILE *file;
+  uint32_t probes;
+  uint32_t misaligned;
+  uint32_t writes;
+
+private:
+  struct Write
+  {
+    uint32_t offset;
+    std::vector<uint8_t> data;
+  };
+  std::vector<Write> pending;
+
+  void apply(size_t budget)
+  {
+    for (const Write &w : pending)
+    {
+      size_t n = w.data.size() < budget ? w.data.size() : budget;
+      fseek(file, w.offset, SEEK_SET);
+      fwrite(w.data.data(), 1, n, file);
+      budget -= n;
+    }
+    pending.clear();
+  }
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%-52s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    failures++;
+}
+
+// Record i: a JSON line whose length depends on i, now and then longer than
+// the write buffer
+static std::string makeRecord(uint32_t i)
+{
+  size_t length = i % 97 == 0 ? 3 * SEG_BUFFER_SIZE / 2 : 40 + (i * 7919) % 1800;
+  std::string line = "{\"rec\":" + std::to_string(i) + ",\"pad\":\"";
+  while (line.size() < length)
+    line += (char)('a' + (i + line.size()) % 26);
+  line += "\"}";
+  return line;
+}
+
+// Its frame header, from one of three collectors
+static RglFrame makeFrame(uint32_t i)
+{
+  RglFrame frame = {};
+  frame.kind = RGL_KIND_JSON;
+  const uint8_t collector[6] = {0x24, 0x58, 0x7C, 0x00, 0x00, (uint8_t)(i % 3)};
+  memcpy(frame.collector, collector, 6);
+  frame.epoch = 7;
+  frame.seq = i;
+  frame.time = 1700000000 + i;
+  return frame;
+}
+
+static bool appendRecord(SegmentWriter &writer, uint32_t i)
+{
+  std::string line = makeRecord(i);
+  return writer.append(line.data(), line.size(), makeFrame(i), i * 10);
+}
+
+static void clearDir()
+{
+  std::string cmd = "rm -rf " DIR " && mkdir " DIR;
+  if (system(cmd.c_str()) != 0)
+    exit(2);
+}
+
+static bool readFile(const std::string &path, std::vector<uint8_t> &data)
+{
+  FILE *in = fopen(path.c_str(), "rb");
+  if (!in)
+    return false;
+  uint8_t chunk[4096];
+  size_t n;
+  data.clear();
+  while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+    data.insert(data.end(), chunk, chunk + n);
+  fclose(in);
+  return true;
+}
+
+// What reading every segment back found
+struct ReadBack
+{
+  std::vector<std::string> records;
+  size_t skipped;
+  uint32_t corrupt;
+  // Segments with an index footer, and whether each matched its frames
+  uint32_t indexed;
+  bool indexOk;
+};
+
+static ReadBack readBack(FileSegmentStore &store)
+{
+  ReadBack out = {};
+  out.indexOk = true;
+  std::vector<uint8_t> data;
+  for (uint32_t s = 1; readFile(store.path(s), data); s++)
+  {
+    static RglIndex index;
+    bool indexed = index.parse(data.data(), data.size());
+    RglReader reader(data.data(), data.size(), indexed ? &index : nullptr);
+    RglFrame frame;
+    uint32_t n = 0;
+    while (reader.next(frame))
+    {
+      std::string record((const char *)frame.payload, frame.length);
+      if (frame.seq >= 1 && record != makeRecord(frame.seq))
+        out.indexOk = false;
+      if (indexed && (n >= index.count || index.entries[n].offset != reader.offset() ||
+                      index.entries[n].seq != frame.seq || index.entries[n].time != frame.time))
+        out.indexOk = false;
+      out.records.push_back(record);
+      n++;
+    }
+    if (indexed)
+    {
+      out.indexed++;
+      out.indexOk = out.indexOk && n == index.count;
+    }
+    out.skipped += reader.skippedBytes();
+    out.corrupt += reader.corruptFrames();
+  }
+  return out;
+}
+
+// Records first, first + 1, ... up to count and nothing else
+static bool inOrder(const std::vector<std::string> &records, uint32_t first, uint32_t count)
+{
+  if (records.size() != count)
+    return false;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (records[i] != makeRecord(first + i))
+      return false;
+  }
+  return true;
+}
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Records a second through a writer with the given policy, synced for real
+static double benchWriter(SegmentSync sync)
+{
+  clearDir();
+  static uint8_t buf[SEG_BUFFER_SIZE];
+  FileSegmentStore store(EXT, true);
+  SegmentWriter writer;
+  writer.begin(store, buf, sync);
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < BENCH_RECORDS; i++)
+    appendRecord(writer, i);
+  writer.flush();
+  return BENCH_RECORDS / seconds(start);
+}
+
+// The same records appended the way the logger did before segments
+static double benchOpenAppendClose()
+{
+  clearDir();
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < BENCH_RECORDS; i++)
+  {
+    std::string line = makeRecord(i) + "\n";
+    FILE *f = fopen(DIR "/log.jsonl", "ab");
+    fwrite(line.data(), 1, line.size(), f);
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+  }
+  return BENCH_RECORDS / seconds(start);
+}
+
+int main()
+{
+  static uint8_t buf[SEG_BUFFER_SIZE];
+  clearDir();
+
+  {
+    FileSegmentStore store(EXT);
+    SegmentWriter writer;
+    check(writer.begin(store, buf, SEG_SYNC_BUFFER) && writer.segment() == 1, "empty card starts segment 1");
+    bool ok = true;
+    for (uint32_t i = 0; i < RECORDS; i++)
+      ok = ok && appendRecord(writer, i);
+    check(ok && writer.flush(), "takes every record");
+    check(writer.segment() > 2, "rolls over to new segments");
+    ReadBack back = readBack(store);
+    check(inOrder(back.records, 0, RECORDS), "reads back every record in order");
+    check(back.skipped == 0 && back.corrupt == 0, "every frame checks out");
+    check(back.indexed == writer.segment() - 1 && back.indexOk, "closed segments are indexed");
+    check(store.misaligned == 0, "writes are whole blocks inside a buffer window");
+    check(writer.syncs() < writer.segment() * 3, "syncs once per flush, not per record");
+    printf("%u records in %u segments, %u writes, %u syncs\n\n", writer.records(), writer.segment(), store.writes,
+           writer.syncs());
+
+    SegmentWriter flushes;
+    flushes.begin(store, buf, SEG_SYNC_BUFFER);
+    std::string line = makeRecord(0);
+    flushes.append(line.data(), line.size(), makeFrame(0), 1000);
+    check(!flushes.flushDue(1000 + SEG_FLUSH_MS - 1) && flushes.flushDue(1000 + SEG_FLUSH_MS),
+          "flush is due SEG_FLUSH_MS after a record");
+    check(flushes.flush() && !flushes.flushDue(1000 + 2 * SEG_FLUSH_MS), "and not after the flush");
+  }
+
+  // A full index moves on to the next segment, and finds a collector's frames
+  {
+    clearDir();
+    FileSegmentStore store(EXT);
+    SegmentWriter writer;
+    writer.begin(store, buf, SEG_SYNC_BUFFER);
+    bool ok = true;
+    for (uint32_t i = 1; i <= RGL_INDEX_ENTRIES + 10; i++)
+    {
+      RglFrame frame = makeFrame(i);
+      ok = ok && writer.append("{}", 2, frame, 0);
+    }
+    writer.flush();
+    std::vector<uint8_t> data;
+    static RglIndex index;
+    ok = ok && writer.segment() == 2 && readFile(store.path(1), data) && index.parse(data.data(), data.size());
+    RglReader reader(data.data(), data.size(), &index);
+    int collector = index.find(makeFrame(2).collector);
+    uint32_t found = 0;
+    for (uint16_t e = 0; ok && e < index.count; e++)
+    {
+      if (index.entries[e].collector != collector)
+        continue;
+      RglFrame frame;
+      reader.seek(index.entries[e].offset);
+      ok = reader.next(frame) && frame.seq % 3 == 2 && memcmp(frame.collector, makeFrame(2).collector, 6) == 0;
+      found++;
+    }
+    check(ok && index.count == RGL_INDEX_ENTRIES && found == (RGL_INDEX_ENTRIES + 1) / 3,
+          "the index finds a collector's frames");
+  }
+
+  // Abandoned records leave nothing behind, whether they stayed in the
+  // buffer, went out with a flush or reached over windows
+  {
+    clearDir();
+    FileSegmentStore store(EXT);
+    SegmentWriter writer;
+    writer.begin(store, buf, SEG_SYNC_RECORD);
+    std::string junk(3 * SEG_BUFFER_SIZE, 'x');
+    bool ok = true;
+    for (uint32_t i = 0; i < 30; i++)
+    {
+      ok = ok && appendRecord(writer, i);
+      size_t dropped = i % 3 == 0 ? 300 : i % 3 == 1 ? SEG_BUFFER_SIZE / 2 : junk.size();
+      writer.start(dropped);
+      writer.write(junk.data(), dropped);
+      if (i % 2)
+        writer.flush();
+      writer.abandon();
+    }
+    ReadBack back = readBack(store);
+    check(ok && inOrder(back.records, 0, 30) && back.skipped == 0, "abandoned records are zeroed again");
+
+    // One that runs out of segment, the next record starts a new one
+    clearDir();
+    FileSegmentStore full(EXT);
+    SegmentWriter overflow;
+    overflow.begin(full, buf, SEG_SYNC_RECORD);
+    ok = appendRecord(overflow, 0) && overflow.start(100);
+    while (overflow.write(junk.data(), junk.size()))
+      ;
+    overflow.abandon();
+    ok = ok && appendRecord(overflow, 1);
+    back = readBack(full);
+    check(ok && overflow.segment() == 2 && inOrder(back.records, 0, 2) && back.skipped == 0 && back.indexed == 1 &&
+              store.misaligned == 0 && full.misaligned == 0,
+          "a record that outgrows its segment is dropped");
+  }
+
+  // A flipped bit costs the frame it is in and no more
+  {
+    clearDir();
+    FileSegmentStore store(EXT);
+    SegmentWriter writer;
+    writer.begin(store, buf, SEG_SYNC_RECORD);
+    for (uint32_t i = 1; i <= 50; i++)
+      appendRecord(writer, i);
+    std::vector<uint8_t> data;
+    readFile(store.path(1), data);
+    RglReader reader(data.data(), data.size());
+    RglFrame frame;
+    while (reader.next(frame) && frame.seq != 20)
+      ;
+    FILE *f = fopen(store.path(1).c_str(), "r+b");
+    fseek(f, reader.offset() + RGL_FRAME_HEADER + 17, SEEK_SET);
+    fputc(data[reader.offset() + RGL_FRAME_HEADER + 17] ^ 0x04, f);
+    fclose(f);
+    ReadBack back = readBack(store);
+    back.records.insert(back.records.begin() + 19, makeRecord(20));
+    check(back.corrupt == 1 && inOrder(back.records, 1, 50), "a damaged frame is skipped, the rest read on");
+  }
+
+  // A reset: the next writer finds the last segment in a few probes
+  {
+    clearDir();
+    FileSegmentStore store(EXT);
+    SegmentWriter writer;
+    writer.begin(store, buf);
+    for (uint32_t segment = 2; segment <= 41; segment++)
+      store.create(segment);
+    store.probes = 0;
+    SegmentWriter after;
+    check(after.begin(store, buf) && after.segment() == 42 && store.probes <= 14,
+          "a new writer starts after the last segment");
+  }
+
+  // Power goes while a record longer than the buffer is half written
+  {
+    clearDir();
+    FileSegmentStore store(EXT);
+    SegmentWriter writer;
+    writer.begin(store, buf, SEG_SYNC_RECORD);
+    bool ok = true;
+    for (uint32_t i = 1; i <= 200; i++)
+      ok = ok && appendRecord(writer, i);
+    std::string line = makeRecord(291);
+    writer.start(line.size());
+    writer.write(line.data(), line.size() - 100);
+    store.cut(SEG_BUFFER_SIZE + 700);
+    FileSegmentStore restarted(EXT);
+    SegmentWriter after;
+    after.begin(restarted, buf, SEG_SYNC_RECORD);
+    ReadBack back = readBack(restarted);
+    check(ok && inOrder(back.records, 1, 200), "synced records survive a power cut");
+    check(back.skipped > 0 && back.corrupt == 0, "the torn record is passed over");
+    for (uint32_t i = 201; i <= 210; i++)
+      ok = ok && appendRecord(after, i);
+    back = readBack(restarted);
+    check(ok && after.segment() == 2 && inOrder(back.records, 1, 210), "appends carry on in the next segment");
+  }
+
+  // Under SEG_SYNC_BUFFER a power cut loses what wasn't flushed, no more
+  {
+    clearDir();
+    FileSegmentStore store(EXT);
+    SegmentWriter writer;
+    writer.begin(store, buf, SEG_SYNC_BUFFER);
+    for (uint32_t i = 0; i < 300; i++)
+    {
+      appendRecord(writer, i);
+      if (i == 249)
+        writer.flush();
+    }
+    static_assert(RGL_INDEX_ENTRIES >= 300, "the records must fit one segment");
+    store.cut(0);
+    FileSegmentStore restarted(EXT);
+    ReadBack back = readBack(restarted);
+    check(inOrder(back.records, 0, 250), "buffered records are lost back to the last flush");
+  }
+
+  double openClose = benchOpenAppendClose();
+  double perRecord = benchWriter(SEG_SYNC_RECORD);
+  double buffered = benchWriter(SEG_SYNC_BUFFER);
+  printf("\nrecords/s on this host, %d records synced to disk:\n", BENCH_RECORDS);
+  printf("  open, append, close     %8.0f\n", openClose);
+  printf("  SEG_SYNC_RECORD         %8.0f\n", perRecord);
+  printf("  SEG_SYNC_BUFFER         %8.0f\n\n", buffered);
+
+  std::string cmd = "rm -rf " DIR;
+  if (system(cmd.c_str()) != 0)
+    failures++;
+  return failures ? 1 : 0;
+}
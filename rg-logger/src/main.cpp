@@ -2,12 +2,21 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <esp_wifi.h>
+#include <esp_heap_caps.h>
 #include <WiFiClient.h>
 #include <HTTPClient.h>
 #include "ArduinoJson.h"
 
 #include "utils.h"
 #include "health.h"
+#include "jsonarena.h"
+#include "logsink.h"
+#include "pollsched.h"
+#include "rgnow.h"
+#include "sdsegments.h"
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+#include "rgnowlink.h"
+#endif
 
 // M5Stack Core2 LCD dimensions
 #define SCREEN_WIDTH 320
@@ -16,19 +25,69 @@
 char ssid[] = "BLEAKEST"; //  your network SSID (name)
 char pass[] = "";         // your network password
 
+// Define the bytes a collector sends per pull, a backlog takes several.
+#define LOG_PULL_BYTES 16384
+// Define the pulls made from one collector per visit.
+#define LOG_MAX_PULLS 8
+// Define the bytes of a serialized sync request, each scanner's MAC takes 20.
+#define LOG_REQUEST_SIZE 512
+// Define the bytes of PSRAM every JSON document is built in, sync requests
+// are the only ones.
+#define LOG_JSON_ARENA_SIZE 4096
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+// Define how long a scanner has to start answering a request over ESP-NOW,
+// HTTPClient's timeout.
+#define NOW_REPLY_WAIT_MS 5000
+// Define the longest gap between the frames of a response.
+#define NOW_FRAME_WAIT_MS 500
+#endif
+
+static_assert(LOG_REQUEST_SIZE >= 128 + 20 * MAX_HEALTH_ITEMS, "a request with every scanner must fit LOG_REQUEST_SIZE");
+static_assert(POLL_MAX_TARGETS >= MAX_HEALTH_ITEMS, "every scanner must be scheduled");
+
 long totalEvents = 0;
+// Sync requests are built here instead of on the heap, loop task only (see
+// jsonarena.h)
+JsonArena jsonArena;
+
+// Every body goes into a frame of the segment files under /rg, written
+// through one buffer (see segwriter.h and rglog.h)
+SdSegmentStore logStore(SD, "/rg", ".rgl");
+SegmentWriter cardLog;
+// Responses stream through here onto it, see logsink.h
+LogSink sink(cardLog);
 
-void appendLog(String log)
+// Picks the scanner to visit next from the backlog in their beacons, see
+// pollsched.h. Beacons are heard on the WiFi task, beaconMux guards it.
+PollScheduler pollScheduler(LOG_PULL_BYTES * LOG_MAX_PULLS);
+portMUX_TYPE beaconMux = portMUX_INITIALIZER_UNLOCKED;
+
+// PSRAM if the board has it, internal RAM otherwise
+void *allocPsram(size_t bytes)
 {
-  File file = SD.open("/log.jsonl", FILE_APPEND);
-  if (!file)
+  void *p = heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM);
+  if (!p)
   {
-    Serial.println(F("Failed to create file"));
-    return;
+    p = malloc(bytes);
   }
-  file.println(log);
-  Serial.println("wrote log to disk");
-  file.close();
+  return p;
+}
+
+// Seconds since 1970 by the RTC, as far as it was ever set, for the frames
+uint32_t rtcSeconds()
+{
+  RTC_DateTypeDef date;
+  RTC_TimeTypeDef time;
+  M5.Rtc.GetDate(&date);
+  M5.Rtc.GetTime(&time);
+  struct tm t = {};
+  t.tm_year = date.Year - 1900;
+  t.tm_mon = date.Month - 1;
+  t.tm_mday = date.Date;
+  t.tm_hour = time.Hours;
+  t.tm_min = time.Minutes;
+  t.tm_sec = time.Seconds;
+  return (uint32_t)mktime(&t);
 }
 
 void updateLcd()
@@ -50,7 +109,10 @@ void updateLcd()
       int scannerIndex = (row * cols) + col;
       if (scannerIndex < seenScanners)
       {
-        bool isHealthy = getHealthy(scannerIndex);
+        // Scanners with nothing to pull aren't visited, their beacon says they are fine
+        portENTER_CRITICAL(&beaconMux);
+        bool isHealthy = getHealthy(scannerIndex) || pollScheduler.idle(scannerIndex, millis());
+        portEXIT_CRITICAL(&beaconMux);
         // Draw the rectangle on the display
         if (isHealthy)
         {
@@ -99,12 +161,37 @@ void sweepForBleakest()
           Serial.print("Adding ");
           Serial.println(WiFi.BSSIDstr(i));
           addScannerToList(mac, WiFi.SSID(i), WiFi.channel(i));
+          portENTER_CRITICAL(&beaconMux);
+          pollScheduler.add(seenScanners - 1);
+          portEXIT_CRITICAL(&beaconMux);
         }
       }
     }
   }
 }
 
+// Vendor elements of the beacons and probe responses the sweep hears, runs
+// on the WiFi task
+void onVendorElement(void *ctx, wifi_vendor_ie_type_t type, const uint8_t sa[6], const vendor_ie_data_t *element,
+                     int rssi)
+{
+  RgbStatus status;
+  if (!rgbParseElement((const uint8_t *)element, 2 + element->length, status))
+  {
+    return;
+  }
+  for (int i = 0; i < seenScanners; i++)
+  {
+    if (memcmp(healthStatusList[i].mac, sa, 6) == 0)
+    {
+      portENTER_CRITICAL(&beaconMux);
+      pollScheduler.heard(i, status, millis());
+      portEXIT_CRITICAL(&beaconMux);
+      return;
+    }
+  }
+}
+
 bool connectWiFi(int scannerIndex)
 {
   Serial.print("Connecting to wifi...");
@@ -143,7 +230,109 @@ void disconnectWiFi()
   Serial.println("done.");
 }
 
-bool getLogJson(int scannerIndex)
+// Serialize the sync request for the scanner into json, returns its length
+size_t buildRequest(int scannerIndex, char *json, size_t size)
+{
+  JsonDocument registerScanner(&jsonArena);
+  registerScanner["si"] = scannerIndex;
+  registerScanner["ss"] = seenScanners;
+  // Collectors split devices by hashing over these, so a scanner joining
+  // only moves the devices it takes over
+  JsonArray scanners = registerScanner["scanners"].to<JsonArray>();
+  for (int i = 0; i < seenScanners; i++)
+  {
+    char mac[18];
+    rgwFormatMac(mac, healthStatusList[i].mac);
+    scanners.add(mac);
+  }
+  // Ask for the compact binary format, older collectors ignore this and send JSON
+  registerScanner["wire"] = RGW_VERSION;
+  // and for its records packed, they go to the card without unpacking
+  registerScanner["pack"] = RGP_VERSION;
+  // Acknowledge what is on the card, the collector drops it and sends what follows
+  registerScanner["epoch"] = healthStatusList[scannerIndex].epoch;
+  registerScanner["after"] = healthStatusList[scannerIndex].cursor;
+  registerScanner["max"] = LOG_PULL_BYTES;
+  return serializeJson(registerScanner, json, size);
+}
+
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+// Session of the last request over ESP-NOW, each gets a new one
+uint16_t nowSession = 0;
+// Status of a refused request
+int nowRefusedCode = 0;
+
+static bool toScanner(void *ctx, const uint8_t *frame, size_t length)
+{
+  return rgnSend((const uint8_t *)ctx, frame, length);
+}
+
+// Bytes of a response go onto the card like an HTTP body
+static void onResponseBytes(void *ctx, uint8_t type, const uint8_t *data, size_t length)
+{
+  if (type == RGN_RESPONSE)
+  {
+    sink.write(data, length);
+  }
+  else if (nowRefusedCode == 0 && length >= 2)
+  {
+    nowRefusedCode = rgwGetU16(data);
+  }
+}
+
+// Tune to the scanner's channel, ESP-NOW needs nothing more to reach it
+bool tuneToScanner(int scannerIndex)
+{
+  rgnDrain();
+  return esp_wifi_set_channel(healthStatusList[scannerIndex].channel, WIFI_SECOND_CHAN_NONE) == ESP_OK;
+}
+
+// Send the request to the scanner over ESP-NOW and stream the response into
+// sink. Returns the status it answered with like HTTPClient::POST(),
+// negative if no answer came.
+int postNow(int scannerIndex, const char *json, size_t jsonLen)
+{
+  uint8_t *mac = healthStatusList[scannerIndex].mac;
+  uint16_t session = ++nowSession;
+  RgnFramer framer(toScanner, mac);
+  framer.begin(RGN_REQUEST, session);
+  framer.write((const uint8_t *)json, jsonLen);
+  if (!framer.end())
+  {
+    return -1;
+  }
+  nowRefusedCode = 0;
+  RgnReassembler reply(onResponseBytes, nullptr);
+  reply.begin(RGN_RESPONSE, session);
+  RgnPacket packet;
+  while (!reply.finished() && rgnReceive(packet, reply.started() ? NOW_FRAME_WAIT_MS : NOW_REPLY_WAIT_MS))
+  {
+    if (memcmp(packet.mac, mac, 6) == 0)
+    {
+      reply.feed(packet.data, packet.length);
+    }
+  }
+  if (!reply.started())
+  {
+    return -1;
+  }
+  if (reply.type() == RGN_REFUSED)
+  {
+    return reply.complete() ? nowRefusedCode : -1;
+  }
+  // A body cut short is dropped again, like an HTTP transfer that broke off
+  if (!reply.complete())
+  {
+    Serial.printf("ESP-NOW response broke off after %lu bytes\n", (unsigned long)reply.length());
+    sink.fail();
+  }
+  return 200;
+}
+#else
+// Send the request to the joined scanner over HTTP and stream the response
+// into sink. Returns the status like HTTPClient::POST(), 0 if the scanner
+// couldn't be reached.
+int postHttp(const char *json, size_t jsonLen)
 {
   WiFiClient client;
   HTTPClient http;
@@ -155,56 +344,96 @@ bool getLogJson(int scannerIndex)
     Serial.println("connected...");
     if (client.connected())
     {
-      // Serialize JSON document to string
-      String json;
-      JsonDocument registerScanner;
-      registerScanner["si"] = scannerIndex;
-      registerScanner["ss"] = seenScanners;
-      serializeJson(registerScanner, json);
-      // Serial.println(json);
-
       // Construct and send POST
       String endpoint = "http://" + WiFi.gatewayIP().toString() + "/logger";
       http.begin(client, endpoint);
       http.addHeader("Content-Type", "application/json");
-      respCode = http.POST(json);
+      respCode = http.POST((uint8_t *)json, jsonLen);
 
-      // Success!
+      // Stream the response onto the card as it arrives, binary bodies
+      // are decoded into a JSON line on the way
       if (respCode == 200)
       {
-        // Read response into a JSON Doc
-        JsonDocument logDoc;
-        String resp = http.getString();
-        if (DeserializationError::Ok == deserializeJson(logDoc, resp))
-        {
-          Serial.println("Deserialize OK!");
-          totalEvents += logDoc["logs"].size();
-          // serializeJsonPretty(logDoc, Serial);
-          // Serial.println(logDoc["logs"].size());
-          appendLog(resp);
-        }
-      }
-      // Failure :(
-      else
-      {
-        Serial.print("failed to POST ");
-        Serial.print(respCode);
-        Serial.println("...");
+        http.writeToStream(&sink);
       }
 
       // Disconnect
       http.end();
     }
   }
+  return respCode;
+}
+#endif
 
-  if (respCode == 200)
+// One pull of records after the scanner's cursor, more is set when the
+// collector has records left and bytes counts what it sent
+bool pullLog(int scannerIndex, bool &more, size_t &bytes)
+{
+  more = false;
+  // Serialize JSON document into a fixed buffer
+  char json[LOG_REQUEST_SIZE];
+  size_t jsonLen = buildRequest(scannerIndex, json, sizeof(json));
+  // Serial.println(json);
+
+  sink.begin(LOG_PULL_BYTES);
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+  int respCode = postNow(scannerIndex, json, jsonLen);
+#else
+  int respCode = postHttp(json, jsonLen);
+#endif
+  // Failure :(
+  if (respCode != 200)
   {
-    return true;
+    Serial.print("failed to POST ");
+    Serial.print(respCode);
+    Serial.println("...");
+    return false;
+  }
+
+  // Success!
+  bytes += sink.bytes();
+  // The cursor only moves once the body is on the card, until then the
+  // collector keeps the records and sends them again
+  if (sink.finish(healthStatusList[scannerIndex].mac, rtcSeconds(), millis()))
+  {
+    Serial.println(sink.isPacked() ? "wrote packed log to disk" : "wrote log to disk");
+    totalEvents += sink.events();
+    if (sink.isBinary())
+    {
+      healthStatusList[scannerIndex].epoch = sink.epoch();
+      healthStatusList[scannerIndex].cursor = sink.lastSeq();
+      more = sink.more();
+    }
   }
   else
   {
-    return false;
+    Serial.println(F("Failed to write log"));
   }
+  return true;
+}
+
+// Drain a scanner in pulls of LOG_PULL_BYTES, each acknowledging the one
+// before. The last one is acknowledged on the next visit. more is set when
+// the scanner has records left, bytes counts what it sent.
+bool getLogJson(int scannerIndex, bool &more, size_t &bytes)
+{
+  bool ok = false;
+  more = true;
+  for (int pull = 0; more && pull < LOG_MAX_PULLS; pull++)
+  {
+    if (!pullLog(scannerIndex, more, bytes))
+    {
+      break;
+    }
+    ok = true;
+  }
+  Serial.printf("JSON arena: peak %u of %u bytes, %lu heap allocations\n", (unsigned)jsonArena.peak(),
+                (unsigned)jsonArena.size(), (unsigned long)jsonArena.heapAllocations());
+  uint32_t records = cardLog.records();
+  uint32_t busyUs = logStore.busyUs();
+  Serial.printf("SD: %lu records, %lu syncs, %.0f records/s\n", (unsigned long)records, (unsigned long)cardLog.syncs(),
+                busyUs ? records * 1e6 / busyUs : 0.0);
+  return ok;
 }
 
 void setup()
@@ -227,38 +456,96 @@ void setup()
   }
   M5.Lcd.println("TF card initialized.");
 
+  // JSON and the SD buffer never need to be in internal RAM
+  void *arena = allocPsram(LOG_JSON_ARENA_SIZE);
+  jsonArena.begin(arena, arena ? LOG_JSON_ARENA_SIZE : 0);
+  // Records are refused without a segment, collectors keep them until then
+  if (!cardLog.begin(logStore, (uint8_t *)allocPsram(SEG_BUFFER_SIZE)))
+  {
+    M5.Lcd.println("Failed to create log segments");
+  }
+
   // dont be silly, im still gonna send it
   esp_wifi_set_ps(WIFI_PS_NONE);
   WiFi.setSleep(false);
 
   WiFi.mode(WIFI_STA);
   disconnectWiFi();
+  // Scanners publish their backlog in their beacons, see rgbeacon.h
+  esp_wifi_set_vendor_ie_cb(onVendorElement, nullptr);
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+  // Scanners are reached by their MAC without joining them, see rgnow.h
+  if (!rgnBegin(WIFI_IF_STA))
+  {
+    M5.Lcd.println("Failed to start ESP-NOW");
+  }
+#endif
 
   M5.Lcd.clear(TFT_BLACK);
 }
 
+// Join a scanner (over ESP-NOW only tune to its channel) and drain it, then
+// tell the scheduler what that cost
+void visitScanner(int scannerIndex)
+{
+  uint32_t start = millis();
+  bool more = false;
+  size_t bytes = 0;
+  uint32_t joinedAt = start;
+  uint32_t doneAt = start;
+#if RG_TRANSPORT == RG_TRANSPORT_ESPNOW
+  bool joined = tuneToScanner(scannerIndex);
+#else
+  bool joined = connectWiFi(scannerIndex);
+#endif
+  if (joined)
+  {
+    joinedAt = millis();
+    if (getLogJson(scannerIndex, more, bytes))
+    {
+      updateScannerInList(healthStatusList[scannerIndex].mac);
+    }
+    doneAt = millis();
+#if RG_TRANSPORT != RG_TRANSPORT_ESPNOW
+    // FIX: disconnect before moving to the next scanner so WiFi.begin()
+    // on the next iteration starts from a clean state
+    disconnectWiFi();
+#endif
+  }
+  portENTER_CRITICAL(&beaconMux);
+  pollScheduler.visited(scannerIndex, millis(), joinedAt - start, bytes, doneAt - joinedAt, more);
+  portEXIT_CRITICAL(&beaconMux);
+}
+
 void loop()
 {
+  // The sweep also brings the scanners' beacons in
   sweepForBleakest();
-  for (int scannerIndex = 0; scannerIndex < seenScanners; scannerIndex++)
+  uint32_t sweptAt = millis();
+  // Visit scanners until none is due, or their beacons are due a refresh
+  for (int visits = 0; visits < seenScanners && millis() - sweptAt < POLL_SWEEP_MS; visits++)
   {
-    bool isHealthy = getHealthy(scannerIndex);
-    if (!isHealthy)
+    static const char *reasons[] = {"", "urgent", "starved", "no beacon", "backlog"};
+    PollReason reason;
+    portENTER_CRITICAL(&beaconMux);
+    int scannerIndex = pollScheduler.pick(millis(), &reason);
+    portEXIT_CRITICAL(&beaconMux);
+    if (scannerIndex < 0)
     {
-      Serial.print("Targetting scanner: ");
-      Serial.println(scannerIndex);
-      if (connectWiFi(scannerIndex))
-      {
-        if (getLogJson(scannerIndex))
-        {
-          updateScannerInList(healthStatusList[scannerIndex].mac);
-        }
-        // FIX: disconnect before moving to the next scanner so WiFi.begin()
-        // on the next iteration starts from a clean state
-        disconnectWiFi();
-      }
+      break;
     }
+    Serial.printf("Targetting scanner: %d (%s)\n", scannerIndex, reasons[reason]);
+    visitScanner(scannerIndex);
     updateLcd();
+    // Under SEG_SYNC_BUFFER records wait in RAM for at most SEG_FLUSH_MS
+    if (cardLog.flushDue(millis()))
+    {
+      cardLog.flush();
+    }
   }
-  // delay(5000);
-}
\ No newline at end of file
+  updateLcd();
+  if (cardLog.flushDue(millis()))
+  {
+    cardLog.flush();
+  }
+}